@@ -0,0 +1,165 @@
+/* Measures the raw trace codec: compression ratio and encode/decode
+ * throughput in MB/s of raw entries.
+ *
+ * Without -in, synthetic traces with the typical access patterns are
+ * generated: a sequential sweep, a strided matrix walk, random accesses
+ * and a call-heavy mix. With -in <file> the entries of an uncompressed raw
+ * trace regina.tmp.N.mmd are measured instead. Every buffer is encoded and
+ * decoded the way the client and the readers do, and checked for a lossless
+ * round trip.
+ *
+ * Usage:
+ *   bench_codec [-entries N] [-buffer_size N] [-in <file>]
+ */
+
+#include "codec.h"
+#include "trace_format.h"
+#include "trace_reader.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+typedef void (*pattern_fn_t)(uint64_t n, mem_entry_t* entry);
+
+static void sequential(uint64_t n, mem_entry_t* entry) {
+    entry->header = trace_make_header(TRACE_TYPE_READ, 8, 0x140001000ull + (n % 4) * 4);
+    entry->addr = 0x7ff000000000ull + n * 8;
+}
+
+static void strided(uint64_t n, mem_entry_t* entry) {
+    /* column walk through a 1024x1024 matrix of doubles plus the store */
+    uint64_t const i = n / 2;
+    if (n & 1) {
+        entry->header = trace_make_header(TRACE_TYPE_WRITE, 8, 0x140001020ull);
+        entry->addr = 0x20000000ull + (i % 1024) * 8;
+    } else {
+        entry->header = trace_make_header(TRACE_TYPE_READ, 8, 0x140001010ull);
+        entry->addr = 0x10000000ull + (i % 1024) * 8192 + (i / 1024 % 1024) * 8;
+    }
+}
+
+static void random_access(uint64_t n, mem_entry_t* entry) {
+    uint64_t x = n * 0x9e3779b97f4a7c15ull;
+    x ^= x >> 29;
+    entry->header = trace_make_header(TRACE_TYPE_READ, 4, 0x140001000ull + (x % 64) * 4);
+    entry->addr = 0x10000000ull + (x % (1ull << 30)) / 4 * 4;
+}
+
+static void calls(uint64_t n, mem_entry_t* entry) {
+    uint64_t const pc = 0x140001000ull + (n * 2654435761ull % 10000) * 4;
+    if (n % 10 == 9) {
+        entry->header = trace_make_header(n % 20 == 9 ? TRACE_TYPE_CALL : TRACE_TYPE_RETURN, 0, pc);
+        entry->addr = 0x140002000ull + (n % 64) * 16;
+    } else {
+        entry->header = trace_make_header(n & 1 ? TRACE_TYPE_WRITE : TRACE_TYPE_READ, 8, pc);
+        entry->addr = 0x7ff000000000ull - (n % 512) * 8;
+    }
+}
+
+static bool measure(char const* label, std::vector<char> const& raw, size_t buffer_size) {
+    std::vector<uint8_t> encoded;
+    std::vector<size_t> block_sizes;
+    std::vector<char> decoded(buffer_size);
+    std::vector<uint8_t> scratch(codec_max_encoded_size(buffer_size));
+    bool ok = true;
+
+    auto const start = std::chrono::steady_clock::now();
+    for (size_t offset = 0; offset < raw.size();) {
+        /* cut at entry boundaries like a flushed buffer */
+        size_t size = 0;
+        while (offset + size < raw.size()) {
+            uint64_t header;
+            std::memcpy(&header, raw.data() + offset + size, sizeof(header));
+            if (size + trace_entry_size(header) > buffer_size)
+                break;
+            size += (size_t)trace_entry_size(header);
+        }
+        size_t const n = codec_encode_entries(raw.data() + offset, size, scratch.data());
+        encoded.insert(encoded.end(), scratch.data(), scratch.data() + n);
+        block_sizes.push_back(size);
+        block_sizes.push_back(n);
+        offset += size;
+    }
+    auto const mid = std::chrono::steady_clock::now();
+    size_t in_offset = 0;
+    size_t out_offset = 0;
+    for (size_t b = 0; b < block_sizes.size(); b += 2) {
+        if (!codec_decode_entries(encoded.data() + in_offset, block_sizes[b + 1], decoded.data(), block_sizes[b])
+            || std::memcmp(decoded.data(), raw.data() + out_offset, block_sizes[b]) != 0)
+            ok = false;
+        in_offset += block_sizes[b + 1];
+        out_offset += block_sizes[b];
+    }
+    auto const end = std::chrono::steady_clock::now();
+
+    double const mb = (double)raw.size() / (1024 * 1024);
+    double const t_enc = std::chrono::duration<double>(mid - start).count();
+    double const t_dec = std::chrono::duration<double>(end - mid).count();
+    std::printf("%-12s %10.1f %10.1f %8.2f %12.0f %12.0f %s\n", label, mb,
+        (double)(encoded.size() + block_sizes.size() / 2 * sizeof(codec_block_header_t)) / (1024 * 1024),
+        (double)raw.size() / (double)(encoded.size() + block_sizes.size() / 2 * sizeof(codec_block_header_t)),
+        mb / t_enc, mb / t_dec, ok ? "" : "MISMATCH");
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    uint64_t entries = 16 * 1024 * 1024;
+    size_t buffer_size = 384 * 1024;
+    std::string in;
+    bool ok = true;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string const arg = argv[i];
+        if (arg == "-entries" && i + 1 < argc) {
+            entries = std::strtoull(argv[++i], NULL, 10);
+        } else if (arg == "-buffer_size" && i + 1 < argc) {
+            buffer_size = (size_t)std::strtoull(argv[++i], NULL, 10);
+        } else if (arg == "-in" && i + 1 < argc) {
+            in = argv[++i];
+        } else {
+            std::fprintf(stderr, "usage: bench_codec [-entries N] [-buffer_size N] [-in <file>]\n");
+            return 1;
+        }
+    }
+    if (buffer_size < TRACE_BB_MAX_SIZE)
+        buffer_size = TRACE_BB_MAX_SIZE;
+
+    std::printf("%-12s %10s %10s %8s %12s %12s\n", "pattern", "raw [MB]", "enc [MB]", "ratio",
+        "enc [MB/s]", "dec [MB/s]");
+    if (!in.empty()) {
+        FILE* f = std::fopen(in.c_str(), "rb");
+        std::vector<char> raw;
+        if (f == NULL) {
+            std::fprintf(stderr, "unable to open %s\n", in.c_str());
+            return 1;
+        }
+        trace_for_each_entry(f, [&](char const* entry, uint64_t header) {
+            raw.insert(raw.end(), entry, entry + trace_entry_size(header));
+        });
+        std::fclose(f);
+        ok = measure(in.c_str(), raw, buffer_size);
+        return ok ? 0 : 1;
+    }
+
+    struct {
+        char const* label;
+        pattern_fn_t fn;
+    } const patterns[] = {
+        { "sequential", sequential },
+        { "strided", strided },
+        { "random", random_access },
+        { "calls", calls },
+    };
+    for (auto const& pattern : patterns) {
+        std::vector<char> raw(entries * sizeof(mem_entry_t));
+        mem_entry_t* e = reinterpret_cast<mem_entry_t*>(raw.data());
+        for (uint64_t n = 0; n < entries; ++n)
+            pattern.fn(n, &e[n]);
+        ok = measure(pattern.label, raw, buffer_size) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,156 @@
+/* Measures the throughput of the .mmtrd output stage in records/second.
+ *
+ * A synthetic raw trace of memory references with a call every 100 records
+ * and 10^4 distinct pcs is generated chunk by chunk and converted the way
+ * the client does: symbol indices come from a pc_cache_t, the records go
+ * through an mmtrd_writer_t, once per .mmtrd version and once with delta
+ * encoded version 2 columns. The same trace is
+ * also written with the previous per-field std::ofstream::write encoding
+ * for comparison.
+ *
+ * Usage:
+ *   bench_mmtrd_writer [-records N] [-out <file>]
+ */
+
+#include "mmtrd.h"
+#include "pc_cache.h"
+#include "trace_format.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#define CHUNK_ENTRIES (1 << 16)
+#define NUM_PCS 10000
+
+/* Fills chunk with the raw entries first .. first + chunk.size() - 1. */
+static void generate(std::vector<mem_entry_t>& chunk, uint64_t first) {
+    for (size_t i = 0; i < chunk.size(); ++i) {
+        uint64_t const n = first + i;
+        uint64_t const pc = 0x140001000ull + (n * 2654435761ull % NUM_PCS) * 4;
+        if (n % 100 == 99) {
+            chunk[i].header = trace_make_header(TRACE_TYPE_CALL, 0, pc);
+            chunk[i].addr = 0x140002000ull + (n % 64) * 16;
+        } else {
+            chunk[i].header = trace_make_header(n & 1 ? TRACE_TYPE_WRITE : TRACE_TYPE_READ, 8, pc);
+            chunk[i].addr = 0x7ff000000000ull + n * 8;
+        }
+    }
+}
+
+static uint64_t symbol_of(pc_cache_t* cache, uint64_t pc) {
+    uint64_t idx;
+    if (!pc_cache_find(cache, pc, &idx)) {
+        idx = cache->count;
+        pc_cache_insert(cache, pc, idx);
+    }
+    return idx;
+}
+
+/* The encoding process_file used before mmtrd_writer_t. */
+static void convert_ofstream(std::string const& path, uint64_t records) {
+    std::ofstream ofile(path, std::ios::binary);
+    std::vector<mem_entry_t> chunk(CHUNK_ENTRIES);
+    pc_cache_t cache;
+    pc_cache_init(&cache, NUM_PCS);
+    for (uint64_t first = 0; first < records; first += chunk.size()) {
+        chunk.resize((size_t)std::min<uint64_t>(CHUNK_ENTRIES, records - first));
+        generate(chunk, first);
+        for (auto const& el : chunk) {
+            uint64_t const header = el.header;
+            if (trace_is_mem(header)) {
+                unsigned char type = 0;
+                unsigned char write = trace_get_type(header) == TRACE_TYPE_WRITE ? 1 : 2;
+                unsigned char size = (unsigned char)trace_get_size(header);
+                uint64_t sym = symbol_of(&cache, trace_get_pc(header));
+                ofile.write(reinterpret_cast<const char*>(&type), sizeof(type));
+                ofile.write(reinterpret_cast<const char*>(&write), sizeof(write));
+                ofile.write(reinterpret_cast<const char*>(&el.addr), sizeof(el.addr));
+                ofile.write(reinterpret_cast<const char*>(&size), sizeof(size));
+                ofile.write(reinterpret_cast<const char*>(&sym), sizeof(sym));
+            } else {
+                unsigned char type = 1;
+                unsigned char sub_type = 0;
+                uint64_t pc = trace_get_pc(header);
+                uint64_t pc_sym = symbol_of(&cache, pc);
+                uint64_t target_sym = symbol_of(&cache, el.addr);
+                ofile.write(reinterpret_cast<const char*>(&type), sizeof(type));
+                ofile.write(reinterpret_cast<const char*>(&sub_type), sizeof(sub_type));
+                ofile.write(reinterpret_cast<const char*>(&pc), sizeof(pc));
+                ofile.write(reinterpret_cast<const char*>(&el.addr), sizeof(el.addr));
+                ofile.write(reinterpret_cast<const char*>(&pc_sym), sizeof(pc_sym));
+                ofile.write(reinterpret_cast<const char*>(&target_sym), sizeof(target_sym));
+            }
+        }
+    }
+}
+
+static void convert_writer(std::string const& path, uint64_t records, uint32_t version, uint32_t flags) {
+    FILE* f = std::fopen(path.c_str(), "wb");
+    mmtrd_writer_t out;
+    std::vector<mem_entry_t> chunk(CHUNK_ENTRIES);
+    pc_cache_t cache;
+    if (f == NULL)
+        return;
+    pc_cache_init(&cache, NUM_PCS);
+    mmtrd_writer_init(&out, f, version, flags);
+    for (uint64_t first = 0; first < records; first += chunk.size()) {
+        chunk.resize((size_t)std::min<uint64_t>(CHUNK_ENTRIES, records - first));
+        generate(chunk, first);
+        for (auto const& el : chunk) {
+            uint64_t const header = el.header;
+            if (trace_is_mem(header)) {
+                mmtrd_write_mem(&out, trace_get_type(header) == TRACE_TYPE_WRITE, el.addr,
+                    trace_get_size(header), symbol_of(&cache, trace_get_pc(header)));
+            } else {
+                uint64_t const pc_sym = symbol_of(&cache, trace_get_pc(header));
+                uint64_t const target_sym = symbol_of(&cache, el.addr);
+                mmtrd_write_call(&out, trace_get_type(header), trace_get_pc(header), el.addr,
+                    pc_sym, target_sym);
+            }
+        }
+    }
+    mmtrd_writer_exit(&out);
+    std::fclose(f);
+}
+
+template <typename F>
+static void run(char const* label, F convert, std::string const& path, uint64_t records) {
+    auto const start = std::chrono::steady_clock::now();
+    convert(path, records);
+    auto const end = std::chrono::steady_clock::now();
+    double const t = std::chrono::duration<double>(end - start).count();
+    std::printf("%-10s %12.3f %16.0f\n", label, t, (double)records / t);
+    std::remove(path.c_str());
+}
+
+int main(int argc, char** argv) {
+    uint64_t records = 100000000;
+    std::string path = "bench.mmtrd";
+
+    for (int i = 1; i < argc; ++i) {
+        std::string const arg = argv[i];
+        if (arg == "-records" && i + 1 < argc) {
+            records = std::strtoull(argv[++i], NULL, 10);
+        } else if (arg == "-out" && i + 1 < argc) {
+            path = argv[++i];
+        } else {
+            std::fprintf(stderr, "usage: bench_mmtrd_writer [-records N] [-out <file>]\n");
+            return 1;
+        }
+    }
+
+    std::printf("%-10s %12s %16s\n", "encoder", "time [s]", "records/s");
+    run("ofstream", convert_ofstream, path, records);
+    run("packed", [](std::string const& p, uint64_t n) { convert_writer(p, n, MMTRD_VERSION_PACKED, 0); },
+        path, records);
+    run("columnar", [](std::string const& p, uint64_t n) { convert_writer(p, n, MMTRD_VERSION_COLUMNAR, 0); },
+        path, records);
+    run("varint", [](std::string const& p, uint64_t n) { convert_writer(p, n, MMTRD_VERSION_COLUMNAR, MMTRD_FLAG_VARINT); },
+        path, records);
+    return 0;
+}
@@ -0,0 +1,107 @@
+/* Measures the slowdown of an application running under regina.
+ *
+ * The application is run natively first and then once per configuration
+ * under drrun; every run is repeated and the median wall time is reported
+ * together with the slowdown relative to the native median.
+ *
+ * Usage:
+ *   bench_slowdown [-runs N] -drrun <drrun> [-config <label> <client> <client options>]...
+ *       -- <app> [app args...]
+ *
+ * e.g. comparing two builds of the client on test_sorting:
+ *   bench_slowdown -drrun drrun.exe -config before old/regina.dll "" \
+ *       -config after regina.dll "" -- test_sorting.exe
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+struct config_t {
+    std::string label;
+    std::string client;
+    std::string options;
+};
+
+static std::string quote(std::string const& s) {
+    return "\"" + s + "\"";
+}
+
+static double run_median(std::string cmd, int runs) {
+#ifdef _WIN32
+    /* cmd.exe strips the outermost pair of quotes */
+    cmd = "\"" + cmd + "\"";
+#endif
+    std::vector<double> times;
+    for (int i = 0; i < runs; ++i) {
+        auto const start = std::chrono::steady_clock::now();
+        int const res = std::system(cmd.c_str());
+        auto const end = std::chrono::steady_clock::now();
+        if (res != 0) {
+            std::fprintf(stderr, "command failed (%d): %s\n", res, cmd.c_str());
+            return -1.0;
+        }
+        times.push_back(std::chrono::duration<double>(end - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+static void usage() {
+    std::fprintf(stderr,
+        "usage: bench_slowdown [-runs N] -drrun <drrun> "
+        "[-config <label> <client> <client options>]... -- <app> [args...]\n");
+}
+
+int main(int argc, char** argv) {
+    int runs = 5;
+    std::string drrun;
+    std::vector<config_t> configs;
+    std::string app;
+
+    int i = 1;
+    for (; i < argc; ++i) {
+        std::string const arg = argv[i];
+        if (arg == "--") {
+            ++i;
+            break;
+        } else if (arg == "-runs" && i + 1 < argc) {
+            runs = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "-drrun" && i + 1 < argc) {
+            drrun = argv[++i];
+        } else if (arg == "-config" && i + 3 < argc) {
+            config_t config;
+            config.label = argv[++i];
+            config.client = argv[++i];
+            config.options = argv[++i];
+            configs.push_back(config);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    for (; i < argc; ++i) {
+        app += (app.empty() ? "" : " ") + quote(argv[i]);
+    }
+    if (drrun.empty() || configs.empty() || app.empty()) {
+        usage();
+        return 1;
+    }
+
+    double const native = run_median(app, runs);
+    if (native <= 0.0)
+        return 1;
+    std::printf("%-16s %12s %10s\n", "config", "median [s]", "slowdown");
+    std::printf("%-16s %12.3f %10.2f\n", "native", native, 1.0);
+    for (auto const& config : configs) {
+        std::string const cmd = quote(drrun) + " -c " + quote(config.client) + " " + config.options + " -- " + app;
+        double const t = run_median(cmd, runs);
+        if (t < 0.0)
+            return 1;
+        std::printf("%-16s %12.3f %10.2f\n", config.label.c_str(), t, t / native);
+    }
+    return 0;
+}
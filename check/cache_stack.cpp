@@ -0,0 +1,98 @@
+/* Checks the stack distances of cache_stack_t, which regina-cachesweep
+ * turns into the misses of every associativity at once, against cache_sim_t:
+ * an access must hit an LRU cache of the same sets and line size with a ways
+ * exactly if its distance is below a. The stream mixes reuse, strided and
+ * random accesses, some of them spanning two lines.
+ *
+ * Usage:
+ *   check_cache_stack
+ */
+
+#include "cachesim.h"
+#include "check.h"
+
+#include <random>
+#include <string>
+#include <vector>
+
+#define LINE_SIZE 64
+#define NUM_SETS 16
+#define DEPTH 16
+#define ACCESSES 200000
+
+static void check_distances(void) {
+    cache_stack_t stack;
+
+    cache_stack_init(&stack, LINE_SIZE, 1, 4);
+    CHECK(cache_stack_access(&stack, 0x000, 4) == 4);
+    CHECK(cache_stack_access(&stack, 0x040, 4) == 4);
+    CHECK(cache_stack_access(&stack, 0x080, 4) == 4);
+    CHECK(cache_stack_access(&stack, 0x000, 4) == 2);
+    CHECK(cache_stack_access(&stack, 0x000, 8) == 0);
+    /* lines 1 and 2, both two deep, the worst of them counts */
+    CHECK(cache_stack_access(&stack, 0x07c, 8) == 2);
+    CHECK(cache_stack_access(&stack, 0x0c0, 4) == 4);
+    CHECK(cache_stack_access(&stack, 0x100, 4) == 4);
+    CHECK(cache_stack_access(&stack, 0x040, 4) == 3);
+    /* line 0 fell off the bottom of the four deep stack */
+    CHECK(cache_stack_access(&stack, 0x000, 4) == 4);
+}
+
+static void check_against_sim(void) {
+    std::vector<cache_sim_t> sims;
+    cache_stack_t stack;
+    std::mt19937_64 rng(42);
+
+    cache_stack_init(&stack, LINE_SIZE, NUM_SETS, DEPTH);
+    for (uint32_t assoc = 1; assoc <= DEPTH; assoc *= 2) {
+        std::vector<cache_config_t> configs;
+        std::string err;
+        std::string const config = std::to_string(NUM_SETS * assoc * LINE_SIZE) + ":" + std::to_string(assoc) + ":"
+            + std::to_string(LINE_SIZE) + ":lru";
+        CHECK(cache_parse_config(config, &configs, &err));
+        sims.emplace_back();
+        cache_sim_init(&sims.back(), configs);
+    }
+
+    uint64_t sequential = 0x10000000ull;
+    uint64_t mismatches = 0;
+    for (uint64_t n = 0; n < ACCESSES; n++) {
+        uint64_t addr;
+        uint32_t const size = 1u << (rng() % 4);
+        switch (rng() % 4) {
+        case 0:
+            addr = sequential;
+            sequential += size;
+            break;
+        case 1:
+            /* a column walk with a stride of four lines */
+            addr = 0x20000000ull + (n % 256) * 4 * LINE_SIZE + (n / 256) % LINE_SIZE;
+            break;
+        case 2:
+            /* a working set of about the largest cache */
+            addr = 0x30000000ull + rng() % (2 * NUM_SETS * DEPTH * LINE_SIZE);
+            break;
+        default:
+            addr = 0x40000000ull + rng() % (1 << 24);
+            break;
+        }
+
+        uint32_t const distance = cache_stack_access(&stack, addr, size);
+        uint32_t assoc = 1;
+        for (auto& sim : sims) {
+            bool const hit = cache_sim_access(&sim, addr, size) == 0;
+            if (hit != (distance < assoc) && mismatches++ < 10) {
+                std::fprintf(stderr, "access %llu at 0x%llx of %u bytes: distance %u, %u ways %s\n",
+                    (unsigned long long)n, (unsigned long long)addr, size, distance, assoc, hit ? "hit" : "missed");
+            }
+            assoc *= 2;
+        }
+    }
+    CHECK(mismatches == 0);
+}
+
+int main() {
+    check_distances();
+    check_against_sim();
+    return check_result();
+}
@@ -0,0 +1,173 @@
+/* Checks the cache model of cachesim.h: the victims of LRU and tree PLRU,
+ * accesses spanning lines, the levels behind L1, the errors of
+ * cache_parse_config, and the loop nests of test/matrix.cpp, whose bad
+ * variants must miss L1 more often than the good ones with the
+ * configuration the README runs them with.
+ *
+ * Usage:
+ *   check_cachesim
+ */
+
+#include "cachesim.h"
+#include "check.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/* the layout of test/matrix.cpp: N x N floats in three allocations */
+#define N 64
+#define B (64 / sizeof(float))
+#define MEM_A 0x10000000ull
+#define MEM_B 0x10010000ull
+
+static cache_sim_t make_sim(char const* config) {
+    std::vector<cache_config_t> configs;
+    std::string err;
+    cache_sim_t sim;
+
+    CHECK(cache_parse_config(config, &configs, &err));
+    cache_sim_init(&sim, configs);
+    return sim;
+}
+
+static uint64_t elem(uint64_t base, size_t i) {
+    return base + i * sizeof(float);
+}
+
+/* Returns the L1 misses of the references of one loop nest. */
+template <typename F>
+static uint64_t l1_misses(F loop) {
+    cache_sim_t sim = make_sim("4K:8:64:lru,32K:8:64:plru");
+    cache_stats_t stats = {};
+
+    loop([&](uint64_t addr, bool write) { cache_stats_add(&stats, write, cache_sim_access(&sim, addr, sizeof(float))); });
+    return stats.misses[0];
+}
+
+static void check_matrix(void) {
+    uint64_t const interchange_bad = l1_misses([](auto access) {
+        for (size_t j = 0; j < N; j++)
+            for (size_t i = 0; i < N; i++)
+                access(elem(MEM_A, i * N + j), false);
+    });
+    uint64_t const interchange_good = l1_misses([](auto access) {
+        for (size_t i = 0; i < N; i++)
+            for (size_t j = 0; j < N; j++)
+                access(elem(MEM_A, i * N + j), false);
+    });
+    uint64_t const blocking_off = l1_misses([](auto access) {
+        for (size_t i = 0; i < N; i++) {
+            for (size_t j = 0; j < N; j++) {
+                access(elem(MEM_A, i * N + j), false);
+                access(elem(MEM_B, j * N + i), true);
+            }
+        }
+    });
+    uint64_t const blocking_on = l1_misses([](auto access) {
+        for (size_t ii = 0; ii < N; ii += B) {
+            for (size_t jj = 0; jj < N; jj += B) {
+                for (size_t i = ii; i < std::min(ii + B - 1, (size_t)N); i++) {
+                    for (size_t j = jj; j < std::min(jj + B - 1, (size_t)N); j++) {
+                        access(elem(MEM_A, i * N + j), false);
+                        access(elem(MEM_B, j * N + i), true);
+                    }
+                }
+            }
+        }
+    });
+
+    std::printf("loop_interchange_bad %llu, loop_interchange_good %llu, loop_blocking_off %llu, loop_blocking_on %llu L1 misses\n",
+        (unsigned long long)interchange_bad, (unsigned long long)interchange_good,
+        (unsigned long long)blocking_off, (unsigned long long)blocking_on);
+    /* every line of the good order is missed once, its 16 floats then hit */
+    CHECK(interchange_good == N * N / B);
+    CHECK(interchange_bad > 4 * interchange_good);
+    CHECK(blocking_on * 2 < blocking_off);
+}
+
+static void check_lru(void) {
+    /* a single set of two ways */
+    cache_sim_t sim = make_sim("128:2:64:lru");
+
+    CHECK(cache_sim_access(&sim, 0x000, 4) == 1);
+    CHECK(cache_sim_access(&sim, 0x040, 4) == 1);
+    CHECK(cache_sim_access(&sim, 0x000, 4) == 0);
+    /* evicts 0x40, the least recently used */
+    CHECK(cache_sim_access(&sim, 0x080, 4) == 1);
+    CHECK(cache_sim_access(&sim, 0x000, 4) == 0);
+    CHECK(cache_sim_access(&sim, 0x040, 4) == 1);
+}
+
+static void check_plru(void) {
+    /* a single set of four ways, filled with lines 0 to 3 */
+    cache_sim_t sim = make_sim("256:4:64:plru");
+
+    for (uint64_t line = 0; line < 4; line++)
+        CHECK(cache_sim_access(&sim, line * 64, 4) == 1);
+    CHECK(cache_sim_access(&sim, 0, 4) == 0);
+    /* The tree now points away from line 0 and, in the other half, away
+     * from line 3: line 2 is the victim, where LRU would pick line 1.
+     */
+    CHECK(cache_sim_access(&sim, 4 * 64, 4) == 1);
+    CHECK(cache_sim_access(&sim, 0 * 64, 4) == 0);
+    CHECK(cache_sim_access(&sim, 1 * 64, 4) == 0);
+    CHECK(cache_sim_access(&sim, 3 * 64, 4) == 0);
+    CHECK(cache_sim_access(&sim, 2 * 64, 4) == 1);
+}
+
+static void check_lines_and_levels(void) {
+    cache_sim_t sim = make_sim("128:2:64:lru,1K:4:64:lru");
+
+    /* 8 bytes at 60 touch lines 0 and 1, both come from memory */
+    CHECK(cache_sim_access(&sim, 60, 8) == 2);
+    CHECK(cache_sim_access(&sim, 0, 4) == 0);
+    CHECK(cache_sim_access(&sim, 64, 4) == 0);
+    /* a new line in either half makes the whole access miss */
+    CHECK(cache_sim_access(&sim, 120, 16) == 2);
+    /* line 0 was evicted from L1 by lines 1 and 2 but is still in L2 */
+    CHECK(cache_sim_access(&sim, 0, 4) == 1);
+    CHECK(cache_sim_access(&sim, 0, 0) == 0);
+}
+
+static void check_parse(void) {
+    std::vector<cache_config_t> configs;
+    std::string err;
+
+    CHECK(cache_parse_config("32K:8:64:plru,1M:16:64", &configs, &err));
+    CHECK(configs.size() == 2);
+    CHECK(configs[0].size == 32 * 1024 && configs[0].assoc == 8 && configs[0].line_size == 64 && configs[0].policy == CACHE_PLRU);
+    CHECK(configs[1].size == 1024 * 1024 && configs[1].assoc == 16 && configs[1].policy == CACHE_LRU);
+
+    char const* const invalid[] = {
+        "",
+        "32K",
+        "32K:8",
+        "32K:8:63",
+        "32K:0:64",
+        "48K:8:64",
+        "32K:128:64",
+        "24K:6:64:plru",
+        "32K:8:64:fifo",
+        "32K:8:64x",
+        "32K:8:64,",
+        "1K:1:64,1K:1:64,1K:1:64,1K:1:64,1K:1:64",
+    };
+    for (char const* text : invalid) {
+        err.clear();
+        bool const ok = cache_parse_config(text, &configs, &err);
+        CHECK(!ok);
+        CHECK(!err.empty());
+        if (ok)
+            std::fprintf(stderr, "accepted '%s'\n", text);
+    }
+}
+
+int main() {
+    check_lru();
+    check_plru();
+    check_lines_and_levels();
+    check_parse();
+    check_matrix();
+    return check_result();
+}
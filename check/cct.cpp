@@ -0,0 +1,100 @@
+/* Checks the calling context tree of cct.h: node numbering and reuse of
+ * children, the frame a return goes back to on a shadow stack with
+ * recursion and frames skipped by longjmp, and the distinct line estimate
+ * of the per-node counters, alone and merged.
+ *
+ * Usage:
+ *   check_cct
+ */
+
+#include "cct.h"
+#include "check.h"
+
+#include <cstring>
+#include <vector>
+
+static void check_tree(void) {
+    cct_tree_t tree;
+
+    cct_tree_init(&tree);
+    CHECK(tree.nodes.size() == 1 && tree.nodes[CCT_ROOT].sym == CCT_NO_SYM);
+    uint32_t const main_node = cct_tree_child(&tree, CCT_ROOT, 10);
+    uint32_t const a = cct_tree_child(&tree, main_node, 20);
+    uint32_t const b = cct_tree_child(&tree, main_node, 30);
+    /* the same callee from another caller is another context */
+    uint32_t const a_from_b = cct_tree_child(&tree, b, 20);
+    uint32_t const recursion = cct_tree_child(&tree, a, 20);
+    CHECK(main_node == 1 && a == 2 && b == 3 && a_from_b == 4 && recursion == 5);
+    CHECK(cct_tree_child(&tree, main_node, 20) == a);
+    CHECK(cct_tree_child(&tree, b, 20) == a_from_b);
+    CHECK(cct_tree_child(&tree, CCT_ROOT, 10) == main_node);
+    CHECK(tree.nodes.size() == 6);
+    CHECK(tree.nodes[a_from_b].parent == b && tree.nodes[a_from_b].sym == 20);
+    CHECK(tree.nodes[recursion].parent == a);
+
+    /* enough children to grow the table */
+    for (uint32_t sym = 0; sym < 20000; sym++)
+        CHECK(cct_tree_child(&tree, a, 1000 + sym) == 6 + sym);
+    for (uint32_t sym = 0; sym < 20000; sym++)
+        CHECK(cct_tree_child(&tree, a, 1000 + sym) == 6 + sym);
+}
+
+static void check_frames(void) {
+    std::vector<cct_frame_t> stack;
+
+    CHECK(cct_find_frame(stack, 0x1005) == 0);
+    stack.push_back(cct_frame_t{ 1, 0x1000, 0 });
+    stack.push_back(cct_frame_t{ 2, 0x2000, 0 });
+    /* a recursive call from the same site */
+    stack.push_back(cct_frame_t{ 3, 0x2000, 0 });
+    stack.push_back(cct_frame_t{ 4, 0x3000, 0 });
+
+    CHECK(cct_find_frame(stack, 0x3005) == 3);
+    CHECK(cct_find_frame(stack, 0x3000 + CCT_MAX_CALL_LENGTH) == 3);
+    /* the innermost of the recursive frames */
+    CHECK(cct_find_frame(stack, 0x2002) == 2);
+    /* a longjmp back to the first frame skips the others */
+    CHECK(cct_find_frame(stack, 0x1005) == 0);
+    /* the call itself and beyond the longest instruction are no returns */
+    CHECK(cct_find_frame(stack, 0x3000) == stack.size());
+    CHECK(cct_find_frame(stack, 0x3000 + CCT_MAX_CALL_LENGTH + 1) == stack.size());
+    CHECK(cct_find_frame(stack, 0x0fff) == stack.size());
+}
+
+static void check_lines(void) {
+    uint64_t const counts[] = { 1, 2, 10, 50, 100, 1000, 10000, 100000 };
+
+    for (uint64_t n : counts) {
+        cct_stats_t all = {}, low = {}, high = {};
+        /* every line twice, at two offsets */
+        for (uint64_t line = 0; line < n; line++) {
+            uint64_t const addr = 0x7ff000000000ull + (line << CCT_LINE_SHIFT);
+            cct_stats_add(&all, false, addr, 8);
+            cct_stats_add(&all, true, addr + 8, 4);
+            cct_stats_add(line < n / 2 ? &low : &high, false, addr, 8);
+            cct_stats_add(line < n / 2 ? &low : &high, true, addr + 8, 4);
+        }
+        CHECK(all.reads == n && all.writes == n && all.bytes == 12 * n);
+        uint64_t const estimate = cct_stats_lines(all);
+        double const error = ((double)estimate - (double)n) / (double)n;
+        std::printf("%llu lines estimated as %llu\n", (unsigned long long)n, (unsigned long long)estimate);
+        /* exact without collisions, about three standard errors otherwise */
+        if (n <= 2)
+            CHECK(estimate == n);
+        else
+            CHECK(error > -0.4 && error < 0.4);
+
+        cct_stats_merge(&low, high);
+        CHECK(low.reads == all.reads && low.writes == all.writes && low.bytes == all.bytes);
+        CHECK(memcmp(low.lines, all.lines, sizeof(all.lines)) == 0);
+    }
+    cct_stats_t none = {};
+    CHECK(cct_stats_lines(none) == 0);
+}
+
+int main() {
+    check_tree();
+    check_frames();
+    check_lines();
+    return check_result();
+}
@@ -0,0 +1,29 @@
+/* Assertions of the check programs, which exercise the headers without
+ * DynamoRIO. A failed CHECK prints where and what failed and makes
+ * check_result, the exit code of main, nonzero; the program goes on to
+ * report every failure.
+ */
+
+#ifndef REGINA_CHECK_H
+#define REGINA_CHECK_H
+
+#include <cstdio>
+
+static int check_failures;
+
+#define CHECK(cond)                                                                      \
+    do {                                                                                 \
+        if (!(cond)) {                                                                   \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            check_failures++;                                                            \
+        }                                                                                \
+    } while (0)
+
+static inline int
+check_result(void) {
+    if (check_failures > 0)
+        std::fprintf(stderr, "%d checks failed\n", check_failures);
+    return check_failures > 0 ? 1 : 0;
+}
+
+#endif /* REGINA_CHECK_H */
@@ -0,0 +1,186 @@
+/* Checks the -compress codec of codec.h and the raw trace reader of
+ * trace_reader.h: the varint and zigzag edge values, a lossless round trip
+ * of blocks mixing every entry type with extreme pcs, sizes and strides,
+ * the rejection of cut off blocks, and plain and encoded trace files read
+ * back through trace_for_each_entry across its read window.
+ *
+ * Usage:
+ *   check_codec
+ */
+
+#include "codec.h"
+#include "check.h"
+#include "trace_format.h"
+#include "trace_reader.h"
+
+#include <cstring>
+#include <random>
+#include <vector>
+
+static void check_varints(void) {
+    int64_t const values[] = { 0, 1, -1, 63, -64, 64, INT64_MAX, INT64_MIN };
+    uint8_t buf[16];
+
+    for (int64_t v : values) {
+        CHECK(codec_unzigzag(codec_zigzag(v)) == v);
+        uint64_t const zz = codec_zigzag(v);
+        uint8_t* end = codec_put_varint(buf, zz);
+        uint64_t back = 0;
+        CHECK(codec_get_varint(buf, end, &back) == end);
+        CHECK(back == zz);
+        /* cut off by one byte */
+        CHECK(codec_get_varint(buf, end - 1, &back) == NULL);
+    }
+    CHECK(codec_zigzag(-1) == 1 && codec_zigzag(1) == 2);
+    CHECK(codec_put_varint(buf, 127) - buf == 1);
+    CHECK(codec_put_varint(buf, 128) - buf == 2);
+    CHECK(codec_put_varint(buf, UINT64_MAX) - buf == 10);
+}
+
+/* Appends n entries of every kind the client writes to trace. */
+static void make_entries(std::mt19937_64* rng, size_t n, std::vector<uint64_t>* trace) {
+    uint64_t const pc_max = (1ull << TRACE_PC_BITS) - 1;
+    uint64_t addr = 0x7ff000000000ull;
+
+    for (size_t i = 0; i < n; i++) {
+        uint64_t const pc = (*rng)() % 2 == 0 ? 0x140001000ull + (*rng)() % 4096 : (*rng)() & pc_max;
+        switch ((*rng)() % 6) {
+        case 0:
+        case 1: {
+            trace_type_t const type = (*rng)() % 2 == 0 ? TRACE_TYPE_READ : TRACE_TYPE_WRITE;
+            uint32_t const size = (*rng)() % 8 == 0 ? TRACE_SIZE_MAX : 1u << ((*rng)() % 6);
+            uint64_t const tls = (*rng)() % 4 == 0 ? TRACE_FLAG_TLS : 0;
+            addr = (*rng)() % 8 == 0 ? (*rng)() : addr + 8;
+            trace->push_back(trace_make_header(type, size, pc) | tls);
+            trace->push_back(addr);
+            break;
+        }
+        case 2: {
+            trace_type_t const types[] = { TRACE_TYPE_CALL, TRACE_TYPE_CALL_IND, TRACE_TYPE_RETURN };
+            trace->push_back(trace_make_header(types[(*rng)() % 3], 0, pc));
+            trace->push_back((*rng)() & pc_max);
+            break;
+        }
+        case 3: {
+            uint32_t const refs = (*rng)() % 4 == 0 ? TRACE_BB_MAX_REFS : (uint32_t)((*rng)() % 8);
+            trace->push_back(trace_make_header(TRACE_TYPE_BB, refs, (*rng)() % 100000));
+            for (uint32_t r = 0; r < refs; r++)
+                trace->push_back((*rng)() % 2 == 0 ? addr - r * 8 : (*rng)());
+            break;
+        }
+        case 4:
+            trace->push_back(trace_make_header(TRACE_TYPE_TIME, 0, 0));
+            trace->push_back((*rng)() % 2 == 0 ? (*rng)() : trace->back() + 100);
+            break;
+        default:
+            /* a long sequential run, the common case */
+            for (int k = 0; k < 16; k++) {
+                addr += 4;
+                trace->push_back(trace_make_header(TRACE_TYPE_READ, 4, 0x140002000ull));
+                trace->push_back(addr);
+            }
+            break;
+        }
+    }
+}
+
+static void check_blocks(void) {
+    std::mt19937_64 rng(1);
+    std::vector<uint64_t> trace;
+
+    make_entries(&rng, 20000, &trace);
+    size_t const size = trace.size() * sizeof(uint64_t);
+    std::vector<uint8_t> enc(codec_max_encoded_size(size));
+    std::vector<char> dec(size);
+    char const* base = reinterpret_cast<char const*>(trace.data());
+
+    size_t const enc_size = codec_encode_entries(base, size, enc.data());
+    CHECK(enc_size <= enc.size());
+    CHECK(enc_size < size);
+    CHECK(codec_decode_entries(enc.data(), enc_size, dec.data(), dec.size()));
+    CHECK(memcmp(dec.data(), base, size) == 0);
+
+    /* the size of the block must match its entries */
+    CHECK(!codec_decode_entries(enc.data(), enc_size, dec.data(), dec.size() - 16));
+    dec.resize(size + 16);
+    CHECK(!codec_decode_entries(enc.data(), enc_size, dec.data(), dec.size()));
+    dec.resize(size);
+
+    /* every block cut off in its last entries is rejected */
+    for (size_t cut = 1; cut < 64; cut++)
+        CHECK(!codec_decode_entries(enc.data(), enc_size - cut, dec.data(), dec.size()));
+
+    /* an empty block, e.g. of a thread without references */
+    CHECK(codec_encode_entries(base, 0, enc.data()) == 0);
+    CHECK(codec_decode_entries(enc.data(), 0, dec.data(), 0));
+
+    /* the worst case bound holds for entries that do not compress */
+    std::vector<uint64_t> noise;
+    for (int i = 0; i < 1000; i++) {
+        noise.push_back(trace_make_header(TRACE_TYPE_WRITE, TRACE_SIZE_MAX, rng() & ((1ull << TRACE_PC_BITS) - 1))
+            | TRACE_FLAG_TLS);
+        noise.push_back(rng());
+    }
+    size_t const noise_size = noise.size() * sizeof(uint64_t);
+    CHECK(codec_encode_entries(reinterpret_cast<char const*>(noise.data()), noise_size, enc.data())
+        <= codec_max_encoded_size(noise_size));
+}
+
+/* Writes trace to a temporary file as the client does and reads it back. */
+static std::vector<uint64_t> write_and_read(std::vector<uint64_t> const& trace, bool compress, size_t block_entries) {
+    std::vector<uint64_t> back;
+    FILE* f = std::tmpfile();
+
+    CHECK(f != NULL);
+    if (f == NULL)
+        return back;
+    if (compress) {
+        fwrite(TRACE_CODEC_MAGIC, 1, TRACE_CODEC_MAGIC_SIZE, f);
+        std::vector<uint8_t> enc;
+        size_t offset = 0;
+        while (offset < trace.size()) {
+            /* a block holds complete entries only */
+            size_t end = offset;
+            while (end < trace.size() && end - offset < block_entries)
+                end += trace_entry_size(trace[end]) / sizeof(uint64_t);
+            size_t const size = (end - offset) * sizeof(uint64_t);
+            codec_block_header_t block;
+            enc.resize(codec_max_encoded_size(size));
+            block.raw_size = (uint32_t)size;
+            block.encoded_size = (uint32_t)codec_encode_entries(reinterpret_cast<char const*>(&trace[offset]), size, enc.data());
+            fwrite(&block, sizeof(block), 1, f);
+            fwrite(enc.data(), 1, block.encoded_size, f);
+            offset = end;
+        }
+    } else {
+        fwrite(trace.data(), sizeof(uint64_t), trace.size(), f);
+        /* a partial entry of a killed thread is dropped */
+        fwrite(trace.data(), 1, 12, f);
+    }
+    rewind(f);
+    trace_for_each_entry(f, [&](char const* entry, uint64_t header) {
+        uint64_t const* words = reinterpret_cast<uint64_t const*>(entry);
+        back.insert(back.end(), words, words + trace_entry_size(header) / sizeof(uint64_t));
+    });
+    fclose(f);
+    return back;
+}
+
+static void check_files(void) {
+    std::mt19937_64 rng(2);
+    std::vector<uint64_t> trace;
+
+    /* more than one read window */
+    while (trace.size() * sizeof(uint64_t) < TRACE_READ_CHUNK + TRACE_READ_CHUNK / 2)
+        make_entries(&rng, 10000, &trace);
+    CHECK(write_and_read(trace, false, 0) == trace);
+    CHECK(write_and_read(trace, true, 1 << 16) == trace);
+    CHECK(write_and_read(trace, true, 1) == trace);
+}
+
+int main() {
+    check_varints();
+    check_blocks();
+    check_files();
+    return check_result();
+}
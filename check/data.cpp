@@ -0,0 +1,67 @@
+/* Checks the stack frame lookup of data.h against its definition, the
+ * innermost frame with a known return address at or above the reference,
+ * on shadow stacks grown and unwound at random in which some frames never
+ * learn their return address, up to a recursion 100000 frames deep.
+ *
+ * Usage:
+ *   check_data
+ */
+
+#include "check.h"
+#include "data.h"
+
+#include <random>
+#include <vector>
+
+static size_t linear_find(std::vector<cct_frame_t> const& stack, uint64_t addr) {
+    for (size_t i = stack.size(); i-- > 0;) {
+        if (stack[i].slot != 0 && stack[i].slot >= addr)
+            return i;
+    }
+    return stack.size();
+}
+
+int main() {
+    std::vector<cct_frame_t> stack;
+    std::vector<uint32_t> known;
+    std::mt19937_64 rng(10);
+    uint64_t const top = 0x7ffff0000000ull;
+    uint64_t sp = top;
+    uint64_t mismatches = 0;
+
+    for (int step = 0; step < 400000; step++) {
+        uint64_t const r = rng() % 16;
+        if (stack.size() < 100000 && (r < 9 || stack.empty() || step < 100000)) {
+            /* a call, one in eight without its return address */
+            sp -= 16 + (rng() % 64) * 8;
+            stack.push_back(cct_frame_t{ (uint32_t)stack.size(), 0x1000, 0 });
+            if (rng() % 8 != 0) {
+                stack.back().slot = sp;
+                known.push_back((uint32_t)(stack.size() - 1));
+            }
+        } else {
+            /* a return, sometimes a longjmp over several frames */
+            size_t const keep = rng() % 8 == 0 ? rng() % stack.size() : stack.size() - 1;
+            stack.resize(keep);
+            while (!known.empty() && known.back() >= keep)
+                known.pop_back();
+            sp = top;
+            for (size_t i = stack.size(); i-- > 0;) {
+                if (stack[i].slot != 0) {
+                    sp = stack[i].slot;
+                    break;
+                }
+            }
+        }
+        /* the definition costs the depth, deep stacks are sampled */
+        if (stack.size() > 1000 && step % 256 != 0)
+            continue;
+        uint64_t const addrs[] = { sp, sp + 8, sp - 8, top - rng() % (top - sp + 1), top + 8 };
+        for (uint64_t addr : addrs) {
+            if (data_find_frame(stack, known, addr) != linear_find(stack, addr) && mismatches++ < 10)
+                std::fprintf(stderr, "step %d: 0x%llx at depth %zu\n", step, (unsigned long long)addr, stack.size());
+        }
+    }
+    CHECK(mismatches == 0);
+    return check_result();
+}
@@ -0,0 +1,116 @@
+/* Checks the code filters of filter.h: parsing of -address_ranges, the
+ * module and function selections, and the range set as modules load and
+ * unload, against a plain list of the ranges of the loaded modules.
+ *
+ * Usage:
+ *   check_filter
+ */
+
+#include "check.h"
+#include "filter.h"
+
+#include <random>
+#include <string>
+#include <vector>
+
+static void check_parse(void) {
+    std::vector<filter_range_t> ranges;
+    std::string err;
+
+    CHECK(filter_parse_ranges("", &ranges, &err) && ranges.empty());
+    CHECK(filter_parse_ranges("401000-402000,,7ff6a000-7ff6b000", &ranges, &err));
+    CHECK(ranges.size() == 2);
+    CHECK(ranges[0].start == 0x401000 && ranges[0].end == 0x402000);
+    CHECK(ranges[1].start == 0x7ff6a000 && ranges[1].end == 0x7ff6b000);
+    CHECK(filter_parse_ranges("0x401000-0x401010", &ranges, &err) && ranges[0].end == 0x401010);
+
+    char const* const invalid[] = { "401000", "401000-", "401000-400000", "401000-401000", "401000-402000x",
+        "main-402000", "401000:402000" };
+    for (char const* text : invalid) {
+        err.clear();
+        CHECK(!filter_parse_ranges(text, &ranges, &err));
+        CHECK(!err.empty());
+    }
+}
+
+static void check_selection(void) {
+    filter_t f;
+
+    filter_init(&f, "App.exe,LIBFOO.so", "main,libbar.so!Solve,APP.EXE!init", "1000-2000");
+    CHECK(filter_wants_module(&f, "app.exe"));
+    CHECK(filter_wants_module(&f, "libfoo.SO"));
+    CHECK(!filter_wants_module(&f, "libbar.so"));
+    CHECK(filter_wants_functions_of(&f, "anything.dll"));
+    CHECK(filter_wants_function(&f, "anything.dll", "main"));
+    CHECK(filter_wants_function(&f, "LibBar.so", "Solve"));
+    /* function names stay case sensitive */
+    CHECK(!filter_wants_function(&f, "libbar.so", "solve"));
+    CHECK(!filter_wants_function(&f, "libfoo.so", "Solve"));
+    CHECK(filter_wants_function(&f, "app.exe", "init"));
+    CHECK(!filter_wants_function(&f, "libbar.so", "init"));
+    CHECK(filter_contains(&f, 0x1000) && filter_contains(&f, 0x1fff));
+    CHECK(!filter_contains(&f, 0x0fff) && !filter_contains(&f, 0x2000));
+
+    filter_init(&f, "", "libbar.so!Solve", "");
+    CHECK(!filter_wants_functions_of(&f, "app.exe"));
+    CHECK(filter_wants_functions_of(&f, "LIBBAR.SO"));
+}
+
+static void check_ranges(void) {
+    filter_t f;
+    std::mt19937_64 rng(9);
+    /* per module slot the ranges added while it is loaded */
+    std::vector<std::vector<filter_range_t>> modules(32);
+    uint64_t const module_size = 0x100000;
+    uint64_t const base = 0x7ff600000000ull;
+    uint64_t mismatches = 0;
+
+    filter_init(&f, "", "", "");
+    for (int step = 0; step < 5000; step++) {
+        size_t const m = rng() % modules.size();
+        uint64_t const start = base + m * module_size;
+        if (rng() % 8 == 0) {
+            /* unload */
+            filter_remove(&f, start, start + module_size);
+            modules[m].clear();
+        } else if (rng() % 4 == 0) {
+            /* the whole module, e.g. for -modules */
+            filter_add(&f, start, start + module_size);
+            modules[m].push_back(filter_range_t{ start, start + module_size });
+        } else {
+            /* a function, which may overlap or touch others */
+            uint64_t const offset = rng() % (module_size - 0x1000);
+            uint64_t const size = 1 + rng() % 0x1000;
+            filter_add(&f, start + offset, start + offset + size);
+            modules[m].push_back(filter_range_t{ start + offset, start + offset + size });
+        }
+
+        for (size_t i = 1; i < f.ranges.size(); i++)
+            CHECK(f.ranges[i - 1].end <= f.ranges[i].start);
+        for (int probe = 0; probe < 20; probe++) {
+            size_t const pm = rng() % modules.size();
+            uint64_t pc = base + pm * module_size + rng() % module_size;
+            if (probe % 2 == 0 && !modules[pm].empty()) {
+                /* the edges of a range */
+                filter_range_t const& r = modules[pm][rng() % modules[pm].size()];
+                uint64_t const edges[] = { r.start - 1, r.start, r.end - 1, r.end };
+                pc = edges[rng() % 4];
+            }
+            bool want = false;
+            for (auto const& mod : modules) {
+                for (auto const& r : mod)
+                    want |= pc >= r.start && pc < r.end;
+            }
+            if (filter_contains(&f, pc) != want && mismatches++ < 10)
+                std::fprintf(stderr, "step %d: 0x%llx %s\n", step, (unsigned long long)pc, want ? "missed" : "included");
+        }
+    }
+    CHECK(mismatches == 0);
+}
+
+int main() {
+    check_parse();
+    check_selection();
+    check_ranges();
+    return check_result();
+}
@@ -0,0 +1,252 @@
+/* Checks the heap index of heap.h against a plain list of allocations:
+ * allocations of a few bytes to a few pages and large ones reuse the same
+ * addresses over time, and every lookup at their first and last bytes,
+ * just past them, and one before, at and after their alloc and free times
+ * has to return the allocation live then or else the first one allocated
+ * afterwards. A second pass looks up stable allocations from several
+ * threads while one thread keeps adding and freeing others, the way the
+ * writer threads use the index while the application allocates. A third
+ * pass cycles large blocks through the same addresses many times: the
+ * index has to grow linearly, and stack and global references, which
+ * never hit the heap, have to stay cheap.
+ *
+ * Usage:
+ *   check_heap
+ */
+
+#include "check.h"
+#include "heap.h"
+
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+#define PAGE (1ull << HEAP_PAGE_SHIFT)
+/* every slot holds at most one allocation at a time */
+#define SLOT_PAGES 96
+#define NUM_SLOTS 64
+#define BASE 0x7f0000000000ull
+
+typedef struct _record_t {
+    uint32_t id;
+    uint64_t start;
+    uint64_t end;
+    uint64_t alloc_time;
+    uint64_t free_time;
+} record_t;
+
+/* Returns what heap_index_lookup must return. */
+static uint32_t expected(std::vector<record_t> const& records, uint64_t addr, uint64_t time) {
+    uint32_t best = HEAP_NONE;
+    uint64_t best_time = UINT64_MAX;
+
+    for (auto const& r : records) {
+        if (addr < r.start || addr >= r.end)
+            continue;
+        if (r.alloc_time <= time && time < r.free_time)
+            return r.id;
+        if (r.alloc_time > time && r.alloc_time < best_time) {
+            best = r.id;
+            best_time = r.alloc_time;
+        }
+    }
+    return best;
+}
+
+/* Adds an allocation of a random size to an empty slot. */
+static void add(heap_index_t* index, std::mt19937_64* rng, uint64_t slot, uint64_t time, std::vector<record_t>* records) {
+    uint64_t size;
+
+    switch ((*rng)() % 4) {
+    case 0:
+        size = (*rng)() % 64;
+        break;
+    case 1:
+        size = PAGE + (*rng)() % (2 * PAGE);
+        break;
+    case 2:
+        size = HEAP_LARGE_PAGES * PAGE + (*rng)() % (16 * PAGE);
+        break;
+    default:
+        size = (*rng)() % (HEAP_LARGE_PAGES * PAGE);
+        break;
+    }
+    uint64_t const room = SLOT_PAGES * PAGE - std::max<uint64_t>(size, 1);
+    uint64_t const start = BASE + slot * SLOT_PAGES * PAGE + ((*rng)() % (room / 16 + 1)) * 16;
+    uint32_t const id = heap_index_add(index, start, size, 7, 1, time);
+    CHECK(id == records->size() + 1);
+    records->push_back(record_t{ id, start, start + std::max<uint64_t>(size, 1), time, UINT64_MAX });
+}
+
+static void check_lookups(void) {
+    heap_index_t* index = new heap_index_t;
+    std::mt19937_64 rng(4);
+    std::vector<record_t> records;
+    /* index of the record in every slot, -1 if empty */
+    std::vector<int64_t> slots(NUM_SLOTS, -1);
+    uint64_t time = 10;
+
+    heap_index_init(index);
+    for (int step = 0; step < 3000; step++, time += 2) {
+        uint64_t const slot = rng() % NUM_SLOTS;
+        if (slots[slot] < 0) {
+            add(index, &rng, slot, time, &records);
+            slots[slot] = (int64_t)records.size() - 1;
+        } else {
+            record_t& r = records[(size_t)slots[slot]];
+            CHECK(heap_index_free(index, r.start, time) == r.id);
+            r.free_time = time;
+            slots[slot] = -1;
+        }
+    }
+
+    uint64_t mismatches = 0;
+    for (auto const& r : records) {
+        uint64_t const addrs[] = { r.start, r.end - 1, r.end, r.start - 1, r.start + (r.end - r.start) / 2 };
+        uint64_t const times[] = { r.alloc_time - 1, r.alloc_time, r.alloc_time + 1, r.free_time - 1, r.free_time,
+            r.free_time + 1, 0, UINT64_MAX - 1 };
+        for (uint64_t addr : addrs) {
+            for (uint64_t t : times) {
+                uint32_t const got = heap_index_lookup(index, addr, t);
+                uint32_t const want = expected(records, addr, t);
+                if (got != want && mismatches++ < 10) {
+                    std::fprintf(stderr, "lookup of 0x%llx at %llu: %u instead of %u\n", (unsigned long long)addr,
+                        (unsigned long long)t, got, want);
+                }
+            }
+        }
+    }
+    CHECK(mismatches == 0);
+
+    /* frees of memory never seen, inside an allocation or twice */
+    CHECK(heap_index_free(index, 0x1000, time) == HEAP_NONE);
+    for (auto const& r : records) {
+        if (r.end - r.start > 1)
+            CHECK(heap_index_free(index, r.start + 1, time) == HEAP_NONE);
+        if (r.free_time != UINT64_MAX)
+            CHECK(heap_index_free(index, r.start, time) == HEAP_NONE);
+    }
+    /* addresses outside the map and below any allocation */
+    CHECK(heap_index_lookup(index, 1ull << 60, time) == HEAP_NONE);
+    CHECK(heap_index_lookup(index, 0, time) == HEAP_NONE);
+    /* above 48 bits an allocation has no pages in the map, no crash */
+    uint32_t const high = heap_index_add(index, 1ull << 50, 16, 7, 1, time);
+    CHECK(high != HEAP_NONE);
+    CHECK(heap_index_lookup(index, 1ull << 50, time) == HEAP_NONE);
+    CHECK(heap_index_free(index, 1ull << 50, time + 1) == high);
+    heap_index_exit(index);
+    delete index;
+}
+
+static void check_concurrent(void) {
+    heap_index_t* index = new heap_index_t;
+    std::vector<record_t> stable;
+    std::atomic<bool> done(false);
+    std::atomic<uint64_t> errors(0);
+    std::mt19937_64 rng(5);
+
+    heap_index_init(index);
+    /* the even slots hold allocations live during the whole pass */
+    for (uint64_t slot = 0; slot < NUM_SLOTS; slot += 2)
+        add(index, &rng, slot, 1, &stable);
+
+    std::thread writer([&]() {
+        std::mt19937_64 wrng(6);
+        std::vector<record_t> churn;
+        uint64_t time = 2;
+        for (int round = 0; round < 200; round++) {
+            churn.clear();
+            for (uint64_t slot = 1; slot < NUM_SLOTS; slot += 2) {
+                uint64_t const size = wrng() % 2 == 0 ? wrng() % (4 * PAGE) : HEAP_LARGE_PAGES * PAGE;
+                uint64_t const start = BASE + slot * SLOT_PAGES * PAGE;
+                heap_index_add(index, start, size, 8, 2, time++);
+                churn.push_back(record_t{ 0, start, start + size, 0, 0 });
+            }
+            for (auto const& c : churn)
+                heap_index_free(index, c.start, time++);
+        }
+        done.store(true);
+    });
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 3; t++) {
+        readers.emplace_back([&, t]() {
+            std::mt19937_64 rrng(7 + t);
+            uint64_t lookups = 0;
+            while (!done.load() || lookups < 10000) {
+                record_t const& r = stable[rrng() % stable.size()];
+                uint64_t const addr = r.start + rrng() % (r.end - r.start);
+                if (heap_index_lookup(index, addr, 1 + rrng() % 100000) != r.id)
+                    errors++;
+                /* a churning slot: none or an allocation covering addr */
+                uint64_t const other = BASE + (2 * (rrng() % (NUM_SLOTS / 2)) + 1) * SLOT_PAGES * PAGE + rrng() % PAGE;
+                uint32_t const id = heap_index_lookup(index, other, rrng() % 100000);
+                if (id != HEAP_NONE) {
+                    heap_alloc_t const* a = heap_index_get(index, id);
+                    if (other < a->start || other >= a->end)
+                        errors++;
+                }
+                lookups++;
+            }
+        });
+    }
+    writer.join();
+    for (auto& r : readers)
+        r.join();
+    CHECK(errors.load() == 0);
+    heap_index_exit(index);
+    delete index;
+}
+
+static void check_large_cycles(void) {
+    heap_index_t* index = new heap_index_t;
+    std::vector<record_t> records;
+    uint64_t const starts[] = { BASE, BASE + 0x1230000, BASE + 0x4000000 + 16 };
+    uint64_t time = 10;
+
+    heap_index_init(index);
+    for (uint32_t cycle = 0; cycle < 20000; cycle++, time += 2) {
+        /* 1 MB to 4 MB, e.g. the buffers of a loop, at a few addresses */
+        uint64_t const start = starts[cycle % 3];
+        uint64_t const size = (1 + cycle % 4) << 20;
+        uint32_t const id = heap_index_add(index, start, size, 7, 1, time);
+        CHECK(heap_index_free(index, start, time + 1) == id);
+        records.push_back(record_t{ id, start, start + size, time, time + 1 });
+    }
+    /* a link per region of each block, nothing else */
+    CHECK(index->num_links <= 1 + 20000 * ((4 << 20 >> HEAP_REGION_SHIFT) + 1));
+
+    uint64_t mismatches = 0;
+    for (size_t i = records.size() - 30; i < records.size(); i++) {
+        record_t const& r = records[i];
+        uint64_t const addrs[] = { r.start, r.end - 1, r.end, r.start - 1 };
+        uint64_t const times[] = { r.alloc_time - 1, r.alloc_time, r.free_time, time };
+        for (uint64_t addr : addrs) {
+            for (uint64_t t : times)
+                mismatches += heap_index_lookup(index, addr, t) != expected(records, addr, t);
+        }
+    }
+    CHECK(mismatches == 0);
+
+    /* stack and globals, below and above the heap */
+    uint64_t const outside[] = { 0x7ffd12345678ull, 0x555555558000ull, BASE - 8, BASE + 0x8000000 };
+    auto const t0 = std::chrono::steady_clock::now();
+    uint32_t found = 0;
+    for (uint32_t i = 0; i < 1000000; i++)
+        found += heap_index_lookup(index, outside[i % 4] + (i % 512) * 8, time) != HEAP_NONE;
+    double const us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+    std::printf("%.3f us per lookup outside the heap\n", us / 1000000);
+    CHECK(found == 0);
+    /* a few loads each, far from a scan over 20000 blocks */
+    CHECK(us / 1000000 < 1.0);
+    heap_index_exit(index);
+    delete index;
+}
+
+int main() {
+    check_lookups();
+    check_large_cycles();
+    check_concurrent();
+    return check_result();
+}
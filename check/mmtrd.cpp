@@ -0,0 +1,264 @@
+/* Checks version 2 .mmtrd files end to end: events written by an
+ * mmtrd_writer_t with every combination of columns, plain and with
+ * MMTRD_FLAG_VARINT, are read back chunk by chunk and as a stream, the
+ * chunk index has to describe them, and mmtrd_find_event and
+ * mmtrd_find_time have to land on the right chunk at the first and last
+ * events, at chunk boundaries, on times shared by two chunks and outside
+ * the file.
+ *
+ * Usage:
+ *   check_mmtrd
+ */
+
+#include "check.h"
+#include "mmtrd.h"
+#include "mmtrd_reader.h"
+
+#include <random>
+#include <vector>
+
+static void check_event(mmtrd_event_t const& got, mmtrd_event_t const& want, uint32_t flags) {
+    CHECK(got.kind == want.kind);
+    CHECK(got.addr == want.addr);
+    CHECK(got.size == want.size);
+    CHECK(got.sym == want.sym);
+    CHECK(got.call_pc == want.call_pc);
+    CHECK(got.target_sym == want.target_sym);
+    CHECK(got.time == ((flags & MMTRD_FLAG_TIME) ? want.time : 0));
+    CHECK(got.thread == ((flags & MMTRD_FLAG_THREAD) ? want.thread : 0));
+    CHECK(got.context == ((flags & MMTRD_FLAG_CONTEXT) ? want.context : 0));
+    CHECK(got.alloc == ((flags & MMTRD_FLAG_ALLOC) ? want.alloc : 0));
+    CHECK(got.object == ((flags & MMTRD_FLAG_OBJECT) ? want.object : 0));
+}
+
+/* Returns n events with the given time steps, many of them 0. */
+static std::vector<mmtrd_event_t> make_events(std::mt19937_64* rng, size_t n) {
+    std::vector<mmtrd_event_t> events(n);
+    uint64_t time = 1000;
+    uint64_t addr = 0x7ff000000000ull;
+
+    for (auto& ev : events) {
+        ev = mmtrd_event_t{};
+        if ((*rng)() % 4 == 0)
+            time += (*rng)() % 8 == 0 ? (*rng)() % (1ull << 40) : 1;
+        ev.time = time;
+        ev.thread = (uint32_t)((*rng)() % 16);
+        ev.context = (uint32_t)((*rng)() % 8 == 0 ? (*rng)() : (*rng)() % 100);
+        ev.alloc = (uint32_t)((*rng)() % 3);
+        ev.object = (uint32_t)((*rng)() % 2 == 0 ? 0 : (*rng)());
+        ev.sym = (uint32_t)((*rng)() % 2000);
+        if ((*rng)() % 8 == 0) {
+            ev.kind = (uint8_t)(MMTRD_CALL + (*rng)() % 3);
+            ev.addr = (*rng)() % 2 == 0 ? 0x140001000ull + (*rng)() % 4096 : (*rng)();
+            ev.call_pc = 0x140000000ull + (*rng)() % (1 << 20);
+            ev.target_sym = (uint32_t)((*rng)() % 2000);
+        } else {
+            ev.kind = (uint8_t)((*rng)() % 2 == 0 ? MMTRD_READ : MMTRD_WRITE);
+            addr = (*rng)() % 16 == 0 ? (*rng)() : addr + 8;
+            ev.addr = addr;
+            ev.size = (uint8_t)(1u << ((*rng)() % 7));
+        }
+    }
+    return events;
+}
+
+static void write_events(FILE* f, uint32_t flags, std::vector<mmtrd_event_t> const& events) {
+    trace_type_t const call_types[] = { TRACE_TYPE_CALL, TRACE_TYPE_CALL_IND, TRACE_TYPE_RETURN };
+    mmtrd_writer_t w;
+
+    mmtrd_writer_init(&w, f, MMTRD_VERSION_COLUMNAR, flags);
+    for (auto const& ev : events) {
+        mmtrd_set_time(&w, ev.time);
+        mmtrd_set_thread(&w, ev.thread);
+        mmtrd_set_context(&w, ev.context);
+        mmtrd_set_alloc(&w, ev.alloc);
+        mmtrd_set_object(&w, ev.object);
+        if (ev.kind >= MMTRD_CALL)
+            mmtrd_write_call(&w, call_types[ev.kind - MMTRD_CALL], ev.call_pc, ev.addr, ev.sym, ev.target_sym);
+        else
+            mmtrd_write_mem(&w, ev.kind == MMTRD_WRITE, ev.addr, ev.size, ev.sym);
+    }
+    mmtrd_writer_exit(&w);
+    fflush(f);
+}
+
+static void check_index(mmtrd_reader_t const* r, std::vector<mmtrd_event_t> const& events) {
+    uint64_t first = 0;
+
+    CHECK(r->footer.num_events == events.size());
+    CHECK(r->index.size() == (events.size() + MMTRD_CHUNK_EVENTS - 1) / MMTRD_CHUNK_EVENTS);
+    for (size_t i = 0; i < r->index.size(); i++) {
+        mmtrd_chunk_info_t const& info = r->index[i];
+        uint64_t min_addr = UINT64_MAX, max_addr = 0;
+        uint32_t calls = 0;
+
+        CHECK(info.first_event == first);
+        CHECK(info.offset % 8 == 0);
+        for (uint64_t e = first; e < first + info.num_events; e++) {
+            mmtrd_event_t const& ev = events[(size_t)e];
+            if (ev.kind >= MMTRD_CALL) {
+                calls++;
+                CHECK(mmtrd_chunk_may_contain(r, i, ev.target_sym));
+            } else {
+                min_addr = std::min(min_addr, ev.addr);
+                max_addr = std::max(max_addr, ev.addr);
+            }
+            CHECK(mmtrd_chunk_may_contain(r, i, ev.sym));
+        }
+        CHECK(info.num_calls == calls);
+        CHECK(info.min_addr == min_addr && info.max_addr == max_addr);
+        CHECK(info.min_time == events[(size_t)first].time);
+        CHECK(info.max_time == events[(size_t)(first + info.num_events - 1)].time);
+        first += info.num_events;
+    }
+    CHECK(first == events.size());
+}
+
+static void check_chunks(mmtrd_reader_t const* r, std::vector<mmtrd_event_t> const& events) {
+    mmtrd_chunk_t chunk;
+
+    for (size_t i = 0; i < r->index.size(); i++) {
+        bool const ok = mmtrd_read_chunk(r, i, &chunk);
+        CHECK(ok);
+        if (!ok)
+            continue;
+        CHECK(memcmp(&chunk.info, &r->index[i], sizeof(chunk.info)) == 0);
+        size_t call = 0;
+        for (uint32_t j = 0; j < chunk.info.num_events; j++) {
+            mmtrd_event_t got = {};
+            got.addr = chunk.addr[j];
+            got.sym = chunk.sym[j];
+            got.kind = chunk.kind[j];
+            got.size = chunk.size[j];
+            got.time = chunk.time.empty() ? 0 : chunk.time[j];
+            got.thread = chunk.thread.empty() ? 0 : chunk.thread[j];
+            got.context = chunk.context.empty() ? 0 : chunk.context[j];
+            got.alloc = chunk.alloc.empty() ? 0 : chunk.alloc[j];
+            got.object = chunk.object.empty() ? 0 : chunk.object[j];
+            if (got.kind >= MMTRD_CALL && call < chunk.call_pc.size()) {
+                got.call_pc = chunk.call_pc[call];
+                got.target_sym = chunk.target_sym[call];
+                call++;
+            }
+            check_event(got, events[(size_t)(chunk.info.first_event + j)], r->flags);
+        }
+        CHECK(call == chunk.info.num_calls);
+    }
+}
+
+static void check_stream(mmtrd_reader_t const* r, std::vector<mmtrd_event_t> const& events, size_t window) {
+    mmtrd_stream_t s;
+    mmtrd_event_t ev;
+    size_t n = 0;
+
+    mmtrd_stream_init(&s, r, window);
+    while (mmtrd_stream_next(&s, &ev)) {
+        CHECK(n < events.size());
+        if (n < events.size())
+            check_event(ev, events[n], r->flags);
+        n++;
+    }
+    CHECK(n == events.size());
+}
+
+static void check_find(mmtrd_reader_t const* r, std::vector<mmtrd_event_t> const& events) {
+    size_t const chunks = r->index.size();
+
+    CHECK(mmtrd_find_event(r, events.size()) == chunks);
+    CHECK(mmtrd_find_event(r, UINT64_MAX) == chunks);
+    CHECK(mmtrd_find_time(r, UINT64_MAX) == chunks);
+    if (events.empty()) {
+        CHECK(mmtrd_find_event(r, 0) == 0 && chunks == 0);
+        CHECK(mmtrd_find_time(r, 0) == 0);
+        return;
+    }
+    CHECK(mmtrd_find_event(r, 0) == 0);
+    CHECK(mmtrd_find_event(r, events.size() - 1) == chunks - 1);
+    CHECK(mmtrd_find_time(r, 0) == 0);
+    CHECK(mmtrd_find_time(r, events.front().time) == 0);
+    CHECK(mmtrd_find_time(r, events.back().time) <= chunks - 1);
+    CHECK(mmtrd_find_time(r, events.back().time + 1) == chunks);
+    for (size_t i = 1; i < chunks; i++) {
+        uint64_t const boundary = r->index[i].first_event;
+        CHECK(mmtrd_find_event(r, boundary - 1) == i - 1);
+        CHECK(mmtrd_find_event(r, boundary) == i);
+        /* the first chunk holding a time, even if it continues in chunk i */
+        uint64_t const last_time = events[(size_t)boundary - 1].time;
+        size_t want = i - 1;
+        while (want > 0 && r->index[want - 1].max_time >= last_time)
+            want--;
+        CHECK(mmtrd_find_time(r, last_time) == want);
+        if (events[(size_t)boundary].time > last_time)
+            CHECK(mmtrd_find_time(r, last_time + 1) == i);
+    }
+}
+
+static void check_file(uint32_t flags, std::vector<mmtrd_event_t> const& events) {
+    mmtrd_reader_t r;
+    FILE* f = std::tmpfile();
+
+    CHECK(f != NULL);
+    if (f == NULL)
+        return;
+    write_events(f, flags, events);
+    bool const ok = mmtrd_reader_open(&r, f);
+    CHECK(ok);
+    if (ok) {
+        CHECK(r.version == MMTRD_VERSION_COLUMNAR && r.flags == flags);
+        check_index(&r, events);
+        check_chunks(&r, events);
+        check_stream(&r, events, 64);
+        check_stream(&r, events, 1 << 16);
+        check_find(&r, events);
+    }
+    fclose(f);
+}
+
+static void check_open(void) {
+    mmtrd_reader_t r;
+    mmtrd_writer_t w;
+    FILE* f = std::tmpfile();
+
+    CHECK(f != NULL);
+    if (f == NULL)
+        return;
+    /* version 1 has no index */
+    mmtrd_writer_init(&w, f, MMTRD_VERSION_PACKED, MMTRD_FLAG_VARINT);
+    mmtrd_write_mem(&w, true, 0x1000, 8, 1);
+    mmtrd_writer_exit(&w);
+    fflush(f);
+    CHECK(mmtrd_reader_open(&r, f));
+    CHECK(r.version == MMTRD_VERSION_PACKED && r.flags == 0 && r.index.empty());
+    fclose(f);
+
+    /* a file cut off before its footer, e.g. by a crash */
+    f = std::tmpfile();
+    CHECK(f != NULL);
+    if (f == NULL)
+        return;
+    mmtrd_writer_init(&w, f, MMTRD_VERSION_COLUMNAR, MMTRD_FLAG_VARINT);
+    mmtrd_write_mem(&w, false, 0x1000, 8, 1);
+    mmtrd_chunk_flush(&w);
+    fflush(f);
+    CHECK(!mmtrd_reader_open(&r, f));
+    fclose(f);
+}
+
+int main() {
+    std::mt19937_64 rng(3);
+    uint32_t const all = MMTRD_FLAG_TIME | MMTRD_FLAG_THREAD | MMTRD_FLAG_CONTEXT | MMTRD_FLAG_ALLOC | MMTRD_FLAG_OBJECT;
+    uint32_t const flags[] = { 0, MMTRD_FLAG_TIME, MMTRD_FLAG_CONTEXT, MMTRD_FLAG_TIME | MMTRD_FLAG_ALLOC, all };
+
+    check_open();
+    check_file(MMTRD_FLAG_VARINT, {});
+    for (uint32_t f : flags) {
+        check_file(f, make_events(&rng, 5000));
+        check_file(f | MMTRD_FLAG_VARINT, make_events(&rng, 5000));
+    }
+    /* two full chunks and a partial one */
+    std::vector<mmtrd_event_t> const events = make_events(&rng, 2 * MMTRD_CHUNK_EVENTS + 777);
+    check_file(all, events);
+    check_file(all | MMTRD_FLAG_VARINT, events);
+    check_file(MMTRD_FLAG_VARINT | MMTRD_FLAG_TIME, std::vector<mmtrd_event_t>(events.begin(), events.begin() + MMTRD_CHUNK_EVENTS));
+    return check_result();
+}
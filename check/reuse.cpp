@@ -0,0 +1,96 @@
+/* Checks the reuse distances of reuse.h against an explicit LRU stack of
+ * lines, without sampling and with a sampling rate of 1/4, over enough
+ * accesses to compact and grow the Fenwick tree several times, and the
+ * edges of the log2 bins.
+ *
+ * Usage:
+ *   check_reuse
+ */
+
+#include "check.h"
+#include "reuse.h"
+
+#include <algorithm>
+#include <random>
+#include <unordered_set>
+#include <vector>
+
+#define LINE_SIZE 64
+#define ACCESSES 400000
+
+/* Returns the number of distinct lines since the last access of line and
+ * moves it to the top of stack, its back, REUSE_COLD if it is new.
+ */
+static uint64_t stack_distance(std::vector<uint64_t>* stack, std::unordered_set<uint64_t>* seen, uint64_t line) {
+    uint64_t distance = REUSE_COLD;
+
+    if (!seen->insert(line).second) {
+        auto it = std::find(stack->rbegin(), stack->rend(), line);
+        distance = (uint64_t)(it - stack->rbegin());
+        stack->erase(std::next(it).base());
+    }
+    stack->push_back(line);
+    return distance;
+}
+
+static void check_distances(uint32_t sample_rate) {
+    reuse_t r;
+    std::vector<uint64_t> stack;
+    std::unordered_set<uint64_t> seen;
+    std::mt19937_64 rng(8);
+    uint64_t sampled = 0, mismatches = 0;
+
+    reuse_init(&r, LINE_SIZE, sample_rate);
+    for (uint64_t n = 0; n < ACCESSES; n++) {
+        uint64_t addr;
+        switch (rng() % 3) {
+        case 0:
+            /* a hot set */
+            addr = 0x10000000ull + (rng() % 64) * LINE_SIZE;
+            break;
+        case 1:
+            /* a working set of a few thousand lines */
+            addr = 0x20000000ull + rng() % (4000 * LINE_SIZE);
+            break;
+        default:
+            /* a growing cold range */
+            addr = 0x40000000ull + n * 16;
+            break;
+        }
+        if (!reuse_sampled(&r, addr))
+            continue;
+        sampled++;
+        uint64_t const want = stack_distance(&stack, &seen, addr / LINE_SIZE);
+        uint64_t const got = reuse_access(&r, addr);
+        if (got != (want == REUSE_COLD ? REUSE_COLD : want * sample_rate) && mismatches++ < 10) {
+            std::fprintf(stderr, "access %llu of 0x%llx at 1/%u: distance %llu instead of %llu\n", (unsigned long long)n,
+                (unsigned long long)addr, sample_rate, (unsigned long long)got, (unsigned long long)want);
+        }
+    }
+    CHECK(mismatches == 0);
+    if (sample_rate == 1)
+        CHECK(sampled == ACCESSES);
+    else
+        CHECK(sampled > ACCESSES / sample_rate / 2 && sampled < ACCESSES / sample_rate * 2);
+}
+
+static void check_bins(void) {
+    CHECK(reuse_bin(REUSE_COLD) == 0);
+    CHECK(reuse_bin(0) == 1);
+    CHECK(reuse_bin(1) == 2);
+    CHECK(reuse_bin(2) == 3 && reuse_bin(3) == 3);
+    CHECK(reuse_bin(4) == 4 && reuse_bin(7) == 4);
+    for (uint32_t b = 3; b < REUSE_BINS - 1; b++) {
+        CHECK(reuse_bin(1ull << (b - 2)) == b);
+        CHECK(reuse_bin((1ull << (b - 1)) - 1) == b);
+    }
+    /* the last bin takes everything above */
+    CHECK(reuse_bin(UINT64_MAX - 1) == REUSE_BINS - 1);
+}
+
+int main() {
+    check_bins();
+    check_distances(1);
+    check_distances(4);
+    return check_result();
+}
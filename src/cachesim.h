@@ -0,0 +1,344 @@
+/* Set associative cache model for -simulate and the offline tools.
+ *
+ * A cache_sim_t is a chain of levels, L1 first, each a set associative
+ * cache with its own size, associativity, line size and replacement
+ * policy. An access looks up every line it touches in L1; a miss is looked
+ * up in the next level and so on, and every level the line was missed in
+ * allocates it (non-inclusive, write-allocate, no write-backs). Reads and
+ * writes are simulated alike.
+ *
+ * A configuration is written as a comma separated list of levels
+ *   <size>:<assoc>:<line size>[:lru|plru]
+ * e.g. "32K:8:64:lru,1M:16:64:plru". Sizes take K, M and G suffixes; the
+ * number of sets and the line size must be powers of two, and plru, the
+ * binary tree pseudo LRU of most hardware, a power of two associativity.
+ *
+ * A cache_stack_t keeps an LRU stack per set instead (Mattson et al.): the
+ * depth at which a line is found is its stack distance, and an access hits
+ * an LRU cache with the same sets and line size exactly if the distance is
+ * below its associativity. One pass thus yields the misses of every
+ * associativity, i.e. of every size with that set count and line size.
+ */
+
+#ifndef REGINA_CACHESIM_H
+#define REGINA_CACHESIM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#define CACHE_MAX_LEVELS 4
+/* tree pseudo LRU keeps its bits of a set in one uint64_t */
+#define CACHE_MAX_ASSOC 64
+
+typedef enum {
+    CACHE_LRU,
+    CACHE_PLRU,
+} cache_policy_t;
+
+typedef struct _cache_config_t {
+    uint64_t size;
+    uint32_t assoc;
+    uint32_t line_size;
+    cache_policy_t policy;
+} cache_config_t;
+
+typedef struct _cache_t {
+    cache_config_t config;
+    uint32_t line_shift;
+    uint64_t set_mask;
+    /* tag + 1 of the line in every way, 0 for an empty way */
+    std::vector<uint64_t> tags;
+    /* LRU: time of the last access of every way */
+    std::vector<uint64_t> stamps;
+    /* PLRU: tree bits of every set */
+    std::vector<uint64_t> plru;
+    uint64_t clock;
+} cache_t;
+
+typedef struct _cache_sim_t {
+    uint32_t num_levels;
+    cache_t levels[CACHE_MAX_LEVELS];
+} cache_sim_t;
+
+/* Counters of a group of accesses, e.g. of one symbol. misses[l] counts
+ * the accesses that missed level l, so misses[l - 1] - misses[l] of them
+ * hit in level l.
+ */
+typedef struct _cache_stats_t {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t misses[CACHE_MAX_LEVELS];
+} cache_stats_t;
+
+static inline bool
+cache_is_pow2(uint64_t v) {
+    return v != 0 && (v & (v - 1)) == 0;
+}
+
+static inline uint32_t
+cache_log2(uint64_t v) {
+    uint32_t n = 0;
+
+    while ((1ull << n) < v)
+        n++;
+    return n;
+}
+
+/* Parses one level or a comma separated list of them into *configs.
+ * Returns false and describes the problem in *err if the text is invalid.
+ */
+static inline bool
+cache_parse_config(std::string const& text, std::vector<cache_config_t>* configs, std::string* err) {
+    size_t start = 0;
+
+    configs->clear();
+    while (start <= text.size()) {
+        size_t end = text.find(',', start);
+        if (end == std::string::npos)
+            end = text.size();
+        std::string const level = text.substr(start, end - start);
+        cache_config_t c;
+        char* p;
+
+        c.size = strtoull(level.c_str(), &p, 10);
+        if (*p == 'K' || *p == 'k')
+            c.size <<= 10, p++;
+        else if (*p == 'M' || *p == 'm')
+            c.size <<= 20, p++;
+        else if (*p == 'G' || *p == 'g')
+            c.size <<= 30, p++;
+        if (*p++ != ':') {
+            *err = "expected <size>:<assoc>:<line size> in '" + level + "'";
+            return false;
+        }
+        c.assoc = (uint32_t)strtoul(p, &p, 10);
+        if (*p++ != ':') {
+            *err = "expected <size>:<assoc>:<line size> in '" + level + "'";
+            return false;
+        }
+        c.line_size = (uint32_t)strtoul(p, &p, 10);
+        c.policy = CACHE_LRU;
+        if (*p == ':') {
+            std::string const policy(p + 1);
+            if (policy == "plru")
+                c.policy = CACHE_PLRU;
+            else if (policy != "lru") {
+                *err = "unknown replacement policy '" + policy + "'";
+                return false;
+            }
+        } else if (*p != '\0') {
+            *err = "trailing characters in '" + level + "'";
+            return false;
+        }
+        if (c.assoc == 0 || c.assoc > CACHE_MAX_ASSOC || !cache_is_pow2(c.line_size)
+            || c.size % ((uint64_t)c.assoc * c.line_size) != 0
+            || !cache_is_pow2(c.size / ((uint64_t)c.assoc * c.line_size))) {
+            *err = "'" + level + "' needs a power of two line size and number of sets and at most 64 ways";
+            return false;
+        }
+        if (c.policy == CACHE_PLRU && !cache_is_pow2(c.assoc)) {
+            *err = "plru needs a power of two associativity in '" + level + "'";
+            return false;
+        }
+        if (configs->size() == CACHE_MAX_LEVELS) {
+            *err = "at most 4 levels are supported";
+            return false;
+        }
+        configs->push_back(c);
+        start = end + 1;
+    }
+    return true;
+}
+
+static inline void
+cache_init(cache_t* cache, cache_config_t const& config) {
+    uint64_t const num_sets = config.size / ((uint64_t)config.assoc * config.line_size);
+
+    cache->config = config;
+    cache->line_shift = cache_log2(config.line_size);
+    cache->set_mask = num_sets - 1;
+    cache->tags.assign(num_sets * config.assoc, 0);
+    cache->stamps.assign(config.policy == CACHE_LRU ? num_sets * config.assoc : 0, 0);
+    cache->plru.assign(config.policy == CACHE_PLRU ? num_sets : 0, 0);
+    cache->clock = 0;
+}
+
+/* Marks way of the set as most recently used: every tree node on its path
+ * points away from it.
+ */
+static inline void
+cache_plru_touch(cache_t* cache, uint64_t set, uint32_t way) {
+    uint64_t bits = cache->plru[set];
+    uint32_t node = 1;
+    uint32_t span = cache->config.assoc;
+
+    while (span > 1) {
+        span >>= 1;
+        if (way & span) {
+            bits &= ~(1ull << node);
+            node = 2 * node + 1;
+        } else {
+            bits |= 1ull << node;
+            node = 2 * node;
+        }
+    }
+    cache->plru[set] = bits;
+}
+
+static inline uint32_t
+cache_plru_victim(cache_t const* cache, uint64_t set) {
+    uint64_t const bits = cache->plru[set];
+    uint32_t node = 1;
+    uint32_t way = 0;
+    uint32_t span = cache->config.assoc;
+
+    while (span > 1) {
+        span >>= 1;
+        if (bits & (1ull << node)) {
+            way |= span;
+            node = 2 * node + 1;
+        } else {
+            node = 2 * node;
+        }
+    }
+    return way;
+}
+
+/* Looks up the line (address >> line_shift) and allocates it on a miss.
+ * Returns whether it hit.
+ */
+static inline bool
+cache_access_line(cache_t* cache, uint64_t line) {
+    uint64_t const set = line & cache->set_mask;
+    uint32_t const assoc = cache->config.assoc;
+    uint64_t* tags = &cache->tags[set * assoc];
+    uint32_t way;
+    uint32_t victim = 0;
+
+    cache->clock++;
+    for (way = 0; way < assoc; way++) {
+        if (tags[way] == line + 1)
+            break;
+    }
+    bool const hit = way < assoc;
+    if (!hit) {
+        if (cache->config.policy == CACHE_PLRU) {
+            /* empty ways first, then the tree */
+            for (victim = 0; victim < assoc && tags[victim] != 0; victim++)
+                ;
+            if (victim == assoc)
+                victim = cache_plru_victim(cache, set);
+        } else {
+            uint64_t const* stamps = &cache->stamps[set * assoc];
+            for (way = 1; way < assoc; way++) {
+                if (stamps[way] < stamps[victim])
+                    victim = way;
+            }
+        }
+        way = victim;
+        tags[way] = line + 1;
+    }
+    if (cache->config.policy == CACHE_PLRU)
+        cache_plru_touch(cache, set, way);
+    else
+        cache->stamps[set * assoc + way] = cache->clock;
+    return hit;
+}
+
+static inline void
+cache_sim_init(cache_sim_t* sim, std::vector<cache_config_t> const& configs) {
+    sim->num_levels = (uint32_t)configs.size();
+    for (uint32_t i = 0; i < sim->num_levels; i++)
+        cache_init(&sim->levels[i], configs[i]);
+}
+
+/* Simulates an access of size bytes at addr starting at level. Returns the
+ * number of levels it missed in, num_levels meaning memory; an access
+ * touching several lines counts its worst one.
+ */
+static inline uint32_t
+cache_sim_access_from(cache_sim_t* sim, uint32_t level, uint64_t addr, uint32_t size) {
+    uint32_t worst = level;
+
+    if (level == sim->num_levels)
+        return level;
+    cache_t* cache = &sim->levels[level];
+    uint64_t const last = (addr + (size == 0 ? 0 : size - 1)) >> cache->line_shift;
+    for (uint64_t line = addr >> cache->line_shift; line <= last; line++) {
+        uint32_t missed = level;
+        if (!cache_access_line(cache, line))
+            missed = cache_sim_access_from(sim, level + 1, line << cache->line_shift, cache->config.line_size);
+        if (missed > worst)
+            worst = missed;
+    }
+    return worst;
+}
+
+static inline uint32_t
+cache_sim_access(cache_sim_t* sim, uint64_t addr, uint32_t size) {
+    return cache_sim_access_from(sim, 0, addr, size);
+}
+
+/* Per-set LRU stacks of up to depth lines, most recently used first. */
+typedef struct _cache_stack_t {
+    uint32_t line_shift;
+    uint64_t set_mask;
+    uint32_t depth;
+    /* line + 1 of every stack entry, 0 for an empty one */
+    std::vector<uint64_t> lines;
+} cache_stack_t;
+
+static inline void
+cache_stack_init(cache_stack_t* stack, uint32_t line_size, uint64_t num_sets, uint32_t depth) {
+    stack->line_shift = cache_log2(line_size);
+    stack->set_mask = num_sets - 1;
+    stack->depth = depth;
+    stack->lines.assign(num_sets * depth, 0);
+}
+
+/* Returns the largest stack distance of the lines of an access of size
+ * bytes at addr, depth if one of them is deeper or new, and moves them to
+ * the top of their sets.
+ */
+static inline uint32_t
+cache_stack_access(cache_stack_t* stack, uint64_t addr, uint32_t size) {
+    uint64_t const last = (addr + (size == 0 ? 0 : size - 1)) >> stack->line_shift;
+    uint32_t worst = 0;
+
+    for (uint64_t line = addr >> stack->line_shift; line <= last; line++) {
+        uint64_t* set = &stack->lines[(line & stack->set_mask) * stack->depth];
+        uint32_t d;
+        for (d = 0; d < stack->depth && set[d] != line + 1; d++)
+            ;
+        /* a line below the stack falls off its bottom */
+        memmove(set + 1, set, sizeof(uint64_t) * (d == stack->depth ? d - 1 : d));
+        set[0] = line + 1;
+        if (d > worst)
+            worst = d;
+    }
+    return worst;
+}
+
+/* Counts an access that missed the first missed levels. */
+static inline void
+cache_stats_add(cache_stats_t* stats, bool write, uint32_t missed) {
+    if (write)
+        stats->writes++;
+    else
+        stats->reads++;
+    for (uint32_t l = 0; l < missed; l++)
+        stats->misses[l]++;
+}
+
+static inline void
+cache_stats_merge(cache_stats_t* into, cache_stats_t const& from) {
+    into->reads += from.reads;
+    into->writes += from.writes;
+    for (uint32_t l = 0; l < CACHE_MAX_LEVELS; l++)
+        into->misses[l] += from.misses[l];
+}
+
+#endif /* REGINA_CACHESIM_H */
@@ -0,0 +1,156 @@
+/* Calling context tree of -cct.
+ *
+ * Every node stands for a chain of calls from the start of a thread, the
+ * root, to a function: a child of a node is called from it. The nodes of
+ * all threads of a run live in one cct_tree_t, numbered in the order they
+ * are first entered, so a 32-bit context id means the same chain in every
+ * .mmtrd file of the run. The children of all nodes are kept in a single
+ * open addressing table keyed by parent and callee symbol.
+ *
+ * A stream tracks the calls and returns of its thread on a shadow stack of
+ * cct_frame_t and counts its references in a cct_stats_t per node, merged
+ * into the totals when the thread is done. A return pops the frame of the
+ * call it returns to, so frames skipped by longjmp or an exception are
+ * dropped with it; a return to no frame on the stack, e.g. out of the
+ * function the thread was started in, changes nothing.
+ *
+ * The distinct lines of a node are estimated with a small HyperLogLog
+ * sketch (Flajolet et al.): CCT_HLL_REGS registers keep the longest run of
+ * leading zeros of the line hashes that fall into them, which costs a
+ * hash per reference, takes a fixed 64 bytes per node and merges by taking
+ * the maximum of every register. The standard error is about 13%.
+ */
+
+#ifndef REGINA_CCT_H
+#define REGINA_CCT_H
+
+#include "pc_cache.h"
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+
+#define CCT_ROOT 0
+/* symbol of the root, which is no function */
+#define CCT_NO_SYM UINT32_MAX
+/* once the tree is full, further calls stay in their caller's context */
+#define CCT_MAX_NODES UINT32_MAX
+#define CCT_HLL_BITS 6
+#define CCT_HLL_REGS (1 << CCT_HLL_BITS)
+#define CCT_LINE_SHIFT 6
+/* the return address of a call is at most an instruction length behind it */
+#define CCT_MAX_CALL_LENGTH 15
+
+typedef struct _cct_node_t {
+    uint32_t parent;
+    uint32_t sym;
+} cct_node_t;
+
+typedef struct _cct_tree_t {
+    std::vector<cct_node_t> nodes;
+    /* (parent << 32 | callee symbol) -> child */
+    pc_cache_t children;
+} cct_tree_t;
+
+typedef struct _cct_stats_t {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t bytes;
+    uint8_t lines[CCT_HLL_REGS];
+} cct_stats_t;
+
+typedef struct _cct_frame_t {
+    uint32_t node;
+    uint64_t call_pc;
+    /* where the call stored its return address, 0 if unknown, see data.h */
+    uint64_t slot;
+} cct_frame_t;
+
+static inline void
+cct_tree_init(cct_tree_t* tree) {
+    tree->nodes.assign(1, cct_node_t{ CCT_ROOT, CCT_NO_SYM });
+    pc_cache_init(&tree->children, 4096);
+}
+
+static inline uint64_t
+cct_child_key(uint32_t parent, uint32_t sym) {
+    return (uint64_t)parent << 32 | sym;
+}
+
+/* Returns the child of parent calling sym, adding it if needed. */
+static inline uint32_t
+cct_tree_child(cct_tree_t* tree, uint32_t parent, uint32_t sym) {
+    uint64_t const key = cct_child_key(parent, sym);
+    uint64_t child;
+
+    if (pc_cache_find(&tree->children, key, &child))
+        return (uint32_t)child;
+    if (tree->nodes.size() >= CCT_MAX_NODES)
+        return parent;
+    child = tree->nodes.size();
+    tree->nodes.push_back(cct_node_t{ parent, sym });
+    pc_cache_insert(&tree->children, key, child);
+    return (uint32_t)child;
+}
+
+/* Returns the index of the frame a return to target goes back to, or the
+ * number of frames if it belongs to none of them.
+ */
+static inline size_t
+cct_find_frame(std::vector<cct_frame_t> const& stack, uint64_t target) {
+    for (size_t i = stack.size(); i-- > 0;) {
+        if (target > stack[i].call_pc && target - stack[i].call_pc <= CCT_MAX_CALL_LENGTH)
+            return i;
+    }
+    return stack.size();
+}
+
+static inline void
+cct_stats_add(cct_stats_t* stats, bool write, uint64_t addr, uint32_t size) {
+    /* the Fibonacci hash leaves the low bits of a line to the high ones */
+    uint64_t const h = pc_cache_hash(addr >> CCT_LINE_SHIFT) * 0xC2B2AE3D27D4EB4Full;
+    uint64_t const rest = h << CCT_HLL_BITS;
+    uint8_t rank = 1;
+
+    if (write)
+        stats->writes++;
+    else
+        stats->reads++;
+    stats->bytes += size;
+    while (rank <= 64 - CCT_HLL_BITS && !(rest & (1ull << (64 - rank))))
+        rank++;
+    if (rank > stats->lines[h >> (64 - CCT_HLL_BITS)])
+        stats->lines[h >> (64 - CCT_HLL_BITS)] = rank;
+}
+
+static inline void
+cct_stats_merge(cct_stats_t* into, cct_stats_t const& from) {
+    into->reads += from.reads;
+    into->writes += from.writes;
+    into->bytes += from.bytes;
+    for (int i = 0; i < CCT_HLL_REGS; i++) {
+        if (from.lines[i] > into->lines[i])
+            into->lines[i] = from.lines[i];
+    }
+}
+
+/* Returns the estimated number of distinct lines of stats. */
+static inline uint64_t
+cct_stats_lines(cct_stats_t const& stats) {
+    double sum = 0;
+    int empty = 0;
+
+    for (int i = 0; i < CCT_HLL_REGS; i++) {
+        sum += ldexp(1.0, -stats.lines[i]);
+        if (stats.lines[i] == 0)
+            empty++;
+    }
+    if (empty == CCT_HLL_REGS)
+        return 0;
+    double estimate = 0.709 * CCT_HLL_REGS * CCT_HLL_REGS / sum;
+    /* linear counting is more accurate for small sets */
+    if (estimate <= 2.5 * CCT_HLL_REGS && empty > 0)
+        estimate = CCT_HLL_REGS * log((double)CCT_HLL_REGS / empty);
+    return (uint64_t)(estimate + 0.5);
+}
+
+#endif /* REGINA_CCT_H */
@@ -0,0 +1,191 @@
+/* Lossless delta + zigzag + varint encoding of trace streams.
+ *
+ * Addresses and pcs of consecutive references are close to each other
+ * (strided loops, sequential merges), so every value is stored as the
+ * zigzag encoded difference to the previous value of its stream, written
+ * as a LEB128 varint: a stride of 8 costs one byte instead of eight.
+ *
+ * Raw traces (-compress) start with TRACE_CODEC_MAGIC, whose low nibble is
+ * no valid entry type, followed by independent blocks of
+ *   uint32_t raw_size, uint32_t encoded_size, encoded_size bytes
+ * each holding one flushed buffer. Per entry the block stores
+ *   varint(type | size << 4 | TRACE_FLAG_TLS as bit 16), zigzag delta
+ *   of the pc (block id for TRACE_TYPE_BB entries, none for
+ *   TRACE_TYPE_TIME), zigzag delta of every address or time
+ * with memory addresses, call targets, block ids and times as separate
+ * streams.
+ * The deltas restart at every block, so a block decodes on its own.
+ *
+ * There is no general purpose compressor behind the varints: the client
+ * cannot pull one in, the encoding is usually within reach of one on
+ * traces and runs in the background writer at memory speed.
+ */
+
+#ifndef REGINA_CODEC_H
+#define REGINA_CODEC_H
+
+#include "trace_format.h"
+#include <stdint.h>
+#include <string.h>
+
+#define TRACE_CODEC_MAGIC "\xffRGNVAR1"
+#define TRACE_CODEC_MAGIC_SIZE 8
+/* in the tag of an entry, above its type and size */
+#define CODEC_TAG_TLS (1ull << (TRACE_TYPE_BITS + TRACE_SIZE_BITS))
+
+typedef struct _codec_block_header_t {
+    uint32_t raw_size;
+    uint32_t encoded_size;
+} codec_block_header_t;
+
+static inline uint64_t
+codec_zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t
+codec_unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline uint8_t*
+codec_put_varint(uint8_t* p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+/* Returns the position after the varint at p, NULL if it is cut off. */
+static inline uint8_t const*
+codec_get_varint(uint8_t const* p, uint8_t const* end, uint64_t* v) {
+    uint64_t result = 0;
+    int shift = 0;
+
+    while (p < end && shift < 64) {
+        uint8_t const b = *p++;
+        result |= (uint64_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            *v = result;
+            return p;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+static inline uint8_t*
+codec_put_delta(uint8_t* p, uint64_t v, uint64_t* prev) {
+    p = codec_put_varint(p, codec_zigzag((int64_t)(v - *prev)));
+    *prev = v;
+    return p;
+}
+
+static inline uint8_t const*
+codec_get_delta(uint8_t const* p, uint8_t const* end, uint64_t* v, uint64_t* prev) {
+    uint64_t zz;
+
+    p = codec_get_varint(p, end, &zz);
+    if (p != NULL) {
+        *v = *prev + (uint64_t)codec_unzigzag(zz);
+        *prev = *v;
+    }
+    return p;
+}
+
+/* Upper bound of the encoded size of size bytes of entries: a 16 byte
+ * entry takes at most 22 bytes, a block address at most 10.
+ */
+static inline size_t
+codec_max_encoded_size(size_t size) {
+    return size + size / 2 + 16;
+}
+
+typedef struct _codec_state_t {
+    uint64_t pc;
+    uint64_t bb;
+    uint64_t addr;
+    uint64_t target;
+    uint64_t time;
+} codec_state_t;
+
+/* Encodes size bytes of complete entries at base into out, which must
+ * hold codec_max_encoded_size(size) bytes. Returns the encoded size.
+ */
+static inline size_t
+codec_encode_entries(char const* base, size_t size, uint8_t* out) {
+    codec_state_t s = {};
+    uint8_t* p = out;
+
+    for (size_t offset = 0; offset + sizeof(uint64_t) <= size;) {
+        uint64_t const* entry = reinterpret_cast<uint64_t const*>(base + offset);
+        uint64_t const header = entry[0];
+        trace_type_t const type = trace_get_type(header);
+
+        p = codec_put_varint(p, (uint64_t)type | ((uint64_t)trace_get_size(header) << TRACE_TYPE_BITS)
+                | (trace_is_mem(header) && trace_is_tls(header) ? CODEC_TAG_TLS : 0));
+        if (type == TRACE_TYPE_BB) {
+            p = codec_put_delta(p, trace_get_pc(header), &s.bb);
+            for (uint32_t i = 0; i < trace_get_size(header); ++i)
+                p = codec_put_delta(p, entry[1 + i], &s.addr);
+        } else if (type == TRACE_TYPE_TIME) {
+            p = codec_put_delta(p, entry[1], &s.time);
+        } else {
+            p = codec_put_delta(p, trace_get_pc(header), &s.pc);
+            p = codec_put_delta(p, entry[1], trace_is_mem(header) ? &s.addr : &s.target);
+        }
+        offset += trace_entry_size(header);
+    }
+    return (size_t)(p - out);
+}
+
+/* Decodes a block encoded by codec_encode_entries into out_size bytes at
+ * out. Returns false if the block is corrupt.
+ */
+static inline bool
+codec_decode_entries(uint8_t const* in, size_t in_size, char* out, size_t out_size) {
+    codec_state_t s = {};
+    uint8_t const* p = in;
+    uint8_t const* end = in + in_size;
+    size_t offset = 0;
+
+    while (p != NULL && p < end) {
+        uint64_t tag, pc, v = 0;
+        p = codec_get_varint(p, end, &tag);
+        if (p == NULL)
+            return false;
+        trace_type_t const type = (trace_type_t)(tag & ((1 << TRACE_TYPE_BITS) - 1));
+        uint32_t const count = (uint32_t)((tag >> TRACE_TYPE_BITS) & TRACE_SIZE_MAX);
+        uint64_t const header = trace_make_header(type, count, 0);
+        size_t const len = trace_entry_size(header);
+        if (offset + len > out_size)
+            return false;
+        uint64_t* entry = reinterpret_cast<uint64_t*>(out + offset);
+        if (type == TRACE_TYPE_TIME) {
+            p = codec_get_delta(p, end, &v, &s.time);
+            entry[0] = header;
+            entry[1] = v;
+            offset += len;
+            continue;
+        }
+        p = codec_get_delta(p, end, &pc, type == TRACE_TYPE_BB ? &s.bb : &s.pc);
+        if (p == NULL)
+            return false;
+        entry[0] = trace_make_header(type, count, pc) | ((tag & CODEC_TAG_TLS) != 0 ? TRACE_FLAG_TLS : 0);
+        if (type == TRACE_TYPE_BB) {
+            for (uint32_t i = 0; i < count && p != NULL; ++i) {
+                p = codec_get_delta(p, end, &v, &s.addr);
+                entry[1 + i] = v;
+            }
+        } else {
+            p = codec_get_delta(p, end, &v, trace_is_mem(header) ? &s.addr : &s.target);
+            entry[1] = v;
+        }
+        offset += len;
+    }
+    return p != NULL && offset == out_size;
+}
+
+#endif /* REGINA_CODEC_H */
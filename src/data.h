@@ -0,0 +1,210 @@
+/* Data objects of -data_objects: what a memory reference hit besides code.
+ *
+ * An object is a global or static variable of a module, the stack frame
+ * of a function, the thread local storage of a thread or, with -heap, the
+ * heap as a whole, which regina.heap.csv breaks down. Objects get ids 1,
+ * 2, ... in the order they are first hit, shared by all threads of a run
+ * like the contexts of cct.h; 0 stands for none of them.
+ *
+ * The variables come from the symbol tables of the modules: drsym
+ * enumerates them at module load, every symbol in a readable and not
+ * executable part of a module counts. A symbol of unknown size reaches up
+ * to the next one or the end of its region. They are kept as disjoint
+ * ranges sorted by start and looked up by binary search without a lock:
+ * the array is replaced as a whole on every load and unload and the old
+ * copies are only freed by data_table_exit, which stays small as modules
+ * load rarely.
+ *
+ * The stack of a thread is the memory region holding its stack pointer at
+ * thread start, see data_stack_t. Within it, a reference belongs to the
+ * frame of the innermost function whose return address lies at or above
+ * it. A stream follows the calls and returns of its thread on a shadow
+ * stack like -cct and remembers where every call stored its return
+ * address: that is the write right after a call entry or, in basic block
+ * mode, the last reference of the block entry before it.
+ *
+ * Thread local storage is addressed relative to a segment register, fs or
+ * gs on x86, and such references carry TRACE_FLAG_TLS. The range they
+ * spanned so far counts as the thread's storage for references through
+ * plain pointers as well.
+ */
+
+#ifndef REGINA_DATA_H
+#define REGINA_DATA_H
+
+#include "cct.h"
+#include "pc_cache.h"
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#define DATA_NONE 0
+/* the main thread's stack grows on demand up to the default limit */
+#define DATA_MAIN_STACK (8 << 20)
+
+typedef enum {
+    DATA_KIND_NONE,
+    DATA_KIND_GLOBAL,
+    DATA_KIND_STACK,
+    DATA_KIND_TLS,
+    DATA_KIND_HEAP,
+} data_kind_t;
+
+static const char* const data_kind_names[] = { "", "global", "stack", "tls", "heap" };
+
+/* a variable of a loaded module, writers only */
+typedef struct _data_var_t {
+    uint64_t start;
+    /* start if the size is unknown */
+    uint64_t end;
+    /* end of the memory region of the variable */
+    uint64_t limit;
+    /* module#symbol */
+    std::string name;
+} data_var_t;
+
+typedef struct _data_range_t {
+    uint64_t start;
+    uint64_t end;
+    /* index of the variable in data_table_t */
+    uint32_t var;
+} data_range_t;
+
+typedef struct _data_table_t {
+    /* every variable seen, also of unloaded modules */
+    std::vector<data_var_t> vars;
+    /* the variables of the loaded modules sorted by start */
+    std::atomic<std::vector<data_range_t>*> ranges;
+    std::vector<std::vector<data_range_t>*> retired;
+} data_table_t;
+
+typedef struct _data_object_t {
+    data_kind_t kind;
+    /* variable, function symbol or thread, 0 for the heap */
+    uint64_t key;
+    /* symbol index of the name, CCT_NO_SYM if it has none */
+    uint64_t sym;
+} data_object_t;
+
+/* the objects hit so far, index 0 is none */
+typedef struct _data_objects_t {
+    std::vector<data_object_t> objects;
+    /* data_object_key -> id */
+    pc_cache_t ids;
+} data_objects_t;
+
+typedef struct _data_stats_t {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t bytes;
+} data_stats_t;
+
+/* stack of a thread, [bottom, top), empty if unknown */
+typedef struct _data_stack_t {
+    uint64_t bottom;
+    uint64_t top;
+} data_stack_t;
+
+static inline void
+data_table_init(data_table_t* table) {
+    table->vars.clear();
+    table->ranges.store(new std::vector<data_range_t>(), std::memory_order_release);
+    table->retired.clear();
+}
+
+/* Adds the variables of a module, which may overlap. Writers are
+ * serialized by the caller.
+ */
+static inline void
+data_table_add(data_table_t* table, std::vector<data_var_t>& vars) {
+    std::vector<data_range_t> const* old = table->ranges.load(std::memory_order_relaxed);
+    std::vector<data_range_t>* ranges = new std::vector<data_range_t>();
+
+    std::sort(vars.begin(), vars.end(), [](data_var_t const& a, data_var_t const& b) {
+        return a.start != b.start ? a.start < b.start : a.end > b.end;
+    });
+    ranges->reserve(old->size() + vars.size());
+    for (size_t i = 0, next; i < vars.size(); i = next) {
+        /* aliases of a variable share its range, the largest one of known
+         * size counts
+         */
+        for (next = i + 1; next < vars.size() && vars[next].start == vars[i].start;)
+            next++;
+        if (vars[i].end <= vars[i].start)
+            vars[i].end = vars[i].limit;
+        if (next < vars.size() && vars[i].end > vars[next].start)
+            vars[i].end = vars[next].start;
+        if (vars[i].end <= vars[i].start || table->vars.size() >= UINT32_MAX)
+            continue;
+        ranges->push_back(data_range_t{ vars[i].start, vars[i].end, (uint32_t)table->vars.size() });
+        table->vars.push_back(vars[i]);
+    }
+    ranges->insert(ranges->end(), old->begin(), old->end());
+    std::sort(ranges->begin(), ranges->end(),
+        [](data_range_t const& a, data_range_t const& b) { return a.start < b.start; });
+    table->ranges.store(ranges, std::memory_order_release);
+    table->retired.push_back((std::vector<data_range_t>*)old);
+}
+
+/* Drops the variables in [start, end), e.g. of an unloaded module. */
+static inline void
+data_table_remove(data_table_t* table, uint64_t start, uint64_t end) {
+    std::vector<data_range_t> const* old = table->ranges.load(std::memory_order_relaxed);
+    std::vector<data_range_t>* ranges = new std::vector<data_range_t>();
+
+    for (auto const& r : *old) {
+        if (r.start < start || r.start >= end)
+            ranges->push_back(r);
+    }
+    table->ranges.store(ranges, std::memory_order_release);
+    table->retired.push_back((std::vector<data_range_t>*)old);
+}
+
+/* Returns the range of ranges holding addr, or NULL. */
+static inline data_range_t const*
+data_table_lookup(std::vector<data_range_t> const* ranges, uint64_t addr) {
+    auto it = std::upper_bound(ranges->begin(), ranges->end(), addr,
+        [](uint64_t a, data_range_t const& r) { return a < r.start; });
+    if (it == ranges->begin() || addr >= (it - 1)->end)
+        return NULL;
+    return &*(it - 1);
+}
+
+static inline void
+data_table_exit(data_table_t* table) {
+    delete table->ranges.load(std::memory_order_relaxed);
+    for (auto old : table->retired)
+        delete old;
+    table->retired.clear();
+    std::vector<data_var_t>().swap(table->vars);
+}
+
+static inline void
+data_objects_init(data_objects_t* objs) {
+    objs->objects.assign(1, data_object_t{ DATA_KIND_NONE, 0, CCT_NO_SYM });
+    pc_cache_init(&objs->ids, 1024);
+}
+
+static inline uint64_t
+data_object_key(data_kind_t kind, uint64_t key) {
+    return (uint64_t)kind << 56 | key;
+}
+
+/* Returns the frame of stack a stack reference to addr belongs to: the
+ * innermost one whose return address lies at or above it, or the number of
+ * frames if there is none. Frames whose return address is unknown, 0, e.g.
+ * one still waiting for it, leave their references to their caller. known
+ * lists the frames with a known return address from the outermost on; the
+ * stack grows down, so their slots decrease along it and the frame is
+ * found by a binary search however deep the recursion.
+ */
+static inline size_t
+data_find_frame(std::vector<cct_frame_t> const& stack, std::vector<uint32_t> const& known, uint64_t addr) {
+    auto it = std::partition_point(known.begin(), known.end(),
+        [&stack, addr](uint32_t i) { return stack[i].slot >= addr; });
+    return it == known.begin() ? stack.size() : *(it - 1);
+}
+
+#endif /* REGINA_DATA_H */
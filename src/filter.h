@@ -0,0 +1,178 @@
+/* Allow-lists of -modules, -functions and -address_ranges: the code that
+ * is instrumented at all.
+ *
+ * Every filter comes down to ranges of code addresses. A module, selected
+ * by its preferred name, covers its whole mapping and a function the
+ * extent drsym gives for it, both resolved as their module loads and
+ * dropped when it is unloaded; an address range stays as given. A block is
+ * instrumented if it starts in any of them, so a block running over the
+ * end of a function is still traced to its end. Without any filter every
+ * block is instrumented.
+ *
+ * The ranges are only looked up when a block is built, the caller
+ * serializes all access.
+ */
+
+#ifndef REGINA_FILTER_H
+#define REGINA_FILTER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+typedef struct _filter_range_t {
+    uint64_t start;
+    uint64_t end;
+} filter_range_t;
+
+typedef struct _filter_t {
+    /* lower case module names */
+    std::vector<std::string> modules;
+    /* (lower case module name or "" for any, function name) */
+    std::vector<std::pair<std::string, std::string>> functions;
+    /* -address_ranges */
+    std::vector<filter_range_t> fixed;
+    /* of the loaded modules, sorted by start and disjoint unless they
+     * touch
+     */
+    std::vector<filter_range_t> ranges;
+} filter_t;
+
+static inline std::string
+filter_lower(std::string s) {
+    for (auto& c : s) {
+        if (c >= 'A' && c <= 'Z')
+            c = (char)(c - 'A' + 'a');
+    }
+    return s;
+}
+
+/* Returns the non-empty items of a comma separated list. */
+static inline std::vector<std::string>
+filter_split(std::string const& text) {
+    std::vector<std::string> items;
+    size_t start = 0;
+
+    while (start <= text.size()) {
+        size_t end = text.find(',', start);
+        if (end == std::string::npos)
+            end = text.size();
+        if (end > start)
+            items.push_back(text.substr(start, end - start));
+        start = end + 1;
+    }
+    return items;
+}
+
+/* Parses a comma separated list of hexadecimal <start>-<end> ranges. */
+static inline bool
+filter_parse_ranges(std::string const& text, std::vector<filter_range_t>* ranges, std::string* err) {
+    ranges->clear();
+    for (auto const& item : filter_split(text)) {
+        filter_range_t r;
+        char* p;
+        r.start = strtoull(item.c_str(), &p, 16);
+        if (*p++ != '-') {
+            *err = "expected <start>-<end> in '" + item + "'";
+            return false;
+        }
+        r.end = strtoull(p, &p, 16);
+        if (*p != '\0' || r.end <= r.start) {
+            *err = "invalid range '" + item + "'";
+            return false;
+        }
+        ranges->push_back(r);
+    }
+    return true;
+}
+
+/* Sets up f from the option values, which must parse. */
+static inline void
+filter_init(filter_t* f, std::string const& modules, std::string const& functions,
+    std::string const& address_ranges) {
+    std::string err;
+
+    f->modules.clear();
+    for (auto const& m : filter_split(modules))
+        f->modules.push_back(filter_lower(m));
+    f->functions.clear();
+    for (auto const& fn : filter_split(functions)) {
+        size_t const bang = fn.find('!');
+        if (bang == std::string::npos)
+            f->functions.push_back(std::make_pair(std::string(), fn));
+        else
+            f->functions.push_back(std::make_pair(filter_lower(fn.substr(0, bang)), fn.substr(bang + 1)));
+    }
+    filter_parse_ranges(address_ranges, &f->fixed, &err);
+    f->ranges.clear();
+}
+
+static inline bool
+filter_wants_module(filter_t const* f, std::string const& module) {
+    return std::find(f->modules.begin(), f->modules.end(), filter_lower(module)) != f->modules.end();
+}
+
+/* Returns whether any function of module is selected. */
+static inline bool
+filter_wants_functions_of(filter_t const* f, std::string const& module) {
+    std::string const m = filter_lower(module);
+    for (auto const& fn : f->functions) {
+        if (fn.first.empty() || fn.first == m)
+            return true;
+    }
+    return false;
+}
+
+static inline bool
+filter_wants_function(filter_t const* f, std::string const& module, char const* name) {
+    std::string const m = filter_lower(module);
+    for (auto const& fn : f->functions) {
+        if ((fn.first.empty() || fn.first == m) && fn.second == name)
+            return true;
+    }
+    return false;
+}
+
+/* Adds [start, end), merging it with the ranges it overlaps. */
+static inline void
+filter_add(filter_t* f, uint64_t start, uint64_t end) {
+    auto it = std::upper_bound(f->ranges.begin(), f->ranges.end(), start,
+        [](uint64_t s, filter_range_t const& r) { return s < r.start; });
+    if (it != f->ranges.begin() && (it - 1)->end > start) {
+        --it;
+        start = it->start;
+    }
+    auto last = it;
+    while (last != f->ranges.end() && last->start < end) {
+        end = std::max(end, last->end);
+        ++last;
+    }
+    it = f->ranges.erase(it, last);
+    f->ranges.insert(it, filter_range_t{ start, end });
+}
+
+/* Drops the ranges starting in [start, end), e.g. of an unloaded module. */
+static inline void
+filter_remove(filter_t* f, uint64_t start, uint64_t end) {
+    f->ranges.erase(std::remove_if(f->ranges.begin(), f->ranges.end(),
+                        [start, end](filter_range_t const& r) { return r.start >= start && r.start < end; }),
+        f->ranges.end());
+}
+
+static inline bool
+filter_contains(filter_t const* f, uint64_t pc) {
+    auto it = std::upper_bound(f->ranges.begin(), f->ranges.end(), pc,
+        [](uint64_t p, filter_range_t const& r) { return p < r.start; });
+    if (it != f->ranges.begin() && pc < (it - 1)->end)
+        return true;
+    for (auto const& r : f->fixed) {
+        if (pc >= r.start && pc < r.end)
+            return true;
+    }
+    return false;
+}
+
+#endif /* REGINA_FILTER_H */
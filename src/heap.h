@@ -0,0 +1,262 @@
+/* Heap allocations of -heap and the index from a data address to the
+ * allocation it hit.
+ *
+ * Every allocation gets an id, 1, 2, ... in the order it is recorded, and
+ * keeps its range, call site and lifetime for the rest of the run: a free
+ * only sets its free time. The references are attributed later, on the
+ * writer threads, so a lookup asks for the allocation covering an address
+ * at a time: the one live then, otherwise the first one allocated after
+ * it. The time of a reference is only known to lie after the last time
+ * stamp of its thread, and memory handed over by another thread may have
+ * been allocated after that.
+ *
+ * An allocation is linked into a list per page it overlaps, newest first,
+ * and the lists are found through a three level radix map over the page
+ * numbers of 48-bit addresses. An allocation of HEAP_LARGE_PAGES pages or
+ * more is linked per region of that size instead, in a second map, so a
+ * huge block costs a few links and an address outside the heap finds two
+ * empty lists. Lookups take no lock and nothing they can see is ever
+ * moved or freed before heap_index_exit: allocations and links live in
+ * chunks that never move, and the lists and map nodes are published with
+ * release stores. Writers are serialized by the caller.
+ */
+
+#ifndef REGINA_HEAP_H
+#define REGINA_HEAP_H
+
+#include <stdint.h>
+#include <atomic>
+#include <unordered_map>
+
+#define HEAP_NONE 0
+#define HEAP_PAGE_SHIFT 12
+#define HEAP_RADIX_BITS 12
+#define HEAP_RADIX_SIZE (1 << HEAP_RADIX_BITS)
+/* allocations of at least a region are linked per region */
+#define HEAP_REGION_SHIFT (HEAP_PAGE_SHIFT + 6)
+#define HEAP_LARGE_PAGES (1 << (HEAP_REGION_SHIFT - HEAP_PAGE_SHIFT))
+#define HEAP_CHUNK_BITS 16
+#define HEAP_CHUNK_SIZE (1 << HEAP_CHUNK_BITS)
+/* ids are 32-bit */
+#define HEAP_MAX_CHUNKS (1 << (32 - HEAP_CHUNK_BITS))
+
+typedef struct _heap_alloc_t {
+    uint64_t start;
+    uint64_t end;
+    /* symbol index of the call site */
+    uint64_t site;
+    uint64_t thread;
+    uint64_t alloc_time;
+    /* UINT64_MAX while live */
+    std::atomic<uint64_t> free_time;
+} heap_alloc_t;
+
+/* counters of the references to one allocation */
+typedef struct _heap_stats_t {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t bytes;
+} heap_stats_t;
+
+/* list node of a page, 0 ends a list */
+typedef struct _heap_link_t {
+    uint32_t id;
+    uint32_t next;
+} heap_link_t;
+
+typedef std::atomic<uint32_t> heap_leaf_t[HEAP_RADIX_SIZE];
+typedef std::atomic<heap_leaf_t*> heap_mid_t[HEAP_RADIX_SIZE];
+
+typedef struct _heap_index_t {
+    std::atomic<heap_alloc_t*> allocs[HEAP_MAX_CHUNKS];
+    std::atomic<heap_link_t*> links[HEAP_MAX_CHUNKS];
+    uint32_t num_allocs;
+    uint32_t num_links;
+    /* list heads by page and, of the large allocations, by region */
+    std::atomic<heap_mid_t*> radix[HEAP_RADIX_SIZE];
+    std::atomic<heap_mid_t*> large[HEAP_RADIX_SIZE];
+    /* start of every live allocation -> id, writers only */
+    std::unordered_map<uint64_t, uint32_t> live;
+} heap_index_t;
+
+static inline void
+heap_index_init(heap_index_t* index) {
+    for (uint32_t i = 0; i < HEAP_MAX_CHUNKS; i++) {
+        index->allocs[i].store(NULL, std::memory_order_relaxed);
+        index->links[i].store(NULL, std::memory_order_relaxed);
+    }
+    for (uint32_t i = 0; i < HEAP_RADIX_SIZE; i++) {
+        index->radix[i].store(NULL, std::memory_order_relaxed);
+        index->large[i].store(NULL, std::memory_order_relaxed);
+    }
+    /* id and link 0 are never used */
+    index->num_allocs = 1;
+    index->num_links = 1;
+    index->live.clear();
+}
+
+static inline heap_alloc_t const*
+heap_index_get(heap_index_t const* index, uint32_t id) {
+    return &index->allocs[id >> HEAP_CHUNK_BITS].load(std::memory_order_acquire)[id & (HEAP_CHUNK_SIZE - 1)];
+}
+
+/* Returns the list head of page, a page or region number, in the map
+ * radix, NULL if the map has no room for it yet and create is false.
+ */
+static inline std::atomic<uint32_t>*
+heap_index_page(std::atomic<heap_mid_t*>* radix, uint64_t page, bool create) {
+    uint64_t const top = page >> (2 * HEAP_RADIX_BITS);
+    uint64_t const mid = (page >> HEAP_RADIX_BITS) & (HEAP_RADIX_SIZE - 1);
+
+    if (top >= HEAP_RADIX_SIZE)
+        return NULL;
+    heap_mid_t* m = radix[top].load(std::memory_order_acquire);
+    if (m == NULL) {
+        if (!create)
+            return NULL;
+        m = (heap_mid_t*)new std::atomic<heap_leaf_t*>[HEAP_RADIX_SIZE]();
+        radix[top].store(m, std::memory_order_release);
+    }
+    heap_leaf_t* l = (*m)[mid].load(std::memory_order_acquire);
+    if (l == NULL) {
+        if (!create)
+            return NULL;
+        l = (heap_leaf_t*)new std::atomic<uint32_t>[HEAP_RADIX_SIZE]();
+        (*m)[mid].store(l, std::memory_order_release);
+    }
+    return &(*l)[page & (HEAP_RADIX_SIZE - 1)];
+}
+
+/* Records an allocation of size bytes at start and returns its id, or
+ * HEAP_NONE once the ids run out.
+ */
+static inline uint32_t
+heap_index_add(heap_index_t* index, uint64_t start, uint64_t size, uint64_t site, uint64_t thread,
+    uint64_t time) {
+    uint32_t const id = index->num_allocs;
+    uint64_t const end = start + (size == 0 ? 1 : size);
+    bool const large = ((end - 1) >> HEAP_PAGE_SHIFT) - (start >> HEAP_PAGE_SHIFT) + 1 >= HEAP_LARGE_PAGES;
+    uint32_t const shift = large ? HEAP_REGION_SHIFT : HEAP_PAGE_SHIFT;
+    uint64_t const first = start >> shift;
+    uint64_t const last = (end - 1) >> shift;
+
+    if (id == UINT32_MAX)
+        return HEAP_NONE;
+    if (index->allocs[id >> HEAP_CHUNK_BITS].load(std::memory_order_relaxed) == NULL)
+        index->allocs[id >> HEAP_CHUNK_BITS].store(new heap_alloc_t[HEAP_CHUNK_SIZE], std::memory_order_release);
+    heap_alloc_t* a = (heap_alloc_t*)heap_index_get(index, id);
+    a->start = start;
+    a->end = end;
+    a->site = site;
+    a->thread = thread;
+    a->alloc_time = time;
+    a->free_time.store(UINT64_MAX, std::memory_order_relaxed);
+    index->num_allocs++;
+    index->live[start] = id;
+
+    for (uint64_t page = first; page <= last; page++) {
+        std::atomic<uint32_t>* head = heap_index_page(large ? index->large : index->radix, page, true);
+        uint32_t const n = index->num_links;
+        if (head == NULL || n == UINT32_MAX)
+            break;
+        if (index->links[n >> HEAP_CHUNK_BITS].load(std::memory_order_relaxed) == NULL)
+            index->links[n >> HEAP_CHUNK_BITS].store(new heap_link_t[HEAP_CHUNK_SIZE], std::memory_order_release);
+        heap_link_t* link = &index->links[n >> HEAP_CHUNK_BITS].load(std::memory_order_relaxed)[n & (HEAP_CHUNK_SIZE - 1)];
+        link->id = id;
+        link->next = head->load(std::memory_order_relaxed);
+        index->num_links++;
+        head->store(n, std::memory_order_release);
+    }
+    return id;
+}
+
+/* Records the free of the live allocation at start and returns its id, or
+ * HEAP_NONE if there is none, e.g. for memory allocated before -heap
+ * wrapped the allocator.
+ */
+static inline uint32_t
+heap_index_free(heap_index_t* index, uint64_t start, uint64_t time) {
+    auto it = index->live.find(start);
+    if (it == index->live.end())
+        return HEAP_NONE;
+    uint32_t const id = it->second;
+    index->live.erase(it);
+    ((heap_alloc_t*)heap_index_get(index, id))->free_time.store(time, std::memory_order_release);
+    return id;
+}
+
+/* Returns whether allocation a covers addr and was live at time. Otherwise
+ * remembers it in *best if it covers addr and is the earliest one
+ * allocated after time.
+ */
+static inline bool
+heap_index_pick(heap_alloc_t const* a, uint32_t id, uint64_t addr, uint64_t time, uint32_t* best,
+    uint64_t* best_time) {
+    if (addr < a->start || addr >= a->end)
+        return false;
+    if (a->alloc_time <= time)
+        return time < a->free_time.load(std::memory_order_acquire);
+    if (a->alloc_time < *best_time) {
+        *best = id;
+        *best_time = a->alloc_time;
+    }
+    return false;
+}
+
+/* Walks the list at head for heap_index_lookup. Returns the allocation
+ * live at time or HEAP_NONE.
+ */
+static inline uint32_t
+heap_index_walk(heap_index_t* index, std::atomic<uint32_t> const* head, uint64_t addr, uint64_t time,
+    uint32_t* best, uint64_t* best_time) {
+    if (head == NULL)
+        return HEAP_NONE;
+    for (uint32_t n = head->load(std::memory_order_acquire); n != 0;) {
+        heap_link_t const& link = index->links[n >> HEAP_CHUNK_BITS].load(std::memory_order_acquire)[n & (HEAP_CHUNK_SIZE - 1)];
+        heap_alloc_t const* a = heap_index_get(index, link.id);
+        if (heap_index_pick(a, link.id, addr, time, best, best_time))
+            return link.id;
+        /* a list is newest first: once a covering allocation was freed
+         * before time, none of the older ones can be live then
+         */
+        if (addr >= a->start && addr < a->end && a->alloc_time <= time)
+            break;
+        n = link.next;
+    }
+    return HEAP_NONE;
+}
+
+/* Returns the allocation addr belongs to at time, see above, or
+ * HEAP_NONE.
+ */
+static inline uint32_t
+heap_index_lookup(heap_index_t* index, uint64_t addr, uint64_t time) {
+    uint32_t best = HEAP_NONE;
+    uint64_t best_time = UINT64_MAX;
+    uint32_t id = heap_index_walk(index, heap_index_page(index->radix, addr >> HEAP_PAGE_SHIFT, false), addr, time, &best, &best_time);
+
+    if (id == HEAP_NONE)
+        id = heap_index_walk(index, heap_index_page(index->large, addr >> HEAP_REGION_SHIFT, false), addr, time, &best, &best_time);
+    return id != HEAP_NONE ? id : best;
+}
+
+static inline void
+heap_index_exit(heap_index_t* index) {
+    for (uint32_t i = 0; i < HEAP_MAX_CHUNKS; i++) {
+        delete[] index->allocs[i].load(std::memory_order_relaxed);
+        delete[] index->links[i].load(std::memory_order_relaxed);
+    }
+    for (auto radix : { index->radix, index->large }) {
+        for (uint32_t i = 0; i < HEAP_RADIX_SIZE; i++) {
+            heap_mid_t* m = radix[i].load(std::memory_order_relaxed);
+            if (m == NULL)
+                continue;
+            for (uint32_t j = 0; j < HEAP_RADIX_SIZE; j++)
+                delete[] (std::atomic<uint32_t>*)(*m)[j].load(std::memory_order_relaxed);
+            delete[] (std::atomic<heap_leaf_t*>*)m;
+        }
+    }
+    index->live.clear();
+}
+
+#endif /* REGINA_HEAP_H */
@@ -0,0 +1,564 @@
+/* The .mmtrd trace format read by the visualization, written by the client
+ * and by regina-symbolize.
+ *
+ * A .mmtrd file starts with an mmtrd_header_t that identifies the format
+ * version. The symbol indices refer to regina.0.mmtrd.txt, one
+ * "index|symbol" line per symbol, shared by every thread of a run. All
+ * values are little endian.
+ *
+ * Version 1 is a sequence of packed records, each starting with a type
+ * byte:
+ *   0  memory reference: write (1 = write, 2 = read), data address, size,
+ *      symbol index of the instruction
+ *   1  call or return: subType (0 = call, 1 = indirect call, 2 = return),
+ *      instruction address, target address and the symbol index of both
+ *
+ * Version 2 stores the events in chunks of up to MMTRD_CHUNK_EVENTS, column
+ * by column, so a reader can jump to any event or time without scanning
+ * the file. Each chunk is an mmtrd_chunk_info_t followed by the columns
+ *   addr[n]        uint64  data address, or the target of a call
+ *   call_pc[c]     uint64  instruction address of every call, in order
+ *   time[n]        uint64  time of the event, MMTRD_FLAG_TIME only
+ *   sym[n]         uint32  symbol index of the instruction
+ *   target_sym[c]  uint32  symbol index of every call target, in order
+ *   thread[n]      uint32  thread of the event, MMTRD_FLAG_THREAD only
+ *   kind[n]        uint8   mmtrd_kind_t
+ *   size[n]        uint8   size of a memory reference, 0 for calls
+ *   context[n]     uint32  calling context of the event, MMTRD_FLAG_CONTEXT
+ *                          only, see cct.h
+ *   alloc[n]       uint32  heap allocation a memory reference hit, 0 for
+ *                          none, MMTRD_FLAG_ALLOC only, see heap.h
+ *   object[n]      uint32  data object a memory reference hit, 0 for none,
+ *                          MMTRD_FLAG_OBJECT only, see data.h
+ * padded to 8 bytes, n being the number of events and c the number of
+ * calls and returns of the chunk. The chunk infos are repeated as an index
+ * after the last chunk, followed by an mmtrd_footer_t at the very end of
+ * the file; the index is sorted by event and by time, so a seek is a binary
+ * search over it, see mmtrd_reader.h.
+ *
+ * With MMTRD_FLAG_VARINT in the header, the uint64 and uint32 columns are
+ * stored as zigzag encoded varint deltas, see codec.h, restarting at every
+ * chunk. The column data then starts with the encoded length in bytes of
+ * every column as one uint32 each, 0 for the absent ones and none for
+ * absent trailing columns behind the last present one, so a column can be
+ * located without decoding the ones before it; data_size of the chunk info
+ * gives the length of the column data.
+ *
+ * The client stores the time stamp counter of a thread's events with
+ * -timestamps: an event has the time of the last TRACE_TYPE_TIME entry
+ * before it, see trace_format.h. regina-merge interleaves the per-thread
+ * files of a run by time into a single file with MMTRD_FLAG_THREAD.
+ *
+ * Records are encoded by an mmtrd_writer_t into large buffers that are
+ * written with a single fwrite each.
+ */
+
+#ifndef REGINA_MMTRD_H
+#define REGINA_MMTRD_H
+
+#include "codec.h"
+#include "trace_format.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#define MMTRD_MAGIC "MMTRD\0\0"
+#define MMTRD_INDEX_MAGIC "MMTRDIX"
+#define MMTRD_VERSION_PACKED 1
+#define MMTRD_VERSION_COLUMNAR 2
+
+/* mmtrd_header_t flags */
+#define MMTRD_FLAG_VARINT 0x1
+#define MMTRD_FLAG_TIME 0x2
+#define MMTRD_FLAG_THREAD 0x4
+#define MMTRD_FLAG_CONTEXT 0x8
+#define MMTRD_FLAG_ALLOC 0x10
+#define MMTRD_FLAG_OBJECT 0x20
+
+/* size of the encoding buffer of an mmtrd_writer_t */
+#define MMTRD_WRITE_BUFFER (4 << 20)
+
+#define MMTRD_MEM_RECORD_SIZE (1 + 1 + 8 + 1 + 8)
+#define MMTRD_CALL_RECORD_SIZE (1 + 1 + 8 + 8 + 8 + 8)
+
+/* events per version 2 chunk */
+#define MMTRD_CHUNK_EVENTS (1 << 20)
+/* symbol bitmap of a chunk: bit (idx % MMTRD_SYM_BITMAP_BITS) is set for
+ * every symbol index in it, so a clear bit rules a symbol out
+ */
+#define MMTRD_SYM_BITMAP_BITS 512
+
+typedef struct _mmtrd_header_t {
+    char magic[8];
+    uint32_t version;
+    /* MMTRD_FLAG_*, version 2 only */
+    uint32_t flags;
+} mmtrd_header_t;
+
+typedef enum {
+    MMTRD_READ = 0,
+    MMTRD_WRITE = 1,
+    MMTRD_CALL = 2,
+    MMTRD_CALL_IND = 3,
+    MMTRD_RETURN = 4,
+} mmtrd_kind_t;
+
+/* the columns of a version 2 chunk in file order */
+typedef enum {
+    MMTRD_COL_ADDR,
+    MMTRD_COL_CALL_PC,
+    MMTRD_COL_TIME,
+    MMTRD_COL_SYM,
+    MMTRD_COL_TARGET_SYM,
+    MMTRD_COL_THREAD,
+    MMTRD_COL_KIND,
+    MMTRD_COL_SIZE,
+    /* last, files without them keep the layout of older versions */
+    MMTRD_COL_CONTEXT,
+    MMTRD_COL_ALLOC,
+    MMTRD_COL_OBJECT,
+    MMTRD_NUM_COLUMNS,
+} mmtrd_column_t;
+
+/* bytes per element of every column */
+static const uint32_t mmtrd_column_width[MMTRD_NUM_COLUMNS] = { 8, 8, 8, 4, 4, 4, 1, 1, 4, 4, 4 };
+
+/* Returns the number of columns whose lengths precede the varint encoded
+ * column data of a file with the given flags.
+ */
+static inline int
+mmtrd_num_columns(uint32_t flags) {
+    if (flags & MMTRD_FLAG_OBJECT)
+        return MMTRD_NUM_COLUMNS;
+    if (flags & MMTRD_FLAG_ALLOC)
+        return MMTRD_COL_OBJECT;
+    return (flags & MMTRD_FLAG_CONTEXT) ? MMTRD_COL_ALLOC : MMTRD_COL_CONTEXT;
+}
+
+typedef struct _mmtrd_chunk_info_t {
+    /* file offset of the chunk */
+    uint64_t offset;
+    /* bytes of column data following the chunk info, without padding */
+    uint64_t data_size;
+    /* index of the first event of the chunk in the file */
+    uint64_t first_event;
+    uint32_t num_events;
+    uint32_t num_calls;
+    /* range of the data addresses, min > max if there are none */
+    uint64_t min_addr;
+    uint64_t max_addr;
+    /* time range of the chunk, see mmtrd_set_time */
+    uint64_t min_time;
+    uint64_t max_time;
+    uint64_t sym_bitmap[MMTRD_SYM_BITMAP_BITS / 64];
+} mmtrd_chunk_info_t;
+
+typedef struct _mmtrd_footer_t {
+    uint64_t index_offset;
+    uint64_t num_chunks;
+    uint64_t num_events;
+    char magic[8];
+} mmtrd_footer_t;
+
+typedef struct _mmtrd_writer_t {
+    FILE* f;
+    uint32_t version;
+    uint32_t flags;
+    /* bytes written to f so far */
+    uint64_t offset;
+    /* time, thread, calling context, allocation and data object stamped on
+     * the following events
+     */
+    uint64_t time;
+    uint32_t thread;
+    uint32_t context;
+    uint32_t alloc;
+    uint32_t object;
+    /* version 1: encoded records */
+    std::vector<char> buf;
+    size_t used;
+    /* version 2: columns of the current chunk */
+    mmtrd_chunk_info_t chunk;
+    std::vector<uint64_t> addr;
+    std::vector<uint64_t> call_pc;
+    std::vector<uint64_t> time_col;
+    std::vector<uint32_t> sym;
+    std::vector<uint32_t> target_sym;
+    std::vector<uint32_t> thread_col;
+    std::vector<uint8_t> kind;
+    std::vector<uint8_t> size;
+    std::vector<uint32_t> context_col;
+    std::vector<uint32_t> alloc_col;
+    std::vector<uint32_t> object_col;
+    std::vector<mmtrd_chunk_info_t> index;
+    /* MMTRD_FLAG_VARINT: encoded columns of the current chunk */
+    std::vector<uint8_t> enc;
+} mmtrd_writer_t;
+
+static inline void
+mmtrd_write_raw(mmtrd_writer_t* w, void const* data, size_t size) {
+    if (size > 0)
+        fwrite(data, 1, size, w->f);
+    w->offset += size;
+}
+
+static inline void
+mmtrd_flush(mmtrd_writer_t* w) {
+    mmtrd_write_raw(w, w->buf.data(), w->used);
+    w->used = 0;
+}
+
+static inline void
+mmtrd_chunk_reset(mmtrd_writer_t* w, uint64_t first_event) {
+    memset(&w->chunk, 0, sizeof(w->chunk));
+    w->chunk.first_event = first_event;
+    w->chunk.min_addr = UINT64_MAX;
+    w->chunk.min_time = UINT64_MAX;
+    w->addr.clear();
+    w->call_pc.clear();
+    w->time_col.clear();
+    w->sym.clear();
+    w->target_sym.clear();
+    w->thread_col.clear();
+    w->kind.clear();
+    w->size.clear();
+    w->context_col.clear();
+    w->alloc_col.clear();
+    w->object_col.clear();
+}
+
+template <typename T>
+static inline void
+mmtrd_write_column(mmtrd_writer_t* w, std::vector<T> const& column) {
+    mmtrd_write_raw(w, column.data(), column.size() * sizeof(T));
+}
+
+/* Returns the number of elements of column col in the chunk described by
+ * info of a file with the given flags.
+ */
+static inline uint64_t
+mmtrd_column_count(uint32_t flags, mmtrd_chunk_info_t const* info, int col) {
+    switch (col) {
+    case MMTRD_COL_CALL_PC:
+    case MMTRD_COL_TARGET_SYM:
+        return info->num_calls;
+    case MMTRD_COL_TIME:
+        return (flags & MMTRD_FLAG_TIME) ? info->num_events : 0;
+    case MMTRD_COL_THREAD:
+        return (flags & MMTRD_FLAG_THREAD) ? info->num_events : 0;
+    case MMTRD_COL_CONTEXT:
+        return (flags & MMTRD_FLAG_CONTEXT) ? info->num_events : 0;
+    case MMTRD_COL_ALLOC:
+        return (flags & MMTRD_FLAG_ALLOC) ? info->num_events : 0;
+    case MMTRD_COL_OBJECT:
+        return (flags & MMTRD_FLAG_OBJECT) ? info->num_events : 0;
+    default:
+        return info->num_events;
+    }
+}
+
+/* Returns whether column col is stored as varint deltas. */
+static inline bool
+mmtrd_column_varint(uint32_t flags, int col) {
+    return (flags & MMTRD_FLAG_VARINT) && mmtrd_column_width[col] > 1;
+}
+
+template <typename T>
+static inline uint8_t*
+mmtrd_encode_column(uint8_t* p, std::vector<T> const& column, uint32_t* size) {
+    uint8_t* const start = p;
+    uint64_t prev = 0;
+
+    if (sizeof(T) == 1) {
+        memcpy(p, column.data(), column.size());
+        p += column.size();
+    } else {
+        for (T v : column)
+            p = codec_put_delta(p, v, &prev);
+    }
+    *size = (uint32_t)(p - start);
+    return p;
+}
+
+/* Encodes the columns of the current chunk into w->enc, behind the table
+ * of their lengths. Returns the size of the column data.
+ */
+static inline size_t
+mmtrd_chunk_encode(mmtrd_writer_t* w) {
+    size_t const n = w->chunk.num_events;
+    size_t const c = w->chunk.num_calls;
+    uint32_t sizes[MMTRD_NUM_COLUMNS];
+    size_t const table = mmtrd_num_columns(w->flags) * sizeof(uint32_t);
+    uint8_t* p;
+
+    w->enc.resize(table + 10 * (6 * n + 2 * c) + 2 * n);
+    p = w->enc.data() + table;
+    p = mmtrd_encode_column(p, w->addr, &sizes[MMTRD_COL_ADDR]);
+    p = mmtrd_encode_column(p, w->call_pc, &sizes[MMTRD_COL_CALL_PC]);
+    p = mmtrd_encode_column(p, w->time_col, &sizes[MMTRD_COL_TIME]);
+    p = mmtrd_encode_column(p, w->sym, &sizes[MMTRD_COL_SYM]);
+    p = mmtrd_encode_column(p, w->target_sym, &sizes[MMTRD_COL_TARGET_SYM]);
+    p = mmtrd_encode_column(p, w->thread_col, &sizes[MMTRD_COL_THREAD]);
+    p = mmtrd_encode_column(p, w->kind, &sizes[MMTRD_COL_KIND]);
+    p = mmtrd_encode_column(p, w->size, &sizes[MMTRD_COL_SIZE]);
+    p = mmtrd_encode_column(p, w->context_col, &sizes[MMTRD_COL_CONTEXT]);
+    p = mmtrd_encode_column(p, w->alloc_col, &sizes[MMTRD_COL_ALLOC]);
+    p = mmtrd_encode_column(p, w->object_col, &sizes[MMTRD_COL_OBJECT]);
+    memcpy(w->enc.data(), sizes, table);
+    return (size_t)(p - w->enc.data());
+}
+
+/* Writes the current version 2 chunk. */
+static inline void
+mmtrd_chunk_flush(mmtrd_writer_t* w) {
+    static const char zero[8] = { 0 };
+    mmtrd_chunk_info_t* info = &w->chunk;
+
+    if (info->num_events == 0)
+        return;
+    if (info->min_time == UINT64_MAX)
+        info->min_time = info->max_time;
+    info->offset = w->offset;
+    if (w->flags & MMTRD_FLAG_VARINT) {
+        info->data_size = mmtrd_chunk_encode(w);
+        mmtrd_write_raw(w, info, sizeof(*info));
+        mmtrd_write_raw(w, w->enc.data(), (size_t)info->data_size);
+    } else {
+        info->data_size = 0;
+        for (int col = 0; col < MMTRD_NUM_COLUMNS; ++col)
+            info->data_size += mmtrd_column_count(w->flags, info, col) * mmtrd_column_width[col];
+        mmtrd_write_raw(w, info, sizeof(*info));
+        mmtrd_write_column(w, w->addr);
+        mmtrd_write_column(w, w->call_pc);
+        mmtrd_write_column(w, w->time_col);
+        mmtrd_write_column(w, w->sym);
+        mmtrd_write_column(w, w->target_sym);
+        mmtrd_write_column(w, w->thread_col);
+        mmtrd_write_column(w, w->kind);
+        mmtrd_write_column(w, w->size);
+        mmtrd_write_column(w, w->context_col);
+        mmtrd_write_column(w, w->alloc_col);
+        mmtrd_write_column(w, w->object_col);
+    }
+    mmtrd_write_raw(w, zero, (8 - w->offset % 8) % 8);
+    w->index.push_back(*info);
+    mmtrd_chunk_reset(w, info->first_event + info->num_events);
+}
+
+/* Starts a .mmtrd file of the given version on f, which stays owned by
+ * the caller. flags are MMTRD_FLAG_* and ignored for version 1.
+ */
+static inline void
+mmtrd_writer_init(mmtrd_writer_t* w, FILE* f, uint32_t version, uint32_t flags) {
+    mmtrd_header_t header = {};
+
+    w->f = f;
+    w->version = version;
+    w->flags = version == MMTRD_VERSION_COLUMNAR ? flags : 0;
+    w->offset = 0;
+    w->time = 0;
+    w->thread = 0;
+    w->context = 0;
+    w->alloc = 0;
+    w->object = 0;
+    w->used = 0;
+    memcpy(header.magic, MMTRD_MAGIC, sizeof(header.magic));
+    header.version = version;
+    header.flags = w->flags;
+    mmtrd_write_raw(w, &header, sizeof(header));
+    if (version == MMTRD_VERSION_PACKED) {
+        w->buf.resize(MMTRD_WRITE_BUFFER);
+    } else {
+        w->addr.reserve(MMTRD_CHUNK_EVENTS);
+        w->sym.reserve(MMTRD_CHUNK_EVENTS);
+        if (w->flags & MMTRD_FLAG_TIME)
+            w->time_col.reserve(MMTRD_CHUNK_EVENTS);
+        if (w->flags & MMTRD_FLAG_THREAD)
+            w->thread_col.reserve(MMTRD_CHUNK_EVENTS);
+        if (w->flags & MMTRD_FLAG_CONTEXT)
+            w->context_col.reserve(MMTRD_CHUNK_EVENTS);
+        if (w->flags & MMTRD_FLAG_ALLOC)
+            w->alloc_col.reserve(MMTRD_CHUNK_EVENTS);
+        if (w->flags & MMTRD_FLAG_OBJECT)
+            w->object_col.reserve(MMTRD_CHUNK_EVENTS);
+        w->kind.reserve(MMTRD_CHUNK_EVENTS);
+        w->size.reserve(MMTRD_CHUNK_EVENTS);
+        mmtrd_chunk_reset(w, 0);
+    }
+}
+
+/* Writes the buffered records, and the index for version 2, and releases
+ * the buffers.
+ */
+static inline void
+mmtrd_writer_exit(mmtrd_writer_t* w) {
+    if (w->version == MMTRD_VERSION_PACKED) {
+        mmtrd_flush(w);
+        std::vector<char>().swap(w->buf);
+        return;
+    }
+    mmtrd_chunk_flush(w);
+    mmtrd_footer_t footer = {};
+    footer.index_offset = w->offset;
+    footer.num_chunks = w->index.size();
+    footer.num_events = w->chunk.first_event;
+    memcpy(footer.magic, MMTRD_INDEX_MAGIC, sizeof(footer.magic));
+    mmtrd_write_column(w, w->index);
+    mmtrd_write_raw(w, &footer, sizeof(footer));
+    std::vector<uint64_t>().swap(w->addr);
+    std::vector<uint64_t>().swap(w->call_pc);
+    std::vector<uint64_t>().swap(w->time_col);
+    std::vector<uint32_t>().swap(w->sym);
+    std::vector<uint32_t>().swap(w->target_sym);
+    std::vector<uint32_t>().swap(w->thread_col);
+    std::vector<uint8_t>().swap(w->kind);
+    std::vector<uint8_t>().swap(w->size);
+    std::vector<uint32_t>().swap(w->context_col);
+    std::vector<uint32_t>().swap(w->alloc_col);
+    std::vector<uint32_t>().swap(w->object_col);
+    std::vector<mmtrd_chunk_info_t>().swap(w->index);
+    std::vector<uint8_t>().swap(w->enc);
+}
+
+/* Sets the time of the following events. Times must not decrease. */
+static inline void
+mmtrd_set_time(mmtrd_writer_t* w, uint64_t time) {
+    w->time = time;
+}
+
+/* Sets the thread of the following events, MMTRD_FLAG_THREAD only. */
+static inline void
+mmtrd_set_thread(mmtrd_writer_t* w, uint32_t thread) {
+    w->thread = thread;
+}
+
+/* Sets the calling context of the following events, MMTRD_FLAG_CONTEXT
+ * only.
+ */
+static inline void
+mmtrd_set_context(mmtrd_writer_t* w, uint32_t context) {
+    w->context = context;
+}
+
+/* Sets the heap allocation of the following events, MMTRD_FLAG_ALLOC
+ * only.
+ */
+static inline void
+mmtrd_set_alloc(mmtrd_writer_t* w, uint32_t alloc) {
+    w->alloc = alloc;
+}
+
+/* Sets the data object of the following events, MMTRD_FLAG_OBJECT only. */
+static inline void
+mmtrd_set_object(mmtrd_writer_t* w, uint32_t object) {
+    w->object = object;
+}
+
+/* Returns the position for a version 1 record of size bytes, flushing if
+ * needed.
+ */
+static inline char*
+mmtrd_reserve(mmtrd_writer_t* w, size_t size) {
+    char* p;
+
+    if (w->used + size > w->buf.size())
+        mmtrd_flush(w);
+    p = w->buf.data() + w->used;
+    w->used += size;
+    return p;
+}
+
+template <typename T>
+static inline char*
+mmtrd_put(char* p, T value) {
+    memcpy(p, &value, sizeof(value));
+    return p + sizeof(value);
+}
+
+/* Appends an event to the current version 2 chunk. */
+static inline void
+mmtrd_chunk_add(mmtrd_writer_t* w, mmtrd_kind_t kind, uint64_t addr, uint32_t size,
+    uint64_t sym_idx) {
+    mmtrd_chunk_info_t* info = &w->chunk;
+
+    w->addr.push_back(addr);
+    w->sym.push_back((uint32_t)sym_idx);
+    w->kind.push_back((uint8_t)kind);
+    w->size.push_back((uint8_t)size);
+    if (w->flags & MMTRD_FLAG_TIME)
+        w->time_col.push_back(w->time);
+    if (w->flags & MMTRD_FLAG_THREAD)
+        w->thread_col.push_back(w->thread);
+    if (w->flags & MMTRD_FLAG_CONTEXT)
+        w->context_col.push_back(w->context);
+    if (w->flags & MMTRD_FLAG_ALLOC)
+        w->alloc_col.push_back(w->alloc);
+    if (w->flags & MMTRD_FLAG_OBJECT)
+        w->object_col.push_back(w->object);
+    info->sym_bitmap[(sym_idx % MMTRD_SYM_BITMAP_BITS) / 64] |= 1ull << (sym_idx % 64);
+    if (info->num_events == 0)
+        info->min_time = w->time;
+    info->max_time = w->time;
+    info->num_events++;
+}
+
+static inline void
+mmtrd_write_mem(mmtrd_writer_t* w, bool write, uint64_t addr, uint32_t size, uint64_t sym_idx) {
+    if (w->version == MMTRD_VERSION_COLUMNAR) {
+        mmtrd_chunk_info_t* info = &w->chunk;
+        if (addr < info->min_addr)
+            info->min_addr = addr;
+        if (addr > info->max_addr)
+            info->max_addr = addr;
+        mmtrd_chunk_add(w, write ? MMTRD_WRITE : MMTRD_READ, addr, size, sym_idx);
+        if (info->num_events == MMTRD_CHUNK_EVENTS)
+            mmtrd_chunk_flush(w);
+        return;
+    }
+    char* p = mmtrd_reserve(w, MMTRD_MEM_RECORD_SIZE);
+    p = mmtrd_put<unsigned char>(p, 0);
+    p = mmtrd_put<unsigned char>(p, write ? 1 : 2);
+    p = mmtrd_put<uint64_t>(p, addr);
+    p = mmtrd_put<unsigned char>(p, (unsigned char)size);
+    mmtrd_put<uint64_t>(p, sym_idx);
+}
+
+/* type is TRACE_TYPE_CALL, TRACE_TYPE_CALL_IND or TRACE_TYPE_RETURN */
+static inline void
+mmtrd_write_call(mmtrd_writer_t* w, trace_type_t type, uint64_t instr, uint64_t target,
+    uint64_t instr_sym_idx, uint64_t target_sym_idx) {
+    unsigned char sub_type;
+
+    switch (type) {
+    case TRACE_TYPE_CALL:
+        sub_type = 0;
+        break;
+    case TRACE_TYPE_CALL_IND:
+        sub_type = 1;
+        break;
+    default:
+        sub_type = 2;
+        break;
+    }
+    if (w->version == MMTRD_VERSION_COLUMNAR) {
+        mmtrd_chunk_info_t* info = &w->chunk;
+        w->call_pc.push_back(instr);
+        w->target_sym.push_back((uint32_t)target_sym_idx);
+        info->sym_bitmap[(target_sym_idx % MMTRD_SYM_BITMAP_BITS) / 64] |= 1ull << (target_sym_idx % 64);
+        info->num_calls++;
+        mmtrd_chunk_add(w, (mmtrd_kind_t)(MMTRD_CALL + sub_type), target, 0, instr_sym_idx);
+        if (info->num_events == MMTRD_CHUNK_EVENTS)
+            mmtrd_chunk_flush(w);
+        return;
+    }
+    char* p = mmtrd_reserve(w, MMTRD_CALL_RECORD_SIZE);
+    p = mmtrd_put<unsigned char>(p, 1);
+    p = mmtrd_put<unsigned char>(p, sub_type);
+    p = mmtrd_put<uint64_t>(p, instr);
+    p = mmtrd_put<uint64_t>(p, target);
+    p = mmtrd_put<uint64_t>(p, instr_sym_idx);
+    mmtrd_put<uint64_t>(p, target_sym_idx);
+}
+
+#endif /* REGINA_MMTRD_H */
@@ -0,0 +1,307 @@
+/* Random access reader for version 2 .mmtrd files, see mmtrd.h.
+ *
+ * Opening a file reads its footer and chunk index only; a chunk holding a
+ * given event or time is then found by a binary search over the index and
+ * read with a single seek. An mmtrd_stream_t reads all events in order
+ * through a small window per column instead, so many files can be read
+ * side by side.
+ */
+
+#ifndef REGINA_MMTRD_READER_H
+#define REGINA_MMTRD_READER_H
+
+#include "mmtrd.h"
+#include <algorithm>
+
+#ifdef _WIN32
+#define MMTRD_FSEEK _fseeki64
+#else
+#define MMTRD_FSEEK fseeko
+#endif
+
+typedef struct _mmtrd_reader_t {
+    FILE* f;
+    uint32_t version;
+    uint32_t flags;
+    mmtrd_footer_t footer;
+    std::vector<mmtrd_chunk_info_t> index;
+} mmtrd_reader_t;
+
+/* The columns of one chunk, see mmtrd.h. */
+typedef struct _mmtrd_chunk_t {
+    mmtrd_chunk_info_t info;
+    std::vector<uint64_t> addr;
+    std::vector<uint64_t> call_pc;
+    /* empty without MMTRD_FLAG_TIME and MMTRD_FLAG_THREAD */
+    std::vector<uint64_t> time;
+    std::vector<uint32_t> sym;
+    std::vector<uint32_t> target_sym;
+    std::vector<uint32_t> thread;
+    std::vector<uint8_t> kind;
+    std::vector<uint8_t> size;
+    /* empty without MMTRD_FLAG_CONTEXT, MMTRD_FLAG_ALLOC and
+     * MMTRD_FLAG_OBJECT
+     */
+    std::vector<uint32_t> context;
+    std::vector<uint32_t> alloc;
+    std::vector<uint32_t> object;
+} mmtrd_chunk_t;
+
+/* Reads the header and, for version 2, the index of f. Returns false if f
+ * is no .mmtrd file or its index is missing, e.g. after a crash.
+ */
+static inline bool
+mmtrd_reader_open(mmtrd_reader_t* r, FILE* f) {
+    mmtrd_header_t header;
+
+    r->f = f;
+    r->index.clear();
+    if (MMTRD_FSEEK(f, 0, SEEK_SET) != 0 || fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, MMTRD_MAGIC, sizeof(header.magic)) != 0)
+        return false;
+    r->version = header.version;
+    r->flags = header.flags;
+    if (r->version != MMTRD_VERSION_COLUMNAR)
+        return r->version == MMTRD_VERSION_PACKED;
+    if (MMTRD_FSEEK(f, -(long)sizeof(r->footer), SEEK_END) != 0 || fread(&r->footer, sizeof(r->footer), 1, f) != 1 || memcmp(r->footer.magic, MMTRD_INDEX_MAGIC, sizeof(r->footer.magic)) != 0)
+        return false;
+    r->index.resize((size_t)r->footer.num_chunks);
+    if (MMTRD_FSEEK(f, r->footer.index_offset, SEEK_SET) != 0)
+        return false;
+    return r->index.empty() || fread(r->index.data(), sizeof(mmtrd_chunk_info_t), r->index.size(), f) == r->index.size();
+}
+
+/* Returns the chunk holding event, or the number of chunks if there is
+ * none.
+ */
+static inline size_t
+mmtrd_find_event(mmtrd_reader_t const* r, uint64_t event) {
+    auto it = std::upper_bound(r->index.begin(), r->index.end(), event,
+        [](uint64_t e, mmtrd_chunk_info_t const& info) { return e < info.first_event; });
+    if (it == r->index.begin())
+        return r->index.size();
+    --it;
+    if (event >= it->first_event + it->num_events)
+        return r->index.size();
+    return (size_t)(it - r->index.begin());
+}
+
+/* Returns the first chunk with events at or after time, or the number of
+ * chunks if there is none.
+ */
+static inline size_t
+mmtrd_find_time(mmtrd_reader_t const* r, uint64_t time) {
+    auto it = std::lower_bound(r->index.begin(), r->index.end(), time,
+        [](mmtrd_chunk_info_t const& info, uint64_t t) { return info.max_time < t; });
+    return (size_t)(it - r->index.begin());
+}
+
+/* Returns whether chunk i may contain symbol sym_idx. */
+static inline bool
+mmtrd_chunk_may_contain(mmtrd_reader_t const* r, size_t i, uint64_t sym_idx) {
+    return (r->index[i].sym_bitmap[(sym_idx % MMTRD_SYM_BITMAP_BITS) / 64] >> (sym_idx % 64)) & 1;
+}
+
+/* Computes the file offset and the length in bytes of every column of
+ * chunk i.
+ */
+static inline bool
+mmtrd_chunk_columns(mmtrd_reader_t const* r, size_t i, uint64_t offset[MMTRD_NUM_COLUMNS],
+    uint64_t size[MMTRD_NUM_COLUMNS]) {
+    mmtrd_chunk_info_t const& info = r->index[i];
+    uint64_t pos = info.offset + sizeof(info);
+    uint32_t sizes[MMTRD_NUM_COLUMNS] = {};
+    size_t const table = mmtrd_num_columns(r->flags) * sizeof(uint32_t);
+
+    if (r->flags & MMTRD_FLAG_VARINT) {
+        if (MMTRD_FSEEK(r->f, pos, SEEK_SET) != 0 || fread(sizes, table, 1, r->f) != 1)
+            return false;
+        pos += table;
+    }
+    for (int col = 0; col < MMTRD_NUM_COLUMNS; ++col) {
+        offset[col] = pos;
+        if (mmtrd_column_varint(r->flags, col))
+            size[col] = sizes[col];
+        else
+            size[col] = mmtrd_column_count(r->flags, &info, col) * mmtrd_column_width[col];
+        pos += size[col];
+    }
+    return pos <= info.offset + sizeof(info) + info.data_size;
+}
+
+/* Reads n elements of column col of a chunk, stored in size bytes at
+ * offset.
+ */
+template <typename T>
+static inline bool
+mmtrd_read_column(mmtrd_reader_t const* r, int col, uint64_t offset, uint64_t size, size_t n,
+    std::vector<T>& column) {
+    column.resize(n);
+    if (size == 0)
+        return n == 0;
+    if (MMTRD_FSEEK(r->f, offset, SEEK_SET) != 0)
+        return false;
+    if (!mmtrd_column_varint(r->flags, col))
+        return size == n * sizeof(T) && fread(column.data(), sizeof(T), n, r->f) == n;
+
+    std::vector<uint8_t> data((size_t)size);
+    uint8_t const* p = data.data();
+    uint8_t const* end = p + data.size();
+    uint64_t prev = 0, v = 0;
+    if (fread(data.data(), 1, data.size(), r->f) != data.size())
+        return false;
+    for (size_t j = 0; j < n; ++j) {
+        p = codec_get_delta(p, end, &v, &prev);
+        if (p == NULL)
+            return false;
+        column[j] = (T)v;
+    }
+    return p == end;
+}
+
+/* Reads the columns of chunk i into chunk. */
+static inline bool
+mmtrd_read_chunk(mmtrd_reader_t const* r, size_t i, mmtrd_chunk_t* chunk) {
+    uint64_t offset[MMTRD_NUM_COLUMNS], size[MMTRD_NUM_COLUMNS];
+    mmtrd_chunk_info_t const& info = r->index[i];
+
+    if (MMTRD_FSEEK(r->f, info.offset, SEEK_SET) != 0 || fread(&chunk->info, sizeof(chunk->info), 1, r->f) != 1)
+        return false;
+    if (!mmtrd_chunk_columns(r, i, offset, size))
+        return false;
+#define MMTRD_READ_COLUMN(col, column) \
+    mmtrd_read_column(r, col, offset[col], size[col], (size_t)mmtrd_column_count(r->flags, &info, col), column)
+    return MMTRD_READ_COLUMN(MMTRD_COL_ADDR, chunk->addr) && MMTRD_READ_COLUMN(MMTRD_COL_CALL_PC, chunk->call_pc) && MMTRD_READ_COLUMN(MMTRD_COL_TIME, chunk->time) && MMTRD_READ_COLUMN(MMTRD_COL_SYM, chunk->sym) && MMTRD_READ_COLUMN(MMTRD_COL_TARGET_SYM, chunk->target_sym) && MMTRD_READ_COLUMN(MMTRD_COL_THREAD, chunk->thread) && MMTRD_READ_COLUMN(MMTRD_COL_KIND, chunk->kind) && MMTRD_READ_COLUMN(MMTRD_COL_SIZE, chunk->size) && MMTRD_READ_COLUMN(MMTRD_COL_CONTEXT, chunk->context) && MMTRD_READ_COLUMN(MMTRD_COL_ALLOC, chunk->alloc) && MMTRD_READ_COLUMN(MMTRD_COL_OBJECT, chunk->object);
+#undef MMTRD_READ_COLUMN
+}
+
+/* One event of a version 2 file, fields of absent columns are 0. */
+typedef struct _mmtrd_event_t {
+    uint64_t addr;
+    /* calls and returns only */
+    uint64_t call_pc;
+    uint64_t time;
+    uint32_t sym;
+    /* calls and returns only */
+    uint32_t target_sym;
+    uint32_t thread;
+    uint8_t kind;
+    uint8_t size;
+    uint32_t context;
+    uint32_t alloc;
+    uint32_t object;
+} mmtrd_event_t;
+
+/* the part of a column not yet read */
+typedef struct _mmtrd_cursor_t {
+    uint64_t offset;
+    uint64_t left;
+    uint64_t prev;
+    std::vector<uint8_t> buf;
+    size_t pos;
+    size_t end;
+} mmtrd_cursor_t;
+
+typedef struct _mmtrd_stream_t {
+    mmtrd_reader_t const* r;
+    /* next chunk to open */
+    size_t chunk;
+    /* events left in the open chunk */
+    uint64_t left;
+    mmtrd_cursor_t col[MMTRD_NUM_COLUMNS];
+} mmtrd_stream_t;
+
+/* Starts reading the events of r from the first one, through a window of
+ * window bytes per column.
+ */
+static inline void
+mmtrd_stream_init(mmtrd_stream_t* s, mmtrd_reader_t const* r, size_t window) {
+    s->r = r;
+    s->chunk = 0;
+    s->left = 0;
+    for (int col = 0; col < MMTRD_NUM_COLUMNS; ++col) {
+        s->col[col].buf.resize(window < 64 ? 64 : window);
+        s->col[col].left = 0;
+        s->col[col].pos = s->col[col].end = 0;
+    }
+}
+
+/* Reads the next value of column col into v. */
+static inline bool
+mmtrd_cursor_read(mmtrd_stream_t* s, int col, uint64_t* v) {
+    mmtrd_cursor_t* c = &s->col[col];
+
+    /* a varint is at most 10 bytes long */
+    if (c->end - c->pos < 10 && c->left > 0) {
+        size_t const rest = c->end - c->pos;
+        size_t const n = (size_t)std::min<uint64_t>(c->left, c->buf.size() - rest);
+        memmove(c->buf.data(), c->buf.data() + c->pos, rest);
+        if (MMTRD_FSEEK(s->r->f, c->offset, SEEK_SET) != 0 || fread(c->buf.data() + rest, 1, n, s->r->f) != n)
+            return false;
+        c->offset += n;
+        c->left -= n;
+        c->pos = 0;
+        c->end = rest + n;
+    }
+    if (mmtrd_column_varint(s->r->flags, col)) {
+        uint8_t const* p = codec_get_delta(c->buf.data() + c->pos, c->buf.data() + c->end, v, &c->prev);
+        if (p == NULL)
+            return false;
+        c->pos = (size_t)(p - c->buf.data());
+        return true;
+    }
+    if (c->end - c->pos < mmtrd_column_width[col])
+        return false;
+    *v = 0;
+    memcpy(v, c->buf.data() + c->pos, mmtrd_column_width[col]);
+    c->pos += mmtrd_column_width[col];
+    return true;
+}
+
+/* Reads the next event into ev. Returns false at the end of the file or
+ * on a read error.
+ */
+static inline bool
+mmtrd_stream_next(mmtrd_stream_t* s, mmtrd_event_t* ev) {
+    uint64_t v[MMTRD_NUM_COLUMNS] = {};
+
+    while (s->left == 0) {
+        uint64_t offset[MMTRD_NUM_COLUMNS], size[MMTRD_NUM_COLUMNS];
+        if (s->chunk == s->r->index.size() || !mmtrd_chunk_columns(s->r, s->chunk, offset, size))
+            return false;
+        for (int col = 0; col < MMTRD_NUM_COLUMNS; ++col) {
+            s->col[col].offset = offset[col];
+            s->col[col].left = size[col];
+            s->col[col].prev = 0;
+            s->col[col].pos = s->col[col].end = 0;
+        }
+        s->left = s->r->index[s->chunk++].num_events;
+    }
+    for (int col = 0; col < MMTRD_NUM_COLUMNS; ++col) {
+        if (col == MMTRD_COL_CALL_PC || col == MMTRD_COL_TARGET_SYM)
+            continue;
+        if ((col == MMTRD_COL_TIME && !(s->r->flags & MMTRD_FLAG_TIME)) || (col == MMTRD_COL_THREAD && !(s->r->flags & MMTRD_FLAG_THREAD))
+            || (col == MMTRD_COL_CONTEXT && !(s->r->flags & MMTRD_FLAG_CONTEXT))
+            || (col == MMTRD_COL_ALLOC && !(s->r->flags & MMTRD_FLAG_ALLOC))
+            || (col == MMTRD_COL_OBJECT && !(s->r->flags & MMTRD_FLAG_OBJECT)))
+            continue;
+        if (!mmtrd_cursor_read(s, col, &v[col]))
+            return false;
+    }
+    if (v[MMTRD_COL_KIND] >= MMTRD_CALL && (!mmtrd_cursor_read(s, MMTRD_COL_CALL_PC, &v[MMTRD_COL_CALL_PC]) || !mmtrd_cursor_read(s, MMTRD_COL_TARGET_SYM, &v[MMTRD_COL_TARGET_SYM])))
+        return false;
+    s->left--;
+    ev->addr = v[MMTRD_COL_ADDR];
+    ev->call_pc = v[MMTRD_COL_CALL_PC];
+    ev->time = v[MMTRD_COL_TIME];
+    ev->sym = (uint32_t)v[MMTRD_COL_SYM];
+    ev->target_sym = (uint32_t)v[MMTRD_COL_TARGET_SYM];
+    ev->thread = (uint32_t)v[MMTRD_COL_THREAD];
+    ev->kind = (uint8_t)v[MMTRD_COL_KIND];
+    ev->size = (uint8_t)v[MMTRD_COL_SIZE];
+    ev->context = (uint32_t)v[MMTRD_COL_CONTEXT];
+    ev->alloc = (uint32_t)v[MMTRD_COL_ALLOC];
+    ev->object = (uint32_t)v[MMTRD_COL_OBJECT];
+    return true;
+}
+
+#endif /* REGINA_MMTRD_READER_H */
@@ -0,0 +1,81 @@
+/* Module table written by the client with -offline_symbols and read by
+ * regina-symbolize.
+ *
+ * regina.modules.txt holds one tab separated line per module event in the
+ * order DR reported them:
+ *   load    <base> <size> <timestamp> <checksum> <name> <path>
+ *   unload  <base>
+ * base and size are hex, timestamp and checksum identify the exact build of
+ * a PE image (both 0 elsewhere), name is DR's preferred module name and
+ * path is last so it may contain spaces.
+ */
+
+#ifndef REGINA_MODTABLE_H
+#define REGINA_MODTABLE_H
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#define MODTABLE_FILE "regina.modules.txt"
+
+typedef struct _modtable_entry_t {
+    uint64_t base;
+    uint64_t size;
+    uint64_t timestamp;
+    uint64_t checksum;
+    std::string name;
+    std::string path;
+} modtable_entry_t;
+
+static inline void
+modtable_write_load(FILE* f, modtable_entry_t const& mod) {
+    fprintf(f, "load\t%" PRIx64 "\t%" PRIx64 "\t%" PRIx64 "\t%" PRIx64 "\t%s\t%s\n", mod.base,
+        mod.size, mod.timestamp, mod.checksum, mod.name.c_str(), mod.path.c_str());
+}
+
+static inline void
+modtable_write_unload(FILE* f, uint64_t base) {
+    fprintf(f, "unload\t%" PRIx64 "\n", base);
+}
+
+/* Reads every load event of f into mods. A module unloaded and loaded
+ * again at another address shows up once per load.
+ */
+static inline bool
+modtable_read(FILE* f, std::vector<modtable_entry_t>& mods) {
+    char line[4096];
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        std::string s(line);
+        std::vector<std::string> fields;
+        size_t start = 0, end;
+
+        while (!s.empty() && (s.back() == '\n' || s.back() == '\r'))
+            s.pop_back();
+        /* the path is the last field and keeps its tabs */
+        while (fields.size() < 6 && (end = s.find('\t', start)) != std::string::npos) {
+            fields.push_back(s.substr(start, end - start));
+            start = end + 1;
+        }
+        fields.push_back(s.substr(start));
+        if (fields[0] == "unload")
+            continue;
+        if (fields[0] != "load" || fields.size() != 7)
+            return false;
+        modtable_entry_t mod;
+        mod.base = strtoull(fields[1].c_str(), NULL, 16);
+        mod.size = strtoull(fields[2].c_str(), NULL, 16);
+        mod.timestamp = strtoull(fields[3].c_str(), NULL, 16);
+        mod.checksum = strtoull(fields[4].c_str(), NULL, 16);
+        mod.name = fields[5];
+        mod.path = fields[6];
+        mods.push_back(mod);
+    }
+    return true;
+}
+
+#endif /* REGINA_MODTABLE_H */
@@ -0,0 +1,285 @@
+/* Runtime options of the client, see options.h. */
+
+#include "dr_api.h"
+#include "cachesim.h"
+#include "filter.h"
+#include "options.h"
+
+droption_t<std::string> op_buffer_mode(DROPTION_SCOPE_CLIENT, "buffer_mode", "lean",
+    "Buffer overflow detection: lean or fault",
+    "Selects how a full trace buffer is detected. 'lean' checks the buffer "
+    "pointer after every entry and jumps to a lean procedure that flushes the "
+    "buffer. 'fault' uses a drx_buf trace buffer with a guard page: the check "
+    "disappears from the inlined code and the buffer is flushed from the fault "
+    "handler when the guard page is hit. 'fault' is not available with -trace_bb.");
+droption_t<bytesize_t> op_buffer_size(DROPTION_SCOPE_CLIENT, "buffer_size", 384 * 1024, 4096,
+    1024 * 1024 * 1024,
+    "Size of each per-thread trace buffer",
+    "Size in bytes of each per-thread trace buffer; suffixes K, M and G are accepted. "
+    "The value is rounded down to a multiple of the 16 byte entry size. Every thread "
+    "allocates -num_buffers buffers of this size (one with -num_buffers 0), so the "
+    "memory needed grows with the number of threads.");
+droption_t<unsigned int> op_num_buffers(DROPTION_SCOPE_CLIENT, "num_buffers", 4,
+    "Trace buffers per thread, 0 writes synchronously",
+    "Number of trace buffers per thread. A full buffer is handed to a background "
+    "writer thread and the application thread continues with the next free buffer "
+    "of its pool; it only waits if all of them are still being written. 0 writes "
+    "every full buffer synchronously on the application thread.");
+droption_t<unsigned int> op_writer_threads(DROPTION_SCOPE_CLIENT, "writer_threads", 2, 1, 64,
+    "Background writer threads",
+    "Number of background threads writing, and with -incremental converting, the "
+    "full buffers. Each application thread is assigned to one of them round "
+    "robin, so its buffers stay in order. Unused with -num_buffers 0.");
+droption_t<bool> op_incremental(DROPTION_SCOPE_CLIENT, "incremental", true,
+    "Convert buffers while the application runs",
+    "Symbolizes and encodes every flushed buffer straight into regina.N.mmtrd on "
+    "the writer threads, so no raw per-thread trace is written and thread exit "
+    "only converts its last partial buffer. -no_incremental writes the raw trace "
+    "regina.tmp.N.mmd and converts it after the thread has exited, see "
+    "-convert_threads. Ignored with -format text and -offline_symbols.");
+droption_t<unsigned int> op_convert_threads(DROPTION_SCOPE_CLIENT, "convert_threads", 4, 0, 256,
+    "Worker threads converting finished traces, 0 converts on exit",
+    "Number of background threads converting the raw trace of an exited thread "
+    "into regina.N.mmtrd with -no_incremental. An exiting thread only hands its "
+    "trace over, so many threads exiting at once do not wait for each other; "
+    "process exit waits for the remaining conversions. 0 converts on the exiting "
+    "thread itself.");
+droption_t<bool> op_trace_bb(DROPTION_SCOPE_CLIENT, "trace_bb", false,
+    "Record one entry per basic block execution",
+    "Records each basic block execution as a single entry holding the block id "
+    "followed by the raw addresses of its memory references. The pcs, sizes and "
+    "read/write flags are static per block and are restored from the block "
+    "descriptors during conversion. Blocks with internal control flow or more than "
+    "255 references are still recorded per reference.");
+droption_t<bool> op_early_symbols(DROPTION_SCOPE_CLIENT, "early_symbols", false,
+    "Resolve symbols at instrumentation time",
+    "Resolves the symbol of every memory reference once, when its basic block is "
+    "instrumented, and records its symbol index in place of the pc, so the "
+    "conversion into regina.N.mmtrd, N being the thread id, skips the lookups. "
+    "Implies -incremental. Calls and returns keep their pcs and are looked up "
+    "through the symbol cache. Requires -format binary.");
+droption_t<bool> op_offline_symbols(DROPTION_SCOPE_CLIENT, "offline_symbols", false,
+    "Leave all symbol work to regina-symbolize",
+    "Does no symbol work in the traced process. The raw per-thread traces "
+    "regina.tmp.N.mmd are kept together with a module table (regina.modules.txt) "
+    "and, with -trace_bb, the block descriptors (regina.bb). regina-symbolize turns "
+    "them into the .mmtrd files and the symbol table afterwards. Requires -format "
+    "binary.");
+droption_t<std::string> op_outdir(DROPTION_SCOPE_CLIENT, "outdir", "",
+    "Directory for all output files",
+    "Directory receiving the temporary per-thread traces, the .mmtrd files and the "
+    "symbol table. It is created if it does not exist. Defaults to the current "
+    "working directory.");
+droption_t<std::string> op_format(DROPTION_SCOPE_CLIENT, "format", "binary",
+    "Trace format: binary or text",
+    "'binary' converts the raw entries into regina.N.mmtrd, see -incremental. "
+    "'text' writes one line per reference into regina.tmp.N.mmd instead and "
+    "skips the conversion; it is an order of magnitude (!) slower and meant for "
+    "debugging.");
+droption_t<unsigned int> op_mmtrd_version(DROPTION_SCOPE_CLIENT, "mmtrd_version", 2, 1, 2,
+    "Version of the .mmtrd output: 1 or 2",
+    "Version 1 writes one packed record after the other. Version 2 stores chunks "
+    "of 1M events column by column with per-chunk address, time and symbol "
+    "summaries and a chunk index at the end of the file, so the visualization can "
+    "seek to any event or time. See mmtrd.h.");
+droption_t<bool> op_compress(DROPTION_SCOPE_CLIENT, "compress", false,
+    "Delta encode raw traces and .mmtrd columns",
+    "Stores addresses, pcs and symbol indices as zigzag encoded deltas to their "
+    "predecessor in LEB128 varints, both in the raw per-thread traces and in the "
+    "columns of -mmtrd_version 2 output. Strided and sequential accesses shrink "
+    "to a few bytes per reference. The encoding runs on the writer threads. "
+    "Requires -format binary. See codec.h.");
+droption_t<bool> op_timestamps(DROPTION_SCOPE_CLIENT, "timestamps", true,
+    "Record the time stamp counter per buffer and call",
+    "Records the time stamp counter at thread start, after every flushed buffer "
+    "and after every call and return, and stores the time of each event in the "
+    "-mmtrd_version 2 output. The counter is shared by all cores of an invariant "
+    "TSC machine, so regina-merge can interleave the per-thread traces into one "
+    "timeline. Costs one rdtsc per call and return.");
+droption_t<bool> op_simulate(DROPTION_SCOPE_CLIENT, "simulate", false,
+    "Simulate caches instead of writing traces",
+    "Runs every flushed buffer through a per-thread model of the -cache_levels "
+    "hierarchy on the writer threads and writes the reads, writes and misses per "
+    "level of every symbol to regina.cachesim.csv at exit instead of any trace. "
+    "Shared levels are modeled per thread. Requires -format binary.");
+droption_t<std::string> op_cache_levels(DROPTION_SCOPE_CLIENT, "cache_levels",
+    "32K:8:64:plru,1M:16:64:plru,32M:16:64:lru",
+    "Cache hierarchy of -simulate",
+    "Comma separated list of cache levels, L1 first, each given as "
+    "<size>:<assoc>:<line size>[:lru|plru]. Sizes take K, M and G suffixes. The "
+    "number of sets and the line size must be powers of two; plru, the tree pseudo "
+    "LRU of most hardware, needs a power of two associativity. See cachesim.h.");
+droption_t<bool> op_reuse_distance(DROPTION_SCOPE_CLIENT, "reuse_distance", false,
+    "Record reuse distance histograms instead of traces",
+    "Computes the reuse distance of every memory reference, the number of distinct "
+    "cache lines touched since its line was last touched, on the writer threads "
+    "and writes log2 binned histograms per thread and symbol to regina.reuse.csv "
+    "at exit instead of any trace. Can be combined with -simulate. Requires "
+    "-format binary.");
+droption_t<unsigned int> op_reuse_line_size(DROPTION_SCOPE_CLIENT, "reuse_line_size", 64,
+    "Line size of -reuse_distance",
+    "Granularity in bytes of -reuse_distance, a power of two.");
+droption_t<unsigned int> op_reuse_sample(DROPTION_SCOPE_CLIENT, "reuse_sample", 1,
+    "Track every Nth line for -reuse_distance",
+    "Tracks a hashed sample of one in N cache lines, N a power of two, and scales "
+    "their distances by N. Bounds the memory and time of -reuse_distance on large "
+    "working sets at the cost of accuracy. 1 tracks every line. See reuse.h.");
+droption_t<bool> op_count_only(DROPTION_SCOPE_CLIENT, "count_only", false,
+    "Count reads, writes and bytes per symbol without a trace",
+    "Replaces the trace with inline counter updates: one per execution of a basic "
+    "block whose references all execute once per run, one per reference "
+    "otherwise. No buffer is filled and no call is recorded. At exit the reads, "
+    "writes and bytes of every symbol are written to regina.counts.csv. Not "
+    "available with -simulate, -reuse_distance and -offline_symbols.");
+droption_t<bool> op_cct(DROPTION_SCOPE_CLIENT, "cct", false,
+    "Build a calling context tree with per-context counters",
+    "Follows the calls and returns of every thread on a shadow stack while its "
+    "buffers are converted or analyzed and builds a calling context tree shared by "
+    "all threads. Version 2 .mmtrd files get a column with the 32-bit context id of "
+    "every event. At exit the reads, writes, bytes and estimated distinct 64-byte "
+    "lines of every context are written to regina.cct.csv. Requires -format binary "
+    "and online symbols; not available with -count_only. See cct.h.");
+droption_t<bool> op_heap(DROPTION_SCOPE_CLIENT, "heap", false,
+    "Attribute memory references to heap allocations",
+    "Wraps malloc, calloc, realloc, free and operator new and delete in every module "
+    "and records each allocation with its call site, size and lifetime. Every "
+    "memory reference is looked up in an index of the allocations while its buffer "
+    "is converted or analyzed; version 2 .mmtrd files get a column with the "
+    "allocation id of every reference. At exit every allocation and the reads, "
+    "writes and bytes it saw are written to regina.heap.csv. Requires -format "
+    "binary, online symbols and -timestamps; not available with -count_only. See "
+    "heap.h.");
+droption_t<bool> op_data_objects(DROPTION_SCOPE_CLIENT, "data_objects", false,
+    "Attribute memory references to data objects",
+    "Classifies every memory reference by the data object it hit: a global or static "
+    "variable from the symbol table of a module, read as the module loads, the stack "
+    "frame of a function, found through a shadow stack of every thread, the thread "
+    "local storage of a thread or, with -heap, the heap. Version 2 .mmtrd files get a "
+    "column with the object id of every reference. At exit every object and the "
+    "reads, writes and bytes it saw are written to regina.data.csv. Requires -format "
+    "binary and online symbols; not available with -count_only. See data.h.");
+droption_t<std::string> op_modules(DROPTION_SCOPE_CLIENT, "modules", "",
+    "Only instrument the code of these modules",
+    "Comma separated list of module names, e.g. test_matrix.exe, compared without "
+    "regard to case with the preferred name of every module as it loads. Basic "
+    "blocks starting outside the listed modules, -functions and -address_ranges are "
+    "not instrumented at all. Empty instruments every module. See filter.h.");
+droption_t<std::string> op_functions(DROPTION_SCOPE_CLIENT, "functions", "",
+    "Only instrument these functions",
+    "Comma separated list of function names, each optionally qualified as "
+    "<module>!<function>, resolved through the symbols of every module as it loads. "
+    "Only the code of the functions themselves is instrumented, not their callees. "
+    "Combines with -modules and -address_ranges. See filter.h.");
+droption_t<std::string> op_address_ranges(DROPTION_SCOPE_CLIENT, "address_ranges", "",
+    "Only instrument these code address ranges",
+    "Comma separated list of hexadecimal <start>-<end> ranges of code addresses, end "
+    "exclusive. Combines with -modules and -functions. See filter.h.");
+droption_t<std::string> op_roi(DROPTION_SCOPE_CLIENT, "roi", "",
+    "Only trace while these functions run",
+    "Comma separated list of functions, each optionally qualified as "
+    "<module>!<function>, whose calls make up the region of interest. Memory "
+    "references are only instrumented while at least one thread is inside the "
+    "region, including the callees of the functions and the other threads; outside "
+    "it the code runs without instrumentation. Opening and closing the region "
+    "flushes the code cache. Requires online symbols.");
+droption_t<bool> op_roi_annotations(DROPTION_SCOPE_CLIENT, "roi_annotations", false,
+    "Trace between the annotations of the application",
+    "Opens the region of interest of the calling thread at every regina_roi_start() "
+    "and closes it at the matching regina_roi_stop() of regina_annotations.h, which "
+    "nest. Combines with -roi.");
+
+void options_init(int argc, const char* argv[]) {
+    std::string parse_err;
+
+    if (!droption_parser_t::parse_argv(DROPTION_SCOPE_CLIENT, argc, argv, &parse_err, NULL)) {
+        dr_fprintf(STDERR, "Usage error: %s\nUsage:\n%s", parse_err.c_str(),
+            droption_parser_t::usage_short(DROPTION_SCOPE_CLIENT).c_str());
+        dr_abort();
+    }
+    if (op_buffer_mode.get_value() != "lean" && op_buffer_mode.get_value() != "fault") {
+        dr_fprintf(STDERR, "Usage error: unknown -buffer_mode %s\n", op_buffer_mode.get_value().c_str());
+        dr_abort();
+    }
+    if (op_format.get_value() != "binary" && op_format.get_value() != "text") {
+        dr_fprintf(STDERR, "Usage error: unknown -format %s\n", op_format.get_value().c_str());
+        dr_abort();
+    }
+    if (op_offline_symbols.get_value() && op_early_symbols.get_value()) {
+        dr_fprintf(STDERR, "Usage error: -offline_symbols and -early_symbols are exclusive\n");
+        dr_abort();
+    }
+    if ((op_early_symbols.get_value() || op_offline_symbols.get_value()) && op_format.get_value() != "binary") {
+        dr_fprintf(STDERR, "Usage error: -early_symbols and -offline_symbols require -format binary\n");
+        dr_abort();
+    }
+    if (op_simulate.get_value()) {
+        std::vector<cache_config_t> levels;
+        std::string err;
+        if (!cache_parse_config(op_cache_levels.get_value(), &levels, &err)) {
+            dr_fprintf(STDERR, "Usage error: -cache_levels: %s\n", err.c_str());
+            dr_abort();
+        }
+    }
+    if (op_reuse_distance.get_value() && (!cache_is_pow2(op_reuse_line_size.get_value()) || !cache_is_pow2(op_reuse_sample.get_value()))) {
+        dr_fprintf(STDERR, "Usage error: -reuse_line_size and -reuse_sample must be powers of two\n");
+        dr_abort();
+    }
+    if ((op_simulate.get_value() || op_reuse_distance.get_value()) && (op_format.get_value() != "binary" || op_offline_symbols.get_value())) {
+        dr_fprintf(STDERR, "Usage error: -simulate and -reuse_distance require -format binary and online symbols\n");
+        dr_abort();
+    }
+    if (op_count_only.get_value() && (op_simulate.get_value() || op_reuse_distance.get_value() || op_offline_symbols.get_value())) {
+        dr_fprintf(STDERR, "Usage error: -count_only excludes -simulate, -reuse_distance and -offline_symbols\n");
+        dr_abort();
+    }
+    if (op_cct.get_value() && (op_format.get_value() != "binary" || op_offline_symbols.get_value() || op_count_only.get_value())) {
+        dr_fprintf(STDERR, "Usage error: -cct requires -format binary and online symbols and excludes -count_only\n");
+        dr_abort();
+    }
+    if (op_heap.get_value() && (op_format.get_value() != "binary" || op_offline_symbols.get_value() || !op_timestamps.get_value() || op_count_only.get_value())) {
+        dr_fprintf(STDERR, "Usage error: -heap requires -format binary, online symbols and -timestamps and excludes -count_only\n");
+        dr_abort();
+    }
+    if (op_data_objects.get_value() && (op_format.get_value() != "binary" || op_offline_symbols.get_value() || op_count_only.get_value())) {
+        dr_fprintf(STDERR, "Usage error: -data_objects requires -format binary and online symbols and excludes -count_only\n");
+        dr_abort();
+    }
+    if ((!op_functions.get_value().empty() || !op_roi.get_value().empty()) && op_offline_symbols.get_value()) {
+        dr_fprintf(STDERR, "Usage error: -functions and -roi require online symbols\n");
+        dr_abort();
+    }
+    if (!op_address_ranges.get_value().empty()) {
+        std::vector<filter_range_t> ranges;
+        std::string err;
+        if (!filter_parse_ranges(op_address_ranges.get_value(), &ranges, &err)) {
+            dr_fprintf(STDERR, "Usage error: -address_ranges: %s\n", err.c_str());
+            dr_abort();
+        }
+    }
+    if (op_compress.get_value() && op_format.get_value() != "binary") {
+        dr_fprintf(STDERR, "Usage error: -compress requires -format binary\n");
+        dr_abort();
+    }
+    if (!op_outdir.get_value().empty() && !dr_directory_exists(op_outdir.get_value().c_str()) && !dr_create_dir(op_outdir.get_value().c_str())) {
+        dr_fprintf(STDERR, "Unable to create -outdir %s\n", op_outdir.get_value().c_str());
+        dr_abort();
+    }
+}
+
+bool options_filter_code(void) {
+    return !op_modules.get_value().empty() || !op_functions.get_value().empty() || !op_address_ranges.get_value().empty();
+}
+
+bool options_roi(void) {
+    return !op_roi.get_value().empty() || op_roi_annotations.get_value();
+}
+
+bool options_text_output(void) {
+    return op_format.get_value() == "text";
+}
+
+std::string output_path(std::string const& name) {
+    if (op_outdir.get_value().empty())
+        return name;
+    return op_outdir.get_value() + "/" + name;
+}
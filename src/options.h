@@ -0,0 +1,64 @@
+/* Runtime options of the client.
+ *
+ * Every option is a droption_t in the client scope, so it is passed after
+ * the client library on the drrun command line, e.g.
+ *   drrun -c regina.dll -buffer_size 4M -outdir D:\scratch -- app.exe
+ * options_init parses and validates them once from dr_client_main; every
+ * subsystem reads the values directly afterwards.
+ */
+
+#ifndef REGINA_OPTIONS_H
+#define REGINA_OPTIONS_H
+
+#include "droption.h"
+#include <string>
+
+extern droption_t<std::string> op_buffer_mode;
+extern droption_t<bytesize_t> op_buffer_size;
+extern droption_t<unsigned int> op_num_buffers;
+extern droption_t<unsigned int> op_writer_threads;
+extern droption_t<bool> op_incremental;
+extern droption_t<unsigned int> op_convert_threads;
+extern droption_t<bool> op_trace_bb;
+extern droption_t<bool> op_early_symbols;
+extern droption_t<bool> op_offline_symbols;
+extern droption_t<std::string> op_outdir;
+extern droption_t<std::string> op_format;
+extern droption_t<unsigned int> op_mmtrd_version;
+extern droption_t<bool> op_compress;
+extern droption_t<bool> op_timestamps;
+extern droption_t<bool> op_simulate;
+extern droption_t<std::string> op_cache_levels;
+extern droption_t<bool> op_reuse_distance;
+extern droption_t<unsigned int> op_reuse_line_size;
+extern droption_t<unsigned int> op_reuse_sample;
+extern droption_t<bool> op_count_only;
+extern droption_t<bool> op_cct;
+extern droption_t<bool> op_heap;
+extern droption_t<bool> op_data_objects;
+extern droption_t<std::string> op_modules;
+extern droption_t<std::string> op_functions;
+extern droption_t<std::string> op_address_ranges;
+extern droption_t<std::string> op_roi;
+extern droption_t<bool> op_roi_annotations;
+
+/* Parses the client options and aborts the process on a usage error. */
+void options_init(int argc, const char* argv[]);
+
+/* Returns whether any of -modules, -functions and -address_ranges was
+ * given.
+ */
+bool options_filter_code(void);
+
+/* Returns whether a region of interest is set by -roi or
+ * -roi_annotations.
+ */
+bool options_roi(void);
+
+/* Returns whether -format text was requested. */
+bool options_text_output(void);
+
+/* Returns the path of the output file name inside -outdir. */
+std::string output_path(std::string const& name);
+
+#endif /* REGINA_OPTIONS_H */
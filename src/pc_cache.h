@@ -0,0 +1,114 @@
+/* Open addressing hash map from a raw pc to its symbol index.
+ *
+ * Conversion looks up the symbol of every record, but a trace only
+ * contains a few distinct pcs; the cache lets each of them go through
+ * drsym once. Linear probing over a power of two table keeps a hit to a
+ * multiplication and usually a single cache line.
+ */
+
+#ifndef REGINA_PC_CACHE_H
+#define REGINA_PC_CACHE_H
+
+#include <stdint.h>
+#include <vector>
+
+/* pc 0 marks an empty slot, a real pc 0 is kept aside */
+typedef struct _pc_slot_t {
+    uint64_t pc;
+    uint64_t idx;
+} pc_slot_t;
+
+typedef struct _pc_cache_t {
+    std::vector<pc_slot_t> slots;
+    uint64_t mask;
+    uint64_t count;
+    bool has_zero;
+    uint64_t zero_idx;
+} pc_cache_t;
+
+static inline void
+pc_cache_init(pc_cache_t* cache, uint64_t capacity) {
+    uint64_t size = 16;
+
+    while (size < capacity)
+        size <<= 1;
+    cache->slots.assign(size, pc_slot_t{ 0, 0 });
+    cache->mask = size - 1;
+    cache->count = 0;
+    cache->has_zero = false;
+    cache->zero_idx = 0;
+}
+
+static inline uint64_t
+pc_cache_hash(uint64_t pc) {
+    /* Fibonacci hashing, the high bits mix in every bit of the pc */
+    uint64_t h = pc * 0x9E3779B97F4A7C15ull;
+    return h ^ (h >> 32);
+}
+
+/* Returns whether pc is cached and stores its index in *idx. */
+static inline bool
+pc_cache_find(pc_cache_t const* cache, uint64_t pc, uint64_t* idx) {
+    uint64_t i;
+
+    if (pc == 0) {
+        *idx = cache->zero_idx;
+        return cache->has_zero;
+    }
+    for (i = pc_cache_hash(pc) & cache->mask;; i = (i + 1) & cache->mask) {
+        pc_slot_t const& slot = cache->slots[i];
+        if (slot.pc == pc) {
+            *idx = slot.idx;
+            return true;
+        }
+        if (slot.pc == 0)
+            return false;
+    }
+}
+
+/* Inserts pc, which must not be cached yet. */
+static inline void
+pc_cache_insert(pc_cache_t* cache, uint64_t pc, uint64_t idx) {
+    uint64_t i;
+
+    if (pc == 0) {
+        cache->has_zero = true;
+        cache->zero_idx = idx;
+        return;
+    }
+    /* keep the load factor below 1/2 */
+    if (2 * (cache->count + 1) > cache->slots.size()) {
+        std::vector<pc_slot_t> old;
+        old.swap(cache->slots);
+        cache->slots.assign(2 * old.size(), pc_slot_t{ 0, 0 });
+        cache->mask = cache->slots.size() - 1;
+        cache->count = 0;
+        for (pc_slot_t const& slot : old) {
+            if (slot.pc != 0)
+                pc_cache_insert(cache, slot.pc, slot.idx);
+        }
+    }
+    for (i = pc_cache_hash(pc) & cache->mask; cache->slots[i].pc != 0; i = (i + 1) & cache->mask)
+        ;
+    cache->slots[i].pc = pc;
+    cache->slots[i].idx = idx;
+    cache->count++;
+}
+
+/* Drops every pc in [start, end), e.g. of an unloaded module. */
+static inline void
+pc_cache_remove_range(pc_cache_t* cache, uint64_t start, uint64_t end) {
+    std::vector<pc_slot_t> old;
+
+    if (start == 0 && end > 0)
+        cache->has_zero = false;
+    old.swap(cache->slots);
+    cache->slots.assign(old.size(), pc_slot_t{ 0, 0 });
+    cache->count = 0;
+    for (pc_slot_t const& slot : old) {
+        if (slot.pc != 0 && (slot.pc < start || slot.pc >= end))
+            pc_cache_insert(cache, slot.pc, slot.idx);
+    }
+}
+
+#endif /* REGINA_PC_CACHE_H */
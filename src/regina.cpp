@@ -45,6 +45,13 @@
  * (1) Fills a buffer and dumps the buffer when it is full.
  * (2) Inlines the buffer filling code to avoid a full context switch.
  * (3) Uses a lean procedure call for clean calls to reduce code cache size.
+ * (4) Records calls and returns, including their targets, into the same
+ *     buffer so they never need a clean call of their own.
+ * (5) Optionally (-buffer_mode fault) uses a drx_buf trace buffer instead:
+ *     a guard page after the buffer raises a fault when it is full, so the
+ *     inlined code needs no bounds check at all.
+ * (6) Hands full buffers to a background writer thread and continues with
+ *     the next free buffer of a per-thread pool, see writer.h.
  *
  * This sample illustrates
  * - the use of drutil_expand_rep_string() to expand string loops to obtain
@@ -54,54 +61,57 @@
  * - the use of drutil_opnd_mem_size_in_bytes() to obtain the size of OP_enter
  *   memory references.
  *
- * The OUTPUT_TEXT define controls the format of the trace: text or binary.
- * Creating a text trace file makes the tool an order of magnitude (!) slower
- * than creating a binary file; thus, the default is binary.
+ * The client is configured at runtime, see options.h. -format selects text or
+ * binary traces. Creating a text trace file makes the tool an order of
+ * magnitude (!) slower than creating a binary file; thus, the default is binary.
  */
 
+#include "cachesim.h"
+#include "cct.h"
+#include "codec.h"
+#include "data.h"
 #include "dr_api.h"
 #include "drmgr.h"
 #include "drreg.h"
 #include "drutil.h"
 #include "drsyms.h"
+#include "drwrap.h"
 #include "drx.h"
+#include "filter.h"
+#include "heap.h"
+#include "mmtrd.h"
+#include "modtable.h"
+#include "options.h"
+#include "pc_cache.h"
+#include "reuse.h"
+#include "trace_format.h"
+#include "trace_reader.h"
 #include "utils.h"
+#include "workers.h"
+#include "writer.h"
 #include <stddef.h> /* for offsetof */
 #include <stdio.h>
 #include <string.h> /* for memset */
 
+#include <atomic>
 #include <vector>
 #include <fstream>
 #include <string>
 #include <unordered_map>
 #include <sstream>
 #include <corecrt_io.h>
+#ifdef WINDOWS
+#include <intrin.h> /* for __rdtsc */
+#else
+#include <x86intrin.h>
+#endif
 
 #define MAX_SYM_RESULT 256
 
-/* Each mem_ref_t includes the type of reference (read or write),
- * the address referenced, and the size of the reference.
- */
-typedef struct _mem_ref_t {
-    bool memRef;
-    bool write;
-    bool call;
-    bool ind;
-    uint32_t pad;
-    void* addr;
-    size_t size;
-    app_pc pc;
-    app_pc target;
-} mem_ref_t;
-
-/* Max number of mem_ref a buffer can have */
-#define MAX_NUM_MEM_REFS 8192
-/* The size of memory buffer for holding mem_refs. When it fills up,
- * we dump data from the buffer to the file.
+/* Each buffer entry is a mem_entry_t or a call_entry_t, see trace_format.h
+ * for the layout. Both are 16 bytes.
  */
-#define MEM_BUF_SIZE (sizeof(mem_ref_t) * MAX_NUM_MEM_REFS)
-
-//#define OUTPUT_TEXT 1
+#define TRACE_ENTRY_SIZE sizeof(mem_entry_t)
 
 /* thread private log file and counter */
 typedef struct {
@@ -109,31 +119,218 @@ typedef struct {
     char* buf_base;
     /* buf_end holds the negative value of real address of buffer end. */
     ptr_int_t buf_end;
+    /* buf_limit holds the real address of buffer end. */
+    char* buf_limit;
     void* cache;
     FILE* logf;
+    /* buffers written by the writer thread, NULL if writing synchronously */
+    buffer_pool_t* pool;
+    /* the pool buffer currently filled in lean mode */
+    trace_buffer_t* cur;
+    /* -incremental: state of the direct conversion into logf */
+    struct _convert_ctx_t* conv;
+    /* -simulate, -reuse_distance: the thread's analyses, replace logf */
+    struct _sim_ctx_t* sim;
+    /* -compress: scratch for the encoded raw blocks */
+    uint8_t* enc_buf;
+    /* -heap: nesting of the wrapped allocator calls, the arguments of the
+     * outermost one and the symbols of the call sites
+     */
+    uint heap_depth;
+    uint64 heap_time;
+    uint64 heap_size;
+    app_pc heap_old;
+    app_pc heap_site;
+    struct _sym_cache_t* heap_syms;
+    /* -roi: the stack pointer at the entry of every ROI function the
+     * thread is in, innermost last, the nesting of its annotated regions
+     * and the pc execution was redirected to after opening or closing the
+     * region, whose trigger is skipped once
+     */
+    std::vector<uint64>* roi_calls;
+    uint roi_marks;
+    app_pc roi_redirect;
     uint64 threadID;
     uint64 num_refs;
 } per_thread_t;
 
+/* Static description of a basic block for basic block mode. */
+typedef struct {
+    app_pc tag;
+    std::vector<bb_ref_t> refs;
+    /* -data_objects: whether each reference has TRACE_FLAG_TLS */
+    std::vector<bool> tls;
+} bb_desc_t;
+
+/* A pc in a block calling roi_return, roi_enter or both. */
+typedef struct {
+    app_pc pc;
+    bool entry;
+    bool ret;
+} roi_trigger_t;
+
 /* Cross-instrumentation-phase data. */
 typedef struct {
     app_pc last_pc;
+    /* basic block mode: descriptor being built, NULL when translating */
+    bb_desc_t* bb;
+    /* basic block mode: whether the block is recorded as one entry */
+    bool bb_entry;
+    uint num_bb_refs;
+    /* -count_only: execution counter of the block, NULL if every
+     * reference is counted on its own
+     */
+    uint64* count;
+    bool translating;
+    /* whether the block is left alone, see filter.h */
+    bool skip;
+    /* -roi: the triggers in the block, NULL if there are none */
+    std::vector<roi_trigger_t>* roi_triggers;
 } instru_data_t;
 
 static size_t page_size;
+/* The size of memory buffer for holding entries (-buffer_size). When it
+ * fills up, we dump data from the buffer to the file.
+ */
+static size_t mem_buf_size;
+/* The buffer is allocated with room for one more basic block entry: in
+ * basic block mode the last entry may start just before the end.
+ */
+static size_t mem_buf_alloc;
 static client_id_t client_id;
 static app_pc code_cache;
+/* the drx_buf trace buffer for -buffer_mode fault, NULL otherwise */
+static drx_buf_t* trace_buffer;
 static void* mutex; /* for multithread support */
 static uint64 global_num_refs; /* keep a global memory reference count */
 static int tls_index;
 
 //static std::vector<file_t> delayed_files;
-static std::unordered_map<std::string, size_t> symbol_lookup;
-static size_t symbol_idx = 0;
-static int file_idx = 0;
+/* The symbol dictionary is split into SYM_SHARDS shards with a lock each:
+ * the symbol index of every pc seen by any conversion, spread by the hash
+ * of the pc, and the index of every symbol name, spread by the hash of the
+ * name. Conversions running in parallel only meet on the same shard, and
+ * drsym is called without holding any of them.
+ */
+#define SYM_SHARDS 64
+typedef struct {
+    void* lock;
+    pc_cache_t pcs;
+} pc_shard_t;
+typedef struct {
+    void* lock;
+    std::unordered_map<std::string, size_t> names;
+} name_shard_t;
+static pc_shard_t pc_shards[SYM_SHARDS];
+static name_shard_t name_shards[SYM_SHARDS];
+static std::atomic<size_t> symbol_idx;
+/* Symbolization counters; lookups, hits and misses are guarded by mutex.
+ * sym_early counts the pcs -early_symbols resolved at instrumentation
+ * time, which are no lookups.
+ */
+static uint64 sym_lookups;
+static uint64 sym_hits;
+static uint64 sym_misses;
+static std::atomic<uint64> sym_early;
+static std::atomic<uint64> sym_resolved;
+/* pcs translate_addr found in no module */
+static std::atomic<uint64> sym_no_module;
+static std::atomic<uint64> sym_us;
+/* Incremented on every module unload, see event_module_unload. */
+static std::atomic<uint64> sym_epoch;
+/* -offline_symbols: the module table, guarded by mutex */
+static FILE* module_table;
 static char symName[MAX_SYM_RESULT];
 static char modName[MAX_SYM_RESULT];
-static uint64 thread_idx = 0;
+static std::atomic<uint64> thread_idx;
+/* Counters of the traces converted by process_file, reported at exit. */
+static std::atomic<uint64> convert_traces;
+static std::atomic<uint64> convert_bytes;
+static std::atomic<uint64> convert_us;
+/* Basic block descriptors indexed by block id, guarded by mutex. */
+static std::vector<bb_desc_t*> bb_table;
+/* -simulate: the levels of -cache_levels and the counters of every symbol
+ * over all exited threads, guarded by mutex
+ */
+static std::vector<cache_config_t> cache_levels;
+static std::vector<cache_stats_t> sim_stats;
+/* -reuse_distance: the histograms of every exited thread and symbol,
+ * guarded by mutex
+ */
+typedef struct {
+    uint64 thread;
+    uint64 sym;
+    reuse_hist_t hist;
+} reuse_row_t;
+static std::vector<reuse_row_t> reuse_rows;
+/* -count_only: every instrumented memory reference with the counter of its
+ * executions, and the counts of the references already banked per symbol,
+ * guarded by mutex. The counters are carved out of chunks reachable from
+ * the code cache.
+ */
+typedef struct {
+    app_pc pc;
+    uint size;
+    bool write;
+    uint64* counter;
+} count_ref_t;
+typedef struct {
+    uint64 reads;
+    uint64 writes;
+    uint64 read_bytes;
+    uint64 write_bytes;
+} count_stats_t;
+#define COUNT_CHUNK 4096
+static std::vector<count_ref_t> count_refs;
+static std::vector<count_stats_t> count_stats;
+static std::vector<uint64*> count_chunks;
+static size_t count_left;
+/* target of the counters in code that is only translated */
+static uint64* count_scratch;
+/* -cct: the calling contexts of every thread, guarded by cct_lock, and
+ * the counters of every context over all finished streams, guarded by
+ * mutex
+ */
+static cct_tree_t cct_tree;
+static void* cct_lock;
+static std::vector<cct_stats_t> cct_totals;
+/* -heap: every allocation of the wrapped allocators, written under
+ * heap_lock and read without any lock, and the counters of every
+ * allocation over all finished streams, guarded by mutex
+ */
+typedef enum {
+    HEAP_FN_MALLOC,
+    HEAP_FN_CALLOC,
+    HEAP_FN_REALLOC,
+    HEAP_FN_FREE,
+} heap_fn_t;
+static heap_index_t heap_index;
+static void* heap_lock;
+static std::vector<heap_stats_t> heap_totals;
+static uint64 heap_unattributed;
+/* -data_objects: the variables of the loaded modules, the objects hit so
+ * far and the stack of every thread, written under data_lock, and the
+ * counters of every object over all finished streams, guarded by mutex
+ */
+static data_table_t data_table;
+static data_objects_t data_objects;
+static std::vector<data_stack_t> data_stacks;
+static void* data_lock;
+static std::vector<data_stats_t> data_totals;
+/* Guards code_filter, roi_entries and roi_returns, which are read once
+ * per block built.
+ */
+static void* filter_lock;
+/* -modules, -functions and -address_ranges: the code to instrument */
+static filter_t code_filter;
+/* -roi, -roi_annotations: the ROI functions, the entries of those loaded
+ * and the return addresses of their calls, and the number of threads
+ * inside the region
+ */
+static filter_t roi_filter;
+static pc_cache_t roi_entries;
+static pc_cache_t roi_returns;
+static std::atomic<uint> roi_threads;
 
 static void
 event_exit(void);
@@ -141,6 +338,10 @@ static void
 event_thread_init(void* drcontext);
 static void
 event_thread_exit(void* drcontext);
+static void
+event_module_load(void* drcontext, const module_data_t* info, bool loaded);
+static void
+event_module_unload(void* drcontext, const module_data_t* info);
 static dr_emit_flags_t
 event_bb_app2app(void* drcontext, void* tag, instrlist_t* bb, bool for_trace,
     bool translating);
@@ -155,6 +356,30 @@ static void
 clean_call(void);
 static void
 memtrace(void* drcontext);
+static bool
+roi_inside(per_thread_t* data);
+static void
+roi_annotation_start(void);
+static void
+roi_annotation_stop(void);
+static void
+write_entries(void* stream, char* base, size_t size);
+static void
+flush_buffer(per_thread_t* data, char* base, size_t size);
+static bool
+analyze_online(void);
+static bool
+uses_writer(void);
+static bool
+records_trace(void);
+static bool
+convert_incremental(void);
+static bool
+convert_in_background(void);
+static void
+convert_job(void* arg);
+static void
+trace_buffer_full(void* drcontext, void* buf_base, size_t size);
 static void
 code_cache_init(void);
 static void
@@ -162,11 +387,27 @@ code_cache_exit(void);
 static void
 instrument_mem(void* drcontext, instrlist_t* ilist, instr_t* where, app_pc pc,
     instr_t* memref_instr, int pos, bool write);
+static void
+instrument_call(void* drcontext, instrlist_t* ilist, instr_t* where, app_pc pc,
+    instr_t* cti_instr);
+static void
+instrument_time(void* drcontext, instrlist_t* ilist, instr_t* where);
+static void
+instrument_bb_mem(void* drcontext, instrlist_t* ilist, instr_t* where, app_pc pc,
+    instr_t* memref_instr, int pos, bool write, instru_data_t* data);
+static void
+instrument_bb_commit(void* drcontext, instrlist_t* ilist, instr_t* where,
+    instru_data_t* data);
+static uint64*
+count_alloc(void);
+static void
+instrument_count(void* drcontext, instrlist_t* ilist, instr_t* where, app_pc pc,
+    instr_t* memref_instr, int pos, bool write, instru_data_t* data);
 
 DR_EXPORT void
 dr_client_main(client_id_t id, int argc, const char* argv[]) {
-    /* We need 2 reg slots beyond drreg's eflags slots => 3 slots */
-    drreg_options_t ops = { sizeof(ops), 3, false };
+    /* We need 3 reg slots beyond drreg's eflags slots => 4 slots */
+    drreg_options_t ops = { sizeof(ops), 4, false };
     /* Specify priority relative to other instrumentation operations: */
     drmgr_priority_t priority = { sizeof(priority), /* size of struct */
         "memtrace", /* name of our operation */
@@ -175,24 +416,104 @@ dr_client_main(client_id_t id, int argc, const char* argv[]) {
         0 }; /* numeric priority */
     dr_set_client_name("DynamoRIO Sample Client 'memtrace'",
         "http://dynamorio.org/issues");
+    options_init(argc, argv);
+    mem_buf_size = (size_t)op_buffer_size.get_value() / TRACE_ENTRY_SIZE * TRACE_ENTRY_SIZE;
+    /* room for the entry stepping over the end and a time stamp */
+    mem_buf_alloc = mem_buf_size + TRACE_BB_MAX_SIZE + sizeof(time_entry_t);
     page_size = dr_page_size();
     drmgr_init();
     drutil_init();
     client_id = id;
     mutex = dr_mutex_create();
     dr_register_exit_event(event_exit);
-    if (!drmgr_register_thread_init_event(event_thread_init) || !drmgr_register_thread_exit_event(event_thread_exit) || !drmgr_register_bb_app2app_event(event_bb_app2app, &priority) || !drmgr_register_bb_instrumentation_event(event_bb_analysis, event_bb_insert, &priority) || drreg_init(&ops) != DRREG_SUCCESS || !drx_init()) {
+    if (!drmgr_register_thread_init_event(event_thread_init) || !drmgr_register_thread_exit_event(event_thread_exit) || !drmgr_register_module_unload_event(event_module_unload) || !drmgr_register_bb_app2app_event(event_bb_app2app, &priority) || !drmgr_register_bb_instrumentation_event(event_bb_analysis, event_bb_insert, &priority) || drreg_init(&ops) != DRREG_SUCCESS || !drx_init()) {
         /* something is wrong: can't continue */
         DR_ASSERT(false);
         return;
     }
-    if (drsym_init(0) != DRSYM_SUCCESS) {
+    if (op_offline_symbols.get_value()) {
+        module_table = fopen(output_path(MODTABLE_FILE).c_str(), "w");
+        if (module_table == NULL || !drmgr_register_module_load_event(event_module_load)) {
+            DR_ASSERT(false);
+            return;
+        }
+    } else if (drsym_init(0) != DRSYM_SUCCESS) {
         dr_log(NULL, DR_LOG_ALL, 1, "WARNING: unable to initialize symbol translation\n");
         dr_printf("Failed to init DR Sym\n");
     }
+    for (int i = 0; i < SYM_SHARDS; i++) {
+        pc_shards[i].lock = dr_mutex_create();
+        pc_cache_init(&pc_shards[i].pcs, (1 << 16) / SYM_SHARDS);
+        name_shards[i].lock = dr_mutex_create();
+    }
     tls_index = drmgr_register_tls_field();
     DR_ASSERT(tls_index != -1);
+    if (op_simulate.get_value()) {
+        std::string err;
+        /* validated by options_init */
+        cache_parse_config(op_cache_levels.get_value(), &cache_levels, &err);
+    }
+    if (op_count_only.get_value())
+        count_scratch = count_alloc();
+    if (op_cct.get_value()) {
+        cct_lock = dr_mutex_create();
+        cct_tree_init(&cct_tree);
+    }
+    if (op_heap.get_value()) {
+        heap_lock = dr_mutex_create();
+        heap_index_init(&heap_index);
+        if (!drwrap_init()) {
+            DR_ASSERT(false);
+            return;
+        }
+    }
+    if (op_data_objects.get_value()) {
+        data_lock = dr_mutex_create();
+        data_table_init(&data_table);
+        data_objects_init(&data_objects);
+    }
+    if (options_filter_code() || options_roi())
+        filter_lock = dr_mutex_create();
+    if (options_filter_code())
+        filter_init(&code_filter, op_modules.get_value(), op_functions.get_value(), op_address_ranges.get_value());
+    if (options_roi()) {
+        filter_init(&roi_filter, "", op_roi.get_value(), "");
+        pc_cache_init(&roi_entries, 64);
+        pc_cache_init(&roi_returns, 64);
+        roi_threads.store(0);
+    }
+    if (op_roi_annotations.get_value() && (!dr_annotation_register_call("regina_roi_start", (void*)roi_annotation_start, false, 0, DR_ANNOTATION_CALL_TYPE_FASTCALL) || !dr_annotation_register_call("regina_roi_stop", (void*)roi_annotation_stop, false, 0, DR_ANNOTATION_CALL_TYPE_FASTCALL))) {
+        DR_ASSERT(false);
+        return;
+    }
+    /* the allocators are wrapped, the variables read and the code to
+     * instrument and the ROI functions found as their modules load
+     */
+    if (!op_offline_symbols.get_value() && (op_heap.get_value() || op_data_objects.get_value() || options_filter_code() || !op_roi.get_value().empty()) && !drmgr_register_module_load_event(event_module_load)) {
+        DR_ASSERT(false);
+        return;
+    }
 
+    /* -count_only fills no buffers */
+    if (op_buffer_mode.get_value() == "fault" && !op_count_only.get_value()) {
+        /* A block entry may straddle the guard page, which the fault
+         * handler cannot split correctly.
+         */
+        if (op_trace_bb.get_value()) {
+            dr_fprintf(STDERR, "-buffer_mode fault is not supported with -trace_bb, using lean\n");
+        } else {
+            trace_buffer = drx_buf_create_trace_buffer(mem_buf_size, trace_buffer_full);
+            DR_ASSERT(trace_buffer != NULL);
+        }
+    }
+    if (uses_writer() && !writer_init(mem_buf_alloc, write_entries, op_writer_threads.get_value())) {
+        DR_ASSERT(false);
+        return;
+    }
+    if (convert_in_background() && !workers_init(op_convert_threads.get_value(), convert_job)) {
+        DR_ASSERT(false);
+        return;
+    }
     code_cache_init();
     /* make it easy to tell, by looking at log file, which client executed */
     dr_log(NULL, DR_LOG_ALL, 1, "Client 'memtrace' initializing\n");
@@ -279,8 +600,13 @@ simple_address(app_pc addr, char* modname, char* symname) {
     dr_free_module_data(data);
 }
 
+/* Returns the name modules are known by in symbols and tables. */
+static const char* module_name(const module_data_t* info) {
+    const char* name = dr_module_preferred_name(info);
+    return name == NULL ? "<noname>" : name;
+}
+
 static void translate_addr(app_pc addr, std::string& sym_string) {
-    //dr_printf("test\n");
     std::ostringstream stringStream;
     stringStream << std::hex;
     drsym_error_t symres;
@@ -292,24 +618,19 @@ static void translate_addr(app_pc addr, std::string& sym_string) {
     if (data == NULL) {
         stringStream << "###";
         sym_string = stringStream.str();
-        dr_printf("failed to lookup module\n");
+        /* runs on the writer and converter threads, reported at exit */
+        sym_no_module.fetch_add(1, std::memory_order_relaxed);
         return;
     }
-    //dr_printf("test2\n");
     sym.struct_size = sizeof(sym);
     sym.name = name;
     sym.name_size = MAX_SYM_RESULT;
     sym.file = file;
     sym.file_size = MAXIMUM_PATH;
-    //dr_printf("test2 %s\n", data->full_path);
     symres = drsym_lookup_address(data->full_path, addr - data->start, &sym,
         DRSYM_DEMANGLE_PDB_TEMPLATES);
-    //dr_printf("test3\n");
     if (symres == DRSYM_SUCCESS || symres == DRSYM_ERROR_LINE_NOT_AVAILABLE) {
-        const char* modname = dr_module_preferred_name(data);
-        if (modname == NULL)
-            modname = "<noname>";
-        stringStream << modname << "#" << sym.name; // << "+" << addr - data->start - sym.start_offs;
+        stringStream << module_name(data) << "#" << sym.name; // << "+" << addr - data->start - sym.start_offs;
         /*if (symres == DRSYM_ERROR_LINE_NOT_AVAILABLE) {
             stringStream << "##";
         } else {
@@ -321,374 +642,2182 @@ static void translate_addr(app_pc addr, std::string& sym_string) {
     dr_free_module_data(data);
 }
 
-struct mem_dump {
-    unsigned char write;
-    uint64 data;
-    unsigned char size;
-    uint64 symIdx;
-};
+/* Private pc cache of a stream in front of the shared pc shards, so a hit
+ * needs no lock, with counters merged into the globals by sym_cache_exit.
+ */
+typedef struct _sym_cache_t {
+    pc_cache_t cache;
+    /* sym_epoch the cache was filled in */
+    uint64 epoch;
+    uint64 lookups;
+    uint64 hits;
+    /* lookups that went through drsym */
+    uint64 misses;
+} sym_cache_t;
+
+/* Per-stream state of -cct: the shadow stack of the thread, a private copy
+ * of the children of cct_tree seen so far and the counters of the contexts
+ * the stream entered, handed to cct_totals by cct_exit. Context ids are
+ * shared by all threads, so the counters are packed in the order the
+ * stream reached them rather than indexed by id.
+ */
+typedef struct _cct_ctx_t {
+    std::vector<cct_frame_t> stack;
+    pc_cache_t children;
+    /* context id to its index in stats and nodes */
+    pc_cache_t slots;
+    std::vector<cct_stats_t> stats;
+    std::vector<uint32_t> nodes;
+    /* the context counted last, only changes on calls and returns */
+    uint32_t last_node;
+    uint32_t last_slot;
+} cct_ctx_t;
+
+/* Per-stream state of -heap: the allocation hit last, which is checked
+ * before the index, and the counters of every allocation, handed to
+ * heap_totals by heap_exit.
+ */
+typedef struct _heap_ctx_t {
+    heap_alloc_t const* last;
+    uint32_t last_id;
+    std::vector<heap_stats_t> stats;
+    uint64 unattributed;
+} heap_ctx_t;
+
+/* Per-stream state of -data_objects, see data.h: the stack of the thread
+ * and its frames, the range of its thread local storage, the variable hit
+ * last, a private copy of the object ids seen so far and the counters of
+ * every object, handed to data_totals by data_exit.
+ */
+typedef struct _data_ctx_t {
+    uint64 thread;
+    data_stack_t stack;
+    /* node holds the symbol of the callee */
+    std::vector<cct_frame_t> frames;
+    /* indices of the frames whose return address is known, see
+     * data_find_frame
+     */
+    std::vector<uint32_t> known;
+    /* the next write stores the return address of the top frame */
+    bool slot_pending;
+    /* the last reference of the last block entry if it was a write */
+    uint64 block_write;
+    uint64 tls_start;
+    uint64 tls_end;
+    std::vector<data_range_t> const* ranges;
+    data_range_t const* last;
+    pc_cache_t ids;
+    uint64 last_key;
+    uint32_t last_id;
+    std::vector<data_stats_t> stats;
+} data_ctx_t;
+
+/* Per-stream conversion state: the .mmtrd output, its symbol cache and the
+ * block descriptors seen so far.
+ */
+typedef struct _convert_ctx_t {
+    mmtrd_writer_t out;
+    sym_cache_t syms;
+    std::vector<bb_desc_t const*> bb_cache;
+    cct_ctx_t cct;
+    heap_ctx_t heap;
+    data_ctx_t data;
+} convert_ctx_t;
+
+/* Per-thread state of -simulate and -reuse_distance: the thread's cache
+ * hierarchy and reuse distance tracker and their counters indexed by
+ * symbol, handed to the globals by sim_exit.
+ */
+typedef struct _sim_ctx_t {
+    uint64 thread;
+    cache_sim_t sim;
+    reuse_t reuse;
+    sym_cache_t syms;
+    std::vector<bb_desc_t const*> bb_cache;
+    std::vector<cache_stats_t> stats;
+    std::vector<reuse_hist_t> hists;
+    cct_ctx_t cct;
+    heap_ctx_t heap;
+    data_ctx_t data;
+    /* the last time stamp of the thread */
+    uint64 time;
+} sim_ctx_t;
+
+/* Returns the symbol index of name, adding it if needed. */
+static uint64 intern_symbol(std::string const& name) {
+    name_shard_t* names = &name_shards[std::hash<std::string>()(name) % SYM_SHARDS];
+    uint64 idx;
+
+    dr_mutex_lock(names->lock);
+    auto it = names->names.find(name);
+    if (it == names->names.end())
+        it = names->names.insert(std::make_pair(name, symbol_idx.fetch_add(1))).first;
+    idx = it->second;
+    dr_mutex_unlock(names->lock);
+    return idx;
+}
 
-struct call_dump {
-    unsigned char subType;
-    uint64 instr;
-    uint64 target;
-    uint64 instrSymIdx;
-    uint64 targetSymIdx;
-};
+/* Returns the symbol index of pc, resolving it through drsym the first
+ * time any thread asks for it. *resolved, if given, tells whether this call
+ * did.
+ */
+static uint64 resolve_symbol(app_pc pc, bool* resolved) {
+    pc_shard_t* shard = &pc_shards[(pc_cache_hash((uint64)pc) >> 48) % SYM_SHARDS];
+    uint64 idx;
+    bool found;
+
+    dr_mutex_lock(shard->lock);
+    found = pc_cache_find(&shard->pcs, (uint64)pc, &idx);
+    dr_mutex_unlock(shard->lock);
+    if (resolved != NULL)
+        *resolved = !found;
+    if (found)
+        return idx;
+
+    /* Two threads may resolve the same pc at once, both get the index of
+     * the same name.
+     */
+    uint64 const start = dr_get_microseconds();
+    std::string str;
+    translate_addr(pc, str);
+    idx = intern_symbol(str);
+
+    dr_mutex_lock(shard->lock);
+    if (!pc_cache_find(&shard->pcs, (uint64)pc, &idx))
+        pc_cache_insert(&shard->pcs, (uint64)pc, idx);
+    dr_mutex_unlock(shard->lock);
+    sym_resolved.fetch_add(1, std::memory_order_relaxed);
+    sym_us.fetch_add(dr_get_microseconds() - start, std::memory_order_relaxed);
+    return idx;
+}
 
-static void process_file(FILE* f, int file_idx) {
-    fseek(f, 0, SEEK_END);
-    auto const fsz = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    auto const num_refs = fsz / sizeof(mem_ref_t);
-    dr_printf("Num Refs %d by %d size and %d type\n", num_refs, fsz, sizeof(mem_ref_t));
-    std::vector<mem_ref_t> ref_buffer(num_refs);
-    //dr_read_file(f, ref_buffer.data(), num_refs * sizeof(mem_ref_t));
-    fread(ref_buffer.data(), sizeof(mem_ref_t), num_refs, f);
-
-    auto ofile = std::ofstream(std ::string("regina.") + std::to_string(file_idx) + std::string(".mmtrd"), std::ios::binary);
-    for (auto const& el : ref_buffer) {
-        //dr_printf("Addr: %p\n", el.pc);
-        //print_address(STDOUT, el.pc, "MEM @\t");
-        if (el.memRef) {
-            mem_dump md = {};
-            unsigned char type = 0;
-            ofile.write(reinterpret_cast<const char*>(&type), sizeof(type));
-            md.write = el.write ? 1 : 2;
-            md.data = (size_t)el.addr;
-            md.size = el.size;
-            std::string str;
-            translate_addr(el.pc, str);
-            auto it = symbol_lookup.find(str);
-            if (it != symbol_lookup.end()) {
-                md.symIdx = it->second;
-            } else {
-                md.symIdx = symbol_idx;
-                symbol_lookup.insert(std::make_pair(str, symbol_idx++));
-            }
-            //md.symIdx = 0;
-            //ofile.write(reinterpret_cast<const char*>(&md), sizeof(md));
-            ofile.write(reinterpret_cast<const char*>(&md.write), sizeof(md.write));
-            ofile.write(reinterpret_cast<const char*>(&md.data), sizeof(md.data));
-            ofile.write(reinterpret_cast<const char*>(&md.size), sizeof(md.size));
-            ofile.write(reinterpret_cast<const char*>(&md.symIdx), sizeof(md.symIdx));
-        } else {
-            call_dump cd = {};
-            unsigned char type = 1;
-            ofile.write(reinterpret_cast<const char*>(&type), sizeof(type));
-            if (el.call && el.ind) {
-                cd.subType = 1;
-            } else if (el.call) {
-                cd.subType = 0;
-            } else {
-                cd.subType = 2;
-            }
-            cd.instr = (size_t)el.pc;
-            std::string str;
-            translate_addr(el.pc, str);
-            auto it = symbol_lookup.find(str);
-            if (it != symbol_lookup.end()) {
-                cd.instrSymIdx = it->second;
-            } else {
-                cd.instrSymIdx = symbol_idx;
-                symbol_lookup.insert(std::make_pair(str, symbol_idx++));
-            }
-            cd.target = (size_t)el.target;
-            translate_addr(el.target, str);
-            it = symbol_lookup.find(str);
-            if (it != symbol_lookup.end()) {
-                cd.targetSymIdx = it->second;
-            } else {
-                cd.targetSymIdx = symbol_idx;
-                symbol_lookup.insert(std::make_pair(str, symbol_idx++));
-            }
-            /*cd.instrSymIdx = 0;
-            cd.targetSymIdx = 0;*/
-            //ofile.write(reinterpret_cast<const char*>(&cd), sizeof(cd));
-            ofile.write(reinterpret_cast<const char*>(&cd.subType), sizeof(cd.subType));
-            ofile.write(reinterpret_cast<const char*>(&cd.instr), sizeof(cd.instr));
-            ofile.write(reinterpret_cast<const char*>(&cd.target), sizeof(cd.target));
-            ofile.write(reinterpret_cast<const char*>(&cd.instrSymIdx), sizeof(cd.instrSymIdx));
-            ofile.write(reinterpret_cast<const char*>(&cd.targetSymIdx), sizeof(cd.targetSymIdx));
-        }
+static void sym_cache_init(sym_cache_t* syms) {
+    pc_cache_init(&syms->cache, 4096);
+    syms->epoch = sym_epoch.load(std::memory_order_acquire);
+    syms->lookups = 0;
+    syms->hits = 0;
+    syms->misses = 0;
+}
+
+/* sym_cache_check drops the cache if a module was unloaded since it was
+ * filled, its pcs may belong to another one by now
+ */
+static void sym_cache_check(sym_cache_t* syms) {
+    if (syms->epoch != sym_epoch.load(std::memory_order_acquire)) {
+        pc_cache_init(&syms->cache, 4096);
+        syms->epoch = sym_epoch.load(std::memory_order_acquire);
     }
-    ofile.close();
 }
 
-static void
-event_exit() {
-#ifdef SHOW_RESULTS
-    char msg[512];
-    int len;
-    len = dr_snprintf(msg, sizeof(msg) / sizeof(msg[0]),
-        "Instrumentation results:\n"
-        "  saw %llu memory references\n",
-        global_num_refs);
-    DR_ASSERT(len > 0);
-    NULL_TERMINATE_BUFFER(msg);
-    DISPLAY_STRING(msg);
-#endif /* SHOW_RESULTS */
-    /*int file_idx = 0;
-    for (auto& f : delayed_files) {
-        process_file(f, file_idx);
-        log_file_close(f);
-        ++file_idx;
-    }*/
+static void sym_cache_exit(sym_cache_t* syms) {
+    dr_mutex_lock(mutex);
+    sym_lookups += syms->lookups;
+    sym_hits += syms->hits;
+    sym_misses += syms->misses;
+    dr_mutex_unlock(mutex);
+}
 
-    FILE* lookupIO = std::fopen("regina.0.mmtrd.txt", "w");
-    for (auto& e : symbol_lookup) {
-        std::string tmp = std::to_string(e.second) + "|" + e.first + "\n";
-        std::fwrite(tmp.c_str(), strlen(tmp.c_str()), 1, lookupIO);
+static uint64 lookup_symbol(sym_cache_t* syms, app_pc pc) {
+    uint64 idx;
+    bool resolved;
+    syms->lookups++;
+    if (pc_cache_find(&syms->cache, (uint64)pc, &idx)) {
+        syms->hits++;
+        return idx;
     }
-    std::fclose(lookupIO);
+    idx = resolve_symbol(pc, &resolved);
+    if (resolved)
+        syms->misses++;
+    pc_cache_insert(&syms->cache, (uint64)pc, idx);
+    return idx;
+}
 
-    code_cache_exit();
+/* Returns the descriptor of block id. Descriptors are never freed before
+ * exit, so the caller may keep the pointer in a local cache.
+ */
+static bb_desc_t* lookup_bb(uint64 id) {
+    bb_desc_t* desc = NULL;
+    dr_mutex_lock(mutex);
+    if (id < bb_table.size())
+        desc = bb_table[id];
+    dr_mutex_unlock(mutex);
+    return desc;
+}
 
-    if (!drmgr_unregister_tls_field(tls_index) || !drmgr_unregister_thread_init_event(event_thread_init) || !drmgr_unregister_thread_exit_event(event_thread_exit) || !drmgr_unregister_bb_insertion_event(event_bb_insert) || drreg_exit() != DRREG_SUCCESS)
-        DR_ASSERT(false);
+/* lookup_bb_cached returns the descriptor of block id through the
+ * stream's own cache
+ */
+static bb_desc_t const* lookup_bb_cached(std::vector<bb_desc_t const*>* bb_cache, uint64 id) {
+    if (id >= bb_cache->size())
+        bb_cache->resize(id + 1, NULL);
+    if ((*bb_cache)[id] == NULL)
+        (*bb_cache)[id] = lookup_bb(id);
+    return (*bb_cache)[id];
+}
 
-    if (drsym_exit() != DRSYM_SUCCESS) {
-        dr_log(NULL, DR_LOG_ALL, 1, "WARNING: error cleaning up symbol library\n");
-        dr_printf("Failed to cleanup symbol library\n");
-    }
+static void cct_init(cct_ctx_t* ctx) {
+    ctx->stack.clear();
+    pc_cache_init(&ctx->children, 1024);
+    pc_cache_init(&ctx->slots, 1024);
+    ctx->stats.clear();
+    ctx->nodes.clear();
+    ctx->last_node = UINT32_MAX;
+    ctx->last_slot = 0;
+}
 
-    dr_mutex_destroy(mutex);
-    drutil_exit();
-    drmgr_exit();
-    drx_exit();
+/* Returns the context the stream is in. */
+static inline uint32_t cct_context(cct_ctx_t const* ctx) {
+    return ctx->stack.empty() ? CCT_ROOT : ctx->stack.back().node;
 }
 
-#ifdef WINDOWS
-#define IF_WINDOWS(x) x
-#else
-#define IF_WINDOWS(x) /* nothing */
-#endif
+/* cct_call enters the callee sym from the call at call_pc */
+static void cct_call(cct_ctx_t* ctx, uint64 call_pc, uint64 sym) {
+    uint32_t const parent = cct_context(ctx);
+    uint64_t const key = cct_child_key(parent, (uint32_t)sym);
+    uint64 child;
+
+    if (!pc_cache_find(&ctx->children, key, &child)) {
+        dr_mutex_lock(cct_lock);
+        child = cct_tree_child(&cct_tree, parent, (uint32_t)sym);
+        dr_mutex_unlock(cct_lock);
+        pc_cache_insert(&ctx->children, key, child);
+    }
+    ctx->stack.push_back(cct_frame_t{ (uint32_t)child, call_pc, 0 });
+}
 
-static void
-event_thread_init(void* drcontext) {
-    per_thread_t* data;
+/* cct_return leaves every context up to the caller target returns to */
+static void cct_return(cct_ctx_t* ctx, uint64 target) {
+    size_t const frame = cct_find_frame(ctx->stack, target);
+    if (frame < ctx->stack.size())
+        ctx->stack.resize(frame);
+}
 
-    /* allocate thread private data */
-    data = (per_thread_t*)dr_thread_alloc(drcontext, sizeof(per_thread_t));
-    drmgr_set_tls_field(drcontext, tls_index, data);
-    data->buf_base = (char*)dr_thread_alloc(drcontext, MEM_BUF_SIZE);
-    data->buf_ptr = data->buf_base;
-    /* set buf_end to be negative of address of buffer end for the lea later */
-    data->buf_end = -(ptr_int_t)(data->buf_base + MEM_BUF_SIZE);
-    data->num_refs = 0;
+static inline void cct_access(cct_ctx_t* ctx, bool write, uint64 addr, uint32_t size) {
+    uint32_t const node = cct_context(ctx);
 
-    /* We're going to dump our data to a per-thread file.
-     * On Windows we need an absolute path so we place it in
-     * the same directory as our library. We could also pass
-     * in a path as a client argument.
-     */
-//    data->log = log_file_open(client_id, drcontext, NULL /* using client lib path */, "memtrace",
-//#ifndef WINDOWS
-//        DR_FILE_CLOSE_ON_FORK |
-//#endif
-//            DR_FILE_ALLOW_LARGE);
-//    data->logf = log_stream_from_file(data->log);
-    data->threadID = thread_idx++;
-#if OUTPUT_TEXT
-    data->logf = fopen((std::string("regina.tmp.") + std::to_string(data->threadID) + std::string(".mmd")).c_str(), "w");
-    fprintf(data->logf,
-        "Format: <instr address>,<(r)ead/(w)rite>,<data size>,<data address>\n");
-#else
-    data->logf = fopen((std::string("regina.tmp.") + std::to_string(data->threadID) + std::string(".mmd")).c_str(), "wb");
-#endif
+    if (node != ctx->last_node) {
+        uint64 slot;
+        if (!pc_cache_find(&ctx->slots, node, &slot)) {
+            slot = ctx->stats.size();
+            ctx->stats.push_back(cct_stats_t{});
+            ctx->nodes.push_back(node);
+            pc_cache_insert(&ctx->slots, node, slot);
+        }
+        ctx->last_node = node;
+        ctx->last_slot = (uint32_t)slot;
+    }
+    cct_stats_add(&ctx->stats[ctx->last_slot], write, addr, size);
 }
 
-static void
-event_thread_exit(void* drcontext) {
-    per_thread_t* data;
-
-    memtrace(drcontext);
-    data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_index);
+static void cct_exit(cct_ctx_t* ctx) {
     dr_mutex_lock(mutex);
-    global_num_refs += data->num_refs;
+    for (size_t i = 0; i < ctx->stats.size(); ++i) {
+        uint32_t const node = ctx->nodes[i];
+        if (node >= cct_totals.size())
+            cct_totals.resize(node + 1, cct_stats_t{});
+        cct_stats_merge(&cct_totals[node], ctx->stats[i]);
+    }
     dr_mutex_unlock(mutex);
-#ifdef OUTPUT_TEXT
-    log_stream_close(data->logf); /* closes fd too */
-#else
-    fclose(data->logf);
-    data->logf = fopen((std::string("regina.tmp.") + std::to_string(data->threadID) + std::string(".mmd")).c_str(), "rb");
-    process_file(data->logf, file_idx++);
-    fclose(data->logf);
-    //log_file_close(data->log);
-    //delayed_files.push_back(data->log);
-#endif
-    dr_thread_free(drcontext, data->buf_base, MEM_BUF_SIZE);
-    dr_thread_free(drcontext, data, sizeof(per_thread_t));
+    std::vector<cct_stats_t>().swap(ctx->stats);
+    std::vector<uint32_t>().swap(ctx->nodes);
+    pc_cache_init(&ctx->slots, 0);
 }
 
-/* we transform string loops into regular loops so we can more easily
- * monitor every memory reference they make
+static void heap_init(heap_ctx_t* ctx) {
+    ctx->last = NULL;
+    ctx->last_id = HEAP_NONE;
+    ctx->stats.clear();
+    ctx->unattributed = 0;
+}
+
+/* heap_access returns the allocation a reference after time hit and
+ * counts it
  */
-static dr_emit_flags_t
-event_bb_app2app(void* drcontext, void* tag, instrlist_t* bb, bool for_trace,
-    bool translating) {
-    if (!drutil_expand_rep_string(drcontext, bb)) {
-        DR_ASSERT(false);
-        /* in release build, carry on: we'll just miss per-iter refs */
-    }
-    if (!drx_expand_scatter_gather(drcontext, bb, NULL)) {
-        DR_ASSERT(false);
+static inline uint32_t heap_access(heap_ctx_t* ctx, bool write, uint64 addr, uint32_t size, uint64 time) {
+    heap_alloc_t const* a = ctx->last;
+
+    if (a == NULL || addr < a->start || addr >= a->end || time < a->alloc_time
+        || time >= a->free_time.load(std::memory_order_acquire)) {
+        uint32_t const id = heap_index_lookup(&heap_index, addr, time);
+        if (id == HEAP_NONE) {
+            ctx->unattributed++;
+            return HEAP_NONE;
+        }
+        ctx->last = heap_index_get(&heap_index, id);
+        ctx->last_id = id;
     }
-    return DR_EMIT_DEFAULT;
+    if (ctx->last_id >= ctx->stats.size())
+        ctx->stats.resize(ctx->last_id + 1, heap_stats_t{});
+    heap_stats_t* s = &ctx->stats[ctx->last_id];
+    if (write)
+        s->writes++;
+    else
+        s->reads++;
+    s->bytes += size;
+    return ctx->last_id;
 }
 
-static dr_emit_flags_t
-event_bb_analysis(void* drcontext, void* tag, instrlist_t* bb, bool for_trace,
-    bool translating, void** user_data) {
-    instru_data_t* data = (instru_data_t*)dr_thread_alloc(drcontext, sizeof(*data));
-    data->last_pc = NULL;
-    *user_data = (void*)data;
-    return DR_EMIT_DEFAULT;
+static void heap_exit(heap_ctx_t* ctx) {
+    dr_mutex_lock(mutex);
+    if (heap_totals.size() < ctx->stats.size())
+        heap_totals.resize(ctx->stats.size(), heap_stats_t{});
+    for (size_t i = 0; i < ctx->stats.size(); ++i) {
+        heap_totals[i].reads += ctx->stats[i].reads;
+        heap_totals[i].writes += ctx->stats[i].writes;
+        heap_totals[i].bytes += ctx->stats[i].bytes;
+    }
+    heap_unattributed += ctx->unattributed;
+    dr_mutex_unlock(mutex);
+    std::vector<heap_stats_t>().swap(ctx->stats);
 }
 
-static void at_call(app_pc instr_addr, app_pc target_addr) {
-    void* drcontext = dr_get_current_drcontext();
-    per_thread_t* data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_index);
+static void data_init(data_ctx_t* ctx, uint64 thread) {
+    ctx->thread = thread;
+    ctx->stack = data_stack_t{ 0, 0 };
+    dr_mutex_lock(data_lock);
+    if (thread < data_stacks.size())
+        ctx->stack = data_stacks[thread];
+    dr_mutex_unlock(data_lock);
+    ctx->frames.clear();
+    ctx->known.clear();
+    ctx->slot_pending = false;
+    ctx->block_write = 0;
+    ctx->tls_start = UINT64_MAX;
+    ctx->tls_end = 0;
+    ctx->ranges = NULL;
+    ctx->last = NULL;
+    pc_cache_init(&ctx->ids, 1024);
+    /* the key of no object */
+    ctx->last_key = 0;
+    ctx->last_id = DATA_NONE;
+    ctx->stats.clear();
+}
 
-#ifdef OUTPUT_TEXT
-    fprintf(data->logf, PIFX ",%c,%d," PIFX "\n", (ptr_uint_t)instr_addr,
-        'c', 0, (ptr_uint_t)target_addr);
-#else
-    mem_ref_t mem_ref = {};
-    mem_ref.memRef = false;
-    mem_ref.call = true;
-    mem_ref.ind = false;
-    mem_ref.pc = instr_addr;
-    mem_ref.target = target_addr;
-    //dr_write_file(data->log, &mem_ref, sizeof(mem_ref));
-    fwrite(&mem_ref, sizeof(mem_ref), 1, data->logf);
-#endif
+/* data_object returns the id of the object of kind with key, adding it if
+ * needed
+ */
+static uint32_t data_object(data_ctx_t* ctx, data_kind_t kind, uint64 key) {
+    uint64_t const k = data_object_key(kind, key);
+    uint64 id;
+
+    if (k == ctx->last_key)
+        return ctx->last_id;
+    if (!pc_cache_find(&ctx->ids, k, &id)) {
+        dr_mutex_lock(data_lock);
+        if (!pc_cache_find(&data_objects.ids, k, &id)) {
+            uint64 sym = CCT_NO_SYM;
+            if (kind == DATA_KIND_STACK)
+                sym = key;
+            else if (kind == DATA_KIND_GLOBAL)
+                sym = intern_symbol(data_table.vars[key].name);
+            id = data_objects.objects.size() < UINT32_MAX ? data_objects.objects.size() : DATA_NONE;
+            if (id != DATA_NONE) {
+                data_objects.objects.push_back(data_object_t{ kind, key, sym });
+                pc_cache_insert(&data_objects.ids, k, id);
+            }
+        }
+        dr_mutex_unlock(data_lock);
+        pc_cache_insert(&ctx->ids, k, id);
+    }
+    ctx->last_key = k;
+    ctx->last_id = (uint32_t)id;
+    return (uint32_t)id;
 }
 
-static void
-at_call_ind(app_pc instr_addr, app_pc target_addr) {
-    void* drcontext = dr_get_current_drcontext();
-    per_thread_t* data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_index);
+/* data_is_slot returns whether addr can hold the return address of the top
+ * frame: it lies on the stack below the one of the innermost caller whose
+ * return address is known
+ */
+static inline bool data_is_slot(data_ctx_t const* ctx, uint64 addr) {
+    return addr >= ctx->stack.bottom && addr < ctx->stack.top
+        && (ctx->known.empty() || addr < ctx->frames[ctx->known.back()].slot);
+}
 
-#ifdef OUTPUT_TEXT
-    fprintf(data->logf, PIFX ",%c,%d," PIFX "\n", (ptr_uint_t)instr_addr,
-        'i', 0, (ptr_uint_t)target_addr);
-#else
-    mem_ref_t mem_ref = {};
-    mem_ref.memRef = false;
-    mem_ref.call = true;
-    mem_ref.ind = true;
-    mem_ref.pc = instr_addr;
-    mem_ref.target = target_addr;
-    //dr_write_file(data->log, &mem_ref, sizeof(mem_ref));
-    fwrite(&mem_ref, sizeof(mem_ref), 1, data->logf);
-#endif
+/* data_set_slot records addr as the return address of the top frame */
+static inline void data_set_slot(data_ctx_t* ctx, uint64 addr) {
+    ctx->frames.back().slot = addr;
+    ctx->known.push_back((uint32_t)(ctx->frames.size() - 1));
 }
 
-static void
-at_return(app_pc instr_addr, app_pc target_addr) {
-    void* drcontext = dr_get_current_drcontext();
-    per_thread_t* data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_index);
+/* data_call enters the callee sym from the call at call_pc */
+static void data_call(data_ctx_t* ctx, uint64 call_pc, uint64 sym) {
+    ctx->frames.push_back(cct_frame_t{ (uint32_t)sym, call_pc, 0 });
+    /* in basic block mode the return address was stored by the block */
+    if (ctx->block_write != 0 && data_is_slot(ctx, ctx->block_write))
+        data_set_slot(ctx, ctx->block_write);
+    else
+        ctx->slot_pending = true;
+    ctx->block_write = 0;
+}
 
-#ifdef OUTPUT_TEXT
-    fprintf(data->logf, PIFX ",%c,%d," PIFX "\n", (ptr_uint_t)instr_addr,
-        'e', 0, (ptr_uint_t)target_addr);
-#else
-    mem_ref_t mem_ref = {};
-    mem_ref.memRef = false;
-    mem_ref.call = false;
-    mem_ref.ind = false;
-    mem_ref.pc = instr_addr;
-    mem_ref.target = target_addr;
-    //dr_write_file(data->log, &mem_ref, sizeof(mem_ref));
-    fwrite(&mem_ref, sizeof(mem_ref), 1, data->logf);
-#endif
+/* data_return leaves every frame up to the caller target returns to */
+static void data_return(data_ctx_t* ctx, uint64 target) {
+    size_t const frame = cct_find_frame(ctx->frames, target);
+    if (frame < ctx->frames.size()) {
+        ctx->frames.resize(frame);
+        while (!ctx->known.empty() && ctx->known.back() >= frame)
+            ctx->known.pop_back();
+    }
+    ctx->slot_pending = false;
+    ctx->block_write = 0;
 }
 
-/* event_bb_insert calls instrument_mem to instrument every
- * application memory reference.
+/* data_block remembers the last of the n references of a block entry if
+ * it is a write, it may store the return address of a call ending the
+ * block
  */
-static dr_emit_flags_t
-event_bb_insert(void* drcontext, void* tag, instrlist_t* bb, instr_t* where,
-    bool for_trace, bool translating, void* user_data) {
-    int i;
-    instru_data_t* data = (instru_data_t*)user_data;
-    /* Use the drmgr_orig_app_instr_* interface to properly handle our own use
-     * of drutil_expand_rep_string() and drx_expand_scatter_gather() (as well
-     * as another client/library emulating the instruction stream).
-     */
-    instr_t* instr_fetch = drmgr_orig_app_instr_for_fetch(drcontext);
-    if (instr_fetch != NULL)
-        data->last_pc = instr_get_app_pc(instr_fetch);
-    app_pc last_pc = data->last_pc;
-    if (drmgr_is_last_instr(drcontext, where))
-        dr_thread_free(drcontext, data, sizeof(*data));
+static inline void data_block(data_ctx_t* ctx, bb_desc_t const* desc, uint64 const* addr, uint n) {
+    if (desc != NULL && n > desc->refs.size())
+        n = (uint)desc->refs.size();
+    ctx->block_write = desc != NULL && n > 0 && desc->refs[n - 1].write ? addr[n - 1] : 0;
+}
 
-    instr_t* instr_operands = drmgr_orig_app_instr_for_operands(drcontext);
-    if (instr_operands == NULL || (!instr_writes_memory(instr_operands) && !instr_reads_memory(instr_operands)))
-        return DR_EMIT_DEFAULT;
-    DR_ASSERT(instr_is_app(instr_operands));
-    DR_ASSERT(last_pc != NULL);
-
-    if (instr_is_call_direct(instr_operands)) {
-        dr_insert_call_instrumentation(drcontext, bb, where, (app_pc)at_call);
-    } else if (instr_is_call_indirect(instr_operands)) {
-        dr_insert_mbr_instrumentation(drcontext, bb, where, (app_pc)at_call_ind,
-            SPILL_SLOT_1);
-    } else if (instr_is_return(instr_operands)) {
-        dr_insert_mbr_instrumentation(drcontext, bb, where, (app_pc)at_return,
-            SPILL_SLOT_1);
-    }
-
-    if (instr_reads_memory(instr_operands)) {
-        for (i = 0; i < instr_num_srcs(instr_operands); i++) {
-            if (opnd_is_memory_reference(instr_get_src(instr_operands, i))) {
-                instrument_mem(drcontext, bb, where, last_pc, instr_operands, i, false);
-            }
-        }
+/* data_access returns the object a reference hit and counts it. tls tells
+ * whether it was relative to a segment register, alloc is the heap
+ * allocation -heap found for it.
+ */
+static inline uint32_t data_access(data_ctx_t* ctx, bool write, uint64 addr, uint32_t size, bool tls,
+    uint32_t alloc) {
+    data_kind_t kind = DATA_KIND_NONE;
+    uint64 key = 0;
+
+    if (ctx->slot_pending && write && data_is_slot(ctx, addr)) {
+        data_set_slot(ctx, addr);
+        ctx->slot_pending = false;
     }
-    if (instr_writes_memory(instr_operands)) {
-        for (i = 0; i < instr_num_dsts(instr_operands); i++) {
-            if (opnd_is_memory_reference(instr_get_dst(instr_operands, i))) {
-                instrument_mem(drcontext, bb, where, last_pc, instr_operands, i, true);
-            }
+    ctx->block_write = 0;
+    if (tls) {
+        if (addr < ctx->tls_start)
+            ctx->tls_start = addr;
+        if (addr + size > ctx->tls_end)
+            ctx->tls_end = addr + size;
+        kind = DATA_KIND_TLS;
+        key = ctx->thread;
+    } else if (addr >= ctx->stack.bottom && addr < ctx->stack.top) {
+        size_t const frame = data_find_frame(ctx->frames, ctx->known, addr);
+        kind = DATA_KIND_STACK;
+        key = frame < ctx->frames.size() ? ctx->frames[frame].node : CCT_NO_SYM;
+    } else if (alloc != HEAP_NONE) {
+        kind = DATA_KIND_HEAP;
+    } else if (addr >= ctx->tls_start && addr < ctx->tls_end) {
+        kind = DATA_KIND_TLS;
+        key = ctx->thread;
+    } else {
+        std::vector<data_range_t> const* ranges = data_table.ranges.load(std::memory_order_acquire);
+        if (ranges != ctx->ranges) {
+            ctx->ranges = ranges;
+            ctx->last = NULL;
+        }
+        if (ctx->last == NULL || addr < ctx->last->start || addr >= ctx->last->end)
+            ctx->last = data_table_lookup(ranges, addr);
+        if (ctx->last != NULL) {
+            kind = DATA_KIND_GLOBAL;
+            key = ctx->last->var;
+        }
+    }
+    uint32_t const id = kind == DATA_KIND_NONE ? DATA_NONE : data_object(ctx, kind, key);
+    if (id >= ctx->stats.size())
+        ctx->stats.resize(id + 1, data_stats_t{});
+    data_stats_t* s = &ctx->stats[id];
+    if (write)
+        s->writes++;
+    else
+        s->reads++;
+    s->bytes += size;
+    return id;
+}
+
+static void data_exit(data_ctx_t* ctx) {
+    dr_mutex_lock(mutex);
+    if (data_totals.size() < ctx->stats.size())
+        data_totals.resize(ctx->stats.size(), data_stats_t{});
+    for (size_t i = 0; i < ctx->stats.size(); ++i) {
+        data_totals[i].reads += ctx->stats[i].reads;
+        data_totals[i].writes += ctx->stats[i].writes;
+        data_totals[i].bytes += ctx->stats[i].bytes;
+    }
+    dr_mutex_unlock(mutex);
+    std::vector<data_stats_t>().swap(ctx->stats);
+    std::vector<cct_frame_t>().swap(ctx->frames);
+    std::vector<uint32_t>().swap(ctx->known);
+}
+
+static void convert_init(convert_ctx_t* ctx, FILE* out, uint64 thread) {
+    uint32_t flags = 0;
+    if (op_compress.get_value())
+        flags |= MMTRD_FLAG_VARINT;
+    if (op_timestamps.get_value())
+        flags |= MMTRD_FLAG_TIME;
+    if (op_cct.get_value()) {
+        flags |= MMTRD_FLAG_CONTEXT;
+        cct_init(&ctx->cct);
+    }
+    if (op_heap.get_value()) {
+        flags |= MMTRD_FLAG_ALLOC;
+        heap_init(&ctx->heap);
+    }
+    if (op_data_objects.get_value()) {
+        flags |= MMTRD_FLAG_OBJECT;
+        data_init(&ctx->data, thread);
+    }
+    mmtrd_writer_init(&ctx->out, out, op_mmtrd_version.get_value(), flags);
+    sym_cache_init(&ctx->syms);
+}
+
+/* convert_exit flushes the output, the caller closes the file */
+static void convert_exit(convert_ctx_t* ctx) {
+    mmtrd_writer_exit(&ctx->out);
+    sym_cache_exit(&ctx->syms);
+    if (op_cct.get_value())
+        cct_exit(&ctx->cct);
+    if (op_heap.get_value())
+        heap_exit(&ctx->heap);
+    if (op_data_objects.get_value())
+        data_exit(&ctx->data);
+}
+
+/* convert_entries writes size bytes of raw entries starting at base as
+ * .mmtrd records to ctx->out. With -early_symbols the pc field of memory
+ * entries and block descriptors already holds the symbol index. With -cct
+ * every record carries the context it happened in, a call the one of its
+ * caller, with -heap every memory reference the allocation it hit and
+ * with -data_objects the data object.
+ */
+static void convert_entries(convert_ctx_t* ctx, char const* base, size_t size) {
+    mmtrd_writer_t* out = &ctx->out;
+    bool const early = op_early_symbols.get_value();
+    bool const cct = op_cct.get_value();
+    bool const heap = op_heap.get_value();
+    bool const data = op_data_objects.get_value();
+    sym_cache_check(&ctx->syms);
+    for (size_t offset = 0; offset + sizeof(uint64) <= size;) {
+        uint64 const header = *reinterpret_cast<uint64 const*>(base + offset);
+        if (offset + trace_entry_size(header) > size)
+            break;
+        if (cct)
+            mmtrd_set_context(out, cct_context(&ctx->cct));
+        if (trace_is_mem(header)) {
+            mem_entry_t const& el = *reinterpret_cast<mem_entry_t const*>(base + offset);
+            uint32_t alloc = HEAP_NONE;
+            if (cct)
+                cct_access(&ctx->cct, trace_get_type(header) == TRACE_TYPE_WRITE, el.addr, trace_get_size(header));
+            if (heap) {
+                alloc = heap_access(&ctx->heap, trace_get_type(header) == TRACE_TYPE_WRITE, el.addr, trace_get_size(header), out->time);
+                mmtrd_set_alloc(out, alloc);
+            }
+            if (data) {
+                mmtrd_set_object(out, data_access(&ctx->data, trace_get_type(header) == TRACE_TYPE_WRITE, el.addr,
+                    trace_get_size(header), trace_is_tls(header), alloc));
+            }
+            mmtrd_write_mem(out, trace_get_type(header) == TRACE_TYPE_WRITE, el.addr,
+                trace_get_size(header),
+                early ? trace_get_pc(header) : lookup_symbol(&ctx->syms, (app_pc)trace_get_pc(header)));
+        } else if (trace_get_type(header) == TRACE_TYPE_BB) {
+            bb_desc_t const* desc = lookup_bb_cached(&ctx->bb_cache, trace_get_pc(header));
+            uint64 const* addr = reinterpret_cast<uint64 const*>(base + offset) + 1;
+            for (uint i = 0; desc != NULL && i < trace_get_size(header) && i < desc->refs.size(); ++i) {
+                bb_ref_t const& ref = desc->refs[i];
+                uint32_t alloc = HEAP_NONE;
+                if (cct)
+                    cct_access(&ctx->cct, ref.write != 0, addr[i], ref.size);
+                if (heap) {
+                    alloc = heap_access(&ctx->heap, ref.write != 0, addr[i], ref.size, out->time);
+                    mmtrd_set_alloc(out, alloc);
+                }
+                if (data)
+                    mmtrd_set_object(out, data_access(&ctx->data, ref.write != 0, addr[i], ref.size, i < desc->tls.size() && desc->tls[i], alloc));
+                mmtrd_write_mem(out, ref.write != 0, addr[i], ref.size,
+                    early ? ref.pc : lookup_symbol(&ctx->syms, (app_pc)ref.pc));
+            }
+            if (data)
+                data_block(&ctx->data, desc, addr, trace_get_size(header));
+        } else if (trace_get_type(header) == TRACE_TYPE_TIME) {
+            mmtrd_set_time(out, reinterpret_cast<time_entry_t const*>(base + offset)->time);
+        } else {
+            call_entry_t const& el = *reinterpret_cast<call_entry_t const*>(base + offset);
+            uint64 const pc = trace_get_pc(header);
+            /* calls keep their pcs, the .mmtrd record needs them */
+            uint64 const pc_sym = lookup_symbol(&ctx->syms, (app_pc)pc);
+            uint64 const target_sym = lookup_symbol(&ctx->syms, (app_pc)el.target);
+            mmtrd_set_alloc(out, HEAP_NONE);
+            mmtrd_set_object(out, DATA_NONE);
+            mmtrd_write_call(out, trace_get_type(header), pc, el.target, pc_sym, target_sym);
+            if (cct && trace_get_type(header) == TRACE_TYPE_RETURN)
+                cct_return(&ctx->cct, el.target);
+            else if (cct)
+                cct_call(&ctx->cct, pc, target_sym);
+            if (data && trace_get_type(header) == TRACE_TYPE_RETURN)
+                data_return(&ctx->data, el.target);
+            else if (data)
+                data_call(&ctx->data, pc, target_sym);
+        }
+        offset += trace_entry_size(header);
+    }
+}
+
+static void sim_init(sim_ctx_t* ctx, uint64 thread) {
+    ctx->thread = thread;
+    if (op_simulate.get_value())
+        cache_sim_init(&ctx->sim, cache_levels);
+    if (op_reuse_distance.get_value())
+        reuse_init(&ctx->reuse, op_reuse_line_size.get_value(), op_reuse_sample.get_value());
+    if (op_cct.get_value())
+        cct_init(&ctx->cct);
+    if (op_heap.get_value())
+        heap_init(&ctx->heap);
+    if (op_data_objects.get_value())
+        data_init(&ctx->data, thread);
+    ctx->time = 0;
+    sym_cache_init(&ctx->syms);
+}
+
+static void sim_access(sim_ctx_t* ctx, bool write, uint64 addr, uint32_t size, bool tls, uint64 sym) {
+    uint32_t alloc = HEAP_NONE;
+
+    if (op_simulate.get_value()) {
+        uint32_t const missed = cache_sim_access(&ctx->sim, addr, size);
+        if (sym >= ctx->stats.size())
+            ctx->stats.resize(sym + 1, cache_stats_t{});
+        cache_stats_add(&ctx->stats[sym], write, missed);
+    }
+    if (op_reuse_distance.get_value() && reuse_sampled(&ctx->reuse, addr)) {
+        uint64 const distance = reuse_access(&ctx->reuse, addr);
+        if (sym >= ctx->hists.size())
+            ctx->hists.resize(sym + 1, reuse_hist_t{});
+        ctx->hists[sym].bins[reuse_bin(distance)]++;
+    }
+    if (op_cct.get_value())
+        cct_access(&ctx->cct, write, addr, size);
+    if (op_heap.get_value())
+        alloc = heap_access(&ctx->heap, write, addr, size, ctx->time);
+    if (op_data_objects.get_value())
+        data_access(&ctx->data, write, addr, size, tls, alloc);
+}
+
+/* simulate_entries runs the memory references of size bytes of raw entries
+ * starting at base through the thread's analyses. Calls and returns only
+ * move the shadow stacks of -cct and -data_objects, time stamps only
+ * matter to -heap.
+ */
+static void simulate_entries(sim_ctx_t* ctx, char const* base, size_t size) {
+    bool const early = op_early_symbols.get_value();
+    sym_cache_check(&ctx->syms);
+    for (size_t offset = 0; offset + sizeof(uint64) <= size;) {
+        uint64 const header = *reinterpret_cast<uint64 const*>(base + offset);
+        if (offset + trace_entry_size(header) > size)
+            break;
+        if (trace_is_mem(header)) {
+            mem_entry_t const& el = *reinterpret_cast<mem_entry_t const*>(base + offset);
+            sim_access(ctx, trace_get_type(header) == TRACE_TYPE_WRITE, el.addr, trace_get_size(header),
+                trace_is_tls(header), early ? trace_get_pc(header) : lookup_symbol(&ctx->syms, (app_pc)trace_get_pc(header)));
+        } else if (trace_get_type(header) == TRACE_TYPE_BB) {
+            bb_desc_t const* desc = lookup_bb_cached(&ctx->bb_cache, trace_get_pc(header));
+            uint64 const* addr = reinterpret_cast<uint64 const*>(base + offset) + 1;
+            for (uint i = 0; desc != NULL && i < trace_get_size(header) && i < desc->refs.size(); ++i) {
+                bb_ref_t const& ref = desc->refs[i];
+                sim_access(ctx, ref.write != 0, addr[i], ref.size, i < desc->tls.size() && desc->tls[i],
+                    early ? ref.pc : lookup_symbol(&ctx->syms, (app_pc)ref.pc));
+            }
+            if (op_data_objects.get_value())
+                data_block(&ctx->data, desc, addr, trace_get_size(header));
+        } else if (trace_get_type(header) == TRACE_TYPE_TIME) {
+            ctx->time = reinterpret_cast<time_entry_t const*>(base + offset)->time;
+        } else if (op_cct.get_value() || op_data_objects.get_value()) {
+            call_entry_t const& el = *reinterpret_cast<call_entry_t const*>(base + offset);
+            if (trace_get_type(header) == TRACE_TYPE_RETURN) {
+                if (op_cct.get_value())
+                    cct_return(&ctx->cct, el.target);
+                if (op_data_objects.get_value())
+                    data_return(&ctx->data, el.target);
+            } else {
+                uint64 const sym = lookup_symbol(&ctx->syms, (app_pc)el.target);
+                if (op_cct.get_value())
+                    cct_call(&ctx->cct, trace_get_pc(header), sym);
+                if (op_data_objects.get_value())
+                    data_call(&ctx->data, trace_get_pc(header), sym);
+            }
+        }
+        offset += trace_entry_size(header);
+    }
+}
+
+static void sim_exit(sim_ctx_t* ctx) {
+    dr_mutex_lock(mutex);
+    if (sim_stats.size() < ctx->stats.size())
+        sim_stats.resize(ctx->stats.size(), cache_stats_t{});
+    for (size_t i = 0; i < ctx->stats.size(); ++i)
+        cache_stats_merge(&sim_stats[i], ctx->stats[i]);
+    for (size_t i = 0; i < ctx->hists.size(); ++i) {
+        reuse_row_t row = { ctx->thread, i, ctx->hists[i] };
+        uint64 n = 0;
+        for (uint b = 0; b < REUSE_BINS; b++)
+            n += row.hist.bins[b];
+        if (n > 0)
+            reuse_rows.push_back(row);
+    }
+    dr_mutex_unlock(mutex);
+    sym_cache_exit(&ctx->syms);
+    if (op_cct.get_value())
+        cct_exit(&ctx->cct);
+    if (op_heap.get_value())
+        heap_exit(&ctx->heap);
+    if (op_data_objects.get_value())
+        data_exit(&ctx->data);
+}
+
+/* count_bank adds the counts of the -count_only references with a pc in
+ * [start, end) to their symbols and forgets the references, e.g. before
+ * their module is unloaded. The symbols are resolved without holding
+ * mutex.
+ */
+static void count_bank(app_pc start, app_pc end) {
+    std::vector<count_ref_t> banked;
+    std::vector<uint64> syms;
+    size_t kept = 0;
+
+    dr_mutex_lock(mutex);
+    for (size_t i = 0; i < count_refs.size(); ++i) {
+        count_ref_t const& ref = count_refs[i];
+        if (ref.pc < start || ref.pc >= end)
+            count_refs[kept++] = ref;
+        else if (*ref.counter != 0)
+            banked.push_back(ref);
+    }
+    count_refs.resize(kept);
+    dr_mutex_unlock(mutex);
+
+    for (auto const& ref : banked)
+        syms.push_back(resolve_symbol(ref.pc, NULL));
+    dr_mutex_lock(mutex);
+    for (size_t i = 0; i < banked.size(); ++i) {
+        count_ref_t const& ref = banked[i];
+        /* the counters live on, the code may still run until it is gone */
+        uint64 const n = *ref.counter;
+        uint64 const sym = syms[i];
+        if (sym >= count_stats.size())
+            count_stats.resize(sym + 1, count_stats_t{});
+        if (ref.write) {
+            count_stats[sym].writes += n;
+            count_stats[sym].write_bytes += n * ref.size;
+        } else {
+            count_stats[sym].reads += n;
+            count_stats[sym].read_bytes += n * ref.size;
+        }
+    }
+    dr_mutex_unlock(mutex);
+}
+
+/* symbol_names returns the name of every symbol index */
+static std::vector<std::string const*> symbol_names(void) {
+    std::vector<std::string const*> names(symbol_idx.load(), NULL);
+    for (auto& shard : name_shards) {
+        for (auto& e : shard.names)
+            names[e.second] = &e.first;
+    }
+    return names;
+}
+
+/* write_sim_stats writes the counters of every symbol to regina.cachesim.csv
+ * and prints the miss rate of every level
+ */
+static void write_sim_stats(void) {
+    FILE* f = fopen(output_path("regina.cachesim.csv").c_str(), "w");
+    std::vector<std::string const*> const names = symbol_names();
+    cache_stats_t total = {};
+    uint32_t l;
+
+    if (f != NULL) {
+        fprintf(f, "symbol,name,reads,writes");
+        for (l = 0; l < cache_levels.size(); l++)
+            fprintf(f, ",L%u misses", l + 1);
+        fprintf(f, "\n");
+    }
+    for (size_t i = 0; i < sim_stats.size(); ++i) {
+        cache_stats_t const& s = sim_stats[i];
+        if (s.reads + s.writes == 0)
+            continue;
+        cache_stats_merge(&total, s);
+        if (f == NULL)
+            continue;
+        /* names are module#symbol, quote them for the commas of C++ signatures */
+        fprintf(f, "%zu,\"%s\"," UINT64_FORMAT_STRING "," UINT64_FORMAT_STRING, i,
+            i < names.size() && names[i] != NULL ? names[i]->c_str() : "", s.reads, s.writes);
+        for (l = 0; l < cache_levels.size(); l++)
+            fprintf(f, "," UINT64_FORMAT_STRING, s.misses[l]);
+        fprintf(f, "\n");
+    }
+    if (f != NULL)
+        fclose(f);
+    for (l = 0; l < cache_levels.size(); l++) {
+        cache_config_t const& c = cache_levels[l];
+        uint64 const accesses = l == 0 ? total.reads + total.writes : total.misses[l - 1];
+        dr_printf("L%u " UINT64_FORMAT_STRING "K %u-way %uB lines: " UINT64_FORMAT_STRING " accesses, " UINT64_FORMAT_STRING " misses (%.2f%%)\n",
+            l + 1, c.size / 1024, c.assoc, c.line_size, accesses, total.misses[l],
+            accesses == 0 ? 0.0 : 100.0 * (double)total.misses[l] / (double)accesses);
+    }
+}
+
+/* write_count_stats writes the counts of every symbol to regina.counts.csv
+ * and prints the totals
+ */
+static void write_count_stats(void) {
+    FILE* f;
+    std::vector<std::string const*> names;
+    count_stats_t total = {};
+
+    count_bank(NULL, (app_pc)POINTER_MAX);
+    names = symbol_names();
+    f = fopen(output_path("regina.counts.csv").c_str(), "w");
+    if (f != NULL)
+        fprintf(f, "symbol,name,reads,writes,bytes read,bytes written\n");
+    for (size_t i = 0; i < count_stats.size(); ++i) {
+        count_stats_t const& s = count_stats[i];
+        if (s.reads + s.writes == 0)
+            continue;
+        total.reads += s.reads;
+        total.writes += s.writes;
+        total.read_bytes += s.read_bytes;
+        total.write_bytes += s.write_bytes;
+        if (f == NULL)
+            continue;
+        fprintf(f, "%zu,\"%s\"," UINT64_FORMAT_STRING "," UINT64_FORMAT_STRING "," UINT64_FORMAT_STRING "," UINT64_FORMAT_STRING "\n",
+            i, i < names.size() && names[i] != NULL ? names[i]->c_str() : "", s.reads, s.writes,
+            s.read_bytes, s.write_bytes);
+    }
+    if (f != NULL)
+        fclose(f);
+    dr_printf("Counted " UINT64_FORMAT_STRING " reads (" UINT64_FORMAT_STRING " bytes) and " UINT64_FORMAT_STRING " writes (" UINT64_FORMAT_STRING " bytes)\n",
+        total.reads, total.read_bytes, total.writes, total.write_bytes);
+    for (auto chunk : count_chunks)
+        dr_custom_free(NULL, DR_ALLOC_CACHE_REACHABLE, chunk, COUNT_CHUNK * sizeof(uint64));
+    count_chunks.clear();
+}
+
+/* write_cct_stats writes every calling context with its counters to
+ * regina.cct.csv, parents before their children
+ */
+static void write_cct_stats(void) {
+    FILE* f = fopen(output_path("regina.cct.csv").c_str(), "w");
+    std::vector<std::string const*> const names = symbol_names();
+
+    if (f == NULL)
+        return;
+    fprintf(f, "context,parent,symbol,name,reads,writes,bytes,lines\n");
+    for (size_t i = 0; i < cct_tree.nodes.size(); ++i) {
+        cct_node_t const& node = cct_tree.nodes[i];
+        cct_stats_t const s = i < cct_totals.size() ? cct_totals[i] : cct_stats_t{};
+        if (i == CCT_ROOT) {
+            fprintf(f, "%zu,,,\"<thread>\"", i);
+        } else {
+            fprintf(f, "%zu,%u,%u,\"%s\"", i, node.parent, node.sym,
+                node.sym < names.size() && names[node.sym] != NULL ? names[node.sym]->c_str() : "");
+        }
+        fprintf(f, "," UINT64_FORMAT_STRING "," UINT64_FORMAT_STRING "," UINT64_FORMAT_STRING "," UINT64_FORMAT_STRING "\n",
+            s.reads, s.writes, s.bytes, cct_stats_lines(s));
+    }
+    fclose(f);
+    dr_printf("Calling contexts: %zu\n", cct_tree.nodes.size());
+}
+
+/* write_heap_stats writes every allocation with its call site, lifetime
+ * and counters to regina.heap.csv
+ */
+static void write_heap_stats(void) {
+    FILE* f = fopen(output_path("regina.heap.csv").c_str(), "w");
+    std::vector<std::string const*> const names = symbol_names();
+    uint64 bytes = 0;
+
+    if (f != NULL)
+        fprintf(f, "alloc,start,size,thread,site,site name,alloc time,free time,reads,writes,bytes\n");
+    for (uint32_t id = 1; id < heap_index.num_allocs; ++id) {
+        heap_alloc_t const* a = heap_index_get(&heap_index, id);
+        heap_stats_t const s = id < heap_totals.size() ? heap_totals[id] : heap_stats_t{};
+        uint64 const free_time = a->free_time.load(std::memory_order_relaxed);
+        bytes += s.bytes;
+        if (f == NULL)
+            continue;
+        fprintf(f, "%u," PFX "," UINT64_FORMAT_STRING "," UINT64_FORMAT_STRING "," UINT64_FORMAT_STRING ",\"%s\"," UINT64_FORMAT_STRING ",",
+            id, (ptr_uint_t)a->start, a->end - a->start, a->thread, a->site,
+            a->site < names.size() && names[a->site] != NULL ? names[a->site]->c_str() : "", a->alloc_time);
+        if (free_time != UINT64_MAX)
+            fprintf(f, UINT64_FORMAT_STRING, free_time);
+        fprintf(f, "," UINT64_FORMAT_STRING "," UINT64_FORMAT_STRING "," UINT64_FORMAT_STRING "\n", s.reads, s.writes, s.bytes);
+    }
+    if (f != NULL)
+        fclose(f);
+    dr_printf("Heap: %u allocations, " UINT64_FORMAT_STRING " bytes accessed in them, " UINT64_FORMAT_STRING " references outside\n",
+        heap_index.num_allocs - 1, bytes, heap_unattributed);
+}
+
+/* write_data_stats writes every data object with its counters to
+ * regina.data.csv and prints the references of every kind
+ */
+static void write_data_stats(void) {
+    FILE* f = fopen(output_path("regina.data.csv").c_str(), "w");
+    std::vector<std::string const*> const names = symbol_names();
+    uint64 refs[DATA_KIND_HEAP + 1] = {};
+
+    if (f != NULL)
+        fprintf(f, "object,kind,start,size,thread,symbol,name,reads,writes,bytes\n");
+    for (size_t i = 0; i < data_objects.objects.size(); ++i) {
+        data_object_t const& o = data_objects.objects[i];
+        data_stats_t const s = i < data_totals.size() ? data_totals[i] : data_stats_t{};
+        char const* name = o.kind == DATA_KIND_STACK ? "<thread>" : o.kind == DATA_KIND_HEAP ? "<heap>" : "";
+        refs[o.kind] += s.reads + s.writes;
+        if (f == NULL || i == DATA_NONE)
+            continue;
+        fprintf(f, "%zu,%s,", i, data_kind_names[o.kind]);
+        if (o.kind == DATA_KIND_GLOBAL) {
+            data_var_t const& v = data_table.vars[o.key];
+            fprintf(f, PFX "," UINT64_FORMAT_STRING, (ptr_uint_t)v.start, v.end - v.start);
+        } else {
+            fprintf(f, ",");
+        }
+        fprintf(f, ",");
+        if (o.kind == DATA_KIND_TLS)
+            fprintf(f, UINT64_FORMAT_STRING, o.key);
+        fprintf(f, ",");
+        if (o.sym != CCT_NO_SYM) {
+            fprintf(f, UINT64_FORMAT_STRING, o.sym);
+            if (o.sym < names.size() && names[o.sym] != NULL)
+                name = names[o.sym]->c_str();
+        }
+        fprintf(f, ",\"%s\"," UINT64_FORMAT_STRING "," UINT64_FORMAT_STRING "," UINT64_FORMAT_STRING "\n", name,
+            s.reads, s.writes, s.bytes);
+    }
+    if (f != NULL)
+        fclose(f);
+    dr_printf("Data objects: %zu, references to globals " UINT64_FORMAT_STRING ", stack " UINT64_FORMAT_STRING ", thread local storage " UINT64_FORMAT_STRING ", heap " UINT64_FORMAT_STRING ", other " UINT64_FORMAT_STRING "\n",
+        data_objects.objects.size() - 1, refs[DATA_KIND_GLOBAL], refs[DATA_KIND_STACK], refs[DATA_KIND_TLS],
+        refs[DATA_KIND_HEAP], refs[DATA_KIND_NONE]);
+}
+
+/* write_reuse_stats writes the reuse distance histogram of every thread
+ * and symbol, and of every thread as a whole, to regina.reuse.csv
+ */
+static void write_reuse_stats(void) {
+    FILE* f = fopen(output_path("regina.reuse.csv").c_str(), "w");
+    std::vector<std::string const*> const names = symbol_names();
+    uint b;
+
+    if (f == NULL)
+        return;
+    /* the columns are the bins of reuse.h, in cache lines */
+    fprintf(f, "thread,symbol,name,cold,0");
+    for (b = 2; b < REUSE_BINS; b++) {
+        if (b == 2)
+            fprintf(f, ",1");
+        else
+            fprintf(f, "," UINT64_FORMAT_STRING "-" UINT64_FORMAT_STRING, (uint64)1 << (b - 2), ((uint64)1 << (b - 1)) - 1);
+    }
+    fprintf(f, "\n");
+    std::sort(reuse_rows.begin(), reuse_rows.end(), [](reuse_row_t const& a, reuse_row_t const& b) {
+        return a.thread != b.thread ? a.thread < b.thread : a.sym < b.sym;
+    });
+    for (size_t i = 0; i < reuse_rows.size(); ++i) {
+        reuse_row_t const& row = reuse_rows[i];
+        fprintf(f, UINT64_FORMAT_STRING "," UINT64_FORMAT_STRING ",\"%s\"", row.thread, row.sym,
+            row.sym < names.size() && names[row.sym] != NULL ? names[row.sym]->c_str() : "");
+        for (b = 0; b < REUSE_BINS; b++)
+            fprintf(f, "," UINT64_FORMAT_STRING, row.hist.bins[b]);
+        fprintf(f, "\n");
+        if (i + 1 == reuse_rows.size() || reuse_rows[i + 1].thread != row.thread) {
+            /* the thread's total, without a symbol */
+            reuse_hist_t total = {};
+            for (size_t j = i + 1; j-- > 0 && reuse_rows[j].thread == row.thread;) {
+                for (b = 0; b < REUSE_BINS; b++)
+                    total.bins[b] += reuse_rows[j].hist.bins[b];
+            }
+            fprintf(f, UINT64_FORMAT_STRING ",,\"<all>\"", row.thread);
+            for (b = 0; b < REUSE_BINS; b++)
+                fprintf(f, "," UINT64_FORMAT_STRING, total.bins[b]);
+            fprintf(f, "\n");
+        }
+    }
+    fclose(f);
+}
+
+static void process_file(FILE* f, uint64 file_idx) {
+    FILE* out = fopen(output_path(std::string("regina.") + std::to_string(file_idx) + std::string(".mmtrd")).c_str(), "wb");
+    convert_ctx_t ctx;
+    uint64 const start = dr_get_microseconds();
+    convert_init(&ctx, out, file_idx);
+    /* stream the trace, a thread may have recorded more than fits in memory */
+    uint64 const bytes = trace_read_chunks(f, [&](char const* base, size_t size) {
+        convert_entries(&ctx, base, size);
+    });
+    convert_exit(&ctx);
+    fclose(out);
+    convert_traces.fetch_add(1, std::memory_order_relaxed);
+    convert_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    convert_us.fetch_add(dr_get_microseconds() - start, std::memory_order_relaxed);
+}
+
+/* Returns whether the buffers are analyzed instead of written. */
+static bool
+analyze_online(void) {
+    return op_simulate.get_value() || op_reuse_distance.get_value();
+}
+
+/* Returns whether full buffers go to the writer threads. */
+static bool
+uses_writer(void) {
+    return op_num_buffers.get_value() > 0 && !op_count_only.get_value();
+}
+
+/* Returns whether a trace is written at all. */
+static bool
+records_trace(void) {
+    return !analyze_online() && !op_count_only.get_value();
+}
+
+/* Returns whether every flushed buffer is converted right away. */
+static bool
+convert_incremental(void) {
+    return !options_text_output() && !op_offline_symbols.get_value() && records_trace()
+        && (op_incremental.get_value() || op_early_symbols.get_value());
+}
+
+/* Returns whether finished traces are converted by the workers. */
+static bool
+convert_in_background(void) {
+    return op_convert_threads.get_value() > 0 && !options_text_output() && !op_offline_symbols.get_value() && records_trace()
+        && !convert_incremental();
+}
+
+/* convert_job converts the raw trace of the exited thread whose id is
+ * passed as arg into regina.<id>.mmtrd.
+ */
+static void
+convert_job(void* arg) {
+    uint64 const id = (uint64)(ptr_uint_t)arg;
+    FILE* f = fopen(output_path(std::string("regina.tmp.") + std::to_string(id) + std::string(".mmd")).c_str(), "rb");
+
+    if (f == NULL)
+        return;
+    process_file(f, id);
+    fclose(f);
+}
+
+/* write_bb_table dumps the block descriptors into TRACE_BB_FILE */
+static void
+write_bb_table(void) {
+    FILE* f = fopen(output_path(TRACE_BB_FILE).c_str(), "wb");
+    uint64 count = bb_table.size();
+
+    if (f == NULL)
+        return;
+    fwrite(&count, sizeof(count), 1, f);
+    for (auto desc : bb_table) {
+        uint32_t num_refs = (uint32_t)desc->refs.size();
+        fwrite(&num_refs, sizeof(num_refs), 1, f);
+        if (num_refs > 0)
+            fwrite(desc->refs.data(), sizeof(bb_ref_t), num_refs, f);
+    }
+    fclose(f);
+}
+
+static void
+event_exit() {
+    if (uses_writer()) {
+        writer_stats_t stats;
+        writer_exit();
+        writer_get_stats(&stats);
+        dr_printf("Writer: " UINT64_FORMAT_STRING " buffers, " UINT64_FORMAT_STRING " bytes, max queue depth " UINT64_FORMAT_STRING ", " UINT64_FORMAT_STRING " waits for a free buffer (" UINT64_FORMAT_STRING " us)\n",
+            stats.buffers_written, stats.bytes_written, stats.max_queue_depth, stats.waits,
+            stats.wait_us);
+    }
+    if (convert_in_background()) {
+        workers_stats_t stats;
+        workers_exit();
+        workers_get_stats(&stats);
+        dr_printf("Converters: " UINT64_FORMAT_STRING " traces of " UINT64_FORMAT_STRING " bytes in " UINT64_FORMAT_STRING " us on %u threads, max queue depth " UINT64_FORMAT_STRING "\n",
+            stats.jobs, convert_bytes.load(), stats.busy_us, op_convert_threads.get_value(), stats.max_queue_depth);
+    } else if (convert_traces.load() > 0) {
+        dr_printf("Converters: " UINT64_FORMAT_STRING " traces of " UINT64_FORMAT_STRING " bytes in " UINT64_FORMAT_STRING " us on the exiting threads\n",
+            convert_traces.load(), convert_bytes.load(), convert_us.load());
+    }
+    if (op_simulate.get_value())
+        write_sim_stats();
+    if (op_reuse_distance.get_value())
+        write_reuse_stats();
+    if (op_count_only.get_value())
+        write_count_stats();
+    if (op_cct.get_value())
+        write_cct_stats();
+    if (op_heap.get_value())
+        write_heap_stats();
+    if (op_data_objects.get_value())
+        write_data_stats();
+    if (!op_offline_symbols.get_value()) {
+        dr_printf("Symbols: " UINT64_FORMAT_STRING " lookups, %.2f%% cache hits (" UINT64_FORMAT_STRING " in the thread caches), " UINT64_FORMAT_STRING " pcs resolved in " UINT64_FORMAT_STRING " us, " UINT64_FORMAT_STRING " of them at instrumentation time, " UINT64_FORMAT_STRING " outside any module\n",
+            sym_lookups, sym_lookups == 0 ? 0.0 : 100.0 * (double)(sym_lookups - sym_misses) / (double)sym_lookups,
+            sym_hits, sym_resolved.load(), sym_us.load(), sym_early.load(), sym_no_module.load());
+    }
+#ifdef SHOW_RESULTS
+    char msg[512];
+    int len;
+    len = dr_snprintf(msg, sizeof(msg) / sizeof(msg[0]),
+        "Instrumentation results:\n"
+        "  saw %llu memory references\n",
+        global_num_refs);
+    DR_ASSERT(len > 0);
+    NULL_TERMINATE_BUFFER(msg);
+    DISPLAY_STRING(msg);
+#endif /* SHOW_RESULTS */
+    /*int file_idx = 0;
+    for (auto& f : delayed_files) {
+        process_file(f, file_idx);
+        log_file_close(f);
+        ++file_idx;
+    }*/
+
+    if (op_offline_symbols.get_value()) {
+        /* regina-symbolize needs the block descriptors to expand block entries */
+        if (op_trace_bb.get_value())
+            write_bb_table();
+        fclose(module_table);
+    } else {
+        FILE* lookupIO = std::fopen(output_path("regina.0.mmtrd.txt").c_str(), "w");
+        for (auto& shard : name_shards) {
+            for (auto& e : shard.names) {
+                std::string tmp = std::to_string(e.second) + "|" + e.first + "\n";
+                std::fwrite(tmp.c_str(), strlen(tmp.c_str()), 1, lookupIO);
+            }
+        }
+        std::fclose(lookupIO);
+    }
+    for (int i = 0; i < SYM_SHARDS; i++) {
+        dr_mutex_destroy(pc_shards[i].lock);
+        dr_mutex_destroy(name_shards[i].lock);
+    }
+
+    for (auto desc : bb_table)
+        delete desc;
+    bb_table.clear();
+
+    code_cache_exit();
+    if (trace_buffer != NULL)
+        drx_buf_free(trace_buffer);
+
+    if (!drmgr_unregister_tls_field(tls_index) || !drmgr_unregister_thread_init_event(event_thread_init) || !drmgr_unregister_thread_exit_event(event_thread_exit) || !drmgr_unregister_module_unload_event(event_module_unload) || !drmgr_unregister_bb_insertion_event(event_bb_insert) || drreg_exit() != DRREG_SUCCESS)
+        DR_ASSERT(false);
+    if ((op_offline_symbols.get_value() || op_heap.get_value() || op_data_objects.get_value() || options_filter_code() || !op_roi.get_value().empty()) && !drmgr_unregister_module_load_event(event_module_load))
+        DR_ASSERT(false);
+    if (op_roi_annotations.get_value() && (!dr_annotation_unregister_call("regina_roi_start", (void*)roi_annotation_start) || !dr_annotation_unregister_call("regina_roi_stop", (void*)roi_annotation_stop)))
+        DR_ASSERT(false);
+    if (op_heap.get_value()) {
+        drwrap_exit();
+        heap_index_exit(&heap_index);
+        dr_mutex_destroy(heap_lock);
+    }
+    if (op_data_objects.get_value()) {
+        data_table_exit(&data_table);
+        dr_mutex_destroy(data_lock);
+    }
+
+    if (!op_offline_symbols.get_value() && drsym_exit() != DRSYM_SUCCESS) {
+        dr_log(NULL, DR_LOG_ALL, 1, "WARNING: error cleaning up symbol library\n");
+        dr_printf("Failed to cleanup symbol library\n");
+    }
+
+    if (cct_lock != NULL)
+        dr_mutex_destroy(cct_lock);
+    if (filter_lock != NULL)
+        dr_mutex_destroy(filter_lock);
+    dr_mutex_destroy(mutex);
+    drutil_exit();
+    drmgr_exit();
+    drx_exit();
+}
+
+#ifdef WINDOWS
+#define IF_WINDOWS(x) x
+#else
+#define IF_WINDOWS(x) /* nothing */
+#endif
+
+/* trace_timestamp reads the time stamp counter, the clock instrument_time
+ * records inline as well
+ */
+static inline uint64
+trace_timestamp(void) {
+    return __rdtsc();
+}
+
+/* put_time_entry stores a TRACE_TYPE_TIME entry at p and returns the
+ * position after it
+ */
+static char*
+put_time_entry(char* p) {
+    time_entry_t* entry = (time_entry_t*)p;
+    entry->header = trace_make_header(TRACE_TYPE_TIME, 0, 0);
+    entry->time = trace_timestamp();
+    return p + sizeof(*entry);
+}
+
+/* set_thread_buffer makes the inlined code fill the buffer at base */
+static void
+set_thread_buffer(per_thread_t* data, char* base) {
+    data->buf_base = base;
+    data->buf_ptr = base;
+    /* set buf_end to be negative of address of buffer end for the lea later */
+    data->buf_end = -(ptr_int_t)(base + mem_buf_size);
+    data->buf_limit = base + mem_buf_size;
+}
+
+/* data_thread_init records the stack of a new thread for -data_objects:
+ * the memory region its stack pointer starts in, with room for the stack
+ * to grow
+ */
+static void
+data_thread_init(void* drcontext, uint64 thread) {
+    dr_mcontext_t mc = { sizeof(mc), DR_MC_CONTROL };
+    dr_mem_info_t info;
+    data_stack_t stack = { 0, 0 };
+
+    if (dr_get_mcontext(drcontext, &mc) && dr_query_memory_ex((byte*)mc.xsp, &info)) {
+        stack.bottom = (uint64)info.base_pc;
+        stack.top = (uint64)info.base_pc + info.size;
+#ifdef WINDOWS
+        /* only the used part of the reservation is committed */
+        MEMORY_BASIC_INFORMATION mbi;
+        if (dr_virtual_query((byte*)mc.xsp, &mbi, sizeof(mbi)) == sizeof(mbi))
+            stack.bottom = (uint64)mbi.AllocationBase;
+#else
+        /* the kernel keeps other mappings out of the main stack's limit */
+        if (thread == 0 && stack.top - stack.bottom < DATA_MAIN_STACK)
+            stack.bottom = stack.top - DATA_MAIN_STACK;
+#endif
+    }
+    dr_mutex_lock(data_lock);
+    if (data_stacks.size() <= thread)
+        data_stacks.resize(thread + 1, data_stack_t{ 0, 0 });
+    data_stacks[thread] = stack;
+    dr_mutex_unlock(data_lock);
+}
+
+static void
+event_thread_init(void* drcontext) {
+    per_thread_t* data;
+
+    /* allocate thread private data */
+    data = (per_thread_t*)dr_thread_alloc(drcontext, sizeof(per_thread_t));
+    drmgr_set_tls_field(drcontext, tls_index, data);
+    data->num_refs = 0;
+    data->pool = NULL;
+    data->cur = NULL;
+    data->conv = NULL;
+    data->sim = NULL;
+    data->enc_buf = NULL;
+    data->heap_depth = 0;
+    data->heap_syms = NULL;
+    if (op_heap.get_value()) {
+        data->heap_syms = new sym_cache_t;
+        sym_cache_init(data->heap_syms);
+    }
+    data->roi_calls = options_roi() ? new std::vector<uint64>() : NULL;
+    data->roi_marks = 0;
+    data->roi_redirect = NULL;
+
+    /* We're going to dump our data to a per-thread file.
+     * On Windows we need an absolute path so we place it in
+     * the same directory as our library. We could also pass
+     * in a path as a client argument.
+     */
+//    data->log = log_file_open(client_id, drcontext, NULL /* using client lib path */, "memtrace",
+//#ifndef WINDOWS
+//        DR_FILE_CLOSE_ON_FORK |
+//#endif
+//            DR_FILE_ALLOW_LARGE);
+//    data->logf = log_stream_from_file(data->log);
+    data->threadID = thread_idx.fetch_add(1);
+    if (op_data_objects.get_value())
+        data_thread_init(drcontext, data->threadID);
+    if (op_count_only.get_value()) {
+        /* the counters live in the code cache, nothing is buffered */
+        data->logf = NULL;
+    } else if (analyze_online()) {
+        /* only the counters are kept, no trace is written */
+        data->logf = NULL;
+        data->sim = new sim_ctx_t;
+        sim_init(data->sim, data->threadID);
+    } else if (options_text_output()) {
+        data->logf = fopen(output_path(std::string("regina.tmp.") + std::to_string(data->threadID) + std::string(".mmd")).c_str(), "w");
+        fprintf(data->logf,
+            "Format: <instr address>,<(r)ead/(w)rite>,<data size>,<data address>\n");
+    } else if (convert_incremental()) {
+        /* convert as we go, no raw trace is kept */
+        data->logf = fopen(output_path(std::string("regina.") + std::to_string(data->threadID) + std::string(".mmtrd")).c_str(), "wb");
+        data->conv = new convert_ctx_t;
+        convert_init(data->conv, data->logf, data->threadID);
+    } else {
+        data->logf = fopen(output_path(std::string("regina.tmp.") + std::to_string(data->threadID) + std::string(".mmd")).c_str(), "wb");
+        if (op_compress.get_value()) {
+            fwrite(TRACE_CODEC_MAGIC, TRACE_CODEC_MAGIC_SIZE, 1, data->logf);
+            data->enc_buf = (uint8_t*)dr_global_alloc(codec_max_encoded_size(mem_buf_alloc));
+        }
+    }
+
+    if (op_count_only.get_value()) {
+        /* only the inline counters, no buffer, no writer and no time */
+        data->buf_base = NULL;
+        data->buf_ptr = NULL;
+        return;
+    }
+    if (uses_writer())
+        data->pool = writer_create_pool(data, op_num_buffers.get_value());
+    /* drx_buf manages the buffer itself in fault mode */
+    if (trace_buffer == NULL) {
+        if (data->pool != NULL) {
+            data->cur = writer_acquire(data->pool);
+            set_thread_buffer(data, data->cur->base);
+        } else {
+            set_thread_buffer(data, (char*)dr_thread_alloc(drcontext, mem_buf_alloc));
+        }
+        if (op_timestamps.get_value())
+            data->buf_ptr = put_time_entry(data->buf_ptr);
+    } else {
+        data->buf_base = NULL;
+        data->buf_ptr = NULL;
+        /* the drx_buf buffer is not ours to fill yet */
+        if (op_timestamps.get_value())
+            flush_buffer(data, NULL, 0);
+    }
+}
+
+static void
+event_thread_exit(void* drcontext) {
+    per_thread_t* data;
+
+    if (!op_count_only.get_value())
+        memtrace(drcontext);
+    data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_index);
+    /* drx_buf may call trace_buffer_full once more on its own thread exit */
+    drmgr_set_tls_field(drcontext, tls_index, NULL);
+    if (data->pool != NULL) {
+        /* the writer thread must be done with our file before we close it */
+        writer_drain(data->pool);
+        writer_destroy_pool(data->pool);
+    } else if (data->buf_base != NULL) {
+        dr_thread_free(drcontext, data->buf_base, mem_buf_alloc);
+    }
+    if (data->enc_buf != NULL)
+        dr_global_free(data->enc_buf, codec_max_encoded_size(mem_buf_alloc));
+    dr_mutex_lock(mutex);
+    global_num_refs += data->num_refs;
+    dr_mutex_unlock(mutex);
+    if (data->heap_syms != NULL) {
+        sym_cache_exit(data->heap_syms);
+        delete data->heap_syms;
+    }
+    if (data->roi_calls != NULL) {
+        /* a thread ending inside the region leaves it, no code of it runs
+         * any more that could be redirected
+         */
+        if (roi_inside(data) && roi_threads.fetch_sub(1) == 1)
+            dr_delay_flush_region(NULL, ~(size_t)0, 0, NULL);
+        delete data->roi_calls;
+    }
+    if (data->sim != NULL) {
+        sim_exit(data->sim);
+        delete data->sim;
+    } else if (data->logf == NULL) {
+        /* -count_only */
+    } else if (data->conv != NULL) {
+        /* flush the converted records before closing their file */
+        convert_exit(data->conv);
+        delete data->conv;
+        fclose(data->logf);
+    } else {
+        fclose(data->logf);
+        /* the trace is complete, leave its conversion to the workers */
+        if (convert_in_background())
+            workers_submit((void*)(ptr_uint_t)data->threadID);
+        else if (!options_text_output() && !op_offline_symbols.get_value())
+            convert_job((void*)(ptr_uint_t)data->threadID);
+        //log_file_close(data->log);
+        //delayed_files.push_back(data->log);
+    }
+    dr_thread_free(drcontext, data, sizeof(per_thread_t));
+}
+
+/* The allocators -heap wraps: the C functions and operator new, new[],
+ * delete and delete[] of the Itanium and MSVC ABIs.
+ */
+static const struct {
+    const char* name;
+    heap_fn_t fn;
+} heap_functions[] = {
+    { "malloc", HEAP_FN_MALLOC },
+    { "calloc", HEAP_FN_CALLOC },
+    { "realloc", HEAP_FN_REALLOC },
+    { "free", HEAP_FN_FREE },
+    { "_Znwm", HEAP_FN_MALLOC },
+    { "_Znam", HEAP_FN_MALLOC },
+    { "_ZdlPv", HEAP_FN_FREE },
+    { "_ZdaPv", HEAP_FN_FREE },
+    { "_ZdlPvm", HEAP_FN_FREE },
+    { "_ZdaPvm", HEAP_FN_FREE },
+    { "??2@YAPEAX_K@Z", HEAP_FN_MALLOC },
+    { "??_U@YAPEAX_K@Z", HEAP_FN_MALLOC },
+    { "??3@YAXPEAX@Z", HEAP_FN_FREE },
+    { "??_V@YAXPEAX@Z", HEAP_FN_FREE },
+    { "??3@YAXPEAX_K@Z", HEAP_FN_FREE },
+    { "??_V@YAXPEAX_K@Z", HEAP_FN_FREE },
+};
+
+/* heap_pre takes the arguments of an allocator call. Only the outermost
+ * call of a thread is recorded, operator new calling malloc allocates one
+ * object. A free is recorded right away: the references before it all
+ * lie before its time.
+ */
+static void
+heap_pre(void* wrapcxt, void** user_data) {
+    per_thread_t* data = (per_thread_t*)drmgr_get_tls_field(drwrap_get_drcontext(wrapcxt), tls_index);
+    heap_fn_t const fn = (heap_fn_t)(ptr_uint_t)*user_data;
+
+    if (data == NULL || data->heap_depth++ > 0)
+        return;
+    data->heap_time = trace_timestamp();
+    data->heap_site = drwrap_get_retaddr(wrapcxt);
+    data->heap_old = NULL;
+    switch (fn) {
+    case HEAP_FN_MALLOC:
+        data->heap_size = (uint64)(ptr_uint_t)drwrap_get_arg(wrapcxt, 0);
+        break;
+    case HEAP_FN_CALLOC:
+        data->heap_size = (uint64)(ptr_uint_t)drwrap_get_arg(wrapcxt, 0) * (uint64)(ptr_uint_t)drwrap_get_arg(wrapcxt, 1);
+        break;
+    case HEAP_FN_REALLOC:
+        data->heap_old = (app_pc)drwrap_get_arg(wrapcxt, 0);
+        data->heap_size = (uint64)(ptr_uint_t)drwrap_get_arg(wrapcxt, 1);
+        break;
+    case HEAP_FN_FREE:
+        dr_mutex_lock(heap_lock);
+        heap_index_free(&heap_index, (uint64)drwrap_get_arg(wrapcxt, 0), data->heap_time);
+        dr_mutex_unlock(heap_lock);
+        break;
+    }
+}
+
+/* heap_post records the allocation of the outermost call. wrapcxt is NULL
+ * if the call was left by longjmp or an exception, e.g. a failed operator
+ * new.
+ */
+static void
+heap_post(void* wrapcxt, void* user_data) {
+    void* drcontext = wrapcxt == NULL ? dr_get_current_drcontext() : drwrap_get_drcontext(wrapcxt);
+    per_thread_t* data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_index);
+    heap_fn_t const fn = (heap_fn_t)(ptr_uint_t)user_data;
+
+    if (data == NULL || data->heap_depth == 0 || --data->heap_depth > 0 || wrapcxt == NULL || fn == HEAP_FN_FREE)
+        return;
+    app_pc const ptr = (app_pc)drwrap_get_retval(wrapcxt);
+    sym_cache_check(data->heap_syms);
+    uint64 const site = lookup_symbol(data->heap_syms, data->heap_site);
+    dr_mutex_lock(heap_lock);
+    /* a failed realloc keeps the old block, realloc(p, 0) may free it */
+    if (data->heap_old != NULL && (ptr != NULL || data->heap_size == 0))
+        heap_index_free(&heap_index, (uint64)data->heap_old, data->heap_time);
+    if (ptr != NULL)
+        heap_index_add(&heap_index, (uint64)ptr, data->heap_size, site, data->threadID, data->heap_time);
+    dr_mutex_unlock(heap_lock);
+}
+
+/* heap_wrap_module wraps the allocators exported by the module or named
+ * in its symbols
+ */
+static void
+heap_wrap_module(const module_data_t* info) {
+    for (auto const& f : heap_functions) {
+        app_pc pc = (app_pc)dr_get_proc_address(info->handle, f.name);
+        size_t offs;
+        if (pc == NULL && info->full_path != NULL && drsym_lookup_symbol(info->full_path, f.name, &offs, DRSYM_LEAVE_MANGLED) == DRSYM_SUCCESS)
+            pc = info->start + offs;
+        /* fails harmlessly for an address wrapped before, e.g. a
+         * forwarded export
+         */
+        if (pc != NULL)
+            drwrap_wrap_ex(pc, heap_pre, heap_post, (void*)(ptr_uint_t)f.fn, 0);
+    }
+}
+
+/* data_module_t collects the variables of a module for -data_objects */
+typedef struct {
+    const module_data_t* info;
+    const char* name;
+    /* its readable, not executable regions */
+    std::vector<std::pair<app_pc, app_pc>> regions;
+    std::vector<data_var_t> vars;
+} data_module_t;
+
+static bool
+data_module_symbol(drsym_info_t* info, drsym_error_t status, void* arg) {
+    data_module_t* mod = (data_module_t*)arg;
+    app_pc const start = mod->info->start + info->start_offs;
+
+    if (info->name == NULL)
+        return true;
+    for (auto const& r : mod->regions) {
+        if (start < r.first || start >= r.second)
+            continue;
+        app_pc const end = mod->info->start + info->end_offs;
+        mod->vars.push_back(data_var_t{ (uint64)start, (uint64)(end < r.second ? end : r.second), (uint64)r.second,
+            std::string(mod->name) + "#" + info->name });
+        break;
+    }
+    return true;
+}
+
+/* data_module_load adds the variables of a module to data_table */
+static void
+data_module_load(const module_data_t* info) {
+    data_module_t mod;
+    dr_mem_info_t mem;
+
+    mod.info = info;
+    mod.name = module_name(info);
+    for (app_pc pc = info->start; pc < info->end; pc = mem.base_pc + mem.size) {
+        if (!dr_query_memory_ex(pc, &mem) || mem.base_pc + mem.size <= pc)
+            break;
+        if (mem.type != DR_MEMTYPE_FREE && (mem.prot & DR_MEMPROT_READ) && !(mem.prot & DR_MEMPROT_EXEC)) {
+            mod.regions.push_back(std::make_pair(mem.base_pc < info->start ? info->start : mem.base_pc,
+                mem.base_pc + mem.size > info->end ? info->end : mem.base_pc + mem.size));
+        }
+    }
+    if (mod.regions.empty() || info->full_path == NULL)
+        return;
+    drsym_enumerate_symbols_ex(info->full_path, data_module_symbol, sizeof(drsym_info_t), &mod,
+        DRSYM_DEMANGLE_PDB_TEMPLATES);
+    dr_mutex_lock(data_lock);
+    data_table_add(&data_table, mod.vars);
+    dr_mutex_unlock(data_lock);
+}
+
+/* filter_module_t collects the functions of a module selected by a
+ * filter_t, code_filter or roi_filter. Only their ranges change after
+ * dr_client_main, so the lists are read without holding mutex.
+ */
+typedef struct {
+    const module_data_t* info;
+    filter_t const* filter;
+    std::string name;
+    std::vector<filter_range_t> ranges;
+} filter_module_t;
+
+static bool
+filter_function(drsym_info_t* info, drsym_error_t status, void* arg) {
+    filter_module_t* mod = (filter_module_t*)arg;
+
+    /* a symbol of unknown size is no function */
+    if (info->name == NULL || info->end_offs <= info->start_offs)
+        return true;
+    if (filter_wants_function(mod->filter, mod->name, info->name)) {
+        mod->ranges.push_back(filter_range_t{ (uint64)(mod->info->start + info->start_offs),
+            (uint64)(mod->info->start + info->end_offs) });
+    }
+    return true;
+}
+
+/* filter_module_load adds the code of a module selected by -modules and
+ * -functions to code_filter
+ */
+static void
+filter_module_load(const module_data_t* info) {
+    filter_module_t mod;
+
+    mod.info = info;
+    mod.filter = &code_filter;
+    mod.name = module_name(info);
+    if (filter_wants_module(&code_filter, mod.name))
+        mod.ranges.push_back(filter_range_t{ (uint64)info->start, (uint64)info->end });
+    else if (filter_wants_functions_of(&code_filter, mod.name) && info->full_path != NULL)
+        drsym_enumerate_symbols_ex(info->full_path, filter_function, sizeof(drsym_info_t), &mod, DRSYM_DEMANGLE);
+    dr_mutex_lock(filter_lock);
+    for (auto const& r : mod.ranges)
+        filter_add(&code_filter, r.start, r.end);
+    dr_mutex_unlock(filter_lock);
+}
+
+/* Returns whether the block at tag is to be instrumented. */
+static bool
+filter_block(void* tag) {
+    bool wanted;
+
+    if (!options_filter_code())
+        return true;
+    dr_mutex_lock(filter_lock);
+    wanted = filter_contains(&code_filter, (uint64)tag);
+    dr_mutex_unlock(filter_lock);
+    return wanted;
+}
+
+/* roi_module_load records the entries of the ROI functions of a module */
+static void
+roi_module_load(const module_data_t* info) {
+    filter_module_t mod;
+    uint64 unused;
+
+    mod.info = info;
+    mod.filter = &roi_filter;
+    mod.name = module_name(info);
+    if (!filter_wants_functions_of(&roi_filter, mod.name) || info->full_path == NULL)
+        return;
+    drsym_enumerate_symbols_ex(info->full_path, filter_function, sizeof(drsym_info_t), &mod, DRSYM_DEMANGLE);
+    dr_mutex_lock(filter_lock);
+    for (auto const& r : mod.ranges) {
+        if (!pc_cache_find(&roi_entries, r.start, &unused))
+            pc_cache_insert(&roi_entries, r.start, 0);
+    }
+    dr_mutex_unlock(filter_lock);
+}
+
+/* The region of interest is open while any thread is inside it: in a call
+ * of a ROI function or between the annotations of the application. Blocks
+ * built while it is closed get no memory instrumentation, so whenever it
+ * opens or closes all code is flushed and instrumented anew as it runs.
+ * Every thread is traced while it is open, e.g. the workers of a parallel
+ * loop the ROI function started. A call leaves a ROI function once the
+ * stack pointer is back above where it was at the entry, which also drops
+ * calls left by longjmp or an exception.
+ */
+static bool
+roi_inside(per_thread_t* data) {
+    return !data->roi_calls->empty() || data->roi_marks > 0;
+}
+
+/* Returns whether blocks built now get memory instrumentation. */
+static bool
+roi_open(void) {
+    return !options_roi() || roi_threads.load(std::memory_order_acquire) > 0;
+}
+
+/* roi_switch accounts for the thread having entered or left the region.
+ * If that opened or closed it, execution resumes at pc in the new code,
+ * unless pc is NULL and the rest of the current block runs as it is.
+ */
+static void
+roi_switch(per_thread_t* data, bool was_inside, app_pc pc, dr_mcontext_t* mc) {
+    bool const inside = roi_inside(data);
+
+    if (inside == was_inside)
+        return;
+    if (inside ? roi_threads.fetch_add(1) != 0 : roi_threads.fetch_sub(1) != 1)
+        return;
+    if (!dr_unlink_flush_region(NULL, ~(size_t)0)) {
+        DR_ASSERT(false);
+        return;
+    }
+    if (pc == NULL)
+        return;
+    data->roi_redirect = pc;
+    mc->pc = pc;
+    dr_redirect_execution(mc);
+}
+
+/* roi_enter is called at the entry of a ROI function */
+static void
+roi_enter(app_pc pc) {
+    void* drcontext = dr_get_current_drcontext();
+    per_thread_t* data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_index);
+    dr_mcontext_t mc = { sizeof(mc), DR_MC_ALL };
+    app_pc ret;
+    uint64 unused;
+    bool known;
+
+    if (data == NULL)
+        return;
+    if (data->roi_redirect == pc) {
+        data->roi_redirect = NULL;
+        return;
+    }
+    if (!dr_get_mcontext(drcontext, &mc) || !dr_safe_read((void*)mc.xsp, sizeof(ret), &ret, NULL))
+        return;
+    dr_mutex_lock(filter_lock);
+    known = pc_cache_find(&roi_returns, (uint64)ret, &unused);
+    if (!known)
+        pc_cache_insert(&roi_returns, (uint64)ret, 0);
+    dr_mutex_unlock(filter_lock);
+    /* the block at a new return address is built again with roi_return */
+    if (!known)
+        dr_unlink_flush_region(ret, 1);
+    bool const was_inside = roi_inside(data);
+    data->roi_calls->push_back((uint64)mc.xsp);
+    roi_switch(data, was_inside, pc, &mc);
+}
+
+/* roi_return is called at every return address of a ROI function */
+static void
+roi_return(app_pc pc) {
+    void* drcontext = dr_get_current_drcontext();
+    per_thread_t* data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_index);
+    dr_mcontext_t mc = { sizeof(mc), DR_MC_ALL };
+
+    if (data == NULL)
+        return;
+    if (data->roi_redirect == pc) {
+        data->roi_redirect = NULL;
+        return;
+    }
+    if (data->roi_calls->empty() || !dr_get_mcontext(drcontext, &mc))
+        return;
+    bool const was_inside = roi_inside(data);
+    while (!data->roi_calls->empty() && data->roi_calls->back() < (uint64)mc.xsp)
+        data->roi_calls->pop_back();
+    roi_switch(data, was_inside, pc, &mc);
+}
+
+/* The annotations do not know the pc they were called from, so the new
+ * code only takes over at the next block.
+ */
+static void
+roi_annotation_start(void) {
+    per_thread_t* data = (per_thread_t*)drmgr_get_tls_field(dr_get_current_drcontext(), tls_index);
+
+    if (data == NULL)
+        return;
+    bool const was_inside = roi_inside(data);
+    data->roi_marks++;
+    roi_switch(data, was_inside, NULL, NULL);
+}
+
+static void
+roi_annotation_stop(void) {
+    per_thread_t* data = (per_thread_t*)drmgr_get_tls_field(dr_get_current_drcontext(), tls_index);
+
+    if (data == NULL || data->roi_marks == 0)
+        return;
+    bool const was_inside = roi_inside(data);
+    data->roi_marks--;
+    roi_switch(data, was_inside, NULL, NULL);
+}
+
+/* roi_find_triggers collects the triggers in bb. They are not limited to
+ * block starts, a trace runs through them.
+ */
+static std::vector<roi_trigger_t>*
+roi_find_triggers(instrlist_t* bb) {
+    std::vector<roi_trigger_t>* triggers = NULL;
+    uint64 unused;
+
+    dr_mutex_lock(filter_lock);
+    for (instr_t* instr = instrlist_first_app(bb); instr != NULL; instr = instr_get_next_app(instr)) {
+        app_pc const pc = instr_get_app_pc(instr);
+        /* an expanded string loop repeats its pc */
+        if (pc == NULL || (triggers != NULL && triggers->back().pc == pc))
+            continue;
+        bool const entry = pc_cache_find(&roi_entries, (uint64)pc, &unused);
+        bool const ret = pc_cache_find(&roi_returns, (uint64)pc, &unused);
+        if (!entry && !ret)
+            continue;
+        if (triggers == NULL)
+            triggers = new std::vector<roi_trigger_t>();
+        triggers->push_back(roi_trigger_t{ pc, entry, ret });
+    }
+    dr_mutex_unlock(filter_lock);
+    return triggers;
+}
+
+/* roi_instrument calls roi_return and roi_enter at pc if it is one of
+ * the triggers of the block
+ */
+static void
+roi_instrument(void* drcontext, instrlist_t* bb, instr_t* where, app_pc pc, std::vector<roi_trigger_t> const* triggers) {
+    auto it = std::find_if(triggers->begin(), triggers->end(), [pc](roi_trigger_t const& t) { return t.pc == pc; });
+
+    if (it == triggers->end())
+        return;
+    /* a call returning right into another one is left first */
+    if (it->ret) {
+        dr_insert_clean_call_ex(drcontext, bb, where, (void*)roi_return,
+            (dr_cleancall_save_t)(DR_CLEANCALL_READS_APP_CONTEXT | DR_CLEANCALL_MULTIPATH), 1, OPND_CREATE_INTPTR(pc));
+    }
+    if (it->entry) {
+        dr_insert_clean_call_ex(drcontext, bb, where, (void*)roi_enter,
+            (dr_cleancall_save_t)(DR_CLEANCALL_READS_APP_CONTEXT | DR_CLEANCALL_MULTIPATH), 1, OPND_CREATE_INTPTR(pc));
+    }
+}
+
+/* event_module_load records every module for regina-symbolize, wraps the
+ * allocators for -heap, reads the variables for -data_objects and finds the
+ * code to instrument and the ROI functions
+ */
+static void
+event_module_load(void* drcontext, const module_data_t* info, bool loaded) {
+    modtable_entry_t mod;
+
+    if (op_heap.get_value())
+        heap_wrap_module(info);
+    if (op_data_objects.get_value())
+        data_module_load(info);
+    if (options_filter_code())
+        filter_module_load(info);
+    if (!op_roi.get_value().empty())
+        roi_module_load(info);
+    if (module_table == NULL)
+        return;
+
+    mod.base = (uint64)info->start;
+    mod.size = (uint64)(info->end - info->start);
+#ifdef WINDOWS
+    mod.timestamp = info->timestamp;
+    mod.checksum = info->checksum;
+#else
+    mod.timestamp = 0;
+    mod.checksum = 0;
+#endif
+    mod.name = module_name(info);
+    mod.path = info->full_path == NULL ? "" : info->full_path;
+    dr_mutex_lock(mutex);
+    modtable_write_load(module_table, mod);
+    dr_mutex_unlock(mutex);
+}
+
+/* A module's pcs may be reused by the next module loaded at its address,
+ * so its symbol indices must be resolved again. Its code is flushed by DR
+ * and re-instrumented, which covers the indices embedded by -early_symbols.
+ */
+static void
+event_module_unload(void* drcontext, const module_data_t* info) {
+    dr_mutex_lock(mutex);
+    if (module_table != NULL)
+        modtable_write_unload(module_table, (uint64)info->start);
+    dr_mutex_unlock(mutex);
+    /* the counts of its code can only be symbolized while it is loaded */
+    if (op_count_only.get_value())
+        count_bank(info->start, info->end);
+    if (filter_lock != NULL) {
+        dr_mutex_lock(filter_lock);
+        if (options_filter_code())
+            filter_remove(&code_filter, (uint64)info->start, (uint64)info->end);
+        if (options_roi()) {
+            pc_cache_remove_range(&roi_entries, (uint64)info->start, (uint64)info->end);
+            pc_cache_remove_range(&roi_returns, (uint64)info->start, (uint64)info->end);
+        }
+        dr_mutex_unlock(filter_lock);
+    }
+    if (op_data_objects.get_value()) {
+        dr_mutex_lock(data_lock);
+        data_table_remove(&data_table, (uint64)info->start, (uint64)info->end);
+        dr_mutex_unlock(data_lock);
+    }
+    for (int i = 0; i < SYM_SHARDS; i++) {
+        dr_mutex_lock(pc_shards[i].lock);
+        pc_cache_remove_range(&pc_shards[i].pcs, (uint64)info->start, (uint64)info->end);
+        dr_mutex_unlock(pc_shards[i].lock);
+    }
+    sym_epoch.fetch_add(1, std::memory_order_release);
+}
+
+/* we transform string loops into regular loops so we can more easily
+ * monitor every memory reference they make
+ */
+static dr_emit_flags_t
+event_bb_app2app(void* drcontext, void* tag, instrlist_t* bb, bool for_trace,
+    bool translating) {
+    if (!filter_block(tag) || !roi_open())
+        return DR_EMIT_DEFAULT;
+    if (!drutil_expand_rep_string(drcontext, bb)) {
+        DR_ASSERT(false);
+        /* in release build, carry on: we'll just miss per-iter refs */
+    }
+    if (!drx_expand_scatter_gather(drcontext, bb, NULL)) {
+        DR_ASSERT(false);
+    }
+    return DR_EMIT_DEFAULT;
+}
+
+/* Returns whether every memory reference of bb executes exactly once per
+ * execution of the block and all of them fit into one TRACE_TYPE_BB entry.
+ * Expanded string loops, scatter/gather sequences and other internal
+ * control flow rule that out.
+ */
+static bool
+bb_fits_single_entry(instrlist_t* bb) {
+    instr_t* instr;
+    uint num_refs = 0;
+    int i;
+
+    for (instr = instrlist_first(bb); instr != NULL; instr = instr_get_next(instr)) {
+        if (drmgr_is_emulation_start(instr))
+            return false;
+        if (instr_is_cti(instr) && instr != instrlist_last(bb))
+            return false;
+        if (!instr_is_app(instr))
+            continue;
+        if (instr_reads_memory(instr)) {
+            for (i = 0; i < instr_num_srcs(instr); i++) {
+                if (opnd_is_memory_reference(instr_get_src(instr, i)))
+                    num_refs++;
+            }
+        }
+        if (instr_writes_memory(instr)) {
+            for (i = 0; i < instr_num_dsts(instr); i++) {
+                if (opnd_is_memory_reference(instr_get_dst(instr, i)))
+                    num_refs++;
+            }
+        }
+    }
+    return num_refs > 0 && num_refs <= TRACE_BB_MAX_REFS;
+}
+
+static dr_emit_flags_t
+event_bb_analysis(void* drcontext, void* tag, instrlist_t* bb, bool for_trace,
+    bool translating, void** user_data) {
+    instru_data_t* data = (instru_data_t*)dr_thread_alloc(drcontext, sizeof(*data));
+    data->last_pc = NULL;
+    data->bb = NULL;
+    data->bb_entry = op_trace_bb.get_value() && bb_fits_single_entry(bb);
+    data->num_bb_refs = 0;
+    data->count = NULL;
+    data->translating = translating;
+    data->skip = !filter_block(tag) || !roi_open();
+    data->roi_triggers = options_roi() ? roi_find_triggers(bb) : NULL;
+    *user_data = (void*)data;
+    /* a block built before the region opened or closed may still have to
+     * be translated, keep its translations
+     */
+    if (data->skip)
+        return options_roi() ? DR_EMIT_STORE_TRANSLATIONS : DR_EMIT_DEFAULT;
+    /* When translating we must only reproduce the same code, so no new
+     * descriptor is registered.
+     */
+    if (data->bb_entry && !translating) {
+        data->bb = new bb_desc_t;
+        data->bb->tag = (app_pc)tag;
+    }
+    if (op_count_only.get_value()) {
+        /* a block whose references execute once per run needs a single
+         * counter for all of them
+         */
+        if (bb_fits_single_entry(bb))
+            data->count = translating ? count_scratch : count_alloc();
+        /* every instrumentation gets new counters, keep the translations */
+        return DR_EMIT_STORE_TRANSLATIONS;
+    }
+    return options_roi() ? DR_EMIT_STORE_TRANSLATIONS : DR_EMIT_DEFAULT;
+}
+
+static void
+instru_data_free(void* drcontext, instru_data_t* data) {
+    delete data->roi_triggers;
+    dr_thread_free(drcontext, data, sizeof(*data));
+}
+
+/* event_bb_insert calls instrument_mem to instrument every
+ * application memory reference.
+ */
+static dr_emit_flags_t
+event_bb_insert(void* drcontext, void* tag, instrlist_t* bb, instr_t* where,
+    bool for_trace, bool translating, void* user_data) {
+    int i;
+    instru_data_t* data = (instru_data_t*)user_data;
+    /* Use the drmgr_orig_app_instr_* interface to properly handle our own use
+     * of drutil_expand_rep_string() and drx_expand_scatter_gather() (as well
+     * as another client/library emulating the instruction stream).
+     */
+    instr_t* instr_fetch = drmgr_orig_app_instr_for_fetch(drcontext);
+    if (instr_fetch != NULL) {
+        data->last_pc = instr_get_app_pc(instr_fetch);
+        if (data->roi_triggers != NULL)
+            roi_instrument(drcontext, bb, where, data->last_pc, data->roi_triggers);
+    }
+    if (data->skip) {
+        if (drmgr_is_last_instr(drcontext, where))
+            instru_data_free(drcontext, data);
+        return DR_EMIT_DEFAULT;
+    }
+    app_pc last_pc = data->last_pc;
+    bool is_cti = false;
+
+    instr_t* instr_operands = drmgr_orig_app_instr_for_operands(drcontext);
+    if (op_count_only.get_value()) {
+        /* only counters, no buffer and no calls */
+        if (drmgr_is_first_instr(drcontext, where) && data->count != NULL) {
+            drx_insert_counter_update(drcontext, bb, where, (dr_spill_slot_t)(SPILL_SLOT_MAX + 1),
+                data->count, 1, DRX_COUNTER_64BIT);
+        }
+        if (instr_operands != NULL && (instr_writes_memory(instr_operands) || instr_reads_memory(instr_operands))) {
+            for (i = 0; i < instr_num_srcs(instr_operands); i++) {
+                if (opnd_is_memory_reference(instr_get_src(instr_operands, i)))
+                    instrument_count(drcontext, bb, where, last_pc, instr_operands, i, false, data);
+            }
+            for (i = 0; i < instr_num_dsts(instr_operands); i++) {
+                if (opnd_is_memory_reference(instr_get_dst(instr_operands, i)))
+                    instrument_count(drcontext, bb, where, last_pc, instr_operands, i, true, data);
+            }
+        }
+        if (drmgr_is_last_instr(drcontext, where))
+            instru_data_free(drcontext, data);
+        return DR_EMIT_DEFAULT;
+    }
+    if (instr_operands != NULL && (instr_writes_memory(instr_operands) || instr_reads_memory(instr_operands))) {
+        DR_ASSERT(instr_is_app(instr_operands));
+        DR_ASSERT(last_pc != NULL);
+
+        is_cti = instr_is_call_direct(instr_operands) || instr_is_call_indirect(instr_operands) || instr_is_return(instr_operands);
+        /* In basic block mode the call entry has to follow the block entry */
+        if (is_cti && !data->bb_entry)
+            instrument_call(drcontext, bb, where, last_pc, instr_operands);
+
+        if (instr_reads_memory(instr_operands)) {
+            for (i = 0; i < instr_num_srcs(instr_operands); i++) {
+                if (opnd_is_memory_reference(instr_get_src(instr_operands, i))) {
+                    if (data->bb_entry)
+                        instrument_bb_mem(drcontext, bb, where, last_pc, instr_operands, i, false, data);
+                    else
+                        instrument_mem(drcontext, bb, where, last_pc, instr_operands, i, false);
+                }
+            }
+        }
+        if (instr_writes_memory(instr_operands)) {
+            for (i = 0; i < instr_num_dsts(instr_operands); i++) {
+                if (opnd_is_memory_reference(instr_get_dst(instr_operands, i))) {
+                    if (data->bb_entry)
+                        instrument_bb_mem(drcontext, bb, where, last_pc, instr_operands, i, true, data);
+                    else
+                        instrument_mem(drcontext, bb, where, last_pc, instr_operands, i, true);
+                }
+            }
+        }
+    }
+
+    if (drmgr_is_last_instr(drcontext, where)) {
+        if (data->bb_entry) {
+            instrument_bb_commit(drcontext, bb, where, data);
+            if (is_cti)
+                instrument_call(drcontext, bb, where, last_pc, instr_operands);
+        }
+        instru_data_free(drcontext, data);
+    }
+    return DR_EMIT_DEFAULT;
+}
+
+/* write_entries dumps size bytes of entries starting at base to the log
+ * file of the per_thread_t stream. It runs on the writer thread unless
+ * -num_buffers is 0.
+ */
+static void
+write_entries(void* stream, char* base, size_t size) {
+    per_thread_t* data = (per_thread_t*)stream;
+    FILE* f = data->logf;
+    char* entry;
+
+    if (data->sim != NULL) {
+        simulate_entries(data->sim, base, size);
+        return;
+    }
+    /* -count_only, only the time stamps end up here */
+    if (f == NULL)
+        return;
+    if (data->conv != NULL) {
+        convert_entries(data->conv, base, size);
+        return;
+    }
+    if (!options_text_output()) {
+        //dr_write_file(data->log, base, size);
+        if (data->enc_buf != NULL) {
+            codec_block_header_t block;
+            block.raw_size = (uint32_t)size;
+            block.encoded_size = (uint32_t)codec_encode_entries(base, size, data->enc_buf);
+            fwrite(&block, sizeof(block), 1, f);
+            fwrite(data->enc_buf, block.encoded_size, 1, f);
+            return;
+        }
+        fwrite(base, size, 1, f);
+        return;
+    }
+    /* We use libc's fprintf as it is buffered and much faster than dr_fprintf
+     * for repeated printing that dominates performance, as the printing does here.
+     */
+    for (entry = base; entry < base + size;) {
+        uint64 header = *(uint64*)entry;
+        /* We use PIFX to avoid leading zeroes and shrink the resulting file. */
+        if (trace_is_mem(header)) {
+            mem_entry_t* mem_ref = (mem_entry_t*)entry;
+            fprintf(f, PIFX ",%c,%d," PIFX "\n", (ptr_uint_t)trace_get_pc(header),
+                trace_get_type(header) == TRACE_TYPE_WRITE ? 'w' : 'r',
+                (int)trace_get_size(header), (ptr_uint_t)mem_ref->addr);
+        } else if (trace_get_type(header) == TRACE_TYPE_BB) {
+            bb_desc_t* desc = lookup_bb(trace_get_pc(header));
+            uint64* addr = (uint64*)entry + 1;
+            for (uint j = 0; desc != NULL && j < trace_get_size(header) && j < desc->refs.size(); j++) {
+                fprintf(f, PIFX ",%c,%d," PIFX "\n", (ptr_uint_t)desc->refs[j].pc,
+                    desc->refs[j].write ? 'w' : 'r', (int)desc->refs[j].size,
+                    (ptr_uint_t)addr[j]);
+            }
+        } else if (trace_get_type(header) == TRACE_TYPE_TIME) {
+            fprintf(f, "0,t,0," UINT64_FORMAT_STRING "\n", (uint64)((time_entry_t*)entry)->time);
+        } else {
+            call_entry_t* call_ref = (call_entry_t*)entry;
+            trace_type_t type = trace_get_type(header);
+            fprintf(f, PIFX ",%c,%d," PIFX "\n", (ptr_uint_t)trace_get_pc(header),
+                type == TRACE_TYPE_CALL ? 'c' : (type == TRACE_TYPE_CALL_IND ? 'i' : 'e'), 0,
+                (ptr_uint_t)call_ref->target);
+        }
+        entry += trace_entry_size(header);
+    }
+}
+
+/* flush_buffer hands size bytes of entries starting at base, which stay
+ * owned by the caller, to be written to the thread's log file, followed by
+ * a time stamp with -timestamps.
+ */
+static void
+flush_buffer(per_thread_t* data, char* base, size_t size) {
+    data->num_refs += size / TRACE_ENTRY_SIZE;
+    if (data->pool != NULL) {
+        trace_buffer_t* buf = writer_acquire(data->pool);
+        if (size > 0)
+            memcpy(buf->base, base, size);
+        buf->size = size;
+        if (op_timestamps.get_value())
+            buf->size = (size_t)(put_time_entry(buf->base + size) - buf->base);
+        writer_submit(buf);
+    } else {
+        time_entry_t stamp;
+        if (size > 0)
+            write_entries(data, base, size);
+        if (op_timestamps.get_value()) {
+            put_time_entry((char*)&stamp);
+            write_entries(data, (char*)&stamp, sizeof(stamp));
         }
     }
-    return DR_EMIT_DEFAULT;
 }
 
 static void
 memtrace(void* drcontext) {
     per_thread_t* data;
-    int num_refs;
-    mem_ref_t* mem_ref;
-#ifdef OUTPUT_TEXT
-    int i;
-#endif
 
     data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_index);
-    mem_ref = (mem_ref_t*)data->buf_base;
-    num_refs = (int)((mem_ref_t*)data->buf_ptr - mem_ref);
-
-#ifdef OUTPUT_TEXT
-    /* We use libc's fprintf as it is buffered and much faster than dr_fprintf
-     * for repeated printing that dominates performance, as the printing does here.
-     */
-    for (i = 0; i < num_refs; i++) {
-        /* We use PIFX to avoid leading zeroes and shrink the resulting file. */
-        fprintf(data->logf, PIFX ",%c,%d," PIFX "\n", (ptr_uint_t)mem_ref->pc,
-            mem_ref->write ? 'w' : 'r', (int)mem_ref->size,
-            (ptr_uint_t)mem_ref->addr);
-        ++mem_ref;
+    if (trace_buffer != NULL) {
+        char* base = (char*)drx_buf_get_buffer_base(drcontext, trace_buffer);
+        char* ptr = (char*)drx_buf_get_buffer_ptr(drcontext, trace_buffer);
+        flush_buffer(data, base, (size_t)(ptr - base));
+        drx_buf_set_buffer_ptr(drcontext, trace_buffer, (byte*)base);
+    } else if (data->pool != NULL) {
+        /* swap in the next free buffer instead of waiting for the write */
+        if (op_timestamps.get_value())
+            data->buf_ptr = put_time_entry(data->buf_ptr);
+        data->cur->size = (size_t)(data->buf_ptr - data->buf_base);
+        data->num_refs += data->cur->size / TRACE_ENTRY_SIZE;
+        writer_submit(data->cur);
+        data->cur = writer_acquire(data->pool);
+        set_thread_buffer(data, data->cur->base);
+    } else {
+        flush_buffer(data, data->buf_base, (size_t)(data->buf_ptr - data->buf_base));
+        data->buf_ptr = data->buf_base;
     }
-#else
-    //dr_write_file(data->log, data->buf_base, (size_t)(data->buf_ptr - data->buf_base));
-    fwrite(data->buf_base, (size_t)(data->buf_ptr - data->buf_base), 1, data->logf);
-#endif
+}
 
-    memset(data->buf_base, 0, MEM_BUF_SIZE);
-    data->num_refs += num_refs;
-    data->buf_ptr = data->buf_base;
+/* trace_buffer_full is called by drx_buf when the guard page is hit */
+static void
+trace_buffer_full(void* drcontext, void* buf_base, size_t size) {
+    per_thread_t* data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_index);
+    if (data == NULL || size == 0)
+        return;
+    flush_buffer(data, (char*)buf_base, size);
 }
 
 /* clean_call dumps the memory reference info to the log file */
@@ -728,6 +2857,157 @@ code_cache_exit(void) {
     dr_nonheap_free(code_cache, page_size);
 }
 
+/*
+ * insert_load_buf_ptr inserts code to load data->buf_ptr, or the drx_buf
+ * pointer in fault mode, into reg_ptr.
+ */
+static void
+insert_load_buf_ptr(void* drcontext, instrlist_t* ilist, instr_t* where, reg_id_t reg_ptr) {
+    opnd_t opnd1, opnd2;
+    instr_t* instr;
+
+    if (trace_buffer != NULL) {
+        drx_buf_insert_load_buf_ptr(drcontext, trace_buffer, ilist, where, reg_ptr);
+        return;
+    }
+
+    drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg_ptr);
+    /* Load data->buf_ptr into reg_ptr */
+    opnd1 = opnd_create_reg(reg_ptr);
+    opnd2 = OPND_CREATE_MEMPTR(reg_ptr, offsetof(per_thread_t, buf_ptr));
+    instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
+    instrlist_meta_preinsert(ilist, where, instr);
+}
+
+/*
+ * insert_update_buf_ptr advances the buffer pointer held in reg_ptr by
+ * stride bytes, writes it back to data->buf_ptr and jumps to our own code
+ * cache to call the clean_call when the buffer is full. In fault mode
+ * drx_buf detects a full buffer on its own.
+ * reg_ptr must be ECX or RCX, it carries the return address of the lean
+ * procedure; reg_tmp is clobbered.
+ */
+static void
+insert_update_buf_ptr(void* drcontext, instrlist_t* ilist, instr_t* where, reg_id_t reg_ptr,
+    reg_id_t reg_tmp, int stride) {
+    instr_t *instr, *call, *restore;
+    opnd_t opnd1, opnd2;
+
+    /* With a drx_buf trace buffer the next store past the end faults into
+     * its guard page, so only the pointer update is needed.
+     */
+    if (trace_buffer != NULL) {
+        drx_buf_insert_update_buf_ptr(drcontext, trace_buffer, ilist, where, reg_ptr, reg_tmp,
+            (ushort)stride);
+        return;
+    }
+
+    /* Increment reg value by pointer size using lea instr */
+    opnd1 = opnd_create_reg(reg_ptr);
+    opnd2 = opnd_create_base_disp(reg_ptr, DR_REG_NULL, 0, stride, OPSZ_lea);
+    instr = INSTR_CREATE_lea(drcontext, opnd1, opnd2);
+    instrlist_meta_preinsert(ilist, where, instr);
+
+    /* Update the data->buf_ptr */
+    drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg_tmp);
+    opnd1 = OPND_CREATE_MEMPTR(reg_tmp, offsetof(per_thread_t, buf_ptr));
+    opnd2 = opnd_create_reg(reg_ptr);
+    instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
+    instrlist_meta_preinsert(ilist, where, instr);
+
+    restore = INSTR_CREATE_label(drcontext);
+    call = INSTR_CREATE_label(drcontext);
+    if (op_trace_bb.get_value()) {
+        /* Basic block entries vary in length, so the pointer may step over
+         * the end of the buffer instead of hitting it. Compare against
+         * buf_limit; the buffer has room for one more entry beyond it.
+         */
+        if (drreg_reserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS)
+            DR_ASSERT(false);
+        opnd1 = opnd_create_reg(reg_ptr);
+        opnd2 = OPND_CREATE_MEMPTR(reg_tmp, offsetof(per_thread_t, buf_limit));
+        instr = INSTR_CREATE_cmp(drcontext, opnd1, opnd2);
+        instrlist_meta_preinsert(ilist, where, instr);
+
+        /* jb restore to skip clean call */
+        opnd1 = opnd_create_instr(restore);
+        instr = INSTR_CREATE_jcc(drcontext, OP_jb, opnd1);
+        instrlist_meta_preinsert(ilist, where, instr);
+    } else {
+        /* we use lea + jecxz trick for better performance
+         * lea and jecxz won't disturb the eflags, so we won't insert
+         * code to save and restore application's eflags.
+         */
+        /* lea [reg_ptr - buf_end] => reg_ptr */
+        opnd1 = opnd_create_reg(reg_tmp);
+        opnd2 = OPND_CREATE_MEMPTR(reg_tmp, offsetof(per_thread_t, buf_end));
+        instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
+        instrlist_meta_preinsert(ilist, where, instr);
+        opnd1 = opnd_create_reg(reg_ptr);
+        opnd2 = opnd_create_base_disp(reg_tmp, reg_ptr, 1, 0, OPSZ_lea);
+        instr = INSTR_CREATE_lea(drcontext, opnd1, opnd2);
+        instrlist_meta_preinsert(ilist, where, instr);
+
+        /* jecxz call */
+        opnd1 = opnd_create_instr(call);
+        instr = INSTR_CREATE_jecxz(drcontext, opnd1);
+        instrlist_meta_preinsert(ilist, where, instr);
+
+        /* jump restore to skip clean call */
+        opnd1 = opnd_create_instr(restore);
+        instr = INSTR_CREATE_jmp(drcontext, opnd1);
+        instrlist_meta_preinsert(ilist, where, instr);
+    }
+
+    /* clean call */
+    /* We jump to lean procedure which performs full context switch and
+     * clean call invocation. This is to reduce the code cache size.
+     */
+    instrlist_meta_preinsert(ilist, where, call);
+    /* mov restore DR_REG_XCX */
+    opnd1 = opnd_create_reg(reg_ptr);
+    /* this is the return address for jumping back from lean procedure */
+    opnd2 = opnd_create_instr(restore);
+    /* We could use instrlist_insert_mov_instr_addr(), but with a register
+     * destination we know we can use a 64-bit immediate.
+     */
+    instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
+    instrlist_meta_preinsert(ilist, where, instr);
+    /* jmp code_cache */
+    opnd1 = opnd_create_pc(code_cache);
+    instr = INSTR_CREATE_jmp(drcontext, opnd1);
+    instrlist_meta_preinsert(ilist, where, instr);
+
+    instrlist_meta_preinsert(ilist, where, restore);
+    if (op_trace_bb.get_value() && drreg_unreserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS)
+        DR_ASSERT(false);
+}
+
+/* instr_pc_field returns what a memory entry records for the instruction
+ * at pc: the pc itself, or with -early_symbols its symbol index, resolved
+ * once here instead of once per executed reference during conversion.
+ */
+static uint64
+instr_pc_field(app_pc pc) {
+    bool resolved;
+
+    if (!op_early_symbols.get_value())
+        return (uint64)pc;
+    uint64 const idx = resolve_symbol(pc, &resolved);
+    if (resolved)
+        sym_early.fetch_add(1, std::memory_order_relaxed);
+    return idx;
+}
+
+/* ref_is_tls returns whether -data_objects flags ref as a thread local
+ * storage reference, see data.h
+ */
+static bool
+ref_is_tls(opnd_t ref) {
+    return op_data_objects.get_value() && opnd_is_far_base_disp(ref)
+        && (opnd_get_segment(ref) == DR_SEG_FS || opnd_get_segment(ref) == DR_SEG_GS);
+}
+
 /*
  * instrument_mem is called whenever a memory reference is identified.
  * It inserts code before the memory reference to to fill the memory buffer
@@ -736,13 +3016,10 @@ code_cache_exit(void) {
 static void
 instrument_mem(void* drcontext, instrlist_t* ilist, instr_t* where, app_pc pc,
     instr_t* memref_instr, int pos, bool write) {
-    instr_t *instr, *call, *restore;
+    instr_t* instr;
     opnd_t ref, opnd1, opnd2;
     reg_id_t reg1, reg2;
     drvector_t allowed;
-    per_thread_t* data;
-
-    data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_index);
 
     /* Steal two scratch registers.
      * reg2 must be ECX or RCX for jecxz.
@@ -765,127 +3042,347 @@ instrument_mem(void* drcontext, instrlist_t* ilist, instr_t* where, app_pc pc,
     drutil_insert_get_mem_addr(drcontext, ilist, where, ref, reg1, reg2);
 
     /* The following assembly performs the following instructions
-     * buf_ptr->write = write;
-     * buf_ptr->addr  = addr;
-     * buf_ptr->size  = size;
-     * buf_ptr->pc    = pc;
+     * buf_ptr->header = type | size | pc;
+     * buf_ptr->addr   = addr;
      * buf_ptr++;
      * if (buf_ptr >= buf_end_ptr)
      *    clean_call();
      */
-    drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg2);
-    /* Load data->buf_ptr into reg2 */
-    opnd1 = opnd_create_reg(reg2);
-    opnd2 = OPND_CREATE_MEMPTR(reg2, offsetof(per_thread_t, buf_ptr));
-    instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
-
-    /* Set memRef */
-    opnd1 = OPND_CREATE_MEM32(reg2, offsetof(mem_ref_t, memRef));
-    opnd2 = OPND_CREATE_INT32(true);
-    instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
-
-    /* Set call */
-    opnd1 = OPND_CREATE_MEM32(reg2, offsetof(mem_ref_t, call));
-    opnd2 = OPND_CREATE_INT32(false);
-    instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
+    insert_load_buf_ptr(drcontext, ilist, where, reg2);
 
-    /* Set ind */
-    opnd1 = OPND_CREATE_MEM32(reg2, offsetof(mem_ref_t, ind));
-    opnd2 = OPND_CREATE_INT32(false);
-    instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
-
-    /* Move write/read to write field */
-    opnd1 = OPND_CREATE_MEM32(reg2, offsetof(mem_ref_t, write));
-    opnd2 = OPND_CREATE_INT32(write);
-    instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
+    /* Store the header word. Type, size and pc are all known statically
+     * and share one pointer-sized immediate.
+     * drutil_opnd_mem_size_in_bytes handles OP_enter.
+     */
+    opnd1 = OPND_CREATE_MEMPTR(reg2, offsetof(mem_entry_t, header));
+    instrlist_insert_mov_immed_ptrsz(drcontext,
+        (ptr_int_t)(trace_make_header(write ? TRACE_TYPE_WRITE : TRACE_TYPE_READ,
+                        drutil_opnd_mem_size_in_bytes(ref, memref_instr), instr_pc_field(pc))
+            | (ref_is_tls(ref) ? TRACE_FLAG_TLS : 0)),
+        opnd1, ilist, where, NULL, NULL);
 
     /* Store address in memory ref */
-    opnd1 = OPND_CREATE_MEMPTR(reg2, offsetof(mem_ref_t, addr));
+    opnd1 = OPND_CREATE_MEMPTR(reg2, offsetof(mem_entry_t, addr));
     opnd2 = opnd_create_reg(reg1);
     instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
     instrlist_meta_preinsert(ilist, where, instr);
 
-    /* Store size in memory ref */
-    opnd1 = OPND_CREATE_MEMPTR(reg2, offsetof(mem_ref_t, size));
-    /* drutil_opnd_mem_size_in_bytes handles OP_enter */
-    opnd2 = OPND_CREATE_INT32(drutil_opnd_mem_size_in_bytes(ref, memref_instr));
-    instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
+    insert_update_buf_ptr(drcontext, ilist, where, reg2, reg1, sizeof(mem_entry_t));
+
+    /* Restore scratch registers */
+    if (drreg_unreserve_register(drcontext, ilist, where, reg1) != DRREG_SUCCESS || drreg_unreserve_register(drcontext, ilist, where, reg2) != DRREG_SUCCESS)
+        DR_ASSERT(false);
+}
+
+/*
+ * instrument_call is called for every direct call, indirect call and return.
+ * It fills the memory buffer inline, just like instrument_mem, so recording
+ * a call or return does not cost a clean call and an fwrite of its own.
+ */
+static void
+instrument_call(void* drcontext, instrlist_t* ilist, instr_t* where, app_pc pc,
+    instr_t* cti_instr) {
+    instr_t* instr;
+    opnd_t target, opnd1, opnd2;
+    reg_id_t reg1, reg2;
+    drvector_t allowed;
+    bool direct = instr_is_call_direct(cti_instr);
+    bool ind = instr_is_call_indirect(cti_instr);
+    trace_type_t type;
+
+    /* reg2 must be ECX or RCX for jecxz. */
+    drreg_init_and_fill_vector(&allowed, false);
+    drreg_set_vector_entry(&allowed, DR_REG_XCX, true);
+    if (drreg_reserve_register(drcontext, ilist, where, &allowed, &reg2) != DRREG_SUCCESS || drreg_reserve_register(drcontext, ilist, where, NULL, &reg1) != DRREG_SUCCESS) {
+        DR_ASSERT(false); /* cannot recover */
+        drvector_delete(&allowed);
+        return;
+    }
+    drvector_delete(&allowed);
 
-    /* Store pc in memory ref */
-    /* For 64-bit, we can't use a 64-bit immediate so we split pc into two halves.
-     * We could alternatively load it into reg1 and then store reg1.
-     * We use a convenience routine that does the two-step store for us.
+    /* Fetch the dynamic target into reg1 before reg2 is taken by buf_ptr:
+     * a return pops its target from the stack, an indirect call reads it
+     * from a register or from memory.
      */
-    opnd1 = OPND_CREATE_MEMPTR(reg2, offsetof(mem_ref_t, pc));
-    instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t)pc, opnd1, ilist, where, NULL,
-        NULL);
+    if (instr_is_return(cti_instr)) {
+        opnd1 = opnd_create_reg(reg1);
+        opnd2 = OPND_CREATE_MEMPTR(DR_REG_XSP, 0);
+        instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
+        instrlist_meta_preinsert(ilist, where, instr);
+    } else if (ind) {
+        target = instr_get_target(cti_instr);
+        if (opnd_is_reg(target)) {
+            /* the app value may live in a drreg spill slot */
+            if (drreg_get_app_value(drcontext, ilist, where, opnd_get_reg(target), reg1) != DRREG_SUCCESS)
+                DR_ASSERT(false);
+        } else {
+            drutil_insert_get_mem_addr(drcontext, ilist, where, target, reg1, reg2);
+            opnd1 = opnd_create_reg(reg1);
+            opnd2 = OPND_CREATE_MEMPTR(reg1, 0);
+            instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
+            instrlist_meta_preinsert(ilist, where, instr);
+        }
+    }
 
-    /* Increment reg value by pointer size using lea instr */
-    opnd1 = opnd_create_reg(reg2);
-    opnd2 = opnd_create_base_disp(reg2, DR_REG_NULL, 0, sizeof(mem_ref_t), OPSZ_lea);
-    instr = INSTR_CREATE_lea(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
+    /* The following assembly performs the following instructions
+     * buf_ptr->header = type | pc;
+     * buf_ptr->target = target;
+     * buf_ptr++;
+     * if (buf_ptr >= buf_end_ptr)
+     *    clean_call();
+     */
+    insert_load_buf_ptr(drcontext, ilist, where, reg2);
 
-    /* Update the data->buf_ptr */
-    drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg1);
-    opnd1 = OPND_CREATE_MEMPTR(reg1, offsetof(per_thread_t, buf_ptr));
-    opnd2 = opnd_create_reg(reg2);
-    instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
+    /* Store the header word */
+    if (instr_is_return(cti_instr))
+        type = TRACE_TYPE_RETURN;
+    else
+        type = ind ? TRACE_TYPE_CALL_IND : TRACE_TYPE_CALL;
+    opnd1 = OPND_CREATE_MEMPTR(reg2, offsetof(call_entry_t, header));
+    instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t)trace_make_header(type, 0, (uint64)pc),
+        opnd1, ilist, where, NULL, NULL);
+
+    /* Store target in call ref */
+    opnd1 = OPND_CREATE_MEMPTR(reg2, offsetof(call_entry_t, target));
+    if (direct) {
+        instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t)instr_get_branch_target_pc(cti_instr),
+            opnd1, ilist, where, NULL, NULL);
+    } else {
+        opnd2 = opnd_create_reg(reg1);
+        instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
+        instrlist_meta_preinsert(ilist, where, instr);
+    }
+
+    insert_update_buf_ptr(drcontext, ilist, where, reg2, reg1, sizeof(call_entry_t));
+
+    /* Restore scratch registers */
+    if (drreg_unreserve_register(drcontext, ilist, where, reg1) != DRREG_SUCCESS || drreg_unreserve_register(drcontext, ilist, where, reg2) != DRREG_SUCCESS)
+        DR_ASSERT(false);
+
+    if (op_timestamps.get_value())
+        instrument_time(drcontext, ilist, where);
+}
+
+/*
+ * instrument_time stores a TRACE_TYPE_TIME entry with the time stamp counter
+ * after every call and return entry, so calls get their own time instead of
+ * the time of the last buffer flush.
+ */
+static void
+instrument_time(void* drcontext, instrlist_t* ilist, instr_t* where) {
+    instr_t* instr;
+    opnd_t opnd1, opnd2;
+    reg_id_t reg_ax, reg_dx, reg_ptr;
+    drvector_t allowed;
+
+    /* rdtsc writes EDX:EAX, the lean procedure needs ECX or RCX */
+    drreg_init_and_fill_vector(&allowed, false);
+    drreg_set_vector_entry(&allowed, DR_REG_XAX, true);
+    if (drreg_reserve_register(drcontext, ilist, where, &allowed, &reg_ax) != DRREG_SUCCESS) {
+        DR_ASSERT(false); /* cannot recover */
+        drvector_delete(&allowed);
+        return;
+    }
+    drreg_set_vector_entry(&allowed, DR_REG_XAX, false);
+    drreg_set_vector_entry(&allowed, DR_REG_XDX, true);
+    if (drreg_reserve_register(drcontext, ilist, where, &allowed, &reg_dx) != DRREG_SUCCESS) {
+        DR_ASSERT(false);
+        drvector_delete(&allowed);
+        return;
+    }
+    drreg_set_vector_entry(&allowed, DR_REG_XDX, false);
+    drreg_set_vector_entry(&allowed, DR_REG_XCX, true);
+    if (drreg_reserve_register(drcontext, ilist, where, &allowed, &reg_ptr) != DRREG_SUCCESS) {
+        DR_ASSERT(false);
+        drvector_delete(&allowed);
+        return;
+    }
+    drvector_delete(&allowed);
 
-    /* we use lea + jecxz trick for better performance
-     * lea and jecxz won't disturb the eflags, so we won't insert
-     * code to save and restore application's eflags.
+    /* The following assembly performs the following instructions
+     * buf_ptr->header = TRACE_TYPE_TIME;
+     * buf_ptr->time   = rdtsc();
+     * buf_ptr++;
+     * if (buf_ptr >= buf_end_ptr)
+     *    clean_call();
+     * The two halves of the counter are stored separately, which leaves
+     * the eflags alone.
      */
-    /* lea [reg2 - buf_end] => reg2 */
-    opnd1 = opnd_create_reg(reg1);
-    opnd2 = OPND_CREATE_MEMPTR(reg1, offsetof(per_thread_t, buf_end));
-    instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
+    instrlist_meta_preinsert(ilist, where, INSTR_CREATE_rdtsc(drcontext));
+    insert_load_buf_ptr(drcontext, ilist, where, reg_ptr);
+    opnd1 = OPND_CREATE_MEMPTR(reg_ptr, offsetof(time_entry_t, header));
+    instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t)trace_make_header(TRACE_TYPE_TIME, 0, 0),
+        opnd1, ilist, where, NULL, NULL);
+    opnd1 = OPND_CREATE_MEM32(reg_ptr, offsetof(time_entry_t, time));
+    opnd2 = opnd_create_reg(DR_REG_EAX);
+    instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
     instrlist_meta_preinsert(ilist, where, instr);
-    opnd1 = opnd_create_reg(reg2);
-    opnd2 = opnd_create_base_disp(reg1, reg2, 1, 0, OPSZ_lea);
-    instr = INSTR_CREATE_lea(drcontext, opnd1, opnd2);
+    opnd1 = OPND_CREATE_MEM32(reg_ptr, offsetof(time_entry_t, time) + 4);
+    opnd2 = opnd_create_reg(DR_REG_EDX);
+    instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
     instrlist_meta_preinsert(ilist, where, instr);
 
-    /* jecxz call */
-    call = INSTR_CREATE_label(drcontext);
-    opnd1 = opnd_create_instr(call);
-    instr = INSTR_CREATE_jecxz(drcontext, opnd1);
-    instrlist_meta_preinsert(ilist, where, instr);
+    insert_update_buf_ptr(drcontext, ilist, where, reg_ptr, reg_ax, sizeof(time_entry_t));
 
-    /* jump restore to skip clean call */
-    restore = INSTR_CREATE_label(drcontext);
-    opnd1 = opnd_create_instr(restore);
-    instr = INSTR_CREATE_jmp(drcontext, opnd1);
-    instrlist_meta_preinsert(ilist, where, instr);
+    /* Restore scratch registers */
+    if (drreg_unreserve_register(drcontext, ilist, where, reg_ptr) != DRREG_SUCCESS || drreg_unreserve_register(drcontext, ilist, where, reg_dx) != DRREG_SUCCESS || drreg_unreserve_register(drcontext, ilist, where, reg_ax) != DRREG_SUCCESS)
+        DR_ASSERT(false);
+}
 
-    /* clean call */
-    /* We jump to lean procedure which performs full context switch and
-     * clean call invocation. This is to reduce the code cache size.
+/*
+ * instrument_bb_mem is called for every memory reference of a block that is
+ * recorded as a single TRACE_TYPE_BB entry. It only stores the address into
+ * the entry's next slot; pc, size and type go into the block descriptor.
+ */
+static void
+instrument_bb_mem(void* drcontext, instrlist_t* ilist, instr_t* where, app_pc pc,
+    instr_t* memref_instr, int pos, bool write, instru_data_t* data) {
+    instr_t* instr;
+    opnd_t ref, opnd1, opnd2;
+    reg_id_t reg1, reg2;
+
+    if (drreg_reserve_register(drcontext, ilist, where, NULL, &reg2) != DRREG_SUCCESS || drreg_reserve_register(drcontext, ilist, where, NULL, &reg1) != DRREG_SUCCESS) {
+        DR_ASSERT(false); /* cannot recover */
+        return;
+    }
+
+    if (write)
+        ref = instr_get_dst(memref_instr, pos);
+    else
+        ref = instr_get_src(memref_instr, pos);
+
+    /* use drutil to get mem address */
+    drutil_insert_get_mem_addr(drcontext, ilist, where, ref, reg1, reg2);
+
+    /* buf_ptr->addr[num_bb_refs] = addr;
+     * buf_ptr is only advanced once the whole block has executed, see
+     * instrument_bb_commit.
      */
-    instrlist_meta_preinsert(ilist, where, call);
-    /* mov restore DR_REG_XCX */
-    opnd1 = opnd_create_reg(reg2);
-    /* this is the return address for jumping back from lean procedure */
-    opnd2 = opnd_create_instr(restore);
-    /* We could use instrlist_insert_mov_instr_addr(), but with a register
-     * destination we know we can use a 64-bit immediate.
+    insert_load_buf_ptr(drcontext, ilist, where, reg2);
+    opnd1 = OPND_CREATE_MEMPTR(reg2, sizeof(uint64) * (1 + data->num_bb_refs));
+    opnd2 = opnd_create_reg(reg1);
+    instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
+    instrlist_meta_preinsert(ilist, where, instr);
+
+    if (data->bb != NULL) {
+        bb_ref_t bb_ref;
+        bb_ref.pc = instr_pc_field(pc);
+        /* drutil_opnd_mem_size_in_bytes handles OP_enter */
+        bb_ref.size = drutil_opnd_mem_size_in_bytes(ref, memref_instr);
+        bb_ref.write = write;
+        data->bb->refs.push_back(bb_ref);
+        data->bb->tls.push_back(ref_is_tls(ref));
+    }
+    data->num_bb_refs++;
+
+    /* Restore scratch registers */
+    if (drreg_unreserve_register(drcontext, ilist, where, reg1) != DRREG_SUCCESS || drreg_unreserve_register(drcontext, ilist, where, reg2) != DRREG_SUCCESS)
+        DR_ASSERT(false);
+}
+
+/*
+ * instrument_bb_commit is called before the last instruction of a block that
+ * is recorded as a single TRACE_TYPE_BB entry. It registers the block
+ * descriptor, stores the entry header and advances the buffer pointer past
+ * the addresses stored by instrument_bb_mem. If the block is left early,
+ * e.g. by a fault, the partial entry is simply overwritten.
+ */
+static void
+instrument_bb_commit(void* drcontext, instrlist_t* ilist, instr_t* where,
+    instru_data_t* data) {
+    instr_t* instr;
+    opnd_t opnd1, opnd2;
+    reg_id_t reg1, reg2;
+    drvector_t allowed;
+    uint64 id = 0;
+    uint64 header;
+
+    if (data->bb != NULL) {
+        dr_mutex_lock(mutex);
+        id = bb_table.size();
+        bb_table.push_back(data->bb);
+        dr_mutex_unlock(mutex);
+        data->bb = NULL;
+    }
+    header = trace_make_header(TRACE_TYPE_BB, data->num_bb_refs, id);
+
+    /* reg2 must be ECX or RCX for the lean procedure. */
+    drreg_init_and_fill_vector(&allowed, false);
+    drreg_set_vector_entry(&allowed, DR_REG_XCX, true);
+    if (drreg_reserve_register(drcontext, ilist, where, &allowed, &reg2) != DRREG_SUCCESS || drreg_reserve_register(drcontext, ilist, where, NULL, &reg1) != DRREG_SUCCESS) {
+        DR_ASSERT(false); /* cannot recover */
+        drvector_delete(&allowed);
+        return;
+    }
+    drvector_delete(&allowed);
+
+    insert_load_buf_ptr(drcontext, ilist, where, reg2);
+
+    /* Store the header as two 32-bit halves, independent of the value of
+     * the block id, so the code has the same shape when translating.
      */
+    opnd1 = OPND_CREATE_MEM32(reg2, 0);
+    opnd2 = OPND_CREATE_INT32((int)(uint)header);
     instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
     instrlist_meta_preinsert(ilist, where, instr);
-    /* jmp code_cache */
-    opnd1 = opnd_create_pc(code_cache);
-    instr = INSTR_CREATE_jmp(drcontext, opnd1);
+    opnd1 = OPND_CREATE_MEM32(reg2, 4);
+    opnd2 = OPND_CREATE_INT32((int)(uint)(header >> 32));
+    instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
     instrlist_meta_preinsert(ilist, where, instr);
 
+    insert_update_buf_ptr(drcontext, ilist, where, reg2, reg1, (int)trace_entry_size(header));
+
     /* Restore scratch registers */
-    instrlist_meta_preinsert(ilist, where, restore);
     if (drreg_unreserve_register(drcontext, ilist, where, reg1) != DRREG_SUCCESS || drreg_unreserve_register(drcontext, ilist, where, reg2) != DRREG_SUCCESS)
         DR_ASSERT(false);
-}
\ No newline at end of file
+}
+
+/* count_alloc returns a zeroed counter the code cache can address */
+static uint64*
+count_alloc(void) {
+    uint64* counter;
+
+    dr_mutex_lock(mutex);
+    if (count_left == 0) {
+        uint64* chunk = (uint64*)dr_custom_alloc(NULL, DR_ALLOC_CACHE_REACHABLE, COUNT_CHUNK * sizeof(uint64),
+            DR_MEMPROT_READ | DR_MEMPROT_WRITE, NULL);
+        memset(chunk, 0, COUNT_CHUNK * sizeof(uint64));
+        count_chunks.push_back(chunk);
+        count_left = COUNT_CHUNK;
+    }
+    counter = count_chunks.back() + (COUNT_CHUNK - count_left);
+    count_left--;
+    dr_mutex_unlock(mutex);
+    return counter;
+}
+
+/*
+ * instrument_count registers a memory reference for -count_only. Blocks
+ * counted as a whole share the block's counter, which is updated once at
+ * its start; any other reference gets a counter of its own, updated right
+ * before its instruction. The updates are not atomic, threads running the
+ * same code at the same time may lose a few counts.
+ */
+static void
+instrument_count(void* drcontext, instrlist_t* ilist, instr_t* where, app_pc pc,
+    instr_t* memref_instr, int pos, bool write, instru_data_t* data) {
+    opnd_t ref = write ? instr_get_dst(memref_instr, pos) : instr_get_src(memref_instr, pos);
+    uint64* counter = data->count;
+    count_ref_t count_ref;
+
+    if (counter == NULL) {
+        counter = data->translating ? count_scratch : count_alloc();
+        drx_insert_counter_update(drcontext, ilist, where, (dr_spill_slot_t)(SPILL_SLOT_MAX + 1),
+            counter, 1, DRX_COUNTER_64BIT);
+    }
+    if (data->translating)
+        return;
+    count_ref.pc = pc;
+    /* drutil_opnd_mem_size_in_bytes handles OP_enter */
+    count_ref.size = drutil_opnd_mem_size_in_bytes(ref, memref_instr);
+    count_ref.write = write;
+    count_ref.counter = counter;
+    dr_mutex_lock(mutex);
+    count_refs.push_back(count_ref);
+    dr_mutex_unlock(mutex);
+}
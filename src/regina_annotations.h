@@ -0,0 +1,35 @@
+/* Region of interest markers for applications run with -roi_annotations.
+ *
+ * This header belongs to the traced application, not to the client: it
+ * needs the include directory of DynamoRIO, and exactly one source file of
+ * the application has to define REGINA_DEFINE_ANNOTATIONS before including
+ * it. Natively the markers are empty calls. Under regina every
+ * REGINA_ROI_START() opens the region of interest for the calling thread
+ * until the matching REGINA_ROI_STOP(), pairs may nest.
+ */
+
+#ifndef REGINA_ANNOTATIONS_H
+#define REGINA_ANNOTATIONS_H
+
+#include "dr_annotations_asm.h"
+
+#define REGINA_ROI_START() regina_roi_start()
+#define REGINA_ROI_STOP() regina_roi_stop()
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+DR_DECLARE_ANNOTATION(void, regina_roi_start, (void));
+DR_DECLARE_ANNOTATION(void, regina_roi_stop, (void));
+
+#ifdef REGINA_DEFINE_ANNOTATIONS
+DR_DEFINE_ANNOTATION(void, regina_roi_start, (void), )
+DR_DEFINE_ANNOTATION(void, regina_roi_stop, (void), )
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* REGINA_ANNOTATIONS_H */
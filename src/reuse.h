@@ -0,0 +1,154 @@
+/* Reuse (stack) distance of cache line accesses, after Olken.
+ *
+ * The reuse distance of an access is the number of distinct lines touched
+ * since the previous access of its line: a fully associative LRU cache of
+ * C lines hits exactly the accesses with a distance below C. Every line
+ * keeps the time of its last access, and a Fenwick tree over the times
+ * holds a 1 at the last access of every line, so the distance is the sum
+ * over the times between the two accesses, O(log n) per access. When the
+ * times run out of the tree, the live ones are renumbered in order.
+ *
+ * With a sampling rate of 1/R, R a power of two, only lines whose hash
+ * falls into the sample are tracked and their distances are scaled by R
+ * (spatial sampling as in SHARDS), which bounds the memory needed to the
+ * sampled working set and the cost to the sampled accesses.
+ *
+ * Distances are counted in log2 bins: bin 0 holds the first accesses of a
+ * line, bin 1 distance 0 and bin b > 1 the distances [2^(b-2), 2^(b-1)).
+ */
+
+#ifndef REGINA_REUSE_H
+#define REGINA_REUSE_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#define REUSE_BINS 42
+#define REUSE_COLD UINT64_MAX
+
+typedef struct _reuse_hist_t {
+    uint64_t bins[REUSE_BINS];
+} reuse_hist_t;
+
+typedef struct _reuse_t {
+    uint32_t line_shift;
+    /* a line is sampled if the low bits of its hash are 0 */
+    uint64_t sample_mask;
+    uint32_t sample_shift;
+    /* time of the last access of every tracked line */
+    std::unordered_map<uint64_t, uint64_t> last;
+    /* Fenwick tree over the times, 1-based */
+    std::vector<uint32_t> tree;
+    uint64_t now;
+} reuse_t;
+
+static inline void
+reuse_init(reuse_t* r, uint32_t line_size, uint32_t sample_rate) {
+    r->line_shift = 0;
+    while ((1u << r->line_shift) < line_size)
+        r->line_shift++;
+    r->sample_shift = 0;
+    while ((1u << r->sample_shift) < sample_rate)
+        r->sample_shift++;
+    r->sample_mask = (1ull << r->sample_shift) - 1;
+    r->last.clear();
+    r->tree.assign(1 << 16, 0);
+    r->now = 0;
+}
+
+static inline void
+reuse_tree_add(reuse_t* r, uint64_t t, int32_t v) {
+    for (uint64_t i = t + 1; i < r->tree.size(); i += i & (0 - i))
+        r->tree[i] += v;
+}
+
+/* Returns the number of live times in [0, t]. */
+static inline uint64_t
+reuse_tree_sum(reuse_t const* r, uint64_t t) {
+    uint64_t sum = 0;
+
+    for (uint64_t i = t + 1; i > 0; i -= i & (0 - i))
+        sum += r->tree[i];
+    return sum;
+}
+
+/* Renumbers the live times 0, 1, ... in order and rebuilds the tree, twice
+ * as large if more than half of it stays in use.
+ */
+static inline void
+reuse_compact(reuse_t* r) {
+    std::vector<std::pair<uint64_t, uint64_t>> live;
+    size_t size = r->tree.size();
+
+    live.reserve(r->last.size());
+    for (auto const& e : r->last)
+        live.push_back(std::make_pair(e.second, e.first));
+    std::sort(live.begin(), live.end());
+    while (2 * (live.size() + 1) > size)
+        size *= 2;
+    r->tree.assign(size, 0);
+    for (uint64_t t = 0; t < live.size(); ++t) {
+        r->last[live[t].second] = t;
+        r->tree[t + 1] = 1;
+    }
+    /* linear Fenwick construction, every node adds itself to its parent */
+    for (uint64_t i = 1; i < size; ++i) {
+        uint64_t const parent = i + (i & (0 - i));
+        if (parent < size)
+            r->tree[parent] += r->tree[i];
+    }
+    r->now = live.size();
+}
+
+static inline uint64_t
+reuse_hash(uint64_t line) {
+    uint64_t h = line * 0x9E3779B97F4A7C15ull;
+    return h ^ (h >> 32);
+}
+
+/* Returns whether the line of addr is tracked at the sampling rate. */
+static inline bool
+reuse_sampled(reuse_t const* r, uint64_t addr) {
+    return (reuse_hash(addr >> r->line_shift) & r->sample_mask) == 0;
+}
+
+/* Records an access of the line of addr, which must be sampled, and
+ * returns its scaled reuse distance or REUSE_COLD for its first access.
+ */
+static inline uint64_t
+reuse_access(reuse_t* r, uint64_t addr) {
+    uint64_t const line = addr >> r->line_shift;
+    uint64_t distance = REUSE_COLD;
+
+    if (r->now + 1 >= r->tree.size())
+        reuse_compact(r);
+    auto it = r->last.find(line);
+    if (it != r->last.end()) {
+        distance = (reuse_tree_sum(r, r->now - 1) - reuse_tree_sum(r, it->second)) << r->sample_shift;
+        reuse_tree_add(r, it->second, -1);
+        it->second = r->now;
+    } else {
+        r->last.emplace(line, r->now);
+    }
+    reuse_tree_add(r, r->now, 1);
+    r->now++;
+    return distance;
+}
+
+static inline uint32_t
+reuse_bin(uint64_t distance) {
+    uint32_t bin = 1;
+
+    if (distance == REUSE_COLD)
+        return 0;
+    while (distance > 0 && bin < REUSE_BINS - 1) {
+        distance >>= 1;
+        bin++;
+    }
+    return bin;
+}
+
+#endif /* REGINA_REUSE_H */
@@ -0,0 +1,126 @@
+/* Raw trace format written by the client into its per-thread buffers and
+ * temporary files.
+ *
+ * Every entry starts with a 64-bit header word
+ *   bits  0..3   entry type (trace_type_t)
+ *   bits  4..15  size of the reference in bytes, memory entries only
+ *   bits 16..62  pc of the instruction
+ *   bit  63      TRACE_FLAG_TLS, memory entries only
+ * followed by a type specific payload. User space pcs fit into 47 bits on
+ * every platform we trace, so a memory reference costs 16 bytes and its
+ * header can be stored with a single pointer-sized immediate. With
+ * -data_objects TRACE_FLAG_TLS marks a reference relative to a segment
+ * register, which addresses thread local storage, see data.h.
+ *
+ * In basic block mode a block execution is recorded as one TRACE_TYPE_BB
+ * entry instead: its header carries the number of references in the size
+ * field and the block id in the pc field, followed by the raw address of
+ * each reference. The pcs, sizes and read/write flags are static and are
+ * kept once per block in a bb_desc_t, in the spirit of drcachesim's
+ * offline format. For offline symbolization the descriptors are written to
+ * TRACE_BB_FILE: a uint64_t block count followed, for each block id in
+ * order, by a uint32_t reference count and that many bb_ref_t.
+ *
+ * With -timestamps a TRACE_TYPE_TIME entry carries the time stamp counter
+ * of its thread: one at thread start, one after the entries of every
+ * flushed buffer and one after every call or return entry. Every entry
+ * before it happened before that time and every entry after it afterwards,
+ * which is all regina-merge needs to interleave the threads. Its header
+ * has no pc and no size.
+ */
+
+#ifndef REGINA_TRACE_FORMAT_H
+#define REGINA_TRACE_FORMAT_H
+
+#include <stdint.h>
+
+typedef enum {
+    TRACE_TYPE_READ = 0,
+    TRACE_TYPE_WRITE = 1,
+    TRACE_TYPE_CALL = 2,
+    TRACE_TYPE_CALL_IND = 3,
+    TRACE_TYPE_RETURN = 4,
+    TRACE_TYPE_BB = 5,
+    TRACE_TYPE_TIME = 6,
+} trace_type_t;
+
+#define TRACE_TYPE_BITS 4
+#define TRACE_SIZE_BITS 12
+#define TRACE_PC_SHIFT (TRACE_TYPE_BITS + TRACE_SIZE_BITS)
+#define TRACE_SIZE_MAX ((1 << TRACE_SIZE_BITS) - 1)
+#define TRACE_PC_BITS 47
+#define TRACE_FLAG_TLS (1ull << 63)
+
+#define TRACE_BB_FILE "regina.bb"
+
+/* Blocks with more references are recorded per reference. */
+#define TRACE_BB_MAX_REFS 255
+/* Size of the largest TRACE_TYPE_BB entry. */
+#define TRACE_BB_MAX_SIZE (sizeof(uint64_t) * (1 + TRACE_BB_MAX_REFS))
+
+/* TRACE_TYPE_READ, TRACE_TYPE_WRITE */
+typedef struct _mem_entry_t {
+    uint64_t header;
+    uint64_t addr;
+} mem_entry_t;
+
+/* TRACE_TYPE_CALL, TRACE_TYPE_CALL_IND, TRACE_TYPE_RETURN */
+typedef struct _call_entry_t {
+    uint64_t header;
+    uint64_t target;
+} call_entry_t;
+
+static inline uint64_t
+trace_make_header(trace_type_t type, uint32_t size, uint64_t pc) {
+    if (size > TRACE_SIZE_MAX)
+        size = TRACE_SIZE_MAX;
+    return (uint64_t)type | ((uint64_t)size << TRACE_TYPE_BITS) | (pc << TRACE_PC_SHIFT);
+}
+
+static inline trace_type_t
+trace_get_type(uint64_t header) {
+    return (trace_type_t)(header & ((1 << TRACE_TYPE_BITS) - 1));
+}
+
+static inline uint32_t
+trace_get_size(uint64_t header) {
+    return (uint32_t)((header >> TRACE_TYPE_BITS) & TRACE_SIZE_MAX);
+}
+
+static inline uint64_t
+trace_get_pc(uint64_t header) {
+    return (header >> TRACE_PC_SHIFT) & ((1ull << TRACE_PC_BITS) - 1);
+}
+
+static inline bool
+trace_is_tls(uint64_t header) {
+    return (header & TRACE_FLAG_TLS) != 0;
+}
+
+static inline bool
+trace_is_mem(uint64_t header) {
+    return trace_get_type(header) <= TRACE_TYPE_WRITE;
+}
+
+/* TRACE_TYPE_TIME */
+typedef struct _time_entry_t {
+    uint64_t header;
+    uint64_t time;
+} time_entry_t;
+
+/* TRACE_TYPE_BB, one per memory reference of the block */
+typedef struct _bb_ref_t {
+    uint64_t pc;
+    uint32_t size;
+    uint32_t write;
+} bb_ref_t;
+
+/* Returns the length in bytes of the entry starting with header. */
+static inline uint64_t
+trace_entry_size(uint64_t header) {
+    if (trace_get_type(header) == TRACE_TYPE_BB)
+        return sizeof(uint64_t) * (1 + trace_get_size(header));
+    return trace_is_mem(header) ? sizeof(mem_entry_t) : sizeof(call_entry_t);
+}
+
+#endif /* REGINA_TRACE_FORMAT_H */
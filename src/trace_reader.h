@@ -0,0 +1,111 @@
+/* Streaming reader for the raw traces written by the client.
+ *
+ * A trace is read through a fixed window, so converting it needs the same
+ * memory for a few megabytes as for hundreds of gigabytes. Positions are
+ * never taken from ftell, whose long overflows at 2 GB on Windows. Traces
+ * encoded with -compress are recognized by their magic and decoded block
+ * by block, see codec.h.
+ */
+
+#ifndef REGINA_TRACE_READER_H
+#define REGINA_TRACE_READER_H
+
+#include "codec.h"
+#include "trace_format.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+/* bytes read from a trace at once */
+#define TRACE_READ_CHUNK (4 << 20)
+
+/* Returns the length of the run of complete entries at the start of the
+ * size bytes at base.
+ */
+static inline size_t
+trace_complete_size(char const* base, size_t size) {
+    size_t offset = 0;
+
+    while (offset + sizeof(uint64_t) <= size) {
+        uint64_t const len = trace_entry_size(*reinterpret_cast<uint64_t const*>(base + offset));
+        if (offset + len > size)
+            break;
+        offset += len;
+    }
+    return offset;
+}
+
+/* Decodes the blocks of an encoded trace, the magic already read, and
+ * calls cb(base, size) for each of them. Stops at the first truncated or
+ * corrupt block. Returns the number of bytes read.
+ */
+template <typename F>
+static inline uint64_t
+trace_read_blocks(FILE* f, F cb) {
+    std::vector<uint8_t> in;
+    std::vector<char> out;
+    codec_block_header_t block;
+    uint64_t total = 0;
+
+    while (fread(&block, sizeof(block), 1, f) == 1) {
+        in.resize(block.encoded_size);
+        out.resize(block.raw_size);
+        if (fread(in.data(), 1, in.size(), f) != in.size())
+            break;
+        total += sizeof(block) + in.size();
+        if (!codec_decode_entries(in.data(), in.size(), out.data(), out.size()))
+            break;
+        if (!out.empty())
+            cb(out.data(), out.size());
+    }
+    return total;
+}
+
+/* Reads f to its end and calls cb(base, size) for every run of complete
+ * entries. An entry cut off by the end of the window is moved to the front
+ * and completed by the next read; a trailing partial entry is dropped.
+ * Returns the number of bytes read.
+ */
+template <typename F>
+static inline uint64_t
+trace_read_chunks(FILE* f, F cb) {
+    /* the largest entry must fit behind a partial one */
+    std::vector<char> buf(TRACE_READ_CHUNK + sizeof(uint64_t) * (1 + TRACE_SIZE_MAX));
+    size_t avail = fread(buf.data(), 1, TRACE_CODEC_MAGIC_SIZE, f);
+    uint64_t total = avail;
+
+    if (avail == TRACE_CODEC_MAGIC_SIZE && memcmp(buf.data(), TRACE_CODEC_MAGIC, TRACE_CODEC_MAGIC_SIZE) == 0)
+        return total + trace_read_blocks(f, cb);
+
+    for (;;) {
+        size_t const got = fread(buf.data() + avail, 1, buf.size() - avail, f);
+        size_t complete;
+
+        total += got;
+        avail += got;
+        complete = trace_complete_size(buf.data(), avail);
+        if (complete > 0)
+            cb(buf.data(), complete);
+        memmove(buf.data(), buf.data() + complete, avail - complete);
+        avail -= complete;
+        if (got == 0)
+            break;
+    }
+    return total;
+}
+
+/* Calls cb(entry, header) for every complete entry of f. */
+template <typename F>
+static inline uint64_t
+trace_for_each_entry(FILE* f, F cb) {
+    return trace_read_chunks(f, [&](char const* base, size_t size) {
+        for (size_t offset = 0; offset < size;) {
+            uint64_t const header = *reinterpret_cast<uint64_t const*>(base + offset);
+            cb(base + offset, header);
+            offset += trace_entry_size(header);
+        }
+    });
+}
+
+#endif /* REGINA_TRACE_READER_H */
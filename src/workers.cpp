@@ -0,0 +1,91 @@
+/* Background workers for post-processing, see workers.h. */
+
+#include "workers.h"
+#include <atomic>
+#include <deque>
+
+static workers_job_cb_t job_cb;
+/* guards queue and exiting */
+static void* lock;
+static std::deque<void*> queue;
+static bool exiting;
+/* signaled whenever a job is queued and on exit */
+static void* work_event;
+static void* exit_event;
+static std::atomic<uint> running;
+
+static std::atomic<uint64> jobs;
+static std::atomic<uint64> busy_us;
+static uint64 max_queue_depth;
+
+static void
+worker_thread(void* arg) {
+    /* process exit waits for us, DR must not suspend us there */
+    dr_client_thread_set_suspendable(false);
+    for (;;) {
+        dr_mutex_lock(lock);
+        if (!queue.empty()) {
+            void* job = queue.front();
+            uint64 start;
+            queue.pop_front();
+            dr_mutex_unlock(lock);
+            start = dr_get_microseconds();
+            (*job_cb)(job);
+            busy_us.fetch_add(dr_get_microseconds() - start, std::memory_order_relaxed);
+            jobs.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        if (exiting) {
+            dr_mutex_unlock(lock);
+            break;
+        }
+        /* reset under the lock, a submit after it signals again */
+        dr_event_reset(work_event);
+        dr_mutex_unlock(lock);
+        dr_event_wait(work_event);
+    }
+    if (running.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        dr_event_signal(exit_event);
+}
+
+bool workers_init(uint num_threads, workers_job_cb_t cb) {
+    uint i;
+
+    job_cb = cb;
+    lock = dr_mutex_create();
+    work_event = dr_event_create();
+    exit_event = dr_event_create();
+    exiting = false;
+    running.store(num_threads, std::memory_order_relaxed);
+    for (i = 0; i < num_threads; i++) {
+        if (!dr_create_client_thread(worker_thread, NULL))
+            return false;
+    }
+    return true;
+}
+
+void workers_submit(void* arg) {
+    dr_mutex_lock(lock);
+    queue.push_back(arg);
+    if (queue.size() > max_queue_depth)
+        max_queue_depth = queue.size();
+    dr_event_signal(work_event);
+    dr_mutex_unlock(lock);
+}
+
+void workers_exit(void) {
+    dr_mutex_lock(lock);
+    exiting = true;
+    dr_event_signal(work_event);
+    dr_mutex_unlock(lock);
+    dr_event_wait(exit_event);
+    dr_event_destroy(work_event);
+    dr_event_destroy(exit_event);
+    dr_mutex_destroy(lock);
+}
+
+void workers_get_stats(workers_stats_t* stats) {
+    stats->jobs = jobs.load(std::memory_order_relaxed);
+    stats->busy_us = busy_us.load(std::memory_order_relaxed);
+    stats->max_queue_depth = max_queue_depth;
+}
@@ -0,0 +1,39 @@
+/* Background workers for post-processing.
+ *
+ * A fixed number of DR client threads run jobs from a shared queue. An
+ * exiting application thread only submits its finished raw trace and
+ * leaves; the conversion into .mmtrd runs on a worker, so threads exiting
+ * together neither wait for each other nor for drsym. The queue is
+ * unbounded, the number of conversions running at once is not.
+ */
+
+#ifndef REGINA_WORKERS_H
+#define REGINA_WORKERS_H
+
+#include "dr_api.h"
+
+typedef struct _workers_stats_t {
+    uint64 jobs;
+    /* time spent running jobs, summed over all workers */
+    uint64 busy_us;
+    /* maximum number of jobs waiting at once */
+    uint64 max_queue_depth;
+} workers_stats_t;
+
+/* Runs the job identified by arg. */
+typedef void (*workers_job_cb_t)(void* arg);
+
+/* Starts num_threads workers running job_cb. Must be called from
+ * dr_client_main.
+ */
+bool workers_init(uint num_threads, workers_job_cb_t job_cb);
+
+/* Queues a job for the next free worker. */
+void workers_submit(void* arg);
+
+/* Waits until every submitted job has run and stops the workers. */
+void workers_exit(void);
+
+void workers_get_stats(workers_stats_t* stats);
+
+#endif /* REGINA_WORKERS_H */
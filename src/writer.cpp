@@ -0,0 +1,218 @@
+/* Asynchronous trace writer, see writer.h. */
+
+#include "writer.h"
+
+/* Intrusive multi-producer single-consumer queue (Vyukov). Application
+ * threads push with a single atomic exchange, only its writer thread pops.
+ */
+typedef struct _writer_queue_t {
+    trace_buffer_t stub;
+    std::atomic<trace_buffer_t*> head;
+    trace_buffer_t* tail;
+    void* work_event;
+} writer_queue_t;
+
+static size_t buffer_size;
+static writer_write_cb_t write_cb;
+static writer_queue_t* queues;
+static uint num_queues;
+static std::atomic<uint> next_queue;
+static std::atomic<uint> running;
+static void* exit_event;
+static std::atomic<bool> exiting;
+
+static std::atomic<uint64> buffers_written;
+static std::atomic<uint64> bytes_written;
+static std::atomic<uint64> waits;
+static std::atomic<uint64> wait_us;
+static std::atomic<uint64> queue_depth;
+static std::atomic<uint64> max_queue_depth;
+
+static void
+queue_push(writer_queue_t* q, trace_buffer_t* buf) {
+    trace_buffer_t* prev;
+
+    buf->next.store(NULL, std::memory_order_relaxed);
+    prev = q->head.exchange(buf, std::memory_order_acq_rel);
+    prev->next.store(buf, std::memory_order_release);
+}
+
+static trace_buffer_t*
+queue_pop(writer_queue_t* q) {
+    trace_buffer_t* tail = q->tail;
+    trace_buffer_t* next = tail->next.load(std::memory_order_acquire);
+
+    if (tail == &q->stub) {
+        if (next == NULL)
+            return NULL;
+        q->tail = next;
+        tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    /* a producer is between its exchange and linking its predecessor */
+    if (tail != q->head.load(std::memory_order_acquire))
+        return NULL;
+    queue_push(q, &q->stub);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static void
+writer_thread(void* arg) {
+    writer_queue_t* q = (writer_queue_t*)arg;
+    trace_buffer_t* buf;
+
+    /* App threads may wait for us, so we must keep running while DR
+     * synchronizes with them.
+     */
+    dr_client_thread_set_suspendable(false);
+    for (;;) {
+        dr_event_wait(q->work_event);
+        /* reset before draining so a submit racing with us is not lost */
+        dr_event_reset(q->work_event);
+        while ((buf = queue_pop(q)) != NULL) {
+            buffer_pool_t* pool = buf->pool;
+            uint tail;
+
+            (*write_cb)(pool->stream, buf->base, buf->size);
+            buffers_written.fetch_add(1, std::memory_order_relaxed);
+            bytes_written.fetch_add(buf->size, std::memory_order_relaxed);
+            queue_depth.fetch_sub(1, std::memory_order_relaxed);
+
+            tail = pool->free_tail.load(std::memory_order_relaxed);
+            pool->free_ring[tail % pool->num_buffers] = buf;
+            pool->free_tail.store(tail + 1, std::memory_order_release);
+            /* last access to the pool, its owner may free it afterwards */
+            pool->outstanding.fetch_sub(1, std::memory_order_release);
+        }
+        if (exiting.load(std::memory_order_acquire) && q->head.load(std::memory_order_acquire) == q->tail)
+            break;
+    }
+    /* the last writer thread out wakes writer_exit */
+    if (running.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        dr_event_signal(exit_event);
+}
+
+bool writer_init(size_t size, writer_write_cb_t cb, uint num_threads) {
+    uint i;
+
+    buffer_size = size;
+    write_cb = cb;
+    num_queues = num_threads == 0 ? 1 : num_threads;
+    queues = new writer_queue_t[num_queues];
+    next_queue.store(0, std::memory_order_relaxed);
+    exiting.store(false, std::memory_order_relaxed);
+    exit_event = dr_event_create();
+    running.store(num_queues, std::memory_order_relaxed);
+    for (i = 0; i < num_queues; i++) {
+        writer_queue_t* q = &queues[i];
+        q->stub.next.store(NULL, std::memory_order_relaxed);
+        q->head.store(&q->stub, std::memory_order_relaxed);
+        q->tail = &q->stub;
+        q->work_event = dr_event_create();
+    }
+    for (i = 0; i < num_queues; i++) {
+        if (!dr_create_client_thread(writer_thread, &queues[i])) {
+            /* the threads already started may not leave before exit */
+            running.fetch_sub(num_queues - i, std::memory_order_relaxed);
+            return false;
+        }
+    }
+    return true;
+}
+
+void writer_exit(void) {
+    uint i;
+
+    exiting.store(true, std::memory_order_release);
+    if (running.load(std::memory_order_acquire) != 0) {
+        for (i = 0; i < num_queues; i++)
+            dr_event_signal(queues[i].work_event);
+        dr_event_wait(exit_event);
+    }
+    for (i = 0; i < num_queues; i++)
+        dr_event_destroy(queues[i].work_event);
+    dr_event_destroy(exit_event);
+    delete[] queues;
+}
+
+buffer_pool_t* writer_create_pool(void* stream, uint num_buffers) {
+    buffer_pool_t* pool = new buffer_pool_t;
+    uint i;
+
+    pool->stream = stream;
+    /* round robin, a thread's buffers always go to the same writer */
+    pool->queue = &queues[next_queue.fetch_add(1, std::memory_order_relaxed) % num_queues];
+    pool->num_buffers = num_buffers;
+    pool->buffers = new trace_buffer_t[num_buffers];
+    pool->free_ring = new trace_buffer_t*[num_buffers];
+    for (i = 0; i < num_buffers; i++) {
+        pool->buffers[i].pool = pool;
+        pool->buffers[i].base = (char*)dr_global_alloc(buffer_size);
+        pool->buffers[i].size = 0;
+        pool->free_ring[i] = &pool->buffers[i];
+    }
+    pool->free_head.store(0, std::memory_order_relaxed);
+    pool->free_tail.store(num_buffers, std::memory_order_relaxed);
+    pool->outstanding.store(0, std::memory_order_relaxed);
+    return pool;
+}
+
+void writer_destroy_pool(buffer_pool_t* pool) {
+    uint i;
+
+    for (i = 0; i < pool->num_buffers; i++)
+        dr_global_free(pool->buffers[i].base, buffer_size);
+    delete[] pool->free_ring;
+    delete[] pool->buffers;
+    delete pool;
+}
+
+trace_buffer_t* writer_acquire(buffer_pool_t* pool) {
+    uint head = pool->free_head.load(std::memory_order_relaxed);
+    trace_buffer_t* buf;
+
+    if (head == pool->free_tail.load(std::memory_order_acquire)) {
+        uint64 start = dr_get_microseconds();
+        waits.fetch_add(1, std::memory_order_relaxed);
+        while (head == pool->free_tail.load(std::memory_order_acquire))
+            dr_thread_yield();
+        wait_us.fetch_add(dr_get_microseconds() - start, std::memory_order_relaxed);
+    }
+    buf = pool->free_ring[head % pool->num_buffers];
+    pool->free_head.store(head + 1, std::memory_order_release);
+    buf->size = 0;
+    return buf;
+}
+
+void writer_submit(trace_buffer_t* buf) {
+    uint64 depth = queue_depth.fetch_add(1, std::memory_order_relaxed) + 1;
+    uint64 max = max_queue_depth.load(std::memory_order_relaxed);
+
+    while (depth > max && !max_queue_depth.compare_exchange_weak(max, depth, std::memory_order_relaxed))
+        ;
+    buf->pool->outstanding.fetch_add(1, std::memory_order_relaxed);
+    queue_push(buf->pool->queue, buf);
+    dr_event_signal(buf->pool->queue->work_event);
+}
+
+void writer_drain(buffer_pool_t* pool) {
+    while (pool->outstanding.load(std::memory_order_acquire) != 0)
+        dr_thread_yield();
+}
+
+void writer_get_stats(writer_stats_t* stats) {
+    stats->buffers_written = buffers_written.load(std::memory_order_relaxed);
+    stats->bytes_written = bytes_written.load(std::memory_order_relaxed);
+    stats->waits = waits.load(std::memory_order_relaxed);
+    stats->wait_us = wait_us.load(std::memory_order_relaxed);
+    stats->max_queue_depth = max_queue_depth.load(std::memory_order_relaxed);
+}
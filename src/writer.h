@@ -0,0 +1,85 @@
+/* Asynchronous trace writer.
+ *
+ * Every application thread owns a pool of trace buffers. A full buffer is
+ * submitted to a lock-free queue and written by a dedicated DR client thread
+ * while the application thread continues with the next free buffer from its
+ * pool. The application thread only blocks when every buffer of its pool is
+ * still waiting to be written; those waits are counted as back-pressure.
+ * With several writer threads every pool is assigned to one of them, so the
+ * buffers of a thread are still written in order.
+ */
+
+#ifndef REGINA_WRITER_H
+#define REGINA_WRITER_H
+
+#include "dr_api.h"
+#include <atomic>
+
+struct _buffer_pool_t;
+struct _writer_queue_t;
+
+typedef struct _trace_buffer_t {
+    /* link in the writer queue */
+    std::atomic<struct _trace_buffer_t*> next;
+    struct _buffer_pool_t* pool;
+    char* base;
+    /* number of bytes used */
+    size_t size;
+} trace_buffer_t;
+
+typedef struct _buffer_pool_t {
+    /* passed to the write callback */
+    void* stream;
+    /* queue of the writer thread writing the pool */
+    struct _writer_queue_t* queue;
+    uint num_buffers;
+    trace_buffer_t* buffers;
+    /* Ring of free buffers. The writer thread is the only producer and the
+     * owning application thread the only consumer.
+     */
+    trace_buffer_t** free_ring;
+    std::atomic<uint> free_head;
+    std::atomic<uint> free_tail;
+    /* buffers submitted but not yet written */
+    std::atomic<uint> outstanding;
+} buffer_pool_t;
+
+typedef struct _writer_stats_t {
+    uint64 buffers_written;
+    uint64 bytes_written;
+    /* how often an application thread had to wait for a free buffer */
+    uint64 waits;
+    uint64 wait_us;
+    /* maximum number of buffers queued at once */
+    uint64 max_queue_depth;
+} writer_stats_t;
+
+/* Writes size bytes of entries starting at base to stream. */
+typedef void (*writer_write_cb_t)(void* stream, char* base, size_t size);
+
+/* Starts num_threads writer threads. buffer_size is the allocation size of
+ * each buffer. Must be called from dr_client_main.
+ */
+bool writer_init(size_t buffer_size, writer_write_cb_t write_cb, uint num_threads);
+
+/* Stops the writer threads once their queues are empty. */
+void writer_exit(void);
+
+/* Creates a pool of num_buffers buffers writing to stream. */
+buffer_pool_t* writer_create_pool(void* stream, uint num_buffers);
+
+/* Frees the pool. All of its buffers must have been written. */
+void writer_destroy_pool(buffer_pool_t* pool);
+
+/* Returns a free buffer of the pool, waiting for the writer if necessary. */
+trace_buffer_t* writer_acquire(buffer_pool_t* pool);
+
+/* Hands buf with buf->size bytes of entries to the writer thread. */
+void writer_submit(trace_buffer_t* buf);
+
+/* Waits until every submitted buffer of the pool has been written. */
+void writer_drain(buffer_pool_t* pool);
+
+void writer_get_stats(writer_stats_t* stats);
+
+#endif /* REGINA_WRITER_H */
@@ -0,0 +1,395 @@
+/* regina-cachesweep: simulates many cache configurations over recorded
+ * .mmtrd files in a single pass.
+ *
+ * Every input is streamed once in batches of memory references; while the
+ * next batch is read, the configurations run over the current one on a
+ * pool of threads. Single level LRU configurations with the same line size
+ * and number of sets share one set of LRU stacks (see cachesim.h), so a
+ * sweep over sizes and associativities costs one simulation per set count
+ * and line size; every other configuration, e.g. a hierarchy or pseudo
+ * LRU, is simulated on its own. Each input starts with cold caches, so a
+ * file merged by regina-merge models caches shared by all threads.
+ *
+ * The result is a CSV with the reads, writes and misses per level of
+ * every configuration and symbol, named through regina.0.mmtrd.txt if it
+ * is found in -dir.
+ *
+ * Usage:
+ *   regina-cachesweep [-dir <dir>] [-out <file>] [-jobs N]
+ *       (-config <levels> | -configs <file>)... [<file> ...]
+ * Levels are written as for the client's -cache_levels; a -configs file
+ * holds one configuration per line, # starts a comment. Without files,
+ * regina.N.mmtrd of -dir are read for N = 0, 1, ...
+ */
+
+#include "cachesim.h"
+#include "mmtrd.h"
+#include "mmtrd_reader.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#define BATCH_SIZE (1 << 20)
+
+struct ref_t {
+    uint64_t addr;
+    uint32_t sym;
+    uint8_t size;
+    uint8_t write;
+};
+
+struct batch_t {
+    std::vector<ref_t> refs;
+    /* the first batch of an input, the caches start cold */
+    bool first;
+};
+
+struct config_t {
+    std::string text;
+    std::vector<cache_config_t> levels;
+    /* counters by symbol */
+    std::vector<cache_stats_t> stats;
+};
+
+/* One unit of simulation work: a hierarchy, or the LRU stacks of all
+ * single level LRU configurations with the same sets and line size.
+ */
+struct lane_t {
+    bool stacked;
+    cache_sim_t sim;
+    cache_stack_t stack;
+    uint64_t num_sets;
+    uint32_t line_size;
+    /* the configurations of the lane */
+    std::vector<config_t*> configs;
+    /* stacked: per symbol the number of accesses by stack distance, the
+     * last bucket counting the ones deeper than the stacks
+     */
+    std::vector<std::vector<uint64_t>> distances;
+    std::vector<uint64_t> reads;
+    std::vector<uint64_t> writes;
+};
+
+static void usage() {
+    std::fprintf(stderr, "usage: regina-cachesweep [-dir <dir>] [-out <file>] [-jobs N] (-config <levels> | -configs <file>)... [<file> ...]\n");
+}
+
+static void lane_reset(lane_t* lane) {
+    if (lane->stacked) {
+        uint32_t depth = 0;
+        for (auto c : lane->configs)
+            depth = std::max(depth, c->levels[0].assoc);
+        cache_stack_init(&lane->stack, lane->line_size, lane->num_sets, depth);
+    } else {
+        cache_sim_init(&lane->sim, lane->configs[0]->levels);
+    }
+}
+
+static void lane_run(lane_t* lane, batch_t const& batch) {
+    if (batch.first)
+        lane_reset(lane);
+    if (!lane->stacked) {
+        std::vector<cache_stats_t>& stats = lane->configs[0]->stats;
+        for (ref_t const& ref : batch.refs) {
+            uint32_t const missed = cache_sim_access(&lane->sim, ref.addr, ref.size);
+            if (ref.sym >= stats.size())
+                stats.resize(ref.sym + 1, cache_stats_t{});
+            cache_stats_add(&stats[ref.sym], ref.write != 0, missed);
+        }
+        return;
+    }
+    for (ref_t const& ref : batch.refs) {
+        uint32_t const d = cache_stack_access(&lane->stack, ref.addr, ref.size);
+        if (ref.sym >= lane->distances.size()) {
+            lane->distances.resize(ref.sym + 1);
+            lane->reads.resize(ref.sym + 1, 0);
+            lane->writes.resize(ref.sym + 1, 0);
+        }
+        std::vector<uint64_t>& hist = lane->distances[ref.sym];
+        if (hist.empty())
+            hist.assign(lane->stack.depth + 1, 0);
+        hist[d]++;
+        if (ref.write)
+            lane->writes[ref.sym]++;
+        else
+            lane->reads[ref.sym]++;
+    }
+}
+
+/* lane_finish turns the stack distances into the misses of every
+ * configuration of a stacked lane
+ */
+static void lane_finish(lane_t* lane) {
+    if (!lane->stacked)
+        return;
+    for (auto c : lane->configs) {
+        uint32_t const assoc = c->levels[0].assoc;
+        c->stats.assign(lane->distances.size(), cache_stats_t{});
+        for (size_t sym = 0; sym < lane->distances.size(); ++sym) {
+            std::vector<uint64_t> const& hist = lane->distances[sym];
+            c->stats[sym].reads = lane->reads[sym];
+            c->stats[sym].writes = lane->writes[sym];
+            for (size_t d = assoc; d < hist.size(); ++d)
+                c->stats[sym].misses[0] += hist[d];
+        }
+    }
+}
+
+/* read_batch reads up to BATCH_SIZE memory references of s into batch.
+ * Returns false once s has no events left.
+ */
+static bool read_batch(mmtrd_stream_t* s, batch_t* batch) {
+    mmtrd_event_t ev;
+
+    batch->refs.clear();
+    while (batch->refs.size() < BATCH_SIZE && mmtrd_stream_next(s, &ev)) {
+        if (ev.kind >= MMTRD_CALL)
+            continue;
+        batch->refs.push_back(ref_t{ ev.addr, ev.sym, ev.size, (uint8_t)(ev.kind == MMTRD_WRITE) });
+    }
+    return !batch->refs.empty();
+}
+
+static bool add_config(std::vector<config_t>& configs, std::string const& text) {
+    config_t c;
+    std::string err;
+
+    c.text = text;
+    if (!cache_parse_config(text, &c.levels, &err)) {
+        std::fprintf(stderr, "invalid configuration %s: %s\n", text.c_str(), err.c_str());
+        return false;
+    }
+    configs.push_back(c);
+    return true;
+}
+
+static std::vector<std::string> read_symbols(std::string const& path) {
+    std::vector<std::string> names;
+    std::ifstream in(path);
+    std::string line;
+
+    while (std::getline(in, line)) {
+        size_t const bar = line.find('|');
+        if (bar == std::string::npos)
+            continue;
+        size_t const idx = (size_t)std::strtoull(line.c_str(), NULL, 10);
+        if (idx >= names.size())
+            names.resize(idx + 1);
+        names[idx] = line.substr(bar + 1);
+    }
+    return names;
+}
+
+int main(int argc, char** argv) {
+    std::string dir;
+    std::string out_path;
+    unsigned int jobs = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<config_t> configs;
+    std::vector<std::string> paths;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string const arg = argv[i];
+        if (arg == "-dir" && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (arg == "-out" && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (arg == "-jobs" && i + 1 < argc) {
+            jobs = std::max(1u, (unsigned int)std::strtoul(argv[++i], NULL, 10));
+        } else if (arg == "-config" && i + 1 < argc) {
+            if (!add_config(configs, argv[++i]))
+                return 1;
+        } else if (arg == "-configs" && i + 1 < argc) {
+            std::ifstream in(argv[++i]);
+            std::string line;
+            if (!in) {
+                std::fprintf(stderr, "unable to open %s\n", argv[i]);
+                return 1;
+            }
+            while (std::getline(in, line)) {
+                line = line.substr(0, line.find('#'));
+                line.erase(std::remove_if(line.begin(), line.end(), [](char c) { return c == ' ' || c == '\t' || c == '\r'; }), line.end());
+                if (!line.empty() && !add_config(configs, line))
+                    return 1;
+            }
+        } else if (!arg.empty() && arg[0] != '-') {
+            paths.push_back(arg);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (configs.empty()) {
+        usage();
+        return 1;
+    }
+    std::string const prefix = dir.empty() ? std::string() : dir + "/";
+    if (out_path.empty())
+        out_path = prefix + "regina.cachesweep.csv";
+    if (paths.empty()) {
+        for (unsigned int n = 0;; ++n) {
+            std::string const path = prefix + "regina." + std::to_string(n) + ".mmtrd";
+            FILE* f = std::fopen(path.c_str(), "rb");
+            if (f == NULL)
+                break;
+            std::fclose(f);
+            paths.push_back(path);
+        }
+    }
+    if (paths.empty()) {
+        std::fprintf(stderr, "no traces found in %s\n", dir.empty() ? "." : dir.c_str());
+        return 1;
+    }
+
+    /* group the single level LRU configurations by sets and line size */
+    std::vector<lane_t> lanes;
+    std::map<std::pair<uint64_t, uint32_t>, size_t> stacked;
+    for (auto& c : configs) {
+        cache_config_t const& l1 = c.levels[0];
+        if (c.levels.size() == 1 && l1.policy == CACHE_LRU) {
+            uint64_t const num_sets = l1.size / ((uint64_t)l1.assoc * l1.line_size);
+            auto it = stacked.find(std::make_pair(num_sets, l1.line_size));
+            if (it != stacked.end()) {
+                lanes[it->second].configs.push_back(&c);
+                continue;
+            }
+            stacked[std::make_pair(num_sets, l1.line_size)] = lanes.size();
+            lanes.push_back(lane_t());
+            lanes.back().stacked = true;
+            lanes.back().num_sets = num_sets;
+            lanes.back().line_size = l1.line_size;
+        } else {
+            lanes.push_back(lane_t());
+            lanes.back().stacked = false;
+        }
+        lanes.back().configs.push_back(&c);
+    }
+    jobs = std::min<unsigned int>(jobs, (unsigned int)lanes.size());
+
+    /* The workers run their lanes over batches[cur] while the main thread
+     * reads the next batch into the other one.
+     */
+    batch_t batches[2];
+    int cur = 0;
+    std::mutex lock;
+    std::condition_variable start_cv, done_cv;
+    uint64_t generation = 0;
+    unsigned int done = 0;
+    bool exiting = false;
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < jobs; ++t) {
+        workers.emplace_back([&, t]() {
+            uint64_t seen = 0;
+            for (;;) {
+                int batch;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    start_cv.wait(guard, [&]() { return exiting || generation != seen; });
+                    if (exiting)
+                        return;
+                    seen = generation;
+                    batch = cur;
+                }
+                for (size_t i = t; i < lanes.size(); i += jobs)
+                    lane_run(&lanes[i], batches[batch]);
+                std::lock_guard<std::mutex> guard(lock);
+                if (++done == jobs)
+                    done_cv.notify_one();
+            }
+        });
+    }
+
+    auto const start = std::chrono::steady_clock::now();
+    uint64_t refs = 0;
+    for (auto const& path : paths) {
+        FILE* f = std::fopen(path.c_str(), "rb");
+        mmtrd_reader_t r;
+        mmtrd_stream_t s;
+        if (f == NULL || !mmtrd_reader_open(&r, f) || r.version != MMTRD_VERSION_COLUMNAR) {
+            std::fprintf(stderr, "%s is no complete version 2 .mmtrd file, skipping it\n", path.c_str());
+            if (f != NULL)
+                std::fclose(f);
+            continue;
+        }
+        mmtrd_stream_init(&s, &r, 64 * 1024);
+        batches[cur].first = true;
+        bool more = read_batch(&s, &batches[cur]);
+        while (more) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                done = 0;
+                generation++;
+            }
+            start_cv.notify_all();
+            refs += batches[cur].refs.size();
+            batches[cur ^ 1].first = false;
+            more = read_batch(&s, &batches[cur ^ 1]);
+            std::unique_lock<std::mutex> guard(lock);
+            done_cv.wait(guard, [&]() { return done == jobs; });
+            cur ^= 1;
+        }
+        std::fclose(f);
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        exiting = true;
+    }
+    start_cv.notify_all();
+    for (auto& w : workers)
+        w.join();
+    for (auto& lane : lanes)
+        lane_finish(&lane);
+
+    std::vector<std::string> const names = read_symbols(prefix + "regina.0.mmtrd.txt");
+    FILE* out = std::fopen(out_path.c_str(), "w");
+    if (out == NULL) {
+        std::fprintf(stderr, "unable to create %s\n", out_path.c_str());
+        return 1;
+    }
+    std::fprintf(out, "config,symbol,name,reads,writes");
+    for (int l = 0; l < CACHE_MAX_LEVELS; ++l)
+        std::fprintf(out, ",L%d misses", l + 1);
+    std::fprintf(out, "\n");
+    for (auto const& c : configs) {
+        cache_stats_t total = {};
+        for (size_t sym = 0; sym < c.stats.size(); ++sym) {
+            cache_stats_t const& st = c.stats[sym];
+            if (st.reads + st.writes == 0)
+                continue;
+            cache_stats_merge(&total, st);
+            std::fprintf(out, "\"%s\",%zu,\"%s\",%llu,%llu", c.text.c_str(), sym,
+                sym < names.size() ? names[sym].c_str() : "", (unsigned long long)st.reads,
+                (unsigned long long)st.writes);
+            for (size_t l = 0; l < CACHE_MAX_LEVELS; ++l) {
+                if (l < c.levels.size())
+                    std::fprintf(out, ",%llu", (unsigned long long)st.misses[l]);
+                else
+                    std::fprintf(out, ",");
+            }
+            std::fprintf(out, "\n");
+        }
+        uint64_t const accesses = total.reads + total.writes;
+        std::printf("%-40s", c.text.c_str());
+        for (size_t l = 0; l < c.levels.size(); ++l) {
+            uint64_t const level_accesses = l == 0 ? accesses : total.misses[l - 1];
+            std::printf(" L%zu %6.2f%%", l + 1,
+                level_accesses == 0 ? 0.0 : 100.0 * (double)total.misses[l] / (double)level_accesses);
+        }
+        std::printf("\n");
+    }
+    std::fclose(out);
+
+    double const t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::printf("simulated %zu configurations in %zu passes over %llu references in %.3f s\n",
+        configs.size(), lanes.size(), (unsigned long long)refs, t);
+    return 0;
+}
@@ -0,0 +1,175 @@
+/* regina-merge: interleaves the per-thread .mmtrd files of a run into a
+ * single timeline.
+ *
+ * Reads version 2 files recorded with -timestamps and k-way merges their
+ * events by time into one version 2 file whose thread column tells the
+ * threads apart. Every input is read through an mmtrd_stream_t with a small
+ * window per column and the output is written chunk by chunk, so the
+ * memory needed depends on the number of threads only, not on the length
+ * of the traces. The next input is taken from a heap; events are copied
+ * from the current input as long as it stays ahead of the others, so the
+ * heap is only touched when the threads actually interleave.
+ *
+ * Usage:
+ *   regina-merge [-dir <dir>] [-out <file>] [-window N] [-compress] [<file> ...]
+ * Without files, regina.N.mmtrd of -dir are merged for N = 0, 1, ... and
+ * N becomes the thread of their events. Calling contexts, heap allocations
+ * and data objects are kept if every input has them; their ids are shared
+ * by all threads of a run.
+ */
+
+#include "mmtrd.h"
+#include "mmtrd_reader.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct input_t {
+    std::string path;
+    FILE* f;
+    mmtrd_reader_t r;
+    mmtrd_stream_t s;
+    /* the next event of the input */
+    mmtrd_event_t ev;
+    uint32_t thread;
+};
+
+static void usage() {
+    std::fprintf(stderr, "usage: regina-merge [-dir <dir>] [-out <file>] [-window N] [-compress] [<file> ...]\n");
+}
+
+static void write_event(mmtrd_writer_t* out, mmtrd_event_t const& ev) {
+    trace_type_t const call_types[] = { TRACE_TYPE_CALL, TRACE_TYPE_CALL_IND, TRACE_TYPE_RETURN };
+
+    if (ev.kind >= MMTRD_CALL)
+        mmtrd_write_call(out, call_types[ev.kind - MMTRD_CALL], ev.call_pc, ev.addr, ev.sym, ev.target_sym);
+    else
+        mmtrd_write_mem(out, ev.kind == MMTRD_WRITE, ev.addr, ev.size, ev.sym);
+}
+
+int main(int argc, char** argv) {
+    std::string dir;
+    std::string out_path;
+    size_t window = 16 * 1024;
+    uint32_t flags = MMTRD_FLAG_TIME | MMTRD_FLAG_THREAD;
+    std::vector<std::string> paths;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string const arg = argv[i];
+        if (arg == "-dir" && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (arg == "-out" && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (arg == "-window" && i + 1 < argc) {
+            window = (size_t)std::strtoull(argv[++i], NULL, 10);
+        } else if (arg == "-compress") {
+            flags |= MMTRD_FLAG_VARINT;
+        } else if (!arg.empty() && arg[0] != '-') {
+            paths.push_back(arg);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    std::string const prefix = dir.empty() ? std::string() : dir + "/";
+    if (out_path.empty())
+        out_path = prefix + "regina.merged.mmtrd";
+    if (paths.empty()) {
+        for (unsigned int n = 0;; ++n) {
+            std::string const path = prefix + "regina." + std::to_string(n) + ".mmtrd";
+            FILE* f = std::fopen(path.c_str(), "rb");
+            if (f == NULL)
+                break;
+            std::fclose(f);
+            paths.push_back(path);
+        }
+    }
+    if (paths.empty()) {
+        std::fprintf(stderr, "no traces found in %s\n", dir.empty() ? "." : dir.c_str());
+        return 1;
+    }
+#ifdef _WIN32
+    /* one stream per thread of the run */
+    _setmaxstdio(8192);
+#endif
+
+    auto const start = std::chrono::steady_clock::now();
+    std::vector<input_t> inputs(paths.size());
+    /* (time of the next event, input) of every input with events left */
+    typedef std::pair<uint64_t, uint32_t> key_t;
+    std::priority_queue<key_t, std::vector<key_t>, std::greater<key_t>> heap;
+    uint32_t shared = MMTRD_FLAG_CONTEXT | MMTRD_FLAG_ALLOC | MMTRD_FLAG_OBJECT;
+    for (uint32_t i = 0; i < inputs.size(); ++i) {
+        input_t& in = inputs[i];
+        in.path = paths[i];
+        in.f = std::fopen(in.path.c_str(), "rb");
+        if (in.f == NULL || !mmtrd_reader_open(&in.r, in.f) || in.r.version != MMTRD_VERSION_COLUMNAR) {
+            std::fprintf(stderr, "%s is no complete version 2 .mmtrd file\n", in.path.c_str());
+            return 1;
+        }
+        if (!(in.r.flags & MMTRD_FLAG_TIME)) {
+            std::fprintf(stderr, "%s has no time stamps, record it with -timestamps\n", in.path.c_str());
+            return 1;
+        }
+        /* every access is a seek, stdio's own buffer would only be refilled */
+        std::setvbuf(in.f, NULL, _IONBF, 0);
+        in.thread = i;
+        shared &= in.r.flags;
+        mmtrd_stream_init(&in.s, &in.r, window);
+        if (mmtrd_stream_next(&in.s, &in.ev))
+            heap.push(key_t(in.ev.time, i));
+    }
+
+    flags |= shared;
+    FILE* out_file = std::fopen(out_path.c_str(), "wb");
+    mmtrd_writer_t out;
+    uint64_t now = 0;
+    if (out_file == NULL) {
+        std::fprintf(stderr, "unable to create %s\n", out_path.c_str());
+        return 1;
+    }
+    mmtrd_writer_init(&out, out_file, MMTRD_VERSION_COLUMNAR, flags);
+    while (!heap.empty()) {
+        uint32_t const i = heap.top().second;
+        input_t& in = inputs[i];
+        bool more;
+        heap.pop();
+        /* copy events until another input is due */
+        do {
+            /* a counter running backwards, e.g. on a machine without an
+             * invariant TSC, must not break the order of the output
+             */
+            if (in.ev.time > now)
+                now = in.ev.time;
+            mmtrd_set_time(&out, now);
+            mmtrd_set_thread(&out, (in.r.flags & MMTRD_FLAG_THREAD) ? in.ev.thread : in.thread);
+            mmtrd_set_context(&out, in.ev.context);
+            mmtrd_set_alloc(&out, in.ev.alloc);
+            mmtrd_set_object(&out, in.ev.object);
+            write_event(&out, in.ev);
+            more = mmtrd_stream_next(&in.s, &in.ev);
+        } while (more && (heap.empty() || key_t(in.ev.time, i) < heap.top()));
+        if (more)
+            heap.push(key_t(in.ev.time, i));
+        else if (in.s.chunk != in.r.index.size() || in.s.left != 0)
+            std::fprintf(stderr, "%s is damaged, skipping the rest of it\n", in.path.c_str());
+    }
+    mmtrd_writer_exit(&out);
+    std::fclose(out_file);
+
+    uint64_t events = 0;
+    for (auto& in : inputs) {
+        events += in.r.footer.num_events;
+        std::fclose(in.f);
+    }
+    double const t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::printf("merged %zu traces, %llu events into %s in %.3f s\n", inputs.size(),
+        (unsigned long long)events, out_path.c_str(), t);
+    return 0;
+}
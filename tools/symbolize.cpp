@@ -0,0 +1,285 @@
+/* regina-symbolize: offline symbolization of traces recorded with
+ * -offline_symbols.
+ *
+ * Reads the module table, the block descriptors and the raw per-thread
+ * traces regina.tmp.N.mmd from a directory and writes regina.N.mmtrd and
+ * the symbol table regina.0.mmtrd.txt next to them, the same output the
+ * client produces online. Symbol loading thus happens outside of the traced
+ * process. Every distinct pc is looked up once; the lookups are spread over
+ * a pool of worker threads. Compressed raw traces are read transparently;
+ * -compress delta encodes the columns of version 2 output like the client's
+ * -compress.
+ *
+ * Usage:
+ *   regina-symbolize [-dir <dir>] [-jobs N] [-version 1|2] [-compress]
+ */
+
+#include "dr_api.h"
+#include "drsyms.h"
+#include "mmtrd.h"
+#include "modtable.h"
+#include "pc_cache.h"
+#include "trace_format.h"
+#include "trace_reader.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define MAX_SYM_RESULT 256
+
+struct block_t {
+    std::vector<bb_ref_t> refs;
+};
+
+static std::string dir;
+/* loaded modules by base, a later load replaces the ones it overlaps */
+static std::map<uint64_t, modtable_entry_t> modules;
+static std::vector<block_t> blocks;
+
+static std::string path_of(std::string const& name) {
+    return dir.empty() ? name : dir + "/" + name;
+}
+
+static std::string trace_name(unsigned int n) {
+    return path_of("regina.tmp." + std::to_string(n) + ".mmd");
+}
+
+static bool read_modules() {
+    FILE* f = std::fopen(path_of(MODTABLE_FILE).c_str(), "r");
+    std::vector<modtable_entry_t> mods;
+
+    if (f == NULL)
+        return false;
+    bool const ok = modtable_read(f, mods);
+    std::fclose(f);
+    for (auto const& mod : mods) {
+        auto it = modules.lower_bound(mod.base);
+        if (it != modules.begin())
+            --it;
+        while (it != modules.end() && it->first < mod.base + mod.size) {
+            if (it->first + it->second.size > mod.base)
+                it = modules.erase(it);
+            else
+                ++it;
+        }
+        modules[mod.base] = mod;
+    }
+    return ok;
+}
+
+static void read_blocks() {
+    FILE* f = std::fopen(path_of(TRACE_BB_FILE).c_str(), "rb");
+    uint64_t count = 0;
+
+    if (f == NULL)
+        return;
+    if (std::fread(&count, sizeof(count), 1, f) == 1) {
+        blocks.resize(count);
+        for (auto& block : blocks) {
+            uint32_t num_refs = 0;
+            if (std::fread(&num_refs, sizeof(num_refs), 1, f) != 1)
+                break;
+            block.refs.resize(num_refs);
+            if (num_refs > 0 && std::fread(block.refs.data(), sizeof(bb_ref_t), num_refs, f) != num_refs)
+                break;
+        }
+    }
+    std::fclose(f);
+}
+
+static std::string symbolize(uint64_t pc) {
+    auto it = modules.upper_bound(pc);
+    if (it == modules.begin())
+        return "###";
+    --it;
+    modtable_entry_t const& mod = it->second;
+    if (pc >= mod.base + mod.size)
+        return "###";
+
+    drsym_info_t sym;
+    char name[MAX_SYM_RESULT];
+    char file[MAXIMUM_PATH];
+    sym.struct_size = sizeof(sym);
+    sym.name = name;
+    sym.name_size = MAX_SYM_RESULT;
+    sym.file = file;
+    sym.file_size = MAXIMUM_PATH;
+    drsym_error_t const res = drsym_lookup_address(mod.path.c_str(), (size_t)(pc - mod.base), &sym,
+        DRSYM_DEMANGLE_PDB_TEMPLATES);
+    if (res != DRSYM_SUCCESS && res != DRSYM_ERROR_LINE_NOT_AVAILABLE)
+        return "###";
+    /* the same strings as the client's translate_addr */
+    return mod.name + "#" + sym.name;
+}
+
+static void usage() {
+    std::fprintf(stderr, "usage: regina-symbolize [-dir <dir>] [-jobs N] [-version 1|2] [-compress]\n");
+}
+
+int main(int argc, char** argv) {
+    unsigned int jobs = std::max(1u, std::thread::hardware_concurrency());
+    uint32_t version = MMTRD_VERSION_COLUMNAR;
+    uint32_t flags = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string const arg = argv[i];
+        if (arg == "-dir" && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (arg == "-jobs" && i + 1 < argc) {
+            jobs = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "-version" && i + 1 < argc) {
+            version = (uint32_t)std::atoi(argv[++i]);
+            if (version != MMTRD_VERSION_PACKED && version != MMTRD_VERSION_COLUMNAR) {
+                usage();
+                return 1;
+            }
+        } else if (arg == "-compress") {
+            flags |= MMTRD_FLAG_VARINT;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (!read_modules()) {
+        std::fprintf(stderr, "unable to read %s\n", path_of(MODTABLE_FILE).c_str());
+        return 1;
+    }
+    read_blocks();
+
+    /* Pass 1: collect the distinct pcs in order of appearance. */
+    pc_cache_t pcs;
+    std::vector<uint64_t> unique;
+    unsigned int num_traces = 0;
+    /* traces recorded with -timestamps */
+    std::vector<bool> timed;
+    pc_cache_init(&pcs, 1 << 16);
+    auto add_pc = [&](uint64_t pc) {
+        uint64_t idx;
+        if (!pc_cache_find(&pcs, pc, &idx)) {
+            pc_cache_insert(&pcs, pc, unique.size());
+            unique.push_back(pc);
+        }
+    };
+    for (;; ++num_traces) {
+        FILE* f = std::fopen(trace_name(num_traces).c_str(), "rb");
+        if (f == NULL)
+            break;
+        timed.push_back(false);
+        trace_for_each_entry(f, [&](char const* entry, uint64_t header) {
+            if (trace_get_type(header) == TRACE_TYPE_TIME) {
+                timed.back() = true;
+            } else if (trace_get_type(header) == TRACE_TYPE_BB) {
+                uint64_t const id = trace_get_pc(header);
+                if (id < blocks.size()) {
+                    for (auto const& ref : blocks[id].refs)
+                        add_pc(ref.pc);
+                }
+            } else {
+                add_pc(trace_get_pc(header));
+                if (!trace_is_mem(header))
+                    add_pc(reinterpret_cast<call_entry_t const*>(entry)->target);
+            }
+        });
+        std::fclose(f);
+    }
+    if (num_traces == 0) {
+        std::fprintf(stderr, "no traces found in %s\n", dir.empty() ? "." : dir.c_str());
+        return 1;
+    }
+
+    /* Resolve them in parallel. */
+    dr_standalone_init();
+    if (drsym_init(0) != DRSYM_SUCCESS) {
+        std::fprintf(stderr, "unable to initialize drsyms\n");
+        return 1;
+    }
+    std::vector<std::string> names(unique.size());
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (unsigned int j = 0; j < jobs; ++j) {
+        workers.emplace_back([&]() {
+            size_t const batch = 64;
+            for (size_t start; (start = next.fetch_add(batch)) < unique.size();) {
+                for (size_t i = start; i < std::min(start + batch, unique.size()); ++i)
+                    names[i] = symbolize(unique[i]);
+            }
+        });
+    }
+    for (auto& worker : workers)
+        worker.join();
+    drsym_exit();
+    dr_standalone_exit();
+
+    /* Number the symbols in order of appearance and map every pc to one. */
+    std::unordered_map<std::string, uint64_t> symbols;
+    std::vector<std::string const*> symbol_names;
+    std::vector<uint64_t> pc_symbol(unique.size());
+    for (size_t i = 0; i < unique.size(); ++i) {
+        auto it = symbols.find(names[i]);
+        if (it == symbols.end()) {
+            it = symbols.insert(std::make_pair(names[i], (uint64_t)symbol_names.size())).first;
+            symbol_names.push_back(&it->first);
+        }
+        pc_symbol[i] = it->second;
+    }
+    auto sym_of = [&](uint64_t pc) {
+        uint64_t idx = 0;
+        pc_cache_find(&pcs, pc, &idx);
+        return pc_symbol[idx];
+    };
+
+    /* Pass 2: write the .mmtrd files. */
+    for (unsigned int n = 0; n < num_traces; ++n) {
+        FILE* f = std::fopen(trace_name(n).c_str(), "rb");
+        FILE* out_file = std::fopen(path_of("regina." + std::to_string(n) + ".mmtrd").c_str(), "wb");
+        mmtrd_writer_t writer;
+        mmtrd_writer_t* out = &writer;
+        if (f == NULL || out_file == NULL) {
+            std::fprintf(stderr, "unable to convert %s\n", trace_name(n).c_str());
+            return 1;
+        }
+        mmtrd_writer_init(out, out_file, version, timed[n] ? flags | MMTRD_FLAG_TIME : flags);
+        trace_for_each_entry(f, [&](char const* entry, uint64_t header) {
+            if (trace_is_mem(header)) {
+                mmtrd_write_mem(out, trace_get_type(header) == TRACE_TYPE_WRITE,
+                    reinterpret_cast<mem_entry_t const*>(entry)->addr, trace_get_size(header),
+                    sym_of(trace_get_pc(header)));
+            } else if (trace_get_type(header) == TRACE_TYPE_BB) {
+                uint64_t const id = trace_get_pc(header);
+                uint64_t const* addr = reinterpret_cast<uint64_t const*>(entry) + 1;
+                if (id >= blocks.size())
+                    return;
+                auto const& refs = blocks[id].refs;
+                for (uint32_t i = 0; i < trace_get_size(header) && i < refs.size(); ++i)
+                    mmtrd_write_mem(out, refs[i].write != 0, addr[i], refs[i].size, sym_of(refs[i].pc));
+            } else if (trace_get_type(header) == TRACE_TYPE_TIME) {
+                mmtrd_set_time(out, reinterpret_cast<time_entry_t const*>(entry)->time);
+            } else {
+                uint64_t const target = reinterpret_cast<call_entry_t const*>(entry)->target;
+                mmtrd_write_call(out, trace_get_type(header), trace_get_pc(header), target,
+                    sym_of(trace_get_pc(header)), sym_of(target));
+            }
+        });
+        mmtrd_writer_exit(out);
+        std::fclose(out_file);
+        std::fclose(f);
+    }
+
+    FILE* table = std::fopen(path_of("regina.0.mmtrd.txt").c_str(), "w");
+    if (table == NULL)
+        return 1;
+    for (size_t i = 0; i < symbol_names.size(); ++i)
+        std::fprintf(table, "%zu|%s\n", i, symbol_names[i]->c_str());
+    std::fclose(table);
+    std::printf("%u traces, %zu distinct pcs, %zu symbols\n", num_traces, unique.size(),
+        symbol_names.size());
+    return 0;
+}